@@ -0,0 +1,116 @@
+#include"AllocStats.h"
+
+#include<stdlib.h>
+#include<unistd.h>
+#include<execinfo.h>
+#include<new>
+
+namespace allocstats
+{
+    //都是平凡类型，常量初始化，第一次operator new之前就可用，不会递归分配
+    static thread_local Counters t_counters;
+    static thread_local bool     t_checking;
+    static thread_local uint64_t t_violations;
+    static bool                  s_abort = false;
+
+    Counters current()
+    {
+        return kEnabled ? t_counters : Counters{};
+    }
+
+    bool checking()
+    {
+        return t_checking;
+    }
+
+    void setChecking(bool on)
+    {
+        t_checking = on;
+    }
+
+    uint64_t violations()
+    {
+        return t_violations;
+    }
+
+    void setAbortOnViolation(bool on)
+    {
+        s_abort = on;
+    }
+}
+
+#if CHAT_ALLOC_STATS
+
+static void countAlloc(size_t size)
+{
+    allocstats::t_counters.allocs++;
+    allocstats::t_counters.bytes += size;
+    if(!allocstats::t_checking)
+        return;
+    allocstats::t_violations++;
+    if(allocstats::s_abort)
+    {
+        //这里不能再用operator new，直接写stderr；调用栈是地址，用addr2line -f -C -e server还原
+        static const char msg[] = "alloc: heap allocation on the steady-state receive->fan-out path\n";
+        ssize_t n = write(STDERR_FILENO, msg, sizeof(msg) - 1);
+        (void)n;
+        void* frames[32];
+        backtrace_symbols_fd(frames, backtrace(frames, 32), STDERR_FILENO);
+        abort();
+    }
+}
+
+static void* countedAlloc(size_t size)
+{
+    void* p = malloc(size ? size : 1);
+    if(!p)
+        throw std::bad_alloc();
+    countAlloc(size);
+    return p;
+}
+
+static void* countedAlignedAlloc(size_t size, std::align_val_t align)
+{
+    size_t alignment = (size_t)align;
+    void* p = aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+    if(!p)
+        throw std::bad_alloc();
+    countAlloc(size);
+    return p;
+}
+
+static void countedFree(void* p)
+{
+    if(!p)
+        return;
+    allocstats::t_counters.frees++;
+    free(p);
+}
+
+void* operator new(size_t size) { return countedAlloc(size); }
+void* operator new[](size_t size) { return countedAlloc(size); }
+void* operator new(size_t size, std::align_val_t align) { return countedAlignedAlloc(size, align); }
+void* operator new[](size_t size, std::align_val_t align) { return countedAlignedAlloc(size, align); }
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+    try { return countedAlloc(size); } catch(...) { return nullptr; }
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept
+{
+    try { return countedAlloc(size); } catch(...) { return nullptr; }
+}
+
+void operator delete(void* p) noexcept { countedFree(p); }
+void operator delete[](void* p) noexcept { countedFree(p); }
+void operator delete(void* p, size_t) noexcept { countedFree(p); }
+void operator delete[](void* p, size_t) noexcept { countedFree(p); }
+void operator delete(void* p, std::align_val_t) noexcept { countedFree(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { countedFree(p); }
+void operator delete(void* p, size_t, std::align_val_t) noexcept { countedFree(p); }
+void operator delete[](void* p, size_t, std::align_val_t) noexcept { countedFree(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { countedFree(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { countedFree(p); }
+
+#endif
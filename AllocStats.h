@@ -0,0 +1,75 @@
+#ifndef ALLOCSTATS_H
+#define ALLOCSTATS_H
+
+#include<stdint.h>
+
+//编译时开关：make ALLOC_STATS=1 (即 -DCHAT_ALLOC_STATS=1) 才会替换全局operator new/delete并计数，否则所有接口都是空的
+#ifndef CHAT_ALLOC_STATS
+#define CHAT_ALLOC_STATS 0
+#endif
+
+//计数放在thread_local里，每个线程只看到自己的分配，不加锁也不用原子操作；
+//事件循环据此统计每轮、每条消息的分配次数，搜索线程等后台线程的分配不会算进来。
+namespace allocstats
+{
+    constexpr bool kEnabled = CHAT_ALLOC_STATS;
+
+    struct Counters
+    {
+        uint64_t allocs; //operator new调用次数
+        uint64_t frees;
+        uint64_t bytes;  //申请的总字节数
+    };
+
+    Counters current(); //当前线程累计到现在的计数，未开启时全是0
+
+    //热路径检查：checking()为真期间当前线程的每次分配都记一次违规
+    bool     checking();
+    void     setChecking(bool on);
+    uint64_t violations(); //当前线程累计的违规次数
+    void     setAbortOnViolation(bool on); //违规时立即abort，core里的调用栈就是分配的位置
+
+    //作用域内检查分配，析构时恢复原来的状态
+    class CheckScope final
+    {
+        public:
+            explicit CheckScope(bool on) : m_saved(false)
+            {
+                if constexpr(kEnabled)
+                {
+                    m_saved = checking();
+                    if(on)
+                        setChecking(true);
+                }
+            }
+            ~CheckScope() { if constexpr(kEnabled) setChecking(m_saved); }
+            CheckScope(const CheckScope&) = delete;
+            CheckScope& operator=(const CheckScope&) = delete;
+
+        private:
+            bool m_saved;
+    };
+
+    //作用域内不检查：命令处理、连接断开这类不在收消息->广播路径上的分支，
+    //以及池子、队列扩容到新的高水位(只在同时在用的量创新高时发生，次数有限)
+    class AllowScope final
+    {
+        public:
+            AllowScope() : m_saved(false)
+            {
+                if constexpr(kEnabled)
+                {
+                    m_saved = checking();
+                    setChecking(false);
+                }
+            }
+            ~AllowScope() { if constexpr(kEnabled) setChecking(m_saved); }
+            AllowScope(const AllowScope&) = delete;
+            AllowScope& operator=(const AllowScope&) = delete;
+
+        private:
+            bool m_saved;
+    };
+}
+
+#endif //ALLOCSTATS_H
@@ -0,0 +1,156 @@
+#ifndef BENCHUTIL_H
+#define BENCHUTIL_H
+
+//各个压测程序共用的小工具：时钟、内存、CPU、分位数，以及启动服务端和连接会话。
+//都是inline函数，不用的压测不会引用smallchat/chatlib.c里的连接函数，也就不用链接它
+#include<sys/wait.h>
+#include<sys/resource.h>
+#include<fcntl.h>
+#include<signal.h>
+#include<poll.h>
+#include<time.h>
+#include<stdio.h>
+#include<string.h>
+#include<unistd.h>
+#include<stdint.h>
+#include<string>
+#include<vector>
+#include<algorithm>
+
+extern "C" {
+#include"smallchat/chatlib.h"
+}
+
+inline int64_t nowNs()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000ll + now.tv_nsec;
+}
+
+//当前进程的常驻内存(字节)
+inline long rssBytes()
+{
+    FILE* fp = fopen("/proc/self/statm", "r");
+    if(!fp)
+        return 0;
+    long pages = 0, resident = 0;
+    int n = fscanf(fp, "%ld %ld", &pages, &resident);
+    fclose(fp);
+    return n == 2 ? resident * sysconf(_SC_PAGESIZE) : 0;
+}
+
+inline double rssMb()
+{
+    return rssBytes() / 1e6;
+}
+
+//另一个进程用掉的CPU时间(utime+stime)，纳秒，精度是一个时钟滴答
+inline int64_t processCpuNs(pid_t pid)
+{
+    std::string path = "/proc/" + std::to_string(pid) + "/stat";
+    FILE* fp = fopen(path.c_str(), "r");
+    if(!fp)
+        return 0;
+    char buf[1024];
+    size_t n = fread(buf, 1, sizeof(buf) - 1, fp);
+    fclose(fp);
+    buf[n] = '\0';
+    const char* p = strrchr(buf, ')'); //进程名里可能有空格，从右括号之后数字段
+    unsigned long long utime = 0, stime = 0;
+    if(!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime) != 2)
+        return 0;
+    return (int64_t)(utime + stime) * 1000000000ll / sysconf(_SC_CLK_TCK);
+}
+
+//本进程用掉的CPU秒数(用户态+内核态)
+inline double selfCpuSeconds()
+{
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+//第p(0到1)分位的样本，会把samples排好序
+inline int64_t percentile(std::vector<int64_t>& samples, double p)
+{
+    if(samples.empty())
+        return 0;
+    std::sort(samples.begin(), samples.end());
+    return samples[std::min(samples.size() - 1, (size_t)(p * samples.size()))];
+}
+
+//启动 path args...，输出丢掉；等到端口能连上为止，失败返回-1
+inline pid_t startServer(const char* path, int port, const std::vector<std::string>& args)
+{
+    pid_t pid = fork();
+    if(pid == 0)
+    {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        std::vector<char*> argv = {(char*)path};
+        for(const std::string& arg : args)
+            argv.push_back((char*)arg.c_str());
+        argv.push_back(nullptr);
+        execv(path, argv.data());
+        _exit(127);
+    }
+
+    for(int i = 0; i < 300; i++)
+    {
+        usleep(10000);
+        int fd = TCPConnect((char*)"127.0.0.1", port, 0);
+        if(fd != -1)
+        {
+            close(fd);
+            return pid;
+        }
+    }
+    kill(pid, SIGTERM);
+    waitpid(pid, nullptr, 0);
+    return -1;
+}
+
+inline void stopServer(pid_t pid)
+{
+    kill(pid, SIGTERM); //多进程模式下启动器转发给所有worker，等它们退出
+    waitpid(pid, nullptr, 0);
+}
+
+//按字节读一行(不含换行)，不会多读到后面的数据；只用在握手和命令回复上，超时返回false
+inline bool readLine(int fd, std::string& line, int timeoutMs = 3000)
+{
+    line.clear();
+    char c;
+    while(true)
+    {
+        pollfd pfd = {fd, POLLIN, 0};
+        if(poll(&pfd, 1, timeoutMs) <= 0 || read(fd, &c, 1) <= 0)
+            return false;
+        if(c == '\n')
+            return true;
+        line.push_back(c);
+    }
+}
+
+//读掉两行欢迎语，失败时关闭fd
+inline bool skipWelcome(int fd)
+{
+    std::string line;
+    if(readLine(fd, line) && readLine(fd, line))
+        return true;
+    close(fd);
+    return false;
+}
+
+//连上本机的服务端并读掉欢迎语
+inline int openSession(int port)
+{
+    int fd = TCPConnect((char*)"127.0.0.1", port, 0);
+    if(fd == -1 || !skipWelcome(fd))
+        return -1;
+    return fd;
+}
+
+#endif //BENCHUTIL_H
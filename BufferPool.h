@@ -0,0 +1,208 @@
+#ifndef BUFFERPOOL_H
+#define BUFFERPOOL_H
+
+#include<stddef.h>
+#include<new>
+#include<algorithm>
+#include<atomic>
+#include<memory>
+#include<string>
+#include<vector>
+#include"AllocStats.h"
+
+#define BUFFER_POOL_MIN     256   //最小的一级，每级是上一级的4倍：256 1K 4K 16K
+#define BUFFER_POOL_CLASSES 4
+#define BUFFER_POOL_KEEP    64    //每级最多缓存的空闲块，多出来的还给malloc，突发过后内存能降下来
+
+#define PAYLOAD_POOL_CLASSES 6     //payload按容量分级，和BufferPool一样每级是上一级的4倍：256 1K 4K 16K 64K 256K
+#define PAYLOAD_POOL_MAX     32768 //每级最多回收多少个payload，超过时直接make_shared
+#define PAYLOAD_POOL_PROBE   8     //取payload时最多往后看几个槽，都还在用就新建一个
+#define PAYLOAD_POOL_SPARE   256   //trim时每级保留的空闲payload个数
+
+//连接的读缓冲区只在有数据没处理完时才从这里借，处理完马上还回来，空闲连接不占缓冲区。
+//只在事件循环线程上使用，不加锁。
+class BufferPool final
+{
+    public:
+        //返回至少size字节的块，*cap是实际大小；size超过最大一级时返回nullptr
+        static char* acquire(size_t size, size_t* cap)
+        {
+            int cls = sizeClass(size);
+            if(cls < 0)
+                return nullptr;
+
+            *cap = (size_t)BUFFER_POOL_MIN << (2 * cls);
+            FreeBlock*& head = s_free[cls];
+            if(head)
+            {
+                FreeBlock* block = head;
+                head = block->next;
+                s_count[cls]--;
+                return (char*)block;
+            }
+            return (char*)::operator new(*cap);
+        }
+
+        static void release(char* p, size_t cap)
+        {
+            int cls = sizeClass(cap);
+            if(s_count[cls] >= BUFFER_POOL_KEEP)
+            {
+                ::operator delete(p);
+                return;
+            }
+
+            FreeBlock* block = (FreeBlock*)p;
+            block->next = s_free[cls];
+            s_free[cls] = block;
+            s_count[cls]++;
+        }
+
+        static size_t maxSize()
+        {
+            return (size_t)BUFFER_POOL_MIN << (2 * (BUFFER_POOL_CLASSES - 1));
+        }
+
+    private:
+        static int sizeClass(size_t size)
+        {
+            size_t cap = BUFFER_POOL_MIN;
+            for(int cls = 0; cls < BUFFER_POOL_CLASSES; cls++, cap <<= 2)
+            {
+                if(size <= cap)
+                    return cls;
+            }
+            return -1;
+        }
+
+    private:
+        struct FreeBlock
+        {
+            FreeBlock* next;
+        };
+        static inline FreeBlock* s_free[BUFFER_POOL_CLASSES] = {};
+        static inline int        s_count[BUFFER_POOL_CLASSES] = {};
+};
+
+//广播payload的回收：payload被接收者的发送队列、/resume的保留窗口、检索线程共享，谁最后放手不确定。
+//池子自己也持有每个payload的一份引用，引用计数降到1说明别人都用完了，控制块和字符串的缓冲区可以直接装下一批消息。
+//每级的payload一开始就预留该级的容量，重新使用时不会因为这一批比上一批长而扩容。
+//payload基本按发出的顺序被放手，所以从上次的位置往后找，通常第一个槽就是空闲的。
+//只在事件循环线程上调用，别的线程只会释放引用。
+class PayloadPool final
+{
+    public:
+        PayloadPool() = default;
+        ~PayloadPool() = default;
+        PayloadPool(const PayloadPool&) = delete;
+        PayloadPool& operator=(const PayloadPool&) = delete;
+
+        //返回一个容量至少为size的空字符串，填好后转成shared_ptr<const std::string>发出去
+        std::shared_ptr<std::string> acquire(size_t size)
+        {
+            int cls = sizeClass(size);
+            if(cls < 0) //比最大一级还大，不回收
+            {
+                std::shared_ptr<std::string> payload = std::make_shared<std::string>();
+                payload->reserve(size);
+                return payload;
+            }
+
+            size_t cap = (size_t)BUFFER_POOL_MIN << (2 * cls);
+            Ring& ring = m_rings[cls];
+            size_t n = ring.slots.size();
+            for(size_t i = 0; i < PAYLOAD_POOL_PROBE && i < n; i++)
+            {
+                size_t at = (ring.next + i) % n;
+                if(ring.slots[at].use_count() != 1)
+                    continue;
+                //别的线程释放引用是release语义的递减，这里配对之后才能改写内容
+                std::atomic_thread_fence(std::memory_order_acquire);
+                std::swap(ring.slots[at], ring.slots[ring.next]); //取到的放在游标处，保持槽按发出顺序排列
+                std::shared_ptr<std::string>& slot = ring.slots[ring.next];
+                ring.next = (ring.next + 1) % n;
+                slot->clear();
+                if(slot->capacity() > cap * 4) //调用者写得比申请的多，撑大了，换回该级的大小
+                {
+                    std::string fresh;
+                    fresh.reserve(cap);
+                    slot->swap(fresh);
+                }
+                return slot;
+            }
+
+            if(n >= PAYLOAD_POOL_MAX)
+            {
+                std::shared_ptr<std::string> payload = std::make_shared<std::string>();
+                payload->reserve(cap);
+                return payload;
+            }
+
+            //同时在用的payload变多了：一次补上一批(现有的一半，不超过trim保留的个数)插在游标处，
+            //在用的数量在新的高点附近抖动时不用每次都分配。插在游标处的槽按发出顺序算最新的，原来那些还是一圈之后再看
+            allocstats::AllowScope allow;
+            size_t grow = std::clamp<size_t>(n / 2, PAYLOAD_POOL_PROBE, PAYLOAD_POOL_SPARE);
+            grow = std::min(grow, PAYLOAD_POOL_MAX - n);
+            ring.slots.insert(ring.slots.begin() + ring.next, grow, nullptr);
+            for(size_t i = 0; i < grow; i++)
+            {
+                std::shared_ptr<std::string>& slot = ring.slots[ring.next + i];
+                slot = std::make_shared<std::string>();
+                slot->reserve(cap);
+            }
+            std::shared_ptr<std::string>& slot = ring.slots[ring.next];
+            ring.next = (ring.next + 1) % ring.slots.size();
+            return slot;
+        }
+
+        //突发过后释放多余的空闲payload，每级保留PAYLOAD_POOL_SPARE个，定期调用
+        void trim()
+        {
+            for(Ring& ring : m_rings)
+            {
+                size_t spare = 0;
+                size_t kept = 0;
+                size_t next = 0;
+                for(size_t i = 0; i < ring.slots.size(); i++)
+                {
+                    if(i == ring.next)
+                        next = kept;
+                    if(ring.slots[i].use_count() == 1 && ++spare > PAYLOAD_POOL_SPARE)
+                        continue;
+                    ring.slots[kept++] = std::move(ring.slots[i]);
+                }
+                ring.slots.resize(kept);
+                ring.next = kept ? next % kept : 0;
+            }
+        }
+
+        size_t size() const
+        {
+            size_t total = 0;
+            for(const Ring& ring : m_rings)
+                total += ring.slots.size();
+            return total;
+        }
+
+    private:
+        static int sizeClass(size_t size)
+        {
+            size_t cap = BUFFER_POOL_MIN;
+            for(int cls = 0; cls < PAYLOAD_POOL_CLASSES; cls++, cap <<= 2)
+            {
+                if(size <= cap)
+                    return cls;
+            }
+            return -1;
+        }
+
+    private:
+        struct Ring
+        {
+            std::vector<std::shared_ptr<std::string>> slots; //按发出的顺序排成一圈
+            size_t                                    next = 0; //下一个要看的槽，它的payload是最早发出的
+        };
+        Ring m_rings[PAYLOAD_POOL_CLASSES];
+};
+
+#endif //BUFFERPOOL_H
@@ -0,0 +1,101 @@
+#include"Capture.h"
+
+#include<time.h>
+#include<iostream>
+
+static uint64_t monotonicNs()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+Capture::Capture()
+    : m_fp(nullptr),
+      m_stop(false),
+      m_lastTs(0),
+      m_dropped(0)
+{
+}
+
+Capture::~Capture()
+{
+    if(!m_fp)
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_cond.notify_one();
+    m_writer.join();
+    fclose(m_fp);
+
+    if(m_dropped)
+        std::cout << "capture dropped " << m_dropped << " records" << std::endl;
+}
+
+bool Capture::open(const char* path)
+{
+    m_fp = fopen(path, "wb");
+    if(!m_fp)
+        return false;
+
+    if(fwrite(CAPTURE_MAGIC, 1, CAPTURE_MAGIC_LEN, m_fp) != CAPTURE_MAGIC_LEN)
+    {
+        fclose(m_fp);
+        m_fp = nullptr;
+        return false;
+    }
+
+    m_lastTs = monotonicNs();
+    m_writer = std::thread(&Capture::writerLoop, this);
+    return true;
+}
+
+void Capture::record(CaptureType type, int fd, const char* data, size_t len)
+{
+    uint64_t now = monotonicNs();
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    //只丢数据：连接的开关记录不占多少空间，丢了之后fd被复用时回放会把两个连接的流量混在一起
+    if((type == CAP_DATA || type == CAP_LINE) && m_pending.size() + len > CAPTURE_MAX_PENDING)
+    {
+        m_dropped++;
+        return;
+    }
+
+    m_pending.push_back((char)type);
+    putVarint(m_pending, now - m_lastTs);
+    putVarint(m_pending, (uint64_t)fd);
+    putVarint(m_pending, len);
+    m_pending.append(data, len);
+    m_lastTs = now;
+}
+
+uint64_t Capture::dropped()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_dropped;
+}
+
+void Capture::writerLoop()
+{
+    std::string batch;
+    while(true)
+    {
+        {
+            //定时醒来批量写，记录时不去通知，事件循环上只多一次无竞争的加锁
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cond.wait_for(lock, std::chrono::milliseconds(100), [this] { return m_stop; });
+            batch.swap(m_pending);
+            if(batch.empty() && m_stop)
+                break;
+        }
+
+        if(!batch.empty() && fwrite(batch.data(), 1, batch.size(), m_fp) != batch.size())
+            std::cout << "capture write failure!" << std::endl;
+        fflush(m_fp);
+        batch.clear();
+    }
+}
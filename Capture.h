@@ -0,0 +1,77 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include<stdint.h>
+#include<stdio.h>
+#include<string>
+#include<thread>
+#include<mutex>
+#include<condition_variable>
+
+//抓包文件格式：8字节魔数，之后是连续的记录
+//  type(1字节) | 距上一条记录的纳秒数(varint) | fd(varint) | 数据长度(varint) | 数据
+//fd会被复用，但OPEN/CLOSE记录是有序的，回放时按fd对应当前存活的模拟连接即可
+#define CAPTURE_MAGIC "SCAP0001"
+#define CAPTURE_MAGIC_LEN 8
+#define CAPTURE_MAX_PENDING (64 * 1024 * 1024) //后台线程跟不上时最多积压的字节数，超过就丢弃消息数据并计数
+
+enum CaptureType : uint8_t
+{
+    CAP_OPEN  = 1, //新连接
+    CAP_CLOSE = 2, //连接关闭
+    CAP_NICK  = 3, //改名成功，数据是新名字(/nick、/login已经在CAP_DATA中；/resume接管的昵称回放时要补一条/nick)
+    CAP_DATA  = 4, //从客户端收到的原始字节
+    CAP_LINE  = 5, //从共享内存环收到的一条消息，不带换行，回放时补上换行当作CAP_DATA发出
+};
+
+inline void putVarint(std::string& out, uint64_t v)
+{
+    while(v >= 0x80)
+    {
+        out.push_back((char)(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back((char)v);
+}
+
+//成功返回读取的字节数，数据不完整返回0
+inline size_t getVarint(const uint8_t* p, size_t len, uint64_t* v)
+{
+    *v = 0;
+    for(size_t i = 0; i < len && i < 10; i++)
+    {
+        *v |= (uint64_t)(p[i] & 0x7f) << (7 * i);
+        if(!(p[i] & 0x80))
+            return i + 1;
+    }
+    return 0;
+}
+
+//事件循环线程只负责把记录编码进内存缓冲区，由后台线程写文件，循环里不做磁盘IO
+class Capture final
+{
+    public:
+        Capture();
+        ~Capture(); //把剩余数据写完并关闭文件
+        Capture(const Capture&) = delete;
+        Capture& operator=(const Capture&) = delete;
+
+        bool open(const char* path);
+        void record(CaptureType type, int fd, const char* data = nullptr, size_t len = 0);
+        uint64_t dropped(); //因积压过多而丢弃的记录数
+
+    private:
+        void writerLoop();
+
+    private:
+        FILE*                   m_fp;
+        std::thread             m_writer;
+        std::mutex              m_mutex;
+        std::condition_variable m_cond;
+        std::string             m_pending; //待写入的已编码记录
+        bool                    m_stop;
+        uint64_t                m_lastTs; //上一条记录的时间戳(纳秒)
+        uint64_t                m_dropped;
+};
+
+#endif //CAPTURE_H
@@ -0,0 +1,124 @@
+//示例机器人：一个进程、一个事件循环线程跑N个机器人身份，每个身份是ChatClient上的一个会话
+//连上后改名为 前缀+编号；有人说 "!ping" 时第一个机器人回复，"!ping 名字" 由对应的机器人回复，"!bots" 报告在线数；
+//-i 秒：每个机器人每隔这么久(带随机抖动)说一句话。服务端重启后所有机器人自动重连并重新改名。
+#include"ChatClient.h"
+
+#include<signal.h>
+#include<stdlib.h>
+#include<string.h>
+#include<unistd.h>
+#include<iostream>
+#include<string>
+#include<vector>
+
+struct Bot
+{
+    int         index;
+    std::string nick;
+};
+
+static volatile sig_atomic_t g_stop = 0;
+
+static void onStopSignal(int)
+{
+    g_stop = 1;
+}
+
+static void usage(const char* prog)
+{
+    std::cout << "Usage: " << prog << " [-H host] [-p port] [-U path] [-n bots] [-x nick_prefix] [-i chatter_seconds]" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+    std::string host = "127.0.0.1";
+    int port = 7711;
+    const char* unixPath = nullptr;
+    int count = 10;
+    std::string prefix = "bot";
+    int chatterSec = 0;
+
+    int opt;
+    while((opt = getopt(argc, argv, "H:p:U:n:x:i:h")) != -1)
+    {
+        switch(opt)
+        {
+            case 'H': host = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            case 'U': unixPath = optarg; break;
+            case 'n': count = atoi(optarg); break;
+            case 'x': prefix = optarg; break;
+            case 'i': chatterSec = atoi(optarg); break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    ChatClient client;
+    if(!client.init())
+    {
+        std::cout << "create epoll failure" << std::endl;
+        return 1;
+    }
+
+    std::vector<Bot> bots(count);
+    std::vector<ChatSession*> sessions(count);
+
+    std::shared_ptr<ChatSession::Handler> handler = std::make_shared<ChatSession::Handler>();
+    handler->onConnect = [&](ChatSession& session) {
+        Bot* bot = (Bot*)session.context();
+        session.send("/nick " + bot->nick);
+        if(session.reconnects())
+            std::cout << bot->nick << " reconnected" << std::endl;
+    };
+    handler->onDisconnect = [](ChatSession& session, int err) {
+        Bot* bot = (Bot*)session.context();
+        std::cout << bot->nick << " disconnected: " << (err ? strerror(err) : "closed by server") << std::endl;
+    };
+    handler->onLine = [&](ChatSession& session, std::string_view line) {
+        //广播的格式是 昵称>内容，其余的(欢迎语、命令回复)不理会；机器人之间不互相回复
+        Bot* bot = (Bot*)session.context();
+        size_t gt = line.find('>');
+        if(gt == std::string_view::npos)
+            return;
+        std::string_view from = line.substr(0, gt);
+        std::string_view text = line.substr(gt + 1);
+        if(from.substr(0, prefix.size()) == prefix)
+            return;
+
+        if(text == "!ping" && bot->index == 0)
+            session.send("pong from " + bot->nick);
+        else if(text.substr(0, 6) == "!ping " && text.substr(6) == bot->nick)
+            session.send("pong from " + bot->nick);
+        else if(text == "!bots" && bot->index == 0)
+            session.send(std::to_string(client.connected()) + "/" + std::to_string(client.sessions()) + " bots online");
+    };
+
+    for(int i = 0; i < count; i++)
+    {
+        bots[i] = Bot{i, prefix + std::to_string(i)};
+        sessions[i] = client.open(unixPath ? unixPath : host, unixPath ? 0 : port, handler);
+        sessions[i]->setContext(&bots[i]);
+    }
+
+    //定时发言：每个机器人的定时器到期后说一句话，再按间隔(±50%)安排下一次
+    std::function<void(int)> chatter = [&](int i) {
+        if(sessions[i]->isConnected())
+            sessions[i]->send("hello from " + bots[i].nick);
+        client.after(chatterSec * 500 + rand() % (chatterSec * 1000 + 1), [&chatter, i] { chatter(i); });
+    };
+    if(chatterSec > 0)
+    {
+        for(int i = 0; i < count; i++)
+            client.after(rand() % (chatterSec * 1000), [&chatter, i] { chatter(i); });
+    }
+
+    signal(SIGINT, onStopSignal);
+    signal(SIGTERM, onStopSignal);
+    std::cout << count << " bots started" << std::endl;
+    while(!g_stop)
+        client.runOnce(1000);
+    std::cout << "stopping, " << client.connected() << " bots connected" << std::endl;
+    return 0;
+}
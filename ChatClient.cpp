@@ -0,0 +1,551 @@
+#include"ChatClient.h"
+
+#include<sys/epoll.h>
+#include<sys/socket.h>
+#include<unistd.h>
+#include<errno.h>
+#include<string.h>
+#include<stdlib.h>
+#include<time.h>
+#include<algorithm>
+
+extern "C" {
+#include"smallchat/chatlib.h"
+}
+
+static int64_t nowMs()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+//////////////////////ChatSession类
+ChatSession::ChatSession(ChatClient* client, uint64_t handle, const std::string& host, int port, std::shared_ptr<Handler> handler)
+    : m_client(client),
+      m_handle(handle),
+      m_host(host),
+      m_port(port),
+      m_handler(std::move(handler)),
+      m_context(nullptr),
+      m_state(State::Idle),
+      m_fd(-1),
+      m_events(0),
+      m_attempt(0),
+      m_failures(0),
+      m_reconnects(0),
+      m_everConnected(false),
+      m_compressLevel(0),
+      m_compressWait(false),
+      m_outPos(0)
+{
+}
+
+ChatSession::~ChatSession()
+{
+    if(m_fd != -1)
+        ::close(m_fd);
+}
+
+uint64_t ChatSession::handle()
+{
+    return m_handle;
+}
+
+bool ChatSession::isConnected()
+{
+    return m_state == State::Connected;
+}
+
+bool ChatSession::send(std::string_view line)
+{
+    if(!line.empty() && line.back() == '\n')
+        return write(line);
+
+    //补换行不能分两次write：第一次发完、第二次失败会留下半行
+    if(m_state != State::Connected || pendingBytes() + line.size() + 1 > SESSION_OUTBUF_MAX)
+        return false;
+    bool idle = (pendingBytes() == 0);
+    m_out.append(line);
+    m_out.push_back('\n');
+    if(idle) //之前没有积压，直接发
+        flush();
+    return true;
+}
+
+bool ChatSession::write(std::string_view data)
+{
+    if(m_state != State::Connected || pendingBytes() + data.size() > SESSION_OUTBUF_MAX)
+        return false;
+
+    if(pendingBytes() == 0)
+    {//没有积压时直接从调用者的内存发，发不完的才拷进缓冲
+        ssize_t n = ::send(m_fd, data.data(), data.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+        if(n == (ssize_t)data.size())
+            return true;
+        if(n < 0)
+        {
+            if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                disconnect(errno);
+                return false;
+            }
+            n = 0;
+        }
+        m_out.clear();
+        m_outPos = 0;
+        m_out.append(data.substr(n));
+        updateEvents();
+        return true;
+    }
+
+    if(m_outPos >= m_out.size() / 2) //前半段已经发出去了，腾出空间
+    {
+        m_out.erase(0, m_outPos);
+        m_outPos = 0;
+    }
+    m_out.append(data);
+    return true;
+}
+
+size_t ChatSession::pendingBytes()
+{
+    return m_out.size() - m_outPos;
+}
+
+uint64_t ChatSession::reconnects()
+{
+    return m_reconnects;
+}
+
+void ChatSession::close()
+{
+    if(m_state == State::Closed)
+        return;
+
+    State old = m_state;
+    m_state = State::Closed;
+    if(m_fd != -1)
+    {
+        m_client->watch(this, 0);
+        ::close(m_fd);
+        m_fd = -1;
+    }
+    if(old == State::Connected)
+        m_client->m_connected--;
+    m_in.clear();
+    m_out.clear();
+    m_outPos = 0;
+    m_compressWait = false;
+    m_decoder.reset();
+    m_client->release(this);
+}
+
+void ChatSession::enableCompression(int level)
+{
+    m_compressLevel = level;
+    if(m_state == State::Connected && !m_decoder && !m_compressWait)
+        requestCompression();
+}
+
+bool ChatSession::isCompressed()
+{
+    return m_decoder != nullptr;
+}
+
+void ChatSession::requestCompression()
+{
+    m_compressWait = send("/compress " + std::to_string(m_compressLevel));
+}
+
+void ChatSession::setContext(void* context)
+{
+    m_context = context;
+}
+
+void* ChatSession::context()
+{
+    return m_context;
+}
+
+void ChatSession::startConnect()
+{
+    m_attempt++;
+    m_fd = (m_port > 0) ? TCPConnect(m_host.data(), m_port, 1) : UnixConnect(m_host.data(), 1);
+    if(m_fd == -1)
+    {
+        disconnect(errno);
+        return;
+    }
+
+    //非阻塞connect完成(成功或失败)时可写
+    m_state = State::Connecting;
+    m_client->watch(this, EPOLLOUT);
+
+    ChatClient* client = m_client;
+    uint64_t handle = m_handle;
+    uint32_t attempt = m_attempt;
+    client->after(CONNECT_TIMEOUT_MS, [client, handle, attempt] {
+        ChatSession* session = client->find(handle);
+        if(session && session->m_state == State::Connecting && session->m_attempt == attempt)
+            session->disconnect(ETIMEDOUT);
+    });
+}
+
+void ChatSession::onEvent(uint32_t events)
+{
+    if(m_state == State::Connecting)
+    {
+        if(events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+            finishConnect();
+        return;
+    }
+
+    if(events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+        readSome();
+    if(m_state == State::Connected && (events & EPOLLOUT))
+        flush();
+}
+
+void ChatSession::finishConnect()
+{
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if(getsockopt(m_fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+        err = errno;
+    if(err)
+    {
+        disconnect(err);
+        return;
+    }
+
+    m_state = State::Connected;
+    m_client->m_connected++;
+    m_failures = 0;
+    if(m_everConnected)
+        m_reconnects++;
+    m_everConnected = true;
+    updateEvents();
+    if(m_compressLevel > 0) //每次重连都要重新协商，服务端的压缩状态跟着连接走
+        requestCompression();
+
+    if(m_handler->onConnect)
+        m_handler->onConnect(*this);
+}
+
+void ChatSession::readSome()
+{
+    ssize_t n = recv(m_fd, m_client->m_scratch, SESSION_READ_SIZE, 0);
+    if(n > 0)
+    {
+        deliver(m_client->m_scratch, n);
+        return;
+    }
+    if(n == 0)
+        disconnect(0);
+    else if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        disconnect(errno);
+}
+
+void ChatSession::deliver(const char* data, size_t len)
+{
+    //等压缩的回复时一行一行交出去：回复那一行之后的字节已经是压缩帧
+    size_t pos = 0;
+    while(m_compressWait && pos < len)
+    {
+        const char* nl = (const char*)memchr(data + pos, '\n', len - pos);
+        size_t end = nl ? nl - data + 1 : len;
+        deliverLines(data + pos, end - pos);
+        if(m_state != State::Connected)
+            return;
+        pos = end;
+    }
+    if(!m_decoder)
+    {
+        if(pos < len)
+            deliverLines(data + pos, len - pos);
+        return;
+    }
+
+    m_plain.clear();
+    if(!m_decoder->feed(data + pos, len - pos, m_plain))
+    {
+        disconnect(EPROTO);
+        return;
+    }
+    deliverLines(m_plain.data(), m_plain.size());
+}
+
+void ChatSession::deliverLines(const char* data, size_t len)
+{
+    //回调可能关闭或者断开这个会话，每次回调后都要确认还连着
+    auto emit = [this](std::string_view line) {
+        if(m_compressWait && line.starts_with("compress "))
+        {//协商的回复不交给回调；忙的时候再发一次，别的错误就留在明文
+            if(line.starts_with("compress on "))
+            {
+                m_compressWait = false;
+                m_decoder = std::make_unique<FrameDecoder>();
+                return true;
+            }
+            if(line.starts_with("compress busy"))
+            {
+                requestCompression();
+                return m_state == State::Connected;
+            }
+            m_compressWait = false;
+        }
+        if(m_handler->onLine)
+            m_handler->onLine(*this, line);
+        return m_state == State::Connected;
+    };
+
+    size_t pos = 0;
+    if(!m_in.empty())
+    {//先补齐上次剩下的半行；回调期间会话可能被关闭，不能把m_in本身交出去
+        const char* nl = (const char*)memchr(data, '\n', len);
+        size_t take = nl ? nl - data : len;
+        m_in.append(data, take);
+        pos = nl ? take + 1 : len;
+        if(nl)
+        {
+            std::string line;
+            line.swap(m_in);
+            if(!emit(line))
+                return;
+        }
+    }
+
+    //完整的行直接从读缓冲区回调，不拷贝
+    while(pos < len)
+    {
+        const char* nl = (const char*)memchr(data + pos, '\n', len - pos);
+        if(!nl)
+            break;
+        size_t end = nl - data;
+        if(!emit(std::string_view(data + pos, end - pos)))
+            return;
+        pos = end + 1;
+    }
+
+    m_in.append(data + pos, len - pos);
+    while(m_in.size() >= SESSION_LINE_MAX)
+    {
+        std::string line = m_in.substr(0, SESSION_LINE_MAX);
+        m_in.erase(0, SESSION_LINE_MAX);
+        if(!emit(line))
+            return;
+    }
+}
+
+void ChatSession::flush()
+{
+    while(m_outPos < m_out.size())
+    {
+        ssize_t n = ::send(m_fd, m_out.data() + m_outPos, m_out.size() - m_outPos, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if(n > 0)
+        {
+            m_outPos += n;
+            continue;
+        }
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+            break;
+        disconnect(n < 0 ? errno : EPIPE);
+        return;
+    }
+    if(m_outPos == m_out.size())
+    {
+        m_out.clear();
+        m_outPos = 0;
+    }
+    updateEvents();
+}
+
+void ChatSession::disconnect(int err)
+{
+    bool wasConnected = (m_state == State::Connected);
+    if(m_fd != -1)
+    {
+        m_client->watch(this, 0);
+        ::close(m_fd);
+        m_fd = -1;
+    }
+    if(wasConnected)
+        m_client->m_connected--;
+    m_in.clear();
+    m_out.clear();
+    m_outPos = 0;
+    m_compressWait = false;
+    m_decoder.reset();
+    if(m_state == State::Closed)
+        return;
+
+    m_state = State::Idle;
+    if(wasConnected && m_handler->onDisconnect) //连接没建立起来的失败不回调，只重试
+        m_handler->onDisconnect(*this, err);
+    if(m_state != State::Idle) //回调里close了
+        return;
+
+    //退避时间在[delay/2, delay]之间随机，服务端重启后所有会话不会在同一时刻一起重连
+    int64_t delay = std::min<int64_t>(RECONNECT_MAX_MS, (int64_t)RECONNECT_MIN_MS << std::min(m_failures, 16));
+    delay = delay / 2 + rand() % (delay / 2 + 1);
+    m_failures++;
+
+    ChatClient* client = m_client;
+    uint64_t handle = m_handle;
+    client->after(delay, [client, handle] {
+        ChatSession* session = client->find(handle);
+        if(session && session->m_state == State::Idle)
+            session->startConnect();
+    });
+}
+
+void ChatSession::updateEvents()
+{
+    uint32_t events = (uint32_t)EPOLLIN | (m_outPos < m_out.size() ? (uint32_t)EPOLLOUT : 0u);
+    if(events != m_events)
+        m_client->watch(this, events);
+}
+
+//////////////////////ChatClient类
+ChatClient::ChatClient()
+    : m_epfd(-1),
+      m_stop(false),
+      m_live(0),
+      m_connected(0),
+      m_timerOrder(0)
+{
+}
+
+ChatClient::~ChatClient()
+{
+    m_slots.clear(); //会话析构时关闭各自的fd
+    if(m_epfd != -1)
+        ::close(m_epfd);
+}
+
+bool ChatClient::init()
+{
+    m_epfd = epoll_create1(EPOLL_CLOEXEC);
+    return m_epfd != -1;
+}
+
+ChatSession* ChatClient::open(const std::string& host, int port, std::shared_ptr<ChatSession::Handler> handler)
+{
+    uint32_t slot;
+    if(!m_freeSlots.empty())
+    {
+        slot = m_freeSlots.back();
+        m_freeSlots.pop_back();
+    }
+    else
+    {
+        slot = m_slots.size();
+        m_slots.emplace_back();
+        m_generations.push_back(0);
+    }
+
+    uint64_t handle = ((uint64_t)m_generations[slot] << 32) | slot;
+    m_slots[slot] = std::make_unique<ChatSession>(this, handle, host, port, std::move(handler));
+    m_live++;
+
+    ChatSession* session = m_slots[slot].get();
+    session->startConnect();
+    return session;
+}
+
+ChatSession* ChatClient::find(uint64_t handle)
+{
+    uint32_t slot = (uint32_t)handle;
+    if(slot >= m_slots.size() || m_generations[slot] != (uint32_t)(handle >> 32))
+        return nullptr;
+    return m_slots[slot].get();
+}
+
+void ChatClient::after(int64_t delayMs, std::function<void()> fn)
+{
+    m_timers.push(Timer{nowMs() + delayMs, m_timerOrder++, std::move(fn)});
+}
+
+int ChatClient::runOnce(int timeoutMs)
+{
+    int next = runTimers();
+    if(next >= 0 && (timeoutMs < 0 || next < timeoutMs))
+        timeoutMs = next;
+
+    epoll_event events[CLIENT_EVENTS_MAX];
+    int n = epoll_wait(m_epfd, events, CLIENT_EVENTS_MAX, timeoutMs);
+    for(int i = 0; i < n; i++)
+    {
+        //同一批里排在后面的会话可能已经被前面的回调关闭
+        ChatSession* session = find(events[i].data.u64);
+        if(session && session->m_state != ChatSession::State::Closed)
+            session->onEvent(events[i].events);
+    }
+    runTimers();
+
+    for(uint32_t slot : m_dead)
+    {
+        m_slots[slot].reset();
+        m_generations[slot]++;
+        m_freeSlots.push_back(slot);
+    }
+    m_dead.clear();
+    return n < 0 ? 0 : n;
+}
+
+void ChatClient::run()
+{
+    m_stop = false;
+    while(!m_stop)
+        runOnce(1000);
+}
+
+void ChatClient::stop()
+{
+    m_stop = true;
+}
+
+size_t ChatClient::sessions()
+{
+    return m_live;
+}
+
+size_t ChatClient::connected()
+{
+    return m_connected;
+}
+
+void ChatClient::watch(ChatSession* session, uint32_t events)
+{
+    epoll_event ev;
+    ev.events = events;
+    ev.data.u64 = session->m_handle;
+    if(events == 0)
+        epoll_ctl(m_epfd, EPOLL_CTL_DEL, session->m_fd, &ev);
+    else if(session->m_events == 0)
+        epoll_ctl(m_epfd, EPOLL_CTL_ADD, session->m_fd, &ev);
+    else
+        epoll_ctl(m_epfd, EPOLL_CTL_MOD, session->m_fd, &ev);
+    session->m_events = events;
+}
+
+void ChatClient::release(ChatSession* session)
+{
+    m_dead.push_back((uint32_t)session->m_handle);
+    m_live--;
+}
+
+int ChatClient::runTimers()
+{
+    int64_t now = nowMs();
+    while(!m_timers.empty() && m_timers.top().due <= now)
+    {
+        std::function<void()> fn = m_timers.top().fn;
+        m_timers.pop();
+        fn();
+    }
+    if(m_timers.empty())
+        return -1;
+    return (int)std::min<int64_t>(m_timers.top().due - now, 1000);
+}
@@ -0,0 +1,148 @@
+#ifndef CHATCLIENT_H
+#define CHATCLIENT_H
+
+#include<stdint.h>
+#include<stddef.h>
+#include<string>
+#include<string_view>
+#include<vector>
+#include<memory>
+#include<functional>
+#include<queue>
+#include"Compress.h"
+
+//多会话客户端库：一个事件循环线程上复用成千上万个聊天连接，给机器人用，不用每个身份起一个smallchat-client进程。
+//连接由smallchat/chatlib.c的TCPConnect/UnixConnect以非阻塞方式发起，事件用epoll(连接数会超过select的FD_SETSIZE)。
+//收到的数据按行回调；写先尽量直接发，发不完的缓冲起来等可写；断开后按指数退避(带随机抖动)自动重连。
+//所有方法只能在事件循环线程上调用，回调里调用也可以。
+#define SESSION_LINE_MAX     (16 * 1024)   //超过这个长度还没有换行就按这个长度切开回调
+#define SESSION_OUTBUF_MAX   (1024 * 1024) //写缓冲上限，超过时send返回false
+#define SESSION_READ_SIZE    (64 * 1024)   //每次可读事件最多读的字节数，所有会话共用一块缓冲区
+#define CONNECT_TIMEOUT_MS   5000          //非阻塞connect这么久还没完成算失败
+#define RECONNECT_MIN_MS     100           //第一次重连的等待时间，之后每次翻倍
+#define RECONNECT_MAX_MS     30000
+#define CLIENT_EVENTS_MAX    256           //每次epoll_wait最多取的事件数
+
+class ChatClient;
+
+class ChatSession final
+{
+    public:
+        //回调都可以为空，同一个Handler可以给很多会话共用；line不含换行，只在回调期间有效
+        struct Handler
+        {
+            std::function<void(ChatSession& session)>                        onConnect;
+            std::function<void(ChatSession& session, std::string_view line)> onLine;
+            std::function<void(ChatSession& session, int err)>               onDisconnect; //err为0表示对端正常关闭
+        };
+
+        ChatSession(ChatClient* client, uint64_t handle, const std::string& host, int port, std::shared_ptr<Handler> handler);
+        ~ChatSession();
+        ChatSession(const ChatSession&) = delete;
+        ChatSession& operator=(const ChatSession&) = delete;
+
+        uint64_t handle(); //在ChatClient里的编号，会话释放后不会再指向别的会话
+        bool     isConnected();
+        bool     send(std::string_view line); //没有换行时补上；没连上或者写缓冲满了返回false
+        bool     write(std::string_view data); //原样写
+        size_t   pendingBytes(); //写缓冲里还没发出去的字节数
+        uint64_t reconnects(); //成功重连的次数
+        void     close(); //断开且不再重连，本轮事件处理完后释放
+        //连上后发送 /compress level，之后收到的压缩帧解压后照常按行回调；已经连上时立即开始协商
+        void     enableCompression(int level = COMPRESS_LEVEL_DEFAULT);
+        bool     isCompressed(); //本次连接已经切换到压缩
+        void     setContext(void* context); //机器人自己的状态
+        void*    context();
+
+    private:
+        friend class ChatClient;
+
+        enum class State { Idle, Connecting, Connected, Closed };
+
+        void startConnect();
+        void onEvent(uint32_t events);
+        void finishConnect();
+        void readSome();
+        void deliver(const char* data, size_t len); //解压缩帧后交给deliverLines
+        void deliverLines(const char* data, size_t len); //按行回调，不完整的行留在m_in
+        void requestCompression();
+        void flush();
+        void disconnect(int err); //关闭连接，回调onDisconnect，没有close的话安排重连
+        void updateEvents();
+
+    private:
+        ChatClient*              m_client;
+        uint64_t                 m_handle;
+        std::string              m_host; //port<=0时是Unix域socket的路径
+        int                      m_port;
+        std::shared_ptr<Handler> m_handler;
+        void*                    m_context;
+        State                    m_state;
+        int                      m_fd;
+        uint32_t                 m_events; //当前在epoll里关注的事件
+        uint32_t                 m_attempt; //本次连接的序号，用来识别过期的超时定时器
+        int                      m_failures; //连续失败次数，决定退避时间
+        uint64_t                 m_reconnects;
+        bool                     m_everConnected;
+        std::string              m_in; //不完整的行
+        int                      m_compressLevel; //0表示不压缩
+        bool                     m_compressWait; //发了 /compress，还在等回复
+        std::unique_ptr<FrameDecoder> m_decoder; //服务端回复compress on之后创建，断开时丢掉
+        std::string              m_plain; //解压出来的明文
+        std::string              m_out;
+        size_t                   m_outPos; //m_out中已经发出的部分
+};
+
+class ChatClient final
+{
+    public:
+        ChatClient();
+        ~ChatClient();
+        ChatClient(const ChatClient&) = delete;
+        ChatClient& operator=(const ChatClient&) = delete;
+
+        bool init(); //创建epoll
+        //新建一个会话并开始连接；port<=0时host是Unix域socket的路径
+        ChatSession* open(const std::string& host, int port, std::shared_ptr<ChatSession::Handler> handler);
+        ChatSession* find(uint64_t handle); //会话已经释放返回nullptr
+        void   after(int64_t delayMs, std::function<void()> fn); //定时器，给机器人定时发言用
+        int    runOnce(int timeoutMs); //处理一轮事件和到期的定时器，返回处理的事件数
+        void   run(); //一直运行到stop()
+        void   stop();
+        size_t sessions(); //没有close的会话数
+        size_t connected();
+
+    private:
+        friend class ChatSession;
+
+        struct Timer
+        {
+            int64_t               due;
+            uint64_t              order; //同一时刻到期的按加入顺序执行
+            std::function<void()> fn;
+
+            bool operator>(const Timer& rhs) const
+            {
+                return due != rhs.due ? due > rhs.due : order > rhs.order;
+            }
+        };
+
+        void watch(ChatSession* session, uint32_t events); //events为0表示移除
+        void release(ChatSession* session); //close后放进待释放列表
+        int  runTimers(); //返回到下一个定时器的毫秒数，没有返回-1
+
+    private:
+        int                                       m_epfd;
+        bool                                      m_stop;
+        std::vector<std::unique_ptr<ChatSession>> m_slots; //编号低32位是下标，高32位是该下标的第几代
+        std::vector<uint32_t>                     m_generations;
+        std::vector<uint32_t>                     m_freeSlots;
+        std::vector<uint32_t>                     m_dead; //本轮close的会话，事件处理完再释放
+        size_t                                    m_live;
+        size_t                                    m_connected;
+        std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> m_timers;
+        uint64_t                                  m_timerOrder;
+        char                                      m_scratch[SESSION_READ_SIZE]; //所有会话共用的读缓冲区
+};
+
+#endif //CHATCLIENT_H
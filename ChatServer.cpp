@@ -3,472 +3,3517 @@
 //设置文件描述符非阻塞非延迟
 int setNonblockNondelay(int fd)
 {
+    if constexpr(transport::kSimulated) //模拟的连接本来就不阻塞
+        return 0;
     int old_property = fcntl(fd, F_GETFL);
-    int new_property = fcntl(fd, F_SETFL, old_property | O_NONBLOCK);
+    if(old_property == -1 || fcntl(fd, F_SETFL, old_property | O_NONBLOCK) == -1)
+        return -1;
     int flag = 1;
     setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char *)&flag, sizeof(flag));
+    return 0;
+}
+
+//单调时钟毫秒数，模拟网络下是虚拟时钟
+int64_t monotonicMs()
+{
+    return transport::nowUs() / 1000;
+}
+
+int64_t monotonicUs()
+{
+    return transport::nowUs();
+}
+
+//这段数据发完以后，客户端收到的明文是不是停在行边界上
+static bool endsLine(const std::string& data, int framing)
+{
+    if(framing == FRAMING_PLAIN)
+        return data.empty() || data.back() == '\n';
+    return framing == FRAMING_LINE;
 }
 
+//整个参数都是数字才算成功
+static bool parseNumber(std::string_view text, uint64_t& value, int base)
+{
+    std::from_chars_result r = std::from_chars(text.data(), text.data() + text.size(), value, base);
+    return r.ec == std::errc() && r.ptr == text.data() + text.size();
+}
+
+static thread_local char t_scratch[CLIENT_SCRATCH_SIZE]; //所有连接共用的读缓冲区
+
 //////////////////////Client类
-Client::Client(int sockfd) 
+Client::Client(int sockfd, uint64_t serial, ChatServer* server) 
 {
     m_fd = sockfd;
+    m_serial = serial;
+    m_server = server;
+    m_events = 0;
+    m_outBytes = 0;
+    m_outLane = -1;
+    m_pickLane = 0;
+    m_lastDrainMs = 0;
+    m_reading = true;
+    m_chargedBytes = 0;
+    m_readWindowMs = 0;
+    m_readWindowBytes = 0;
+    m_readRate = 0;
+    m_zeroCopy = false;
+    m_zcNextId = 0;
     m_nick = "client " + std::to_string(sockfd);
-    memset(m_writeBuf, 0, sizeof(m_writeBuf));
+    m_token = 0;
+    m_seq = false;
+    m_roster = false;
+    m_registered = false;
+    m_inData = nullptr;
+    m_inStash = nullptr;
+    m_inStashCap = 0;
+    m_inStart = 0;
+    m_inEnd = 0;
+    m_inClosed = false;
+    m_lineCut = false;
+    m_chunkReader = false;
+    m_fileActive = false;
 }
 
 Client::~Client()
 {
-    close(m_fd);
+    transport::close(m_fd);
+    if(m_inStash)
+        BufferPool::release(m_inStash, m_inStashCap);
 }
 
 template<typename Func>
 void Client::setReadCallback(Func func) 
 {                          
-    m_readCallback = [=]() { //传入进来的外部变量必须是传拷贝，传入的函数对象是临时的
+    m_readCallback = [=, this]() { //传入进来的外部变量必须是传拷贝，传入的函数对象是临时的
         func(this);
     };
 }
 
-void Client::handleEvent()
+template<typename Func>
+void Client::setWriteCallback(Func func) 
+{                          
+    m_writeCallback = [=, this]() {
+        func(this);
+    };
+}
+
+Client::ReadLineAwaiter Client::readLine()
 {
-    //这里只用处理接收到来自客户端的数据一种情况(也就是读事件)
-    if(m_readCallback) 
-        m_readCallback();
+    return ReadLineAwaiter{this};
 }
 
-int Client::fd()
+Client::WriteAllAwaiter Client::writeAll(std::string data)
 {
-    return m_fd;
+    allocstats::AllowScope allow; //只用来回复命令，不在收消息->广播的热路径上
+    return WriteAllAwaiter{this, std::make_shared<const std::string>(std::move(data)), 0};
 }
 
-std::string Client::nick()
+bool Client::ReadLineAwaiter::await_ready()
 {
-    return m_nick;
+    return client->hasLine() && !client->m_server->inputBlocked(client);
 }
 
-std::string Client::Buffer()
+Client::ReadChunkAwaiter Client::readChunk()
 {
-    return m_writeBuf;
+    return ReadChunkAwaiter{this};
 }
 
-void Client::changeNick(const char* nick)
+Client::ReceiveFileAwaiter Client::receiveFile()
 {
-    m_nick = nick;
+    return ReceiveFileAwaiter{this};
 }
 
-void Client::changeBuffer(const char* buffer)
+Client::SendFileAwaiter Client::sendFile()
 {
-    memset(m_writeBuf, 0, sizeof(m_writeBuf));
-    memcpy(m_writeBuf, buffer, sizeof(m_writeBuf));
+    return SendFileAwaiter{this, 0};
 }
 
-//////////////这里是Acceptor类
-Acceptor::Acceptor(ChatServer* server) 
-    : m_server(server),
-      m_listenfd(-2),
-      m_clientNum(0),
-      m_isReadyAcc(false)
+bool Client::ReceiveFileAwaiter::await_ready()
 {
+    client->m_fileActive = true;
+    return client->m_server->receiveBuffered(client) || client->m_inClosed;
 }
 
-Acceptor::~Acceptor()
-{   
-    close(m_listenfd);
+bool Client::ReceiveFileAwaiter::await_resume()
+{
+    return client->m_file && client->m_file->done();
 }
 
-int Acceptor::fd()
+bool Client::SendFileAwaiter::await_ready()
 {
-    if(m_listenfd == -2) 
-        std::cout << "listenfd not initialized" << std::endl;
-    
-    return m_listenfd;
+    client->m_fileActive = true;
+    result = client->m_server->sendFile(client);
+    return result != 0;
 }
 
-bool Acceptor::isReady()
+bool Client::WriteAllAwaiter::await_ready()
 {
-    return m_isReadyAcc;
+    result = client->m_server->writeSome(client, data);
+    return result != 0;
 }
 
-bool Acceptor::listenClient()  //返回false代表创建listenfd失败
+void Client::setSession(Task session)
 {
-    m_listenfd = socket(AF_INET, SOCK_STREAM, 0);
-    if(m_listenfd == -1)
-    {
-        std::cout << "socket failure" << std::endl;
-        return false;
-    }
+    m_session = std::move(session);
+}
 
-    int yes = 1;
-    setsockopt(m_listenfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+bool Client::isSessionDone()
+{
+    return m_session.done();
+}
 
-    sockaddr_in saddr;
-    saddr.sin_addr.s_addr = htonl(INADDR_ANY);
-    saddr.sin_port = htons(BIND_PORT);
-    saddr.sin_family = AF_INET;
-    int ret = bind(m_listenfd, (struct sockaddr*)&saddr, sizeof(saddr));
-    if(ret == -1)
-    {
-        std::cout << "bind failure" << std::endl;
-        return false;
-    }
+void Client::resumeSession()
+{
+    std::coroutine_handle<> handle;
+    bool readable = false;
+    if(m_reader && isReceivingFile())
+        readable = m_inClosed || m_file->done();
+    else if(m_reader)
+        readable = m_chunkReader ? hasChunk() : hasLine() && !m_server->inputBlocked(this);
+
+    if(readable)
+        std::swap(handle, m_reader);
+    else if(m_writer && !isSendingFile() && (m_file && !m_file->isUpload() ? !hasPendingOutput() && m_outLane < 0 : !hasPendingOutput(LANE_CONTROL)))
+        std::swap(handle, m_writer); //下载的文件不分通道，要等队列里的全部发完才开始
+
+    if(handle)
+        handle.resume();
+}
 
-    ret = listen(m_listenfd, 5);
-    if(ret == -1)
+char* Client::beginInput(char* scratch, size_t* space)
+{
+    //上次剩下的数据(通常是不完整的一行)挪到scratch开头，借来的缓冲区马上还回去
+    size_t left = m_inEnd - m_inStart;
+    if(left)
+        memcpy(scratch, m_inData + m_inStart, left);
+    if(m_inStash)
     {
-        std::cout << "listen failure" << std::endl;
-        return false;
+        BufferPool::release(m_inStash, m_inStashCap);
+        m_inStash = nullptr;
     }
 
-    m_server->initMaxFd(m_listenfd);
-
-    return true;
+    m_inData = scratch;
+    m_inStart = 0;
+    m_inEnd = left;
+    *space = CLIENT_SCRATCH_SIZE - left;
+    return scratch + left;
 }
 
-void Acceptor::setReady(bool ready)
+void Client::commitInput(size_t n)
 {
-    m_isReadyAcc = ready;
+    m_inEnd += n;
 }
 
-bool Acceptor::acceptClient()
+void Client::endInput()
 {
-    sockaddr_in cliaddr;
-    socklen_t cli_len = sizeof(cliaddr);
-    memset(&cliaddr, 0, cli_len);
-
-    int sockfd;
-    while(1)
-    {
-        sockfd = accept(m_listenfd, (struct sockaddr*)&cliaddr, &cli_len);
-        if(sockfd < 0)
-        {
-            if(errno == EINTR)  //如果accept是被信号意外中断则重新accept
-                continue;
-            std::cout << "accept failure!" << std::endl;
-            return false;
-        }
-
-        break;
-    }
-
-    if(m_clientNum == MAX_CLIENT)
+    size_t left = m_inEnd - m_inStart;
+    if(left == 0)
     {
-        std::cout << "Client Number limit!" << std::endl;
-        close(sockfd);
-        return false;
+        m_inData = nullptr;
+        m_inStart = m_inEnd = 0;
+        return;
     }
 
-    setNonblockNondelay(sockfd);
-    
-    addClient(sockfd);
-    m_clientNum++;
-
-    welcomeClientJoin(sockfd);
-
-    setReady(false); 
-    
-    return true;
+    //会话没取完的数据不能留在scratch里，按大小借一块缓冲区存起来
+    m_inStash = BufferPool::acquire(left, &m_inStashCap);
+    memcpy(m_inStash, m_inData + m_inStart, left);
+    m_inData = m_inStash;
+    m_inStart = 0;
+    m_inEnd = left;
 }
 
-void Acceptor::addClient(int fd) 
+void Client::closeInput()
 {
-    m_server->addClient(fd);
+    m_inClosed = true;
 }
 
-void Acceptor::welcomeClientJoin(int sockfd)
+bool Client::hasLine()
 {
-    std::cout << "welcome sockfd: " << sockfd << " join chatRoom" << std::endl;
+    size_t avail = m_inEnd - m_inStart;
+    return m_inClosed || avail >= CLIENT_LINE_MAX || (avail && memchr(m_inData + m_inStart, '\n', avail));
+}
 
-    std::string msg("welcome to chatroom, /nick is change yourname\n");
-    send(sockfd, msg.c_str(), msg.size(), 0);
+std::optional<std::string_view> Client::takeLine()
+{
+    char* begin = m_inData + m_inStart;
+    size_t avail = m_inEnd - m_inStart;
+    if(avail == 0) //只有连接关闭后才会走到这里
+        return std::nullopt;
+
+    //超长的行先交出CLIENT_LINE_MAX字节并标记截断，剩下的由readChunk取；连接关闭前最后不完整的一行原样交出去
+    size_t len = std::min<size_t>(avail, CLIENT_LINE_MAX);
+    size_t consumed = len;
+    char* nl = (char*)memchr(begin, '\n', len);
+    if(nl)
+    {
+        len = nl - begin;
+        consumed = len + 1;
+    }
+    m_lineCut = !nl && !(m_inClosed && avail <= CLIENT_LINE_MAX);
+    m_inStart += consumed;
+    return std::string_view(begin, len);
 }
 
-void Acceptor::reduceClientNum()
+bool Client::lineCut()
 {
-    m_clientNum--;
-} 
+    return m_lineCut;
+}
 
-//////////////这里是Poller类
-Poller::Poller() : m_maxClientFd(-1){}
+bool Client::hasChunk()
+{
+    return m_inClosed || m_inEnd > m_inStart;
+}
 
-void Poller::poll(std::vector<std::shared_ptr<Client>>& activeClients, std::shared_ptr<Acceptor> acceptor) //不使用引用是防止被误删资源
+std::optional<std::string_view> Client::takeChunk()
 {
-    FD_ZERO(&m_readfds);
-    
-    FD_SET(acceptor->fd(), &m_readfds);
-    for(int i = 0; i <= m_maxClientFd; i++) //listenfd不由m_users管
+    char* begin = m_inData + m_inStart;
+    size_t avail = m_inEnd - m_inStart;
+    if(avail == 0)
     {
-        if(m_users[i] && i != acceptor->fd()) //如果这个客户端对象存在就需要监听他的事件
-            FD_SET(i, &m_readfds);
+        m_lineCut = false;
+        return std::nullopt;
     }
 
-    //开始监听
-    int num = select(m_maxClientFd + 1, &m_readfds, nullptr, nullptr, nullptr);
-    if(num > 0)
+    size_t len = avail;
+    char* nl = (char*)memchr(begin, '\n', avail);
+    if(nl)
     {
-        if(FD_ISSET(acceptor->fd(), &m_readfds))
-        {
-            num--;
-            acceptor->setReady(true);
-        }   
-
-        fillActiveClients(activeClients, num);
+        len = nl - begin;
+        m_inStart += len + 1;
     }
-    else 
+    else
     {
-        std::cout << "select error" << std::endl;
-        return ;
+        m_inStart += len;
     }
+    m_lineCut = !nl && !m_inClosed;
+    return std::string_view(begin, len);
 }
 
-//填充事件准备就绪的client对象
-void Poller::fillActiveClients(std::vector<std::shared_ptr<Client>>& activeClients, int num) 
+std::string_view Client::takeInput(size_t max)
 {
-    //填充activeClients
-    for(int i = 0; i <= m_maxClientFd && num > 0; i++)
-    {
-        if(m_users[i] && FD_ISSET(i, &m_readfds))
-        {
-            num--;
-            activeClients.push_back(m_users[i]);
-        }
-    }
+    size_t len = std::min(max, m_inEnd - m_inStart);
+    if(len == 0)
+        return std::string_view();
+    std::string_view data(m_inData + m_inStart, len);
+    m_inStart += len;
+    return data;
 }
 
-void Poller::initMaxFd(int listenfd)
+bool Client::wantsRead()
 {
-    m_maxClientFd = listenfd;
+    return m_reading && !m_writer;
 }
 
-void Poller::addClient(std::shared_ptr<Client>& ptr, int maxClientFd) 
+void Client::setReadyEvents(int events)
 {
-    //添加监听客户端
-    m_users[ptr->fd()] = ptr;
-    m_maxClientFd = maxClientFd;
+    m_events = events;
 }
 
-void Poller::rmClient(int fd, int maxClientFd)
+int Client::readyEvents()
 {
-    m_users[fd].reset();
-    m_maxClientFd = maxClientFd;
+    return m_events;
 }
 
-////////////从这里开始ChatServer类
-ChatServer::ChatServer() 
-{   
-    m_maxClientFd = -2;
-    m_acceptor = std::make_shared<Acceptor>(this);
-    m_poller = std::make_unique<Poller>();
+void Client::handleEvent()
+{
+    //门铃只说明对方动过环，读走计数后按既有数据又有空间处理
+    if(m_shm && (m_events & EV_BELL))
+    {
+        m_shm->clearBell();
+        if(hasPendingOutput())
+            m_events |= EV_WRITE;
+    }
+
+    //零拷贝的完成通知走错误队列，select会把它报告为可读，先把它取走
+    if(m_zcPending)
+        reapZeroCopy();
+
+    //先发送积压的数据，腾出预算后再读新消息
+    if((m_events & EV_WRITE) && m_writeCallback)
+        m_writeCallback();
+
+    if((m_events & (EV_READ | EV_BELL)) && m_readCallback) 
+        m_readCallback();
 }
 
-ChatServer& ChatServer::getInstance()
+int Client::fd()
 {
-    static ChatServer server;
-    return server;
+    return m_fd;
 }
 
-void ChatServer::initMaxFd(int listenfd)
+uint64_t Client::serial()
 {
-    m_maxClientFd = listenfd;
-    m_poller->initMaxFd(listenfd);
+    return m_serial;
 }
 
-void ChatServer::addClient(int fd)
+const std::string& Client::nick()
 {
-    //添加客户端addClient
-    m_users[fd] = std::make_shared<Client>(fd);
-    m_users[fd]->setReadCallback(std::bind(&ChatServer::forwardMessage, this, std::placeholders::_1));
-    
-    if(fd > m_maxClientFd)
-        m_maxClientFd = fd;
-
-    m_poller->addClient(m_users[fd], m_maxClientFd);
+    return m_nick;
 }
 
-void ChatServer::forwardMessage(Client* client) //由client对象调用,调用该函数的client的读事件就绪
+void Client::changeNick(std::string_view nick)
 {
-    //1.read()消息 2.将消息转发(通过m_users,还有m_maxClientFd)
-    int Flag = readFromSocket(client);
-    if(Flag == 1) 
-    {
-        //转发消息
-        for(int i = 0; i <= m_maxClientFd; i++) 
-        {
-            if(m_users[i] == nullptr || i == client->fd()) 
-                continue;
-            if(!sendMsg(client, i)) //发送消息失败
-            {
-                //释放连接客户端资源
-                freeClient(i);
-            }
-        }
-    }    
-    else if(Flag == -1)
-    {
-        //读取消息失败，释放连接客户端资源
-        freeClient(client->fd());
-    }
-    
+    m_server->rosterDelta(m_nick, -1);
+    m_server->rosterDelta(nick, 1);
+    m_nick = nick;
+    m_registered = false;
 }
 
-int ChatServer::readFromSocket(Client* client) //-1代表出错或断开连接  0代表设置指令(改名)或没读到数据  1代表读取到数据
+uint64_t Client::token()
 {
-    if(!client) //防止访问空指针
-    {
-        std::cout << "readFd Empty Client" << std::endl;
-        return -1; 
-    }
-
-    //这个read可能是设置命令(改名字)也可能是发送消息
-    char msg[1024]={0};
-    memset(msg, 0, sizeof(msg));
-    int nread = recv(client->fd(), msg, sizeof(msg), 0);
-    if(nread == -1)
-    {
-        if(errno == EAGAIN || errno == EINTR)
-            return 0;
-        return -1;
-    }
-    else if(nread == 0)
-    {
-        printf("client %d close connect...\n", client->fd());
-        return -1;
-    }
-    
-    //在这里进行判断是进行改名字还是发消息
-    if (msg[0] == '/')
-    {
-        processCmd(client, msg);
-        return 0;
-    } 
-
-    //发送消息
-    readMsg(client, msg, nread);
-
-    return 1;
+    return m_token;
 }
 
-void ChatServer::processCmd(Client* client, char* msg)
+void Client::setToken(uint64_t token)
 {
-    //去除命令中的换行符
-    char *target;
-    target = strchr(msg,'\r'); if(target) *target = '\0';
-    target = strchr(msg,'\n'); if(target) *target = '\0';
-
-    char* args = strchr(msg,' ');
-    if(args) 
-        *args++ = '\0';
+    m_token = token;
+}
 
-    if(!strcasecmp(msg, "/nick") && args)
-    {//改名
-        client->changeNick(args);
-        std::string info = "change nick success!\n";
-        send(client->fd(), info.c_str(), info.size(), 0);
-    }
-    else 
-    {
-        std::string errstr = "unsupported cmd\n";
-        send(client->fd(), errstr.c_str(), errstr.size(), 0);
-    }
+bool Client::wantsSeq()
+{
+    return m_seq;
 }
 
-void ChatServer::readMsg(Client* client, char* msg, int nread)
+void Client::enableSeq()
 {
-    char writeBuf[1024];
-    memset(writeBuf, 0, sizeof(writeBuf));
+    m_seq = true;
+}
 
-    int len = client->nick().size();
-    memcpy(writeBuf, client->nick().c_str(), len);
-    writeBuf[len++] = '>';
-    memcpy(writeBuf + len, msg, sizeof(writeBuf) - len);
+bool Client::wantsRoster()
+{
+    return m_roster;
+}
 
-    if(nread > sizeof(writeBuf)) //当用户发送数据太长时截断，防止操作未分配内存
-    {
-        nread = sizeof(writeBuf) - 1;
-        writeBuf[nread] = '\0';
-    }
+bool Client::isRegistered()
+{
+    return m_registered;
+}
 
-    //把聊天用户发的消息打印在聊天服务端控制台 
-    std::cout << writeBuf << std::endl;
+void Client::setRegistered(bool registered)
+{
+    m_registered = registered;
+}
 
-    client->changeBuffer(writeBuf);
+void Client::enableRoster()
+{
+    m_roster = true;
 }
 
-bool ChatServer::sendMsg(Client* client, int targetFd)
+bool Client::enableZeroCopy()
 {
-    int tmp = send(targetFd, client->Buffer().c_str(), client->Buffer().size(), 0);
-    if(tmp <= 0)
-    {
-        std::cout << "send to " << targetFd << " failure!" << std::endl;
+    int one = 1;
+    if(transport::setsockopt(m_fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == -1)
         return false;
-    }
+
+    m_zeroCopy = true;
     return true;
 }
 
-void ChatServer::freeClient(int fd)
+bool Client::isZeroCopy()
 {
-    if(fd == m_maxClientFd) 
+    return m_zeroCopy;
+}
+
+int Client::sendZeroCopy(const std::shared_ptr<const std::string>& payload, size_t offset)
+{
+    int ret = transport::send(m_fd, payload->data() + offset, payload->size() - offset, MSG_ZEROCOPY);
+    if(ret > 0) //内核只为成功的调用分配序号，页面在完成通知前仍被内核引用，payload不能释放
     {
-        //更新最大fd
-        for(int i = m_maxClientFd - 1; i >= 0; i--)
-        {
-            if(m_users[i] != nullptr)
-            {
-                m_maxClientFd = i;
-                break;
-            }
-        }
+        if(!m_zcPending)
+            m_zcPending = std::make_unique<std::deque<std::pair<uint32_t, std::shared_ptr<const std::string>>>>();
+        m_zcPending->emplace_back(m_zcNextId++, payload);
     }
-
-    //释放fd相关资源
-    m_users[fd].reset();
     
-    m_poller->rmClient(fd, m_maxClientFd); 
-    m_acceptor->reduceClientNum(); //减少客户端数量
+    return ret;
 }
 
-void ChatServer::start()
+void Client::reapZeroCopy()
 {
-    m_isStop = false;
-    if(!m_acceptor->listenClient())
+    while(m_zcPending)
     {
-        std::cout << "create listenfd false" << std::endl;
-        return ;
-    }
-    std::vector<std::shared_ptr<Client>> activeClients;
+        char control[128];
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
 
-    while(!m_isStop)
-    {
-        activeClients.clear();
-        m_poller->poll(activeClients, m_acceptor);
+        if(recvmsg(m_fd, &msg, MSG_ERRQUEUE) == -1) //EAGAIN: 暂时没有新的完成通知
+            return;
 
-        if(m_acceptor->isReady()) //listenfd就绪
+        for(cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
         {
-            if(!m_acceptor->acceptClient())
+            if(!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+               !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+                continue;
+
+            sock_extended_err* serr = (sock_extended_err*)CMSG_DATA(cm);
+            if(serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+
+            //内核最终还是做了拷贝(比如loopback)，零拷贝只剩通知开销，这个连接改回普通send
+            if(serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                m_zeroCopy = false;
+
+            //通知是一个闭区间[ee_info, ee_data]，TCP上按序完成，释放到ee_data为止
+            uint32_t last = serr->ee_data;
+            while(!m_zcPending->empty() && (int32_t)(m_zcPending->front().first - last) <= 0)
+                m_zcPending->pop_front();
+            if(m_zcPending->empty()) //全部完成后连队列一起释放
             {
-                std::cout << "accept Client failure!" << std::endl;
+                m_zcPending.reset();
+                return;
             }
         }
-
-        for(std::shared_ptr<Client>& client : activeClients)
-        {
-            client->handleEvent();  
-        } 
     }
-
 }
 
-void ChatServer::stop()
+bool Client::enableBusyPoll(int usec)
 {
-    m_isStop = true;
-}
+    //SO_BUSY_POLL调大超过net.core.busy_read需要CAP_NET_ADMIN；SO_PREFER_BUSY_POLL需要5.11以上内核
+    int prefer = 1;
+    if(transport::setsockopt(m_fd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec)) == -1)
+        return false;
+    transport::setsockopt(m_fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof(prefer));
+    return true;
+}
+
+bool Client::hasPendingOutput()
+{
+    return m_out != nullptr;
+}
+
+bool Client::hasPendingOutput(int lane)
+{
+    return m_out && !m_out->lanes[lane].empty();
+}
+
+bool Client::hasSendableOutput()
+{
+    //同一行的后面部分只能接在前面部分之后发，中间不能插进别的通道的数据
+    return m_out && (m_outLane < 0 || !m_out->lanes[m_outLane].empty());
+}
+
+bool Client::canSendDirect(int lane)
+{
+    return !m_out && !isSendingFile() && (m_outLane < 0 || m_outLane == lane);
+}
+
+void Client::markSent(int lane, bool lineEnd)
+{
+    m_outLane = lineEnd ? -1 : lane;
+}
+
+size_t Client::pendingBytes()
+{
+    return m_outBytes;
+}
+
+void Client::queueOutput(OutChunk chunk, int lane)
+{
+    if(!m_out) //队列只在有数据积压时存在，空闲连接不占内存；排空的队列留着给下一个积压的连接，不用每次重新分配
+    {
+        if(s_spareQueues.empty())
+        {
+            allocstats::AllowScope allow; //同时积压的连接数创新高
+            m_out = std::make_unique<OutLanes>();
+        }
+        else
+        {
+            m_out = std::move(s_spareQueues.back());
+            s_spareQueues.pop_back();
+        }
+        m_lastDrainMs = monotonicMs();
+        transport::watchWrite(m_fd);
+    }
+    else if(lane == m_outLane && m_out->lanes[lane].empty()) //停在半行上的通道等到了后续数据，从现在开始算有没有卡住
+    {
+        m_lastDrainMs = monotonicMs();
+    }
+    m_outBytes += chunk.data->size() - chunk.offset;
+    m_out->lanes[lane].push_back(std::move(chunk));
+    m_out->chunks++;
+}
+
+OutChunk& Client::frontOutput()
+{
+    int lane = m_outLane;
+    if(lane < 0 || m_out->lanes[lane].empty()) //半行的后续数据还没到时只有释放连接会走到这里，按优先级选
+    {
+        lane = 0;
+        while(m_out->lanes[lane].empty())
+            lane++;
+        for(int i = LANE_COUNT - 1; i > lane; i--)
+        {
+            if(!m_out->lanes[i].empty() && m_out->waited[i] >= LANE_AGING_BYTES)
+            {
+                lane = i;
+                break;
+            }
+        }
+    }
+    m_pickLane = lane;
+    return m_out->lanes[lane].front();
+}
+
+void Client::advanceOutput(size_t n)
+{
+    RingQueue<OutChunk>& queue = m_out->lanes[m_pickLane];
+    OutChunk& chunk = queue.front();
+    chunk.offset += n;
+    m_outBytes -= n;
+    m_lastDrainMs = monotonicMs();
+    for(int i = m_pickLane + 1; i < LANE_COUNT; i++)
+    {
+        if(!m_out->lanes[i].empty())
+            m_out->waited[i] += n;
+    }
+    if(chunk.offset < chunk.data->size())
+    {
+        m_outLane = m_pickLane;
+        return;
+    }
+
+    //流的块不以换行结尾，要等这一行发完才能切到别的通道
+    m_outLane = endsLine(*chunk.data, chunk.framing) ? -1 : m_pickLane;
+    m_out->waited[m_pickLane] = 0;
+    queue.pop_front();
+    if(--m_out->chunks == 0)
+    {
+        size_t capacity = 0;
+        for(RingQueue<OutChunk>& lane : m_out->lanes)
+            capacity += lane.capacity();
+        if(s_spareQueues.size() < OUTQUEUE_SPARE && capacity <= OUTQUEUE_KEEP_CHUNKS)
+            s_spareQueues.push_back(std::move(m_out));
+        else
+            m_out.reset();
+    }
+}
+
+bool Client::limitUnsent(int bytes)
+{
+    //内核里排着的数据没法插队，只留够填满网络的量，其余的留在发送队列里按通道的优先级发
+    return transport::setsockopt(m_fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &bytes, sizeof(bytes)) == 0;
+}
+
+int64_t Client::lastDrainMs()
+{
+    return m_lastDrainMs;
+}
+
+bool Client::isReading()
+{
+    return m_reading;
+}
+
+void Client::pauseReading()
+{
+    m_reading = false;
+}
+
+void Client::resumeReading()
+{
+    m_reading = true;
+}
+
+void Client::charge(size_t n)
+{
+    m_chargedBytes += n;
+}
+
+void Client::uncharge(size_t n)
+{
+    m_chargedBytes -= n;
+}
+
+size_t Client::chargedBytes()
+{
+    return m_chargedBytes;
+}
+
+FileTransfer* Client::transfer()
+{
+    return m_file.get();
+}
+
+void Client::setTransfer(std::unique_ptr<FileTransfer> transfer)
+{
+    m_file = std::move(transfer);
+    m_fileActive = false;
+    m_lastDrainMs = monotonicMs();
+}
+
+std::unique_ptr<FileTransfer> Client::takeTransfer()
+{
+    m_fileActive = false;
+    return std::move(m_file);
+}
+
+bool Client::isReceivingFile()
+{
+    return m_fileActive && m_file && m_file->isUpload();
+}
+
+bool Client::isSendingFile()
+{
+    return m_fileActive && m_file && !m_file->isUpload();
+}
+
+void Client::advanceTransfer(size_t n)
+{
+    m_file->advance(n);
+    if(!m_file->isUpload()) //下载一直有进展就不算卡死，哪怕排在后面的消息一直没发
+        m_lastDrainMs = monotonicMs();
+}
+
+bool Client::attachShm(const char* reply)
+{
+    std::unique_ptr<ShmEndpoint> shm = std::make_unique<ShmEndpoint>();
+    if(!shm->create() || shm->bellFd() >= FD_SETSIZE) //门铃要放进select的集合
+        return false;
+    if(!shm->handOver(m_fd, reply))
+        return false;
+
+    m_shm = std::move(shm);
+    return true;
+}
+
+void Client::reframeOutput(size_t before, size_t after)
+{
+    m_outBytes = m_outBytes - before + after;
+}
+
+void Client::enableCompression(int level)
+{
+    m_compress = std::make_unique<CompressLink>();
+    m_compress->level = level;
+}
+
+bool Client::isCompressed()
+{
+    return m_compress != nullptr;
+}
+
+CompressLink* Client::compression()
+{
+    return m_compress.get();
+}
+
+bool Client::isShm()
+{
+    return m_shm != nullptr;
+}
+
+ShmEndpoint* Client::shm()
+{
+    return m_shm.get();
+}
+
+bool Client::armShm(bool wantRead)
+{
+    size_t pendingLen = 0;
+    if(hasSendableOutput())
+    {
+        OutChunk& chunk = frontOutput();
+        pendingLen = chunk.data->size() - chunk.offset;
+    }
+    return m_shm->arm(wantRead, pendingLen);
+}
+
+void Client::accountRead(size_t n, int64_t nowMs)
+{
+    if(nowMs - m_readWindowMs >= 1000)
+    {
+        //超过两个窗口没读到数据时上一个窗口的量也作废
+        m_readRate = (nowMs - m_readWindowMs >= 2000) ? 0 : m_readWindowBytes;
+        m_readWindowMs = nowMs;
+        m_readWindowBytes = 0;
+    }
+    m_readWindowBytes += n;
+}
+
+bool Client::isBulk()
+{
+    return std::max(m_readRate, m_readWindowBytes) > BULK_BYTES_PER_SEC;
+}
+
+//////////////这里是Acceptor类
+Acceptor::Acceptor(ChatServer* server) 
+    : m_server(server),
+      m_clientNum(0),
+      m_isPaused(false)
+{
+}
+
+Acceptor::~Acceptor()
+{   
+    for(Listener& listener : m_listeners)
+    {
+        if(listener.fd >= 0)
+            transport::close(listener.fd);
+        if(!listener.unixPath.empty() && listener.fd >= 0)
+            unlink(listener.unixPath.c_str());
+    }
+}
+
+const std::vector<Listener>& Acceptor::listeners()
+{
+    return m_listeners;
+}
+
+bool Acceptor::isReady()
+{
+    for(Listener& listener : m_listeners)
+    {
+        if(listener.ready)
+            return true;
+    }
+    return false;
+}
+
+void Acceptor::addUnixListener(const char* path)
+{
+    m_listeners.push_back(Listener{-1, path, false});
+}
+
+bool Acceptor::listenClient()  //返回false代表创建listenfd失败
+{
+    if(!listenTcp())
+        return false;
+
+    //多进程模式下Unix域socket只能有一个进程bind，由0号worker监听，其它worker不要
+    if(m_server->m_workerIndex > 0)
+    {
+        m_listeners.erase(std::remove_if(m_listeners.begin(), m_listeners.end(),
+                                         [](const Listener& listener) { return !listener.unixPath.empty(); }),
+                          m_listeners.end());
+    }
+    for(Listener& listener : m_listeners)
+    {
+        if(!listener.unixPath.empty() && !listenUnix(listener.unixPath))
+            return false;
+    }
+    return true;
+}
+
+bool Acceptor::listenTcp()
+{
+    if constexpr(transport::kSimulated) //模拟网络里没有端口，只有一个虚拟的listenfd
+    {
+        int listenfd = SimNet::instance().listen();
+        m_listeners.insert(m_listeners.begin(), Listener{listenfd, "", false});
+        m_server->initMaxFd(listenfd);
+        return true;
+    }
+    if(m_server->m_workerListenFd >= 0) //多进程模式：启动器已经在端口上为这个worker建好了SO_REUSEPORT的监听socket
+    {
+        m_listeners.insert(m_listeners.begin(), Listener{m_server->m_workerListenFd, "", false});
+        m_server->initMaxFd(m_server->m_workerListenFd);
+        return true;
+    }
+
+    int listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    if(listenfd == -1)
+    {
+        std::cout << "socket failure" << std::endl;
+        return false;
+    }
+
+    int yes = 1;
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+    sockaddr_in saddr;
+    saddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    saddr.sin_port = htons(BIND_PORT);
+    saddr.sin_family = AF_INET;
+    int ret = bind(listenfd, (struct sockaddr*)&saddr, sizeof(saddr));
+    if(ret == -1)
+    {
+        std::cout << "bind failure" << std::endl;
+        close(listenfd);
+        return false;
+    }
+
+    ret = listen(listenfd, 511); //过载时会暂缓accept，连接要能在队列里等一会
+    if(ret == -1)
+    {
+        std::cout << "listen failure" << std::endl;
+        close(listenfd);
+        return false;
+    }
+
+    m_listeners.insert(m_listeners.begin(), Listener{listenfd, "", false});
+    m_server->initMaxFd(listenfd);
+
+    return true;
+}
+
+bool Acceptor::listenUnix(const std::string& path)
+{
+    sockaddr_un saddr;
+    memset(&saddr, 0, sizeof(saddr));
+    saddr.sun_family = AF_UNIX;
+    if(path.size() >= sizeof(saddr.sun_path))
+    {
+        std::cout << "unix socket path too long: " << path << std::endl;
+        return false;
+    }
+    memcpy(saddr.sun_path, path.c_str(), path.size());
+
+    int listenfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(listenfd == -1)
+    {
+        std::cout << "socket failure" << std::endl;
+        return false;
+    }
+
+    unlink(path.c_str()); //上次没有正常退出时留下的socket文件
+    if(bind(listenfd, (struct sockaddr*)&saddr, sizeof(saddr)) == -1 || listen(listenfd, 511) == -1)
+    {
+        std::cout << "bind unix socket " << path << " failure" << std::endl;
+        close(listenfd);
+        return false;
+    }
+
+    for(Listener& listener : m_listeners)
+    {
+        if(listener.unixPath == path)
+            listener.fd = listenfd;
+    }
+    m_server->initMaxFd(listenfd);
+
+    return true;
+}
+
+void Acceptor::setReady(int listenfd)
+{
+    for(Listener& listener : m_listeners)
+    {
+        if(listener.fd == listenfd)
+            listener.ready = true;
+    }
+}
+
+void Acceptor::clearReady()
+{
+    for(Listener& listener : m_listeners)
+        listener.ready = false;
+}
+
+int Acceptor::acceptOne(int listenfd)
+{
+    sockaddr_storage cliaddr;
+    socklen_t cli_len = sizeof(cliaddr);
+    memset(&cliaddr, 0, cli_len);
+
+    int sockfd;
+    while(1)
+    {
+        sockfd = transport::accept(listenfd, (struct sockaddr*)&cliaddr, &cli_len);
+        if(sockfd < 0)
+        {
+            if(errno == EINTR)  //如果accept是被信号意外中断则重新accept
+                continue;
+            std::cout << "accept failure!" << std::endl;
+            return -1;
+        }
+
+        break;
+    }
+    return sockfd;
+}
+
+bool Acceptor::acceptClient()
+{
+    trace::Scope<> scope("acceptClient");
+
+    bool ok = true;
+    for(Listener& listener : m_listeners)
+    {
+        if(!listener.ready)
+            continue;
+        listener.ready = false;
+
+        int sockfd = acceptOne(listener.fd);
+        if(sockfd < 0)
+        {
+            ok = false;
+            continue;
+        }
+
+        if(m_clientNum == MAX_CLIENT || sockfd >= MAX_CLIENT) //传输中的文件也占fd编号，新连接的fd可能超出m_users
+        {
+            std::cout << "Client Number limit!" << std::endl;
+            transport::close(sockfd);
+            ok = false;
+            continue;
+        }
+
+        setNonblockNondelay(sockfd); //Unix域socket上设置TCP_NODELAY会失败，不影响
+        
+        addClient(sockfd);
+        m_clientNum++;
+        m_server->rosterDelta(m_server->m_users[sockfd]->nick(), 1);
+
+        welcomeClientJoin(sockfd);
+    }
+    
+    return ok;
+}
+
+bool Acceptor::rejectClient()
+{
+    bool rejected = false;
+    for(Listener& listener : m_listeners)
+    {
+        if(!listener.ready)
+            continue;
+        listener.ready = false;
+
+        int sockfd = transport::accept(listener.fd);
+        if(sockfd < 0)
+            continue;
+
+        //连接还没加入Poller，直接用非阻塞send尽力而为
+        std::string msg("server busy, retry later\n");
+        transport::send(sockfd, msg.c_str(), msg.size(), MSG_DONTWAIT);
+        transport::close(sockfd);
+        rejected = true;
+    }
+    return rejected;
+}
+
+void Acceptor::setPaused(bool paused)
+{
+    m_isPaused = paused;
+}
+
+bool Acceptor::isPaused()
+{
+    return m_isPaused;
+}
+
+void Acceptor::addClient(int fd) 
+{
+    m_server->addClient(fd);
+}
+
+void Acceptor::welcomeClientJoin(int sockfd)
+{
+    std::cout << "welcome sockfd: " << sockfd << " join chatRoom" << std::endl;
+
+    //第二行是这个连接的会话令牌和当前序号，断线重连时用 /resume <令牌> <最后看到的序号> 补发缺失的消息
+    char token[64];
+    snprintf(token, sizeof(token), "session %016llx %llu\n",
+             (unsigned long long)m_server->issueSession(m_server->m_users[sockfd].get()), (unsigned long long)m_server->m_seq);
+    std::string msg("welcome to chatroom, /nick is change yourname\n");
+    msg += token;
+    transport::send(sockfd, msg.c_str(), msg.size());
+}
+
+void Acceptor::reduceClientNum()
+{
+    m_clientNum--;
+} 
+
+int Acceptor::clientNum()
+{
+    return m_clientNum;
+}
+
+//////////////这里是Poller类
+Poller::Poller() : m_maxClientFd(-1), m_readPaused(false), m_hasShm(false), m_spinUs(0), m_exclusiveFd(-1), m_wakeNow(false){}
+
+void Poller::poll(std::vector<std::shared_ptr<Client>>& activeClients, std::shared_ptr<Acceptor> acceptor) //不使用引用是防止被误删资源
+{
+    if constexpr(transport::kSimulated)
+    {
+        pollSimulated(activeClients, acceptor.get());
+        return;
+    }
+
+    FD_ZERO(&m_readfds);
+    FD_ZERO(&m_writefds);
+    
+    if(!acceptor->isPaused()) //过载暂缓accept时不关注listenfd
+    {
+        for(const Listener& listener : acceptor->listeners())
+            FD_SET(listener.fd, &m_readfds);
+    }
+    int maxFd = m_maxClientFd; //门铃和通知用的eventfd不在m_users里，可能比所有socket都大
+    for(int fd : m_notifyFds)
+    {
+        FD_SET(fd, &m_readfds);
+        maxFd = std::max(maxFd, fd);
+    }
+    bool hasOutput = false;
+    bool shmReady = false; //有共享内存连接的环里已经有活可干，select不能阻塞
+    m_hasShm = false;
+    for(int i = 0; i <= m_maxClientFd; i++) //listenfd不由m_users管
+    {
+        if(!m_users[i]) //listenfd不在m_users里
+            continue;
+        if(m_users[i]->isShm())
+        {
+            int bell = m_users[i]->shm()->bellFd();
+            FD_SET(bell, &m_readfds);
+            maxFd = std::max(maxFd, bell);
+            m_hasShm = true;
+            bool ready = m_users[i]->armShm(!m_readPaused && m_users[i]->isReading() && (m_exclusiveFd < 0 || i == m_exclusiveFd));
+            m_users[i]->setReadyEvents(ready ? EV_BELL : 0);
+            shmReady = shmReady || ready;
+        }
+        //被流控暂停、会话在等发送完成、或者别的连接的流正在转发时，不关注读事件
+        if(!m_readPaused && m_users[i]->wantsRead() && (m_exclusiveFd < 0 || i == m_exclusiveFd))
+            FD_SET(i, &m_readfds);
+        if(m_users[i]->hasSendableOutput() || m_users[i]->isSendingFile()) //只有发送队列有能发的数据或者在下载文件时才关注写事件
+        {
+            FD_SET(i, &m_writefds);
+            hasOutput = true;
+        }
+    }
+
+    //开始监听
+    int num;
+    {
+        trace::Scope<> scope("select");
+        //有数据积压时要能发现发送队列完全不动的接收者，暂缓accept时要能在空闲后及时恢复，所以带上超时
+        timeval timeout = {1, 0};
+        if(acceptor->isPaused())
+            timeout = {0, 100000};
+        bool busy = shmReady || m_wakeNow;
+        m_wakeNow = false;
+        if(busy)
+            timeout = {0, 0};
+        bool needTimeout = hasOutput || acceptor->isPaused() || busy || m_exclusiveFd >= 0; //转发流时要检查发送者是否空闲
+
+        //低延迟模式：先用零超时的select空转一段时间，省掉阻塞后被唤醒的开销
+        num = 0;
+        if(m_spinUs > 0 && !busy)
+        {
+            fd_set readfds = m_readfds, writefds = m_writefds; //select会改写集合，每次都要从副本恢复
+            int64_t deadline = monotonicUs() + m_spinUs;
+            do
+            {
+                m_readfds = readfds;
+                m_writefds = writefds;
+                timeval zero = {0, 0};
+                num = select(maxFd + 1, &m_readfds, &m_writefds, nullptr, &zero);
+            } while(num == 0 && monotonicUs() < deadline);
+
+            if(num == 0)
+            {
+                m_readfds = readfds;
+                m_writefds = writefds;
+            }
+        }
+
+        if(num == 0) //空转预算用完仍然没有事件，退回阻塞等待
+            num = select(maxFd + 1, &m_readfds, &m_writefds, nullptr, needTimeout ? &timeout : nullptr);
+    }
+    m_notified.clear();
+    if(num > 0 || (num == 0 && shmReady))
+    {
+        for(int fd : m_notifyFds)
+        {
+            if(FD_ISSET(fd, &m_readfds))
+            {
+                num--;
+                m_notified.push_back(fd);
+            }
+        }
+        for(const Listener& listener : acceptor->listeners())
+        {
+            if(FD_ISSET(listener.fd, &m_readfds))
+            {
+                num--;
+                acceptor->setReady(listener.fd);
+            }   
+        }
+
+        fillActiveClients(activeClients, num);
+    }
+    else if(num == -1 && errno != EINTR) //超时或者被信号打断(比如请求导出trace)时下一轮重新select
+    {
+        std::cout << "select error" << std::endl;
+    }
+}
+
+//模拟网络：连接数可以远超FD_SETSIZE，不扫描所有连接，只看有数据到达的和发送队列在积压的。
+//没有就绪事件时推进虚拟时钟，相当于select阻塞，超时和select一样。共享内存连接和后台线程的eventfd不在模拟范围内
+void Poller::pollSimulated(std::vector<std::shared_ptr<Client>>& activeClients, Acceptor* acceptor)
+{
+    SimNet& net = SimNet::instance();
+    m_notified.clear();
+    int64_t limit = INT64_MAX;
+    bool more = true;
+    while(true)
+    {
+        if(!acceptor->isPaused() && net.acceptReady())
+        {
+            for(const Listener& listener : acceptor->listeners())
+                acceptor->setReady(listener.fd);
+        }
+
+        //同一个连接可能既可读又可写，先清掉上一轮留下的事件再合并
+        net.forEachReadable([this](int fd) {
+            if(fd < MAX_CLIENT && m_users[fd])
+                m_users[fd]->setReadyEvents(0);
+        });
+        net.forEachWatched([this](int fd) {
+            if(fd >= MAX_CLIENT || !m_users[fd] || !m_users[fd]->hasPendingOutput()) //队列排空了，等下次积压时再登记
+                return false;
+            m_users[fd]->setReadyEvents(0);
+            return true;
+        });
+
+        auto ready = [&](int fd, int event) {
+            std::shared_ptr<Client>& client = m_users[fd];
+            if(client->readyEvents() == 0)
+                activeClients.push_back(client);
+            client->setReadyEvents(client->readyEvents() | event);
+        };
+        net.forEachReadable([&](int fd) {
+            if(fd < MAX_CLIENT && m_users[fd] && !m_readPaused && m_users[fd]->wantsRead() && (m_exclusiveFd < 0 || fd == m_exclusiveFd))
+                ready(fd, EV_READ);
+        });
+        bool hasOutput = false;
+        net.forEachWatched([&](int fd) {
+            hasOutput = true;
+            if(m_users[fd]->hasSendableOutput() && net.writable(fd))
+                ready(fd, EV_WRITE);
+            return true;
+        });
+
+        if(!activeClients.empty() || acceptor->isReady() || !more)
+            break;
+        if(limit == INT64_MAX && (hasOutput || acceptor->isPaused() || m_exclusiveFd >= 0))
+            limit = net.now() + (acceptor->isPaused() ? 100000 : 1000000);
+        more = net.advance(limit);
+    }
+}
+
+//填充事件准备就绪的client对象
+void Poller::fillActiveClients(std::vector<std::shared_ptr<Client>>& activeClients, int num) 
+{
+    //填充activeClients
+    for(int i = 0; i <= m_maxClientFd && (num > 0 || m_hasShm); i++)
+    {
+        if(!m_users[i])
+            continue;
+
+        int events = 0;
+        if(m_users[i]->isShm())
+        {
+            events = m_users[i]->readyEvents(); //poll里检查环时已经设置了EV_BELL
+            if(FD_ISSET(m_users[i]->shm()->bellFd(), &m_readfds))
+            {
+                num--;
+                events |= EV_BELL;
+            }
+        }
+        if(FD_ISSET(i, &m_readfds))
+        {
+            num--;
+            events |= EV_READ;
+        }
+        if(FD_ISSET(i, &m_writefds))
+        {
+            num--;
+            events |= EV_WRITE;
+        }
+
+        if(events)
+        {
+            m_users[i]->setReadyEvents(events);
+            activeClients.push_back(m_users[i]);
+        }
+    }
+}
+
+void Poller::addNotifyFd(int fd)
+{
+    m_notifyFds.push_back(fd);
+    m_notified.reserve(m_notifyFds.size());
+}
+
+bool Poller::takeNotify(int fd)
+{
+    auto it = std::find(m_notified.begin(), m_notified.end(), fd);
+    if(it == m_notified.end())
+        return false;
+    m_notified.erase(it);
+    return true;
+}
+
+void Poller::setExclusiveReader(int fd)
+{
+    m_exclusiveFd = fd;
+}
+
+void Poller::wakeNow()
+{
+    m_wakeNow = true;
+}
+
+void Poller::initMaxFd(int listenfd)
+{
+    m_maxClientFd = std::max(m_maxClientFd, listenfd); //可能有多个监听socket
+}
+
+void Poller::addClient(std::shared_ptr<Client>& ptr, int maxClientFd) 
+{
+    //添加监听客户端
+    m_users[ptr->fd()] = ptr;
+    m_maxClientFd = maxClientFd;
+}
+
+void Poller::rmClient(int fd, int maxClientFd)
+{
+    m_users[fd].reset();
+    m_maxClientFd = maxClientFd;
+}
+
+void Poller::setReadPaused(bool paused)
+{
+    m_readPaused = paused;
+}
+
+bool Poller::isReadPaused()
+{
+    return m_readPaused;
+}
+
+void Poller::setSpin(int64_t spinUs)
+{
+    m_spinUs = spinUs;
+}
+
+////////////从这里开始ChatServer类
+ChatServer::ChatServer() 
+{   
+    m_maxClientFd = -2;
+    m_zeroCopyThreshold = 0;
+    m_nextSerial = 0;
+    m_pendingBytes = 0;
+    m_lastStallCheckMs = 0;
+    m_lagDeferUs = LAG_DEFER_US;
+    m_lagRejectUs = LAG_REJECT_US;
+    m_loopLagUs = 0;
+    m_lastBusyUs = 0;
+    m_deferredAccepts = 0;
+    m_rejectedAccepts = 0;
+    m_deferredBulkReads = 0;
+    m_lastShedTotal = 0;
+    m_lastShedReportMs = 0;
+    m_cpu = -1;
+    m_busyPollUs = 0;
+    m_notsentLowat = CLIENT_NOTSENT_LOWAT;
+    m_seq = 0;
+    m_seqClients = 0;
+    m_retainedBytes = 0;
+    m_searchLines = SEARCH_DEFAULT_DOCS;
+    m_subscribedClients = 0;
+    m_scanStamp = 0;
+    m_rosterClients = 0;
+    m_streamOwner = nullptr;
+    m_streamBytes = 0;
+    m_streamLastMs = 0;
+    m_streamThrottled = false;
+    m_streamEnded = false;
+    m_lastTrimMs = 0;
+    m_mailLost = 0;
+    m_lastJoinMs = 0;
+    m_allocBase = allocstats::Counters{};
+    m_allocBaseSeq = 0;
+    m_allocBaseViolations = 0;
+    m_allocIters = 0;
+    m_allocReportMs = 0;
+    m_bus = nullptr;
+    m_workerIndex = -1;
+    m_workerListenFd = -1;
+    m_busPending = 0;
+    m_busPaused = false;
+    m_busBlocked = false;
+    m_broadcastId = 0;
+    m_acceptor = std::make_shared<Acceptor>(this);
+    m_poller = std::make_unique<Poller>();
+}
+
+ChatServer& ChatServer::getInstance()
+{
+    static ChatServer server;
+    return server;
+}
+
+void ChatServer::initMaxFd(int listenfd)
+{
+    m_maxClientFd = std::max(m_maxClientFd, listenfd);
+    m_poller->initMaxFd(listenfd);
+}
+
+void ChatServer::addClient(int fd)
+{
+    m_lastJoinMs = monotonicMs();
+    //添加客户端addClient
+    m_users[fd] = std::make_shared<Client>(fd, ++m_nextSerial, this);
+    //回调只捕获this，能放进std::function内部的小缓冲区，每个连接不用再为它单独分配内存
+    m_users[fd]->setReadCallback([this](Client* client) { onReadable(client); });
+    m_users[fd]->setWriteCallback([this](Client* client) { flushClient(client); });
+    if(m_zeroCopyThreshold > 0 && !m_users[fd]->enableZeroCopy())
+        std::cout << "SO_ZEROCOPY unsupported on fd: " << fd << std::endl;
+
+    if(m_busyPollUs > 0 && !m_users[fd]->enableBusyPoll(m_busyPollUs))
+        std::cout << "SO_BUSY_POLL failure on fd " << fd << ": " << strerror(errno) << std::endl;
+
+    if(m_notsentLowat > 0) //Unix域socket没有这个选项，失败不影响
+        m_users[fd]->limitUnsent(m_notsentLowat);
+
+    if(m_capture)
+        m_capture->record(CAP_OPEN, fd);
+    
+    if(fd > m_maxClientFd)
+        m_maxClientFd = fd;
+
+    m_poller->addClient(m_users[fd], m_maxClientFd);
+
+    //会话协程立即开始运行，读缓冲区是空的，会停在第一个readLine上
+    m_users[fd]->setSession(session(m_users[fd].get()));
+}
+
+Task ChatServer::session(Client* client)
+{
+    std::string batch; //缓冲区里已经到齐的消息攒成一批再广播，每条都带自己的昵称前缀
+
+    while(std::optional<std::string_view> line = co_await client->readLine())
+    {
+        if(!line->empty() && line->front() == '/')
+        {
+            broadcastBatch(client, batch); //命令之前的消息先发出去，改名只影响之后的消息
+            std::string reply = processCmd(client, *line);
+            while(client->lineCut()) //超长的命令只看前CLIENT_LINE_MAX字节，剩下的丢掉
+            {
+                if(!co_await client->readChunk())
+                    break;
+            }
+            if(!reply.empty() && !co_await client->writeAll(std::move(reply)))
+                break;
+            if(client->transfer() && client->transfer()->isUpload())
+            {//回复了起始位置之后，连接上接着来的是文件内容，收齐再回到按行读
+                if(!co_await client->receiveFile())
+                    break;
+                if(!co_await client->writeAll(finishUpload(client)))
+                    break;
+            }
+            else if(client->transfer() && !co_await client->sendFile())
+            {
+                break;
+            }
+            continue;
+        }
+
+        if(client->lineCut())
+        {//超长的消息不再切成多行，作为一条流边读边转发，内存里只有还没发出去的块
+            broadcastBatch(client, batch);
+            beginStream(client, client->nick(), *line);
+            bool open = true;
+            while(client->lineCut())
+            {
+                std::optional<std::string_view> chunk = co_await client->readChunk();
+                if(!chunk)
+                {
+                    open = false;
+                    break;
+                }
+                relayChunk(client, *chunk);
+            }
+            endStream(client);
+            if(!open)
+                break;
+            continue;
+        }
+
+        batch.append(client->nick()); //昵称直接从连接上取引用，不再每个会话拷贝一份
+        batch.push_back('>');
+        batch.append(*line);
+        batch.push_back('\n');
+
+        //缓冲区里没有完整的行了，下一次readLine会挂起，先把这一批广播出去
+        if(!client->hasLine())
+            broadcastBatch(client, batch);
+    }
+    broadcastBatch(client, batch);
+}
+
+std::string ChatServer::who(Client* client)
+{
+    //快照之前攒下的增量先发给已经在关注的连接(包括它自己)，这个连接从快照之后开始只收新的变化
+    if(!m_streamOwner)
+        flushRoster(client);
+    if(!client->wantsRoster())
+    {
+        client->enableRoster();
+        m_rosterClients++;
+    }
+
+    int count = 0;
+    size_t size = 0;
+    for(int i = 0; i <= m_maxClientFd; i++)
+    {
+        if(m_users[i])
+        {
+            count++;
+            size += m_users[i]->nick().size() + 6;
+        }
+    }
+
+    std::string reply = "who " + std::to_string(count) + "\n";
+    reply.reserve(reply.size() + size);
+    for(int i = 0; i <= m_maxClientFd; i++)
+    {
+        if(!m_users[i])
+            continue;
+        reply += "who +";
+        reply += m_users[i]->nick();
+        reply += '\n';
+    }
+    return reply;
+}
+
+void ChatServer::rosterDelta(std::string_view nick, int change)
+{
+    if(m_rosterClients == 0) //没有人关注时不用记，第一个/who拿到的快照就是当时的状态
+        return;
+    auto it = m_rosterDelta.find(std::string(nick));
+    if(it == m_rosterDelta.end())
+        m_rosterDelta.emplace(nick, change);
+    else if((it->second += change) == 0)
+        m_rosterDelta.erase(it);
+}
+
+void ChatServer::flushRoster(Client* caller)
+{
+    //先下线后上线：改名成已经在线的另一个人的名字时，客户端按多重集合处理不会出现负数
+    size_t size = 0;
+    for(const std::pair<const std::string, int>& delta : m_rosterDelta)
+        size += std::abs(delta.second) * (delta.first.size() + 6);
+    if(size == 0)
+        return;
+
+    std::shared_ptr<std::string> out = m_payloads.acquire(size);
+    for(int sign : {-1, 1})
+    {
+        for(const std::pair<const std::string, int>& delta : m_rosterDelta)
+        {
+            for(int n = delta.second * sign; n > 0; n--)
+            {
+                out->append(sign < 0 ? "who -" : "who +");
+                out->append(delta.first);
+                out->push_back('\n');
+            }
+        }
+    }
+    m_rosterDelta.clear(); //发送失败断开的连接会产生新的增量，留到下一轮
+
+    std::shared_ptr<const std::string> payload = std::move(out);
+    for(int i = 0; i <= m_maxClientFd; i++)
+    {
+        Client* target = m_users[i].get();
+        if(!target || !target->wantsRoster())
+            continue;
+        bool drop = false;
+        if(target->pendingBytes() + payload->size() > CLIENT_OUTBUF_MAX)
+        {
+            std::cout << "client " << i << " reads roster too slow, disconnect" << std::endl;
+            drop = true;
+        }
+        else if(writeSome(target, payload, LANE_DIRECT) == -1)
+        {
+            drop = true;
+        }
+
+        if(drop && target == caller) //调用者的会话还在运行，不能在这里断开
+            m_rosterDrops.emplace_back(i, target->serial());
+        else if(drop)
+            freeClient(i);
+    }
+}
+
+std::string ChatServer::directMessage(Client* client, const CommandArgs& cmd)
+{
+    if(cmd.argc < 2)
+        return "usage: /msg <nick> <text>\n";
+    std::string_view nick = cmd.argv[0];
+    std::string_view text = cmd.rest.substr(cmd.argv[1].data() - cmd.rest.data());
+    bool registered = m_mail && m_mail->isRegistered(nick);
+
+    //注册过的昵称只发给验证过口令的连接；信箱还没补发完时新消息也排进信箱，不会跑到旧消息前面
+    if(!registered || !m_mail->hasMail(nick))
+    {
+        std::string line = "msg ";
+        line.append(client->nick());
+        line.push_back('>');
+        line.append(text);
+        line.push_back('\n');
+        std::shared_ptr<const std::string> payload = std::make_shared<const std::string>(std::move(line));
+
+        int delivered = 0;
+        for(int i = 0; i <= m_maxClientFd; i++)
+        {
+            Client* target = m_users[i].get();
+            if(!target || target->nick() != nick || (registered && !target->isRegistered()))
+                continue;
+            delivered++;
+            if(target == client) //发给自己的不能在这里断开，自己的会话还在运行
+                writeSome(target, payload, LANE_DIRECT);
+            else if(target->pendingBytes() + payload->size() > CLIENT_OUTBUF_MAX || writeSome(target, payload, LANE_DIRECT) == -1)
+                freeClient(i);
+        }
+        if(delivered > 0)
+            return "msg ok\n";
+        if(!registered)
+            return "msg no such nick\n";
+    }
+
+    //存进信箱的带上时间，登录后才收到
+    char stamp[32];
+    snprintf(stamp, sizeof(stamp), "mail %lld ", (long long)time(nullptr));
+    std::string line = stamp;
+    line.append(client->nick());
+    line.push_back('>');
+    line.append(text);
+    line.push_back('\n');
+    int rc = m_mail->deposit(nick, line);
+    if(rc == 0)
+        return "msg mailbox full\n";
+    if(rc == -1)
+        return "msg mailbox busy, retry later\n";
+
+    //收件人在线(还在补发旧消息)时确保它在补发名单里
+    for(int i = 0; i <= m_maxClientFd; i++)
+    {
+        if(m_users[i] && m_users[i]->isRegistered() && m_users[i]->nick() == nick)
+            openMailbox(m_users[i].get());
+    }
+    return "msg queued\n";
+}
+
+std::string ChatServer::registerNick(Client* client, const CommandArgs& cmd)
+{
+    if(!m_mail)
+        return "mailbox disabled\n";
+    if(cmd.argc != 1)
+        return "usage: /register <password>\n";
+    //私信按空白切出收件人，投递时用'>'分隔发送者和内容
+    const std::string& nick = client->nick();
+    if(nick.empty() || nick.size() > MAIL_NICK_MAX || nick.find_first_of(" \t>") != std::string::npos)
+        return "register bad nick, /nick without spaces first\n";
+
+    int rc = m_mail->enroll(nick, cmd.argv[0]);
+    if(rc == 0)
+        return "register nick taken\n";
+    if(rc == -1)
+        return "register full\n";
+    client->setRegistered(true);
+    std::cout << "client " << client->fd() << " registered " << nick << ", " << m_mail->boxes() << " mailboxes" << std::endl;
+    return "register ok\n";
+}
+
+void ChatServer::renameClient(Client* client, std::string_view nick)
+{
+    client->changeNick(nick);
+    if(m_capture)
+        m_capture->record(CAP_NICK, client->fd(), nick.data(), nick.size());
+}
+
+std::string ChatServer::login(Client* client, const CommandArgs& cmd)
+{
+    if(!m_mail)
+        return "mailbox disabled\n";
+    if(cmd.argc != 2)
+        return "usage: /login <nick> <password>\n";
+    if(!m_mail->verify(cmd.argv[0], cmd.argv[1]))
+        return "login failed\n";
+
+    if(client->nick() != cmd.argv[0])
+    {
+        renameClient(client, cmd.argv[0]);
+    }
+    client->setRegistered(true);
+    openMailbox(client); //回复先发出去，信箱里的消息由deliverMail在本轮最后开始补发
+    return "login ok " + std::to_string(m_mail->count(client->nick())) + "\n";
+}
+
+void ChatServer::openMailbox(Client* client)
+{
+    if(!m_mail->hasMail(client->nick()))
+        return;
+    for(const std::pair<int, uint64_t>& reader : m_mailReaders)
+    {
+        if(reader.first == client->fd() && reader.second == client->serial())
+            return;
+    }
+    m_mailReaders.emplace_back(client->fd(), client->serial());
+}
+
+void ChatServer::deliverMail()
+{
+    std::string lines;
+    for(size_t i = 0; i < m_mailReaders.size();)
+    {
+        int fd = m_mailReaders[i].first;
+        Client* client = m_users[fd].get();
+        int rc = -1;
+        if(client && client->serial() == m_mailReaders[i].second && client->isRegistered())
+        {
+            //发送队列降到一批以下才取下一批，信箱再大也只占接收者一批的预算；在磁盘上的等后台线程读回再取
+            rc = 0;
+            while(client->pendingBytes() < MAIL_BATCH_BYTES && (rc = m_mail->collect(client->nick(), MAIL_BATCH_BYTES, lines)) == 1)
+            {
+                if(writeSome(client, std::make_shared<const std::string>(std::move(lines)), LANE_DIRECT) == -1)
+                {
+                    freeClient(fd);
+                    rc = -1;
+                    break;
+                }
+                lines.clear();
+            }
+        }
+
+        if(rc == -1) //取空了或者连接已经不在了
+        {
+            m_mailReaders[i] = m_mailReaders.back();
+            m_mailReaders.pop_back();
+            continue;
+        }
+        i++;
+    }
+
+    if(m_mail->lost() != m_mailLost)
+    {
+        m_mailLost = m_mail->lost();
+        std::cout << "mail store lost " << m_mailLost << " messages to disk errors" << std::endl;
+    }
+}
+
+std::string ChatServer::startTransfer(Client* client, const CommandArgs& cmd, bool upload)
+{
+    if(!m_spool)
+        return "file sharing disabled\n";
+    const char* usage = upload ? "usage: /upload <name> <size>\n" : "usage: /get <name> [offset]\n";
+    uint64_t number = 0; //上传是文件大小，下载是开始的偏移
+    if(upload ? cmd.argc != 2 : (cmd.argc != 1 && cmd.argc != 2))
+        return usage;
+    if(cmd.argc == 2 && !parseNumber(cmd.argv[1], number, 10))
+        return usage;
+    if(client->isShm()) //文件数据走socket本身，共享内存连接的socket只用来回复命令，不再读
+        return "file transfer not over shm\n";
+    if(client->isCompressed() && !upload) //下载的文件原样从page cache发出去，没法夹在压缩帧中间
+        return "get not over compressed connection\n";
+
+    const char* err = nullptr;
+    std::unique_ptr<FileTransfer> transfer = upload ? m_spool->startUpload(cmd.argv[0], number, &err)
+                                                    : m_spool->startDownload(cmd.argv[0], number, &err);
+    if(!transfer)
+        return err;
+
+    char reply[64];
+    if(upload)
+        snprintf(reply, sizeof(reply), "upload ok %llu\n", (unsigned long long)transfer->offset());
+    else
+        snprintf(reply, sizeof(reply), "get ok %llu %llu\n", (unsigned long long)transfer->end(), (unsigned long long)transfer->offset());
+    std::cout << "client " << client->fd() << (upload ? " uploading " : " downloading ") << transfer->name()
+              << " bytes " << transfer->offset() << "-" << transfer->end() << std::endl;
+    client->setTransfer(std::move(transfer)); //回复发出去之后会话才开始搬文件数据
+    return reply;
+}
+
+std::string ChatServer::listFiles()
+{
+    if(!m_spool)
+        return "file sharing disabled\n";
+    std::vector<std::pair<std::string, uint64_t>> files = m_spool->list();
+    std::string reply = "files " + std::to_string(files.size()) + "\n";
+    for(const std::pair<std::string, uint64_t>& file : files)
+        reply += "file " + file.first + " " + std::to_string(file.second) + "\n";
+    return reply;
+}
+
+bool ChatServer::receiveBuffered(Client* client)
+{
+    //客户端没等回复就发了文件内容时，有一部分已经随命令读进了用户态，只能pwrite
+    FileTransfer* file = client->transfer();
+    if(!file)
+        return true;
+    std::string_view data = client->takeInput(file->remaining());
+    if(!data.empty())
+    {
+        if(m_spool->writeBuffered(file, data.data(), data.size()) == -1)
+        {
+            std::cout << "client " << client->fd() << " upload write failure: " << strerror(errno) << std::endl;
+            endTransfer(client);
+            return true;
+        }
+        client->advanceTransfer(data.size());
+    }
+    return file->done();
+}
+
+int ChatServer::receiveFile(Client* client)
+{
+    trace::Scope<> scope("receiveFile");
+
+    //每次最多搬FILE_CHUNK_PER_EVENT字节，剩下的留在内核里，下一轮还会就绪，不耽误别的连接
+    FileTransfer* file = client->transfer();
+    size_t budget = FILE_CHUNK_PER_EVENT;
+    int result = 0;
+    while(budget > 0 && !file->done())
+    {
+        ssize_t n = m_spool->receive(file, client->fd(), budget);
+        if(n == -1)
+        {
+            if(errno)
+                std::cout << "client " << client->fd() << " upload failure: " << strerror(errno) << std::endl;
+            else
+                printf("client %d close connect...\n", client->fd());
+            return -1;
+        }
+        if(n == 0)
+            break;
+        client->advanceTransfer(n);
+        client->accountRead(n, monotonicMs()); //上传算大流量连接，过载时和别的大流量连接一起被推迟
+        budget -= std::min<size_t>(budget, n);
+        result = 1;
+    }
+    return result;
+}
+
+int ChatServer::sendFile(Client* client)
+{
+    trace::Scope<> scope("sendFile");
+
+    FileTransfer* file = client->transfer();
+    size_t budget = FILE_CHUNK_PER_EVENT;
+    while(budget > 0 && !file->done())
+    {
+        ssize_t n = m_spool->send(file, client->fd(), budget);
+        if(n == -1)
+        {
+            std::cout << "send file to " << client->fd() << " failure: " << strerror(errno) << std::endl;
+            return -1;
+        }
+        if(n == 0)
+            return 0;
+        client->advanceTransfer(n);
+        budget -= std::min<size_t>(budget, n);
+    }
+    if(!file->done()) //预算用完，socket还可写，下一轮接着发
+        return 0;
+    endTransfer(client);
+    return 1;
+}
+
+std::string ChatServer::finishUpload(Client* client)
+{
+    FileTransfer* file = client->transfer();
+    std::string reply = "upload done " + file->name() + " " + std::to_string(file->end()) + "\n";
+    if(!endTransfer(client))
+        return "upload failure\n";
+    return reply;
+}
+
+bool ChatServer::endTransfer(Client* client)
+{
+    allocstats::AllowScope allow;
+    std::unique_ptr<FileTransfer> file = client->takeTransfer();
+    bool ok = m_spool->finish(file.get());
+    std::cout << "client " << client->fd() << (file->isUpload() ? " upload " : " download ") << file->name()
+              << (ok ? " done, " : " stopped at ") << file->offset() << " bytes" << std::endl;
+    return ok;
+}
+
+bool ChatServer::inputBlocked(Client* client)
+{
+    return m_streamOwner && m_streamOwner != client;
+}
+
+void ChatServer::beginStream(Client* client, const std::string& nick, std::string_view first)
+{
+    allocstats::AllowScope allow; //流的每块一个payload，不算稳定状态的热路径
+    //流占一个序号，但不进保留窗口和检索索引，/resume补不回来
+    m_streamOwner = client;
+    m_streamBytes = first.size();
+    m_streamLastMs = monotonicMs();
+    uint64_t seq = ++m_seq;
+
+    std::string head = nick + ">";
+    head.append(first);
+    std::shared_ptr<const std::string> plain = std::make_shared<const std::string>(std::move(head));
+    std::shared_ptr<const std::string> stamped;
+    if(m_seqClients > 0)
+        stamped = stampBatch(*plain, seq);
+
+    //接收者在开始时就确定：之后连上来的连接收不到开头，整条都不给它；有订阅的连接按第一块决定要不要
+    if(m_subscribedClients > 0)
+        matchSubscriptions(*plain);
+    for(int i = 0; i <= m_maxClientFd; i++)
+    {
+        if(m_users[i] == nullptr || i == client->fd())
+            continue;
+        if(!m_subs[i].empty() && m_matchedLines[i].empty())
+            continue;
+        if(m_users[i]->isSendingFile()) //流的数据排在文件后面，会卡住整条流，在下载的连接收不到这条消息
+            continue;
+        m_streamPeers.emplace_back(i, m_users[i]->serial());
+    }
+    for(int fd : m_matchedFds)
+        m_matchedLines[fd].clear();
+    m_matchedFds.clear();
+
+    //其它连接先不读，它们的消息在内核缓冲区里等流结束
+    m_poller->setExclusiveReader(client->fd());
+    relayStream(client, plain, stamped);
+}
+
+void ChatServer::relayChunk(Client* client, std::string_view data)
+{
+    //每块只拷贝一次，所有接收者共享；积压超过SENDER_PENDING_HIGH时停止读发送者，内存有界
+    allocstats::AllowScope allow;
+    m_streamBytes += data.size();
+    m_streamLastMs = monotonicMs();
+    if(!data.empty())
+        relayStream(client, std::make_shared<const std::string>(data), nullptr);
+}
+
+void ChatServer::relayStream(Client* client, const std::shared_ptr<const std::string>& plain, const std::shared_ptr<const std::string>& stamped)
+{
+    trace::Scope<> scope("relayStream");
+    for(const std::pair<int, uint64_t>& peer : m_streamPeers)
+    {
+        Client* target = m_users[peer.first].get();
+        if(!target || target->serial() != peer.second)
+            continue;
+        if(!sendMsg(client, peer.first, (stamped && target->wantsSeq()) ? stamped : plain, LANE_BULK))
+            freeClient(peer.first);
+    }
+}
+
+void ChatServer::endStream(Client* client)
+{
+    allocstats::AllowScope allow;
+    relayStream(client, std::make_shared<const std::string>("\n"), nullptr);
+    std::cout << client->nick() << " streamed " << m_streamBytes << " bytes to " << m_streamPeers.size() << " peers" << std::endl;
+
+    m_streamOwner = nullptr;
+    m_streamPeers.clear();
+    m_streamThrottled = false;
+    m_poller->setExclusiveReader(-1);
+    m_streamEnded = true; //等待的会话在本轮事件处理完以后统一恢复，不在这里重入
+}
+
+void ChatServer::wakeBlockedSessions()
+{
+    m_streamEnded = false;
+    for(int i = 0; i <= m_maxClientFd && !m_streamOwner; i++) //恢复的会话可能马上开始新的流
+    {
+        if(m_users[i])
+            runSession(m_users[i].get());
+    }
+    if(m_search && !m_streamOwner)
+        deliverSearchResults();
+}
+
+void ChatServer::checkStream(int64_t nowMs)
+{
+    //所有接收者共享同一块数据，发送者的账是按接收者重复记的；真正要限制的是单个接收者的积压，
+    //否则一个慢的接收者会因为超过CLIENT_OUTBUF_MAX被断开
+    size_t slowest = 0;
+    for(const std::pair<int, uint64_t>& peer : m_streamPeers)
+    {
+        Client* target = m_users[peer.first].get();
+        if(target && target->serial() == peer.second && !target->isSendingFile()) //流开始后才下载的连接不等它，积压超限就断开
+            slowest = std::max(slowest, target->pendingBytes());
+    }
+    if(!m_streamThrottled && slowest > STREAM_PEER_HIGH)
+    {
+        m_streamThrottled = true;
+        m_poller->setExclusiveReader(MAX_CLIENT);
+    }
+    else if(m_streamThrottled && slowest < STREAM_PEER_LOW)
+    {
+        m_streamThrottled = false;
+        m_poller->setExclusiveReader(m_streamOwner->fd());
+    }
+
+    //被流控暂停时没有新数据是接收者慢，不算发送者的
+    if(m_streamThrottled || !m_streamOwner->isReading() || m_poller->isReadPaused())
+    {
+        m_streamLastMs = nowMs;
+        return;
+    }
+    if(nowMs - m_streamLastMs >= STREAM_IDLE_SEC * 1000)
+    {
+        std::cout << "client " << m_streamOwner->fd() << " stream idle for " << STREAM_IDLE_SEC << "s, disconnect" << std::endl;
+        freeClient(m_streamOwner->fd());
+    }
+}
+
+void ChatServer::runSession(Client* client)
+{
+    client->resumeSession();
+    if(m_users[client->fd()].get() == client && client->isSessionDone())
+        freeClient(client->fd());
+}
+
+void ChatServer::onReadable(Client* client) //由client对象调用,调用该函数的client的读事件就绪
+{
+    if(m_users[client->fd()].get() != client) //本轮前面的处理中已经被释放(比如写事件出错)
+        return;
+
+    if(client->readyEvents() & EV_BELL)
+    {
+        readFromShm(client);
+        if(m_users[client->fd()].get() != client)
+            return;
+    }
+    if(!(client->readyEvents() & EV_READ)) //共享内存连接的socket上没有数据，只是门铃响了
+        return;
+
+    if(client->isReceivingFile())
+    {//上传的数据不经过读缓冲区，收齐后恢复会话
+        int flag = receiveFile(client);
+        if(flag == -1)
+        {
+            client->closeInput();
+            runSession(client);
+            if(m_users[client->fd()].get() == client)
+                freeClient(client->fd());
+        }
+        else if(client->transfer()->done())
+        {
+            runSession(client);
+        }
+        return;
+    }
+
+    //读到的数据交给会话协程按行处理
+    int Flag = readFromSocket(client);
+    if(Flag == 1) 
+    {
+        runSession(client);
+    }    
+    else if(Flag == -1)
+    {
+        //对端关闭时让会话把最后不完整的一行处理完，然后释放连接客户端资源
+        client->closeInput();
+        runSession(client);
+        if(m_users[client->fd()].get() == client)
+            freeClient(client->fd());
+        return;
+    }
+
+    if(m_users[client->fd()].get() == client)
+        client->endInput();
+}
+
+void ChatServer::broadcast(Client* client, const std::shared_ptr<const std::string>& plain, const std::shared_ptr<const std::string>& stamped, uint32_t lines)
+{
+    if(m_subscribedClients > 0)
+        matchSubscriptions(*plain);
+
+    //转发消息
+    trace::Scope<> scope("fanout");
+    m_broadcastId++;
+    for(int i = 0; i <= m_maxClientFd; i++) 
+    {
+        if(m_users[i] == nullptr || (client && i == client->fd())) //别的worker转来的没有本进程的发送者
+            continue;
+
+        const std::shared_ptr<const std::string>& payload = m_users[i]->wantsSeq() ? stamped : plain;
+        bool ok;
+        if(m_subs[i].empty())
+        {
+            ok = m_users[i]->isCompressed() ? sendFrame(client, i, payload) : sendMsg(client, i, payload);
+        }
+        else
+        {
+            //有订阅的连接只收命中的行，全部命中时和其它连接共享同一个payload
+            const std::vector<uint32_t>& matched = m_matchedLines[i];
+            if(matched.empty())
+                continue;
+            ok = sendMsg(client, i, matched.size() == lines ? payload : pickLines(*payload, matched));
+        }
+
+        if(!ok) //发送消息失败
+        {
+            //释放连接客户端资源
+            freeClient(i);
+        }
+    }
+
+    if(client && client->isCompressed() && m_subs[client->fd()].empty())
+        echoFrame(client);
+
+    for(int fd : m_matchedFds)
+        m_matchedLines[fd].clear();
+    m_matchedFds.clear();
+}
+
+int ChatServer::compressGroup(Client* target)
+{
+    return (target->compression()->level - 1) * 2 + (target->wantsSeq() ? 1 : 0);
+}
+
+bool ChatServer::groupFrame(int id, const std::string& payload)
+{
+    CompressGroup& group = m_compressGroups[id];
+    if(group.broadcastId == m_broadcastId)
+        return true;
+
+    if(!group.stream.isReady())
+    {
+        allocstats::AllowScope allow; //每个配置只分配一次
+        if(!group.stream.init(id / 2 + 1, COMPRESS_WINDOW_BITS, COMPRESS_MEM_LEVEL))
+            return false;
+    }
+    //有连接在等着加入：从这一帧开始重新压缩，收到它的连接(包括原来的成员)一起重置
+    group.resetFrame = group.resetNext;
+    group.resetNext = false;
+    if(group.resetFrame)
+        group.stream.reset();
+
+    std::shared_ptr<std::string> frame = m_payloads.acquire(payload.size() + FRAME_HEADER_MAX);
+    group.stream.frame(FRAME_GROUP | (group.resetFrame ? FRAME_RESET : 0), payload.data(), payload.size(), *frame);
+    group.frame = std::move(frame);
+    group.own.reset();
+    group.frames++;
+    group.broadcastId = m_broadcastId;
+    return true;
+}
+
+bool ChatServer::sendFrame(Client* client, int targetFd, const std::shared_ptr<const std::string>& payload)
+{
+    Client* target = m_users[targetFd].get();
+    CompressLink* link = target->compression();
+    int id = compressGroup(target);
+    if(!groupFrame(id, *payload))
+        return sendMsg(client, targetFd, payload);
+
+    //收到过这个共享流的每一帧才能解这一帧；刚开启压缩、改了配置或者漏了帧(有订阅的时候)的连接这一次用私有流发，
+    //下一帧之前重置共享流，它和原来的成员一起从头开始
+    CompressGroup& group = m_compressGroups[id];
+    if(!group.resetFrame && (link->group != id || link->seen + 1 != group.frames))
+    {
+        group.resetNext = true;
+        link->group = -1;
+        return sendMsg(client, targetFd, payload);
+    }
+    link->group = id;
+    link->seen = group.frames;
+    return sendMsg(client, targetFd, group.frame, LANE_BROADCAST, FRAMING_LINE);
+}
+
+void ChatServer::echoFrame(Client* client)
+{
+    CompressLink* link = client->compression();
+    int id = compressGroup(client);
+    CompressGroup& group = m_compressGroups[id];
+    if(group.broadcastId != m_broadcastId) //配置里没有别的成员，共享流没有前进
+        return;
+    if(!group.resetFrame && (link->group != id || link->seen + 1 != group.frames))
+        return; //本来就没同步，等它下次收广播时再加入
+
+    if(!group.own)
+    {
+        std::shared_ptr<std::string> own = m_payloads.acquire(group.frame->size());
+        own->assign(*group.frame);
+        (*own)[0] |= FRAME_OWN;
+        group.own = std::move(own);
+    }
+    link->group = id;
+    link->seen = group.frames;
+    //发送者的会话还在运行，发不出去也不能在这里释放它，只是退出共享流，读写出错时自然会断开
+    if(!sendMsg(client, client->fd(), group.own, LANE_BROADCAST, FRAMING_LINE))
+        link->group = -1;
+}
+
+std::shared_ptr<const std::string> ChatServer::encodePrivate(Client* target, const std::string& data, size_t offset)
+{
+    CompressLink* link = target->compression();
+    if(!link->stream.isReady())
+    {
+        allocstats::AllowScope allow; //每个连接只分配一次
+        if(!link->stream.init(link->level, PRIVATE_WINDOW_BITS, PRIVATE_MEM_LEVEL))
+        {
+            std::cout << "compress init for " << target->fd() << " failure" << std::endl;
+            return nullptr;
+        }
+    }
+    size_t len = data.size() - offset;
+    std::shared_ptr<std::string> frame = m_payloads.acquire(len + FRAME_HEADER_MAX);
+    link->stream.frame(FRAME_PRIVATE, data.data() + offset, len, *frame);
+    return frame;
+}
+
+bool ChatServer::encodeChunk(Client* client, OutChunk& chunk)
+{
+    size_t before = chunk.data->size() - chunk.offset;
+    int framing = endsLine(*chunk.data, FRAMING_PLAIN) ? FRAMING_LINE : FRAMING_MIDLINE;
+    std::shared_ptr<const std::string> frame = encodePrivate(client, *chunk.data, chunk.offset);
+    if(!frame)
+        return false;
+
+    //发送者和全局的账改成按压缩后的大小记
+    size_t after = frame->size();
+    if(after < before)
+        releaseOutput(chunk, before - after);
+    else
+        chargeOutput(chunk, after - before);
+    chunk.data = std::move(frame);
+    chunk.offset = 0;
+    chunk.framing = framing;
+    client->reframeOutput(before, after);
+    return true;
+}
+
+void ChatServer::matchSubscriptions(const std::string& batch)
+{
+    //每行只扫描一遍，开销和订阅的关键词个数无关
+    trace::Scope<> scope("match");
+    m_patternMark.resize(m_matcher.capacity(), 0);
+
+    uint32_t line = 0;
+    size_t pos = 0;
+    while(pos < batch.size())
+    {
+        size_t nl = batch.find('\n', pos);
+        size_t end = (nl == std::string::npos) ? batch.size() : nl;
+        m_scanStamp++;
+        m_matcher.scan(std::string_view(batch).substr(pos, end - pos), [&](int id) {
+            if(m_patternMark[id] == m_scanStamp)
+                return;
+            m_patternMark[id] = m_scanStamp;
+            for(int fd : m_subscribers[id])
+            {
+                std::vector<uint32_t>& matched = m_matchedLines[fd];
+                if(matched.empty())
+                    m_matchedFds.push_back(fd);
+                if(matched.empty() || matched.back() != line) //多个关键词命中同一行
+                    matched.push_back(line);
+            }
+        });
+        line++;
+        pos = end + 1;
+    }
+}
+
+std::shared_ptr<const std::string> ChatServer::pickLines(const std::string& source, const std::vector<uint32_t>& lines)
+{
+    std::shared_ptr<std::string> out = m_payloads.acquire(source.size()); //挑出的行不会比整批长
+    uint32_t line = 0;
+    size_t pos = 0;
+    for(uint32_t want : lines)
+    {
+        for(; line < want; line++) //跳过没命中的行
+            pos = source.find('\n', pos) + 1;
+        size_t nl = source.find('\n', pos);
+        size_t end = (nl == std::string::npos) ? source.size() : nl + 1;
+        out->append(source, pos, end - pos);
+        pos = end;
+        line++;
+    }
+    return out;
+}
+
+std::string ChatServer::subscribe(Client* client, std::string_view pattern)
+{
+    std::vector<int>& subs = m_subs[client->fd()];
+    if(pattern.empty())
+    {
+        if(subs.empty())
+            return "subs none\n";
+        std::string reply = "subs";
+        for(int id : subs)
+            reply += " [" + m_matcher.pattern(id) + "]";
+        return reply + "\n";
+    }
+
+    if(pattern.size() > SUB_PATTERN_MAX)
+        return "sub pattern too long\n";
+    int id = m_matcher.find(pattern);
+    if(id >= 0 && std::find(subs.begin(), subs.end(), id) != subs.end())
+        return "sub exists\n";
+    if(subs.size() >= SUB_MAX_PER_CLIENT)
+        return "sub limit reached\n";
+
+    id = m_matcher.add(pattern);
+    if(m_subscribers.size() <= (size_t)id)
+        m_subscribers.resize(id + 1);
+    m_subscribers[id].push_back(client->fd());
+    if(subs.empty())
+        m_subscribedClients++;
+    subs.push_back(id);
+    return "sub ok [" + m_matcher.pattern(id) + "]\n";
+}
+
+std::string ChatServer::unsubscribe(Client* client, std::string_view pattern)
+{
+    int fd = client->fd();
+    std::vector<int>& subs = m_subs[fd];
+    if(subs.empty())
+        return "subs none\n";
+
+    int only = -1;
+    if(!pattern.empty())
+    {
+        only = m_matcher.find(pattern);
+        if(only < 0 || std::find(subs.begin(), subs.end(), only) == subs.end())
+            return "unsub not subscribed\n";
+    }
+
+    for(auto it = subs.begin(); it != subs.end();)
+    {
+        if(only >= 0 && *it != only)
+        {
+            ++it;
+            continue;
+        }
+        std::vector<int>& fds = m_subscribers[*it];
+        fds.erase(std::find(fds.begin(), fds.end(), fd));
+        m_matcher.remove(*it);
+        it = subs.erase(it);
+    }
+    if(subs.empty())
+        m_subscribedClients--;
+    return "unsub ok\n";
+}
+
+void ChatServer::broadcastBatch(Client* client, std::string& batch)
+{
+    if(batch.empty())
+        return;
+
+    //把聊天用户发的消息打印在聊天服务端控制台，别的worker转来的已经在那边打印过
+    if(client)
+        std::cout << batch << std::flush;
+
+    //每行一个序号；带序号的版本只有在有客户端需要时才生成，也只生成一份
+    uint32_t lines = std::count(batch.begin(), batch.end(), '\n');
+    uint64_t firstSeq = m_seq + 1;
+    m_seq += lines;
+
+    //消息只拷贝一份出来，所有接收者共享：发不完需要排队或者走零拷贝时，要等最后一个接收者用完才释放。
+    //payload从池子里取，batch保留自己的缓冲区攒下一批，稳定状态下两边都不用重新分配
+    std::shared_ptr<std::string> payload = m_payloads.acquire(batch.size());
+    payload->assign(batch);
+    std::shared_ptr<const std::string> plain = std::move(payload);
+    std::shared_ptr<const std::string> stamped;
+    if(m_bus && client) //先交给其它worker，它们和本进程的扇出同时进行；序号各个worker自己编
+    {
+        m_bus->publish(plain);
+        checkBusBacklog();
+    }
+    if(m_seqClients > 0)
+        stamped = stampBatch(*plain, firstSeq);
+
+    retain(Retained{firstSeq, lines, client ? client->token() : 0, plain, stamped});
+    if(m_search) //索引在后台线程建，这里只把payload的引用交过去
+        m_search->add(firstSeq, plain);
+    broadcast(client, plain, stamped, lines);
+    batch.clear();
+}
+
+void ChatServer::relayBus()
+{
+    trace::Scope<> scope("relayBus");
+    std::string& batch = m_busBatch; //和m_shmBatch一样，广播后清空，缓冲区留给下一批
+    size_t total = 0;
+    while(total < SHM_DRAIN_PER_EVENT && !m_busPaused) //一次最多取这么多，剩下的留到下一轮，不让总线占住整轮事件循环；积压超预算就停下
+    {
+        size_t n = m_bus->receive([&](const char* data, size_t len) { batch.append(data, len); }, SHM_BATCH_BYTES);
+        if(n == 0)
+            break;
+        total += n;
+        broadcastBatch(nullptr, batch);
+    }
+}
+
+void ChatServer::checkBusBacklog()
+{
+    size_t backlog = m_bus->backlogBytes();
+    if(!m_busBlocked && backlog > BUS_BACKLOG_HIGH)
+    {
+        std::cout << "bus backlog " << backlog << " bytes over budget, pause reading" << std::endl;
+        m_busBlocked = true;
+        m_poller->setReadPaused(true);
+    }
+    else if(m_busBlocked && backlog <= BUS_BACKLOG_LOW)
+    {
+        std::cout << "bus backlog drained to " << backlog << " bytes, resume reading" << std::endl;
+        m_busBlocked = false;
+        if(m_pendingBytes <= GLOBAL_PENDING_LOW)
+            m_poller->setReadPaused(false);
+    }
+}
+
+void ChatServer::readFromShm(Client* client)
+{
+    trace::Scope<> scope("readFromShm");
+
+    int fd = client->fd();
+    const std::string& nick = client->nick(); //改名命令会原地修改，引用一直有效
+    std::string& batch = m_shmBatch; //每一批都会广播出去并清空，留下的缓冲区给下一次用
+    size_t total = 0;
+
+    //被流控暂停时不再取，环写满后生产者自己会停下来等门铃
+    while(total < SHM_DRAIN_PER_EVENT && client->isReading() && !m_poller->isReadPaused() && !inputBlocked(client))
+    {
+        batch.reserve(SHM_BATCH_BYTES + SHM_MSG_MAX + nick.size() + 2);
+        size_t n = client->shm()->receive([&](const char* data, size_t len) {
+            if(m_capture)
+                m_capture->record(CAP_LINE, fd, data, len);
+
+            if(len > 0 && data[0] == '/') //命令要和前后的消息保持顺序，比如改名只影响之后的消息
+            {
+                broadcastBatch(client, batch);
+                allocstats::AllowScope allow;
+                std::string reply = processCmd(client, std::string_view(data, len));
+                if(!reply.empty()) //回复和广播一样写进它的环里，不等待
+                    writeSome(client, std::make_shared<const std::string>(std::move(reply)));
+                return;
+            }
+
+            batch.append(nick);
+            batch.push_back('>');
+            batch.append(data, len);
+            if(len == 0 || data[len - 1] != '\n')
+                batch.push_back('\n');
+        }, SHM_BATCH_BYTES);
+
+        if(n == 0 && !client->shm()->corrupt())
+            break;
+        total += n;
+        broadcastBatch(client, batch);
+        if(m_users[fd].get() != client)
+            return;
+        if(client->shm()->corrupt()) //环里的长度或者头位置是坏的，之后的数据都不可信
+        {
+            std::cout << "client " << fd << " wrote a corrupt shm record, disconnect" << std::endl;
+            freeClient(fd);
+            return;
+        }
+    }
+
+    if(total)
+        client->accountRead(total, monotonicMs());
+}
+
+int ChatServer::readFromSocket(Client* client) //-1代表出错或断开连接  0代表没读到数据  1代表读取到数据
+{
+    trace::Scope<> scope("readFromSocket");
+
+    if(!client) //防止访问空指针
+    {
+        std::cout << "readFd Empty Client" << std::endl;
+        return -1; 
+    }
+
+    //先读进每个线程一块的scratch，会话处理完后只有剩下的部分才需要连接自己的缓冲区
+    size_t space;
+    char* buf = client->beginInput(t_scratch, &space);
+    if(space == 0) //会话还没处理完缓冲区里的行(比如在等回复发完)，数据先留在内核里
+        return 0;
+
+    int nread = transport::recv(client->fd(), buf, space);
+    if(nread == -1)
+    {
+        if(errno == EAGAIN || errno == EINTR)
+            return 0;
+        return -1;
+    }
+    else if(nread == 0)
+    {
+        printf("client %d close connect...\n", client->fd());
+        return -1;
+    }
+
+    if(m_capture)
+        m_capture->record(CAP_DATA, client->fd(), buf, nread);
+
+    client->accountRead(nread, monotonicMs());
+    client->commitInput(nread);
+    return 1;
+}
+
+ChatServer::BuiltinCommand ChatServer::builtinCommand(std::string_view name)
+{
+    static constexpr CommandDef<BuiltinCommand> builtins[] = {
+        {"shm", [](ChatServer* server, Client* client, const CommandArgs&) -> std::string {
+            //切换到共享内存传输，成功时回复已经随fd一起发出
+            return server->attachShm(client);
+        }},
+        {"compress", [](ChatServer* server, Client* client, const CommandArgs& cmd) -> std::string {
+            //之后发给这个连接的数据都压缩成帧，成功时回复已经发出
+            return server->startCompression(client, cmd);
+        }},
+        {"seq", [](ChatServer* server, Client* client, const CommandArgs&) -> std::string {
+            //之后的广播每行带上序号
+            if(!client->wantsSeq())
+            {
+                client->enableSeq();
+                server->m_seqClients++;
+            }
+            return "seq on " + std::to_string(server->m_seq) + "\n";
+        }},
+        {"resume", [](ChatServer* server, Client* client, const CommandArgs& cmd) -> std::string {
+            //断线重连：继承原来的令牌和昵称，补发缺失的消息
+            return server->resumeFrom(client, cmd);
+        }},
+        {"sub", [](ChatServer* server, Client* client, const CommandArgs& cmd) -> std::string {
+            //只接收包含关键词的消息，不带参数时列出已有的订阅
+            return server->subscribe(client, cmd.rest);
+        }},
+        {"unsub", [](ChatServer* server, Client* client, const CommandArgs& cmd) -> std::string {
+            //退订一个关键词，不带参数时退订全部，恢复接收所有消息
+            return server->unsubscribe(client, cmd.rest);
+        }},
+        {"search", [](ChatServer* server, Client* client, const CommandArgs& cmd) -> std::string {
+            //全文检索，查询在后台线程执行，结果由deliverSearchResults发回
+            if(!server->m_search)
+                return "search disabled\n";
+            if(cmd.rest.empty())
+                return "usage: /search <terms>\n";
+            server->m_search->query(client->fd(), client->serial(), cmd.rest);
+            return "";
+        }},
+        {"upload", [](ChatServer* server, Client* client, const CommandArgs& cmd) -> std::string {
+            //回复从哪里开始传，之后连接上的size-offset字节是文件内容
+            return server->startTransfer(client, cmd, true);
+        }},
+        {"get", [](ChatServer* server, Client* client, const CommandArgs& cmd) -> std::string {
+            //回复文件大小，之后是从offset到结尾的文件内容
+            return server->startTransfer(client, cmd, false);
+        }},
+        {"files", [](ChatServer* server, Client*, const CommandArgs&) -> std::string {
+            return server->listFiles();
+        }},
+        {"ping", [](ChatServer*, Client*, const CommandArgs& cmd) -> std::string {
+            //回复走控制通道，排在积压的广播前面，客户端用它测量交互延迟
+            std::string reply = "pong";
+            if(!cmd.rest.empty())
+            {
+                reply.push_back(' ');
+                reply.append(cmd.rest);
+            }
+            reply.push_back('\n');
+            return reply;
+        }},
+        {"who", [](ChatServer* server, Client* client, const CommandArgs&) -> std::string {
+            //在线名单的快照，之后只推送增量
+            return server->who(client);
+        }},
+        {"msg", [](ChatServer* server, Client* client, const CommandArgs& cmd) -> std::string {
+            //私信，注册过的昵称不在线时存进信箱
+            return server->directMessage(client, cmd);
+        }},
+        {"register", [](ChatServer* server, Client* client, const CommandArgs& cmd) -> std::string {
+            return server->registerNick(client, cmd);
+        }},
+        {"login", [](ChatServer* server, Client* client, const CommandArgs& cmd) -> std::string {
+            //换成注册过的昵称，之后补发信箱里的消息
+            return server->login(client, cmd);
+        }},
+        {"nick", [](ChatServer* server, Client* client, const CommandArgs& cmd) -> std::string {
+            //改名，注册过的昵称要用/login
+            if(cmd.rest.empty())
+                return "usage: /nick <name>\n";
+            if(client->isRegistered() && cmd.rest == client->nick())
+                return "change nick success!\n";
+            if(server->m_mail && server->m_mail->isRegistered(cmd.rest))
+                return "nick registered, use /login <nick> <password>\n";
+            server->renameClient(client, cmd.rest);
+            return "change nick success!\n";
+        }},
+    };
+    static constexpr CommandTable<BuiltinCommand, std::size(builtins)> commands(builtins);
+
+    const BuiltinCommand* handler = commands.find(name);
+    return handler ? *handler : nullptr;
+}
+
+bool ChatServer::registerCommand(std::string_view name, CommandHandler handler)
+{
+    if(builtinCommand(name))
+        return false;
+    return m_commands.add(name, std::move(handler));
+}
+
+std::string ChatServer::processCmd(Client* client, std::string_view line)
+{
+    allocstats::AllowScope allow; //命令不在收消息->广播的热路径上
+    CommandArgs cmd = CommandArgs::parse(line);
+    if(BuiltinCommand handler = builtinCommand(cmd.name))
+        return handler(this, client, cmd);
+    if(const CommandHandler* handler = m_commands.find(cmd.name))
+        return (*handler)(client, cmd);
+    return "unsupported cmd\n";
+}
+
+std::string ChatServer::attachShm(Client* client)
+{
+    sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    const char* err = nullptr;
+
+    //fd只能通过Unix域socket传递；队列里还有没发完的数据时切换会打乱顺序
+    if(client->isShm())
+        err = "shm already attached\n";
+    else if(transport::getsockname(client->fd(), (struct sockaddr*)&addr, &len) == -1 || addr.ss_family != AF_UNIX)
+        err = "shm only over unix socket\n";
+    else if(client->isCompressed())
+        err = "shm not over compressed connection\n";
+    else if(client->hasPendingOutput())
+        err = "shm busy, retry later\n";
+    else if(!client->attachShm("shm ok\n"))
+        err = "shm setup failure\n";
+
+    if(err)
+        return err;
+    std::cout << "client " << client->fd() << " switched to shared memory" << std::endl;
+    return "";
+}
+
+std::string ChatServer::startCompression(Client* client, const CommandArgs& cmd)
+{
+    uint64_t level = COMPRESS_LEVEL_DEFAULT;
+    if(cmd.argc > 1 || (cmd.argc == 1 && (!parseNumber(cmd.argv[0], level, 10) || level < 1 || level > COMPRESS_LEVEL_MAX)))
+        return "usage: /compress [1-9]\n";
+    if(client->isCompressed())
+        return "compress already on\n";
+    if(client->isShm())
+        return "compress not over shm\n";
+    //回复是最后一段明文，切换点之前不能还有没发出去的明文
+    if(client->hasPendingOutput() || client->isSendingFile())
+        return "compress busy, retry later\n";
+
+    //队列是空的，回复直接发出去或者排在最前面；按线路上的形式排，轮到它时不会被压缩
+    std::string reply = "compress on " + std::to_string(level) + "\n";
+    if(writeSome(client, std::make_shared<const std::string>(std::move(reply)), LANE_CONTROL, 0, FRAMING_LINE) == -1)
+        return "";
+    client->enableCompression((int)level);
+    std::cout << "client " << client->fd() << " switched to compression level " << level << std::endl;
+    return "";
+}
+
+bool ChatServer::sendMsg(Client* client, int targetFd, const std::shared_ptr<const std::string>& payload, int lane, int framing)
+{
+    Client* target = m_users[targetFd].get();
+
+    //压缩的连接能直接发的时候就地压缩，否则先排明文，轮到它的时候再压缩
+    if(framing == FRAMING_PLAIN && target->isCompressed() && target->canSendDirect(lane))
+    {
+        std::shared_ptr<const std::string> frame = encodePrivate(target, *payload, 0);
+        return frame && sendMsg(client, targetFd, frame, lane, endsLine(*payload, FRAMING_PLAIN) ? FRAMING_LINE : FRAMING_MIDLINE);
+    }
+
+    //队列里还有数据、正在下载文件或者停在别的通道的半行上时必须排队，由写事件按通道的优先级发
+    size_t sent = 0;
+    if(target->canSendDirect(lane))
+    {
+        int tmp = sendChunk(target, payload, 0);
+        if(tmp == -1)
+        {
+            std::cout << "send to " << targetFd << " failure!" << std::endl;
+            return false;
+        }
+        sent = tmp;
+        if(sent > 0)
+            target->markSent(lane, sent == payload->size() && endsLine(*payload, framing));
+        if(sent == payload->size())
+            return true;
+    }
+
+    size_t left = payload->size() - sent;
+    if(target->pendingBytes() + left > CLIENT_OUTBUF_MAX)
+    {
+        std::cout << "client " << targetFd << " reads too slow, disconnect" << std::endl;
+        return false;
+    }
+
+    //剩下的排队，并记在发送者和全局的账上，超预算就停止读发送者；别的worker转来的记在总线的账上，超预算就停止从总线取
+    m_pendingBytes += left;
+    if(client)
+    {
+        target->queueOutput(OutChunk{payload, sent, client->fd(), (uint8_t)framing, client->serial()}, lane);
+        client->charge(left);
+        if(client->isReading() && client->chargedBytes() > SENDER_PENDING_HIGH)
+            client->pauseReading();
+    }
+    else
+    {
+        target->queueOutput(OutChunk{payload, sent, BUS_OWNER_FD, (uint8_t)framing, 0}, lane);
+        m_busPending += left;
+        if(m_busPending > SENDER_PENDING_HIGH)
+            m_busPaused = true;
+    }
+    if(!m_poller->isReadPaused() && m_pendingBytes > GLOBAL_PENDING_HIGH)
+    {
+        std::cout << "pending output " << m_pendingBytes << " bytes over budget, pause reading" << std::endl;
+        m_poller->setReadPaused(true);
+    }
+    
+    return true;
+}
+
+int ChatServer::writeSome(Client* client, const std::shared_ptr<const std::string>& data, int lane, size_t offset, int framing)
+{
+    if(framing == FRAMING_PLAIN && client->isCompressed() && client->canSendDirect(lane))
+    {
+        std::shared_ptr<const std::string> frame = encodePrivate(client, *data, offset);
+        if(!frame)
+            return -1;
+        return writeSome(client, frame, lane, 0, endsLine(*data, FRAMING_PLAIN) ? FRAMING_LINE : FRAMING_MIDLINE);
+    }
+
+    size_t sent = offset;
+    if(client->canSendDirect(lane))
+    {
+        int tmp = sendChunk(client, data, offset);
+        if(tmp == -1)
+            return -1;
+        sent += tmp;
+        if(tmp > 0)
+            client->markSent(lane, sent == data->size() && endsLine(*data, framing));
+        if(sent == data->size())
+            return 1;
+    }
+
+    //服务端自己的回复不记在任何发送者账上；会话会等它发完，每个连接的控制通道最多排一条
+    client->queueOutput(OutChunk{data, sent, -1, (uint8_t)framing, 0}, lane);
+    m_pendingBytes += data->size() - sent;
+    return 0;
+}
+
+uint64_t ChatServer::issueSession(Client* client)
+{
+    int64_t now = monotonicMs();
+    //在线的连接各占一个令牌，只按断开后留着的令牌数限制，否则在线连接多于上限时每次accept都要扫一遍整张表
+    if(m_sessions.size() >= RESUME_MAX_SESSIONS + (size_t)m_acceptor->clientNum())
+        purgeSessions(now);
+
+    uint64_t token = 0;
+    while(token == 0 || m_sessions.count(token)) //令牌要猜不出来，不能用递增的序号
+    {
+        if(getrandom(&token, sizeof(token), 0) != sizeof(token))
+            token = ((uint64_t)rand() << 32) ^ rand() ^ now;
+    }
+
+    client->setToken(token);
+    m_sessions[token] = ResumeSession{client->nick(), client->fd(), client->serial(), 0, false};
+    return token;
+}
+
+void ChatServer::detachSession(Client* client)
+{
+    if(client->wantsSeq())
+        m_seqClients--;
+
+    auto it = m_sessions.find(client->token());
+    if(it == m_sessions.end() || it->second.serial != client->serial()) //令牌已经被新连接接管
+        return;
+    it->second.nick = client->nick();
+    it->second.registered = client->isRegistered();
+    it->second.fd = -1;
+    it->second.detachedMs = monotonicMs();
+}
+
+void ChatServer::purgeSessions(int64_t nowMs)
+{
+    auto oldest = m_sessions.end();
+    for(auto it = m_sessions.begin(); it != m_sessions.end();)
+    {
+        if(it->second.fd == -1 && nowMs - it->second.detachedMs >= RESUME_TTL_SEC * 1000)
+        {
+            it = m_sessions.erase(it);
+            continue;
+        }
+        if(it->second.fd == -1 && (oldest == m_sessions.end() || it->second.detachedMs < oldest->second.detachedMs))
+            oldest = it;
+        ++it;
+    }
+
+    if(m_sessions.size() >= RESUME_MAX_SESSIONS + (size_t)m_acceptor->clientNum() && oldest != m_sessions.end())
+        m_sessions.erase(oldest);
+}
+
+std::string ChatServer::resumeFrom(Client* client, const CommandArgs& cmd)
+{
+    uint64_t token = 0, last = 0;
+    if(cmd.argc < 2 || !parseNumber(cmd.argv[0], token, 16) || !parseNumber(cmd.argv[1], last, 10))
+        return "usage: /resume <token> <last seq>\n";
+
+    auto it = m_sessions.find(token);
+    if(it == m_sessions.end() || token == client->token())
+        return "resume unknown session\n";
+
+    //手机网络切换时旧连接往往还没被发现断开，新连接直接接管
+    ResumeSession& old = it->second;
+    if(old.fd >= 0 && m_users[old.fd] && m_users[old.fd]->serial() == old.serial)
+    {
+        std::cout << "client " << old.fd << " taken over by resumed client " << client->fd() << std::endl;
+        freeClient(old.fd);
+    }
+
+    //新连接继承原来的令牌和昵称，欢迎时发给它的令牌作废
+    m_sessions.erase(client->token());
+    client->setToken(token);
+    renameClient(client, old.nick);
+    if(old.registered && m_mail && m_mail->isRegistered(old.nick)) //令牌就是凭证，不用再输口令
+    {
+        client->setRegistered(true);
+        openMailbox(client);
+    }
+    old.fd = client->fd();
+    old.serial = client->serial();
+    if(!client->wantsSeq())
+    {
+        client->enableSeq();
+        m_seqClients++;
+    }
+
+    //比保留窗口还旧的消息已经补不回来，告诉客户端从哪里开始是完整的，由它决定要不要全量同步
+    last = std::min<unsigned long long>(last, m_seq);
+    uint64_t oldest = m_retained.empty() ? m_seq + 1 : m_retained.front().firstSeq;
+    std::string reply = (last + 1 >= oldest) ? "resume ok " + std::to_string(m_seq) + "\n"
+                                             : "resume truncated " + std::to_string(oldest) + "\n";
+    if(writeSome(client, std::make_shared<const std::string>(std::move(reply))) == -1)
+        return "";
+
+    //补发直接引用保留的payload，从缺失的第一行开始，不拷贝数据
+    for(size_t i = 0; i < m_retained.size(); i++)
+    {
+        Retained& entry = m_retained[i];
+        if(entry.firstSeq + entry.lines <= last + 1 || entry.senderToken == token)
+            continue;
+        if(!entry.stamped)
+        {
+            entry.stamped = stampBatch(*entry.plain, entry.firstSeq);
+            m_retainedBytes += entry.stamped->size();
+        }
 
-int main(int argc,char * argv[])
+        size_t offset = 0;
+        for(uint64_t seq = entry.firstSeq; seq <= last; seq++)
+            offset = entry.stamped->find('\n', offset) + 1;
+        if(writeSome(client, entry.stamped, LANE_BROADCAST, offset) == -1)
+            break;
+    }
+    return "";
+}
+
+std::shared_ptr<const std::string> ChatServer::stampBatch(const std::string& batch, uint64_t firstSeq)
+{
+    //每行前面加上 "#序号 "
+    std::shared_ptr<std::string> out = m_payloads.acquire(batch.size() + 16 * std::count(batch.begin(), batch.end(), '\n'));
+
+    uint64_t seq = firstSeq;
+    size_t pos = 0;
+    while(pos < batch.size())
+    {
+        size_t nl = batch.find('\n', pos);
+        size_t end = (nl == std::string::npos) ? batch.size() : nl + 1;
+
+        char num[24];
+        num[0] = '#';
+        char* p = std::to_chars(num + 1, num + sizeof(num) - 1, seq++).ptr;
+        *p++ = ' ';
+        out->append(num, p - num);
+        out->append(batch, pos, end - pos);
+        pos = end;
+    }
+    return out;
+}
+
+void ChatServer::retain(Retained entry)
+{
+    m_retainedBytes += entry.plain->size() + (entry.stamped ? entry.stamped->size() : 0);
+    m_retained.push_back(std::move(entry));
+
+    while(m_retained.size() > 1 && m_retainedBytes > RESUME_WINDOW_BYTES)
+    {
+        const Retained& front = m_retained.front();
+        m_retainedBytes -= front.plain->size() + (front.stamped ? front.stamped->size() : 0);
+        m_retained.pop_front();
+    }
+}
+
+int ChatServer::sendChunk(Client* target, const std::shared_ptr<const std::string>& data, size_t offset)
+{
+    size_t len = data->size() - offset;
+    if(target->isShm()) //环里只写完整的记录，放不下就整个排队，等对方腾出空间敲门铃
+        return target->shm()->send(data->data() + offset, len) ? (int)len : 0;
+
+    int tmp = -1;
+    if(m_zeroCopyThreshold > 0 && len >= m_zeroCopyThreshold && target->isZeroCopy())
+    {
+        tmp = target->sendZeroCopy(data, offset);
+        if(tmp == -1 && errno != ENOBUFS) //超过optmem限制时内核拒绝零拷贝，退回普通发送
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    }
+
+    if(tmp == -1)
+        tmp = transport::send(target->fd(), data->data() + offset, len);
+
+    if(tmp == -1)
+        return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+    return tmp;
+}
+
+void ChatServer::flushClient(Client* client)
+{
+    int fd = client->fd();
+    if(m_users[fd].get() != client)
+        return;
+
+    //队列里的都是下载开始以后才到的，排在文件后面
+    if(client->isSendingFile())
+    {
+        int tmp = sendFile(client);
+        if(tmp == -1)
+        {
+            freeClient(fd);
+            return;
+        }
+        if(tmp == 0)
+            return;
+    }
+
+    //高优先级的通道先发；预算用完时剩下的留到下一轮，写事件会立刻再次就绪
+    size_t budget = FLUSH_BUDGET_PER_EVENT;
+    while(budget > 0 && client->hasSendableOutput())
+    {
+        bool control = client->hasPendingOutput(LANE_CONTROL);
+        OutChunk& chunk = client->frontOutput();
+        if(chunk.framing == FRAMING_PLAIN && client->isCompressed() && !encodeChunk(client, chunk))
+        {
+            freeClient(fd);
+            return;
+        }
+        int tmp = sendChunk(client, chunk.data, chunk.offset);
+        if(tmp == -1)
+        {
+            std::cout << "send to " << fd << " failure!" << std::endl;
+            freeClient(fd);
+            return;
+        }
+        if(tmp == 0) //发送缓冲区又满了，等下一次写事件
+            break;
+
+        releaseOutput(chunk, tmp);
+        client->advanceOutput(tmp);
+        budget -= std::min<size_t>(budget, tmp);
+
+        //回复发完了马上恢复会话，缓冲区里的下一条命令的回复也排在积压的广播前面
+        if(control && !client->hasPendingOutput(LANE_CONTROL))
+        {
+            runSession(client);
+            if(m_users[fd].get() != client)
+                return;
+        }
+    }
+
+    runSession(client); //会话可能在等回复发完，低优先级的通道不用发完
+}
+
+void ChatServer::releaseOutput(const OutChunk& chunk, size_t n)
+{
+    m_pendingBytes -= n;
+
+    //发送者已经断开(或者fd被新连接复用)时它的账已经不存在了
+    if(chunk.ownerFd >= 0 && m_users[chunk.ownerFd] && m_users[chunk.ownerFd]->serial() == chunk.ownerSerial)
+    {
+        Client* owner = m_users[chunk.ownerFd].get();
+        owner->uncharge(n);
+        if(!owner->isReading() && owner->chargedBytes() <= SENDER_PENDING_LOW)
+            owner->resumeReading();
+    }
+    else if(chunk.ownerFd == BUS_OWNER_FD)
+    {
+        m_busPending -= n;
+        if(m_busPaused && m_busPending <= SENDER_PENDING_LOW) //睡眠前arm时发现总线上有数据，下一轮接着取
+            m_busPaused = false;
+    }
+
+    if(m_poller->isReadPaused() && m_pendingBytes <= GLOBAL_PENDING_LOW && !m_busBlocked)
+    {
+        std::cout << "pending output drained to " << m_pendingBytes << " bytes, resume reading" << std::endl;
+        m_poller->setReadPaused(false);
+    }
+}
+
+void ChatServer::chargeOutput(const OutChunk& chunk, size_t n)
+{
+    //只在压缩后反而变大时用到，多出来的只有帧头和块头的几个字节，不检查预算
+    m_pendingBytes += n;
+    if(chunk.ownerFd >= 0 && m_users[chunk.ownerFd] && m_users[chunk.ownerFd]->serial() == chunk.ownerSerial)
+        m_users[chunk.ownerFd]->charge(n);
+    else if(chunk.ownerFd == BUS_OWNER_FD)
+        m_busPending += n;
+}
+
+void ChatServer::dropStalledReaders(int64_t now)
+{
+    //队列一直发不动的接收者占着发送者的预算，不断开的话发送者会被一直暂停
+    for(int i = 0; i <= m_maxClientFd; i++)
+    {
+        if(m_users[i] && (m_users[i]->hasSendableOutput() || m_users[i]->isSendingFile()) && now - m_users[i]->lastDrainMs() >= STALL_TIMEOUT_SEC * 1000)
+        {
+            std::cout << "client " << i << " output stalled, disconnect" << std::endl;
+            freeClient(i);
+        }
+    }
+}
+
+void ChatServer::updateLoopLag(int64_t lagUs)
+{
+    m_loopLagUs += (lagUs - m_loopLagUs) / 8; //指数平滑，单个慢事件不会立刻触发削减
+
+    bool defer = m_loopLagUs >= m_lagDeferUs && m_loopLagUs < m_lagRejectUs;
+    if(defer && !m_acceptor->isPaused())
+        m_deferredAccepts++;
+    m_acceptor->setPaused(defer); //超过拒绝阈值时要继续accept，才能告诉对方稍后重试
+}
+
+void ChatServer::reportShedding(int64_t nowMs)
+{
+    uint64_t total = m_deferredAccepts + m_rejectedAccepts + m_deferredBulkReads;
+    if(total == m_lastShedTotal || nowMs - m_lastShedReportMs < SHED_REPORT_SEC * 1000)
+        return;
+
+    m_lastShedTotal = total;
+    m_lastShedReportMs = nowMs;
+    std::cout << "shedding: loop lag " << m_loopLagUs << "us, accept deferred " << m_deferredAccepts
+              << " times, rejected " << m_rejectedAccepts << ", bulk reads deferred " << m_deferredBulkReads << std::endl;
+}
+
+void ChatServer::reportAllocs(int64_t nowMs, uint64_t iterations)
 {
-    ChatServer::getInstance();
-    ChatServer::getInstance().start();
+    m_allocIters += iterations;
+    if(nowMs - m_allocReportMs < ALLOC_REPORT_SEC * 1000)
+        return;
+
+    allocstats::Counters now = allocstats::current();
+    uint64_t violations = allocstats::violations();
+    uint64_t allocs = now.allocs - m_allocBase.allocs;
+    uint64_t bytes = now.bytes - m_allocBase.bytes;
+    uint64_t msgs = m_seq - m_allocBaseSeq;
+    if(msgs > 0 || violations > m_allocBaseViolations) //空闲时不打印
+    {
+        char line[256];
+        snprintf(line, sizeof(line), "alloc: %.2f allocs/iter, %.0f bytes/iter, %.3f allocs/msg over %llu iters, %llu msgs; %llu on the hot path, %zu pooled payloads",
+                 (double)allocs / m_allocIters, (double)bytes / m_allocIters, (double)allocs / std::max<uint64_t>(msgs, 1),
+                 (unsigned long long)m_allocIters, (unsigned long long)msgs, (unsigned long long)(violations - m_allocBaseViolations),
+                 m_payloads.size());
+        std::cout << line << std::endl;
+    }
+
+    //打印本身的分配不算进下一段
+    m_allocBase = allocstats::current();
+    m_allocBaseSeq = m_seq;
+    m_allocBaseViolations = violations;
+    m_allocIters = 0;
+    m_allocReportMs = nowMs;
+}
+
+void ChatServer::freeClient(int fd)
+{
+    allocstats::AllowScope allow; //断开不在稳定状态的热路径上
+    if(fd == m_maxClientFd) 
+    {
+        //更新最大fd
+        for(int i = m_maxClientFd - 1; i >= 0; i--)
+        {
+            if(m_users[i] != nullptr)
+            {
+                m_maxClientFd = i;
+                break;
+            }
+        }
+    }
+
+    if(m_capture)
+        m_capture->record(CAP_CLOSE, fd);
+
+    //还没发出去的数据直接丢弃，归还预算
+    Client* client = m_users[fd].get();
+    if(m_streamOwner == client) //流的发送者断开，给接收者补上换行结束这条消息
+        endStream(client);
+    if(client->transfer()) //没传完的上传留着.part等续传
+        endTransfer(client);
+    detachSession(client);
+    unsubscribe(client, std::string_view());
+    rosterDelta(client->nick(), -1);
+    if(client->wantsRoster())
+        m_rosterClients--;
+    while(client->hasPendingOutput())
+    {
+        OutChunk& chunk = client->frontOutput();
+        size_t left = chunk.data->size() - chunk.offset;
+        releaseOutput(chunk, left);
+        client->advanceOutput(left);
+    }
+
+    //释放fd相关资源
+    m_users[fd].reset();
     
-    return 0;
+    m_poller->rmClient(fd, m_maxClientFd); 
+    m_acceptor->reduceClientNum(); //减少客户端数量
+}
+
+void ChatServer::start()
+{
+    m_isStop = false;
+    if(!init())
+        return;
+
+    while(!m_isStop)
+        runOnce();
+}
+
+bool ChatServer::init()
+{
+    if(!m_acceptor->listenClient())
+    {
+        std::cout << "create listenfd false" << std::endl;
+        return false;
+    }
+    if(m_cpu >= 0) //把事件循环线程绑定到指定核上，避免迁移和缓存失效
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(m_cpu, &set);
+        if(sched_setaffinity(0, sizeof(set), &set) == -1)
+            std::cout << "pin to cpu " << m_cpu << " failure: " << strerror(errno) << std::endl;
+    }
+
+    if(m_searchLines > 0 && !transport::kSimulated) //后台线程按真实时间完成，模拟时关掉，每次跑的结果才一样
+    {
+        m_search = std::make_unique<SearchIndex>();
+        if(m_search->start(m_searchLines))
+        {
+            m_poller->addNotifyFd(m_search->notifyFd());
+        }
+        else
+        {
+            std::cout << "start search index failure, /search disabled" << std::endl;
+            m_search.reset();
+        }
+    }
+
+    if(m_bus)
+        m_poller->addNotifyFd(m_bus->bellFd());
+
+    m_allocBase = allocstats::current();
+    m_allocReportMs = monotonicMs();
+    return true;
+}
+
+void ChatServer::runOnce()
+{
+    m_activeClients.clear();
+    m_bulkClients.clear();
+
+    int64_t pollStart = monotonicUs();
+    m_poller->poll(m_activeClients, m_acceptor);
+    int64_t ready = monotonicUs();
+    //select没有阻塞说明事件在上一轮处理期间就已就绪，已经等了上一轮的处理时间
+    int64_t carried = (ready - pollStart < 50) ? m_lastBusyUs : 0;
+    int64_t maxLag = 0;
+    //平滑值只在处理事件时更新，空闲期间要按阻塞的时长衰减，否则负载过去后的第一批新连接还会被拒绝
+    if(ready - pollStart >= LAG_IDLE_HALVE_US)
+        m_loopLagUs >>= std::min<int64_t>(62, (ready - pollStart) / LAG_IDLE_HALVE_US);
+
+    int64_t now = monotonicMs();
+    if((m_pendingBytes > 0 || (m_spool && m_spool->active() > 0)) && now - m_lastStallCheckMs >= 1000)
+    {
+        m_lastStallCheckMs = now;
+        dropStalledReaders(now);
+    }
+    if(now - m_lastTrimMs >= 1000) //突发过后把多余的空闲payload还回去
+    {
+        m_lastTrimMs = now;
+        m_payloads.trim();
+    }
+
+    if constexpr(trace::kEnabled)
+    {
+        if(trace::dumpRequested())
+            dumpTrace();
+    }
+
+    if(m_search && m_poller->takeNotify(m_search->notifyFd()))
+        deliverSearchResults();
+    if(m_mail && m_poller->takeNotify(m_mail->notifyFd())) //有信箱从磁盘读回来了，本轮后面接着补发
+        m_mail->takeLoaded();
+    if(m_bus)
+    {
+        if(m_poller->takeNotify(m_bus->bellFd()))
+            m_bus->clearBell();
+        //流正在转发时别的消息不能插进去；总线转来的积压超预算时不取，环满以后背压传回发消息的worker
+        if(!m_streamOwner && !m_busPaused)
+            relayBus();
+    }
+
+    bool overloaded = m_loopLagUs >= m_lagDeferUs;
+    //稳定状态(一段时间没有新连接)下处理就绪事件时不应该有任何堆分配
+    bool steady = allocstats::kEnabled && now - m_lastJoinMs >= ALLOC_WARMUP_SEC * 1000;
+    if(m_acceptor->isReady()) //listenfd就绪
+    {
+        if(m_loopLagUs >= m_lagRejectUs)
+        {
+            if(m_acceptor->rejectClient())
+                m_rejectedAccepts++;
+        }
+        else if(!m_acceptor->acceptClient())
+        {
+            std::cout << "accept Client failure!" << std::endl;
+        }
+    }
+
+    //过载时先处理普通连接，大流量连接放到最后并且每轮只读有限几个
+    for(std::shared_ptr<Client>& client : m_activeClients)
+    {
+        if(m_users[client->fd()] != client) //本轮前面处理别的连接时已经把它释放了
+            continue;
+        if(overloaded && client->isBulk() && (client->readyEvents() & (EV_READ | EV_BELL)))
+        {
+            m_bulkClients.push_back(client);
+            continue;
+        }
+        maxLag = std::max(maxLag, carried + monotonicUs() - ready);
+        allocstats::CheckScope check(steady);
+        client->handleEvent();  
+    } 
+
+    int bulkReads = 0;
+    for(std::shared_ptr<Client>& client : m_bulkClients)
+    {
+        if(m_users[client->fd()] != client)
+            continue;
+        if(bulkReads++ >= BULK_READS_PER_LOOP) //数据留在内核里，下一轮还会就绪
+        {
+            m_deferredBulkReads++;
+            client->setReadyEvents(client->readyEvents() & ~(EV_READ | EV_BELL));
+        }
+        allocstats::CheckScope check(steady);
+        client->handleEvent();
+    }
+
+    if(m_streamOwner)
+        checkStream(monotonicMs());
+    if(m_streamEnded)
+        wakeBlockedSessions();
+    for(const std::pair<int, uint64_t>& drop : m_rosterDrops)
+    {
+        if(m_users[drop.first] && m_users[drop.first]->serial() == drop.second)
+            freeClient(drop.first);
+    }
+    m_rosterDrops.clear();
+    if(!m_rosterDelta.empty() && !m_streamOwner) //增量不能插进正在转发的流里，等流结束
+        flushRoster();
+    if(!m_mailReaders.empty() && !m_streamOwner)
+        deliverMail();
+
+    //睡眠前补发排队的记录并在总线上置等待标志，之后别的worker写入会敲门铃；已经有数据的话这次poll不阻塞
+    if(m_bus)
+    {
+        if(m_bus->arm(!m_streamOwner && !m_busPaused))
+            m_poller->wakeNow();
+        checkBusBacklog();
+    }
+
+    m_lastBusyUs = monotonicUs() - ready;
+    updateLoopLag(maxLag);
+    reportShedding(now);
+    if constexpr(allocstats::kEnabled)
+        reportAllocs(now, 1);
+}
+
+void ChatServer::stop()
+{
+    m_isStop = true;
+}
+
+void ChatServer::dumpTrace()
+{
+    std::string path = "trace-" + std::to_string(getpid()) + ".json";
+    if(trace::dump(path))
+        std::cout << "trace written to " << path << std::endl;
+    else
+        std::cout << "trace dump to " << path << " failure!" << std::endl;
+}
+
+void ChatServer::deliverSearchResults()
+{
+    std::vector<SearchIndex::Result> results;
+    m_search->takeResults(results);
+    for(SearchIndex::Result& result : results)
+        m_searchResults.push_back(std::move(result));
+    if(m_streamOwner) //回复不能插进正在转发的流里，等流结束
+        return;
+
+    results.swap(m_searchResults);
+    for(SearchIndex::Result& result : results)
+    {
+        //查询期间连接可能已经断开，fd也可能已经分给了新连接
+        Client* client = m_users[result.fd].get();
+        if(!client || client->serial() != result.serial)
+            continue;
+        if(writeSome(client, std::make_shared<const std::string>(std::move(result.reply)), LANE_DIRECT) == -1)
+            freeClient(result.fd);
+    }
+}
+
+void ChatServer::setNotsentLowat(int bytes)
+{
+    m_notsentLowat = bytes;
+}
+
+void ChatServer::setZeroCopyThreshold(size_t bytes)
+{
+    m_zeroCopyThreshold = bytes;
+}
+
+bool ChatServer::setCapture(const char* path)
+{
+    m_capture = std::make_unique<Capture>();
+    if(!m_capture->open(path))
+    {
+        m_capture.reset();
+        return false;
+    }
+    return true;
+}
+
+void ChatServer::setLagThresholds(int64_t deferUs, int64_t rejectUs)
+{
+    m_lagDeferUs = deferUs;
+    m_lagRejectUs = rejectUs;
 }
 
+void ChatServer::setLowLatency(int cpu, int64_t spinUs, int busyPollUs)
+{
+    m_cpu = cpu;
+    m_busyPollUs = busyPollUs;
+    m_poller->setSpin(spinUs);
+}
+
+void ChatServer::addUnixListener(const char* path)
+{
+    m_acceptor->addUnixListener(path);
+}
+
+void ChatServer::setSearchHistory(uint64_t lines)
+{
+    m_searchLines = lines;
+}
+
+bool ChatServer::setSpoolDir(const char* dir)
+{
+    m_spool = std::make_unique<FileSpool>();
+    if(m_spool->open(dir))
+        return true;
+    m_spool.reset();
+    return false;
+}
+
+bool ChatServer::setMailDir(const char* dir)
+{
+    m_mail = std::make_unique<MailStore>();
+    if(m_mail->start(dir))
+    {
+        m_poller->addNotifyFd(m_mail->notifyFd());
+        return true;
+    }
+    m_mail.reset();
+    return false;
+}
+
+void ChatServer::setWorker(int index, int listenfd, int cpu, WorkerBus* bus)
+{
+    m_workerIndex = index;
+    m_workerListenFd = listenfd;
+    m_bus = bus;
+    if(cpu >= 0)
+        m_cpu = cpu;
+}
+
+void ChatServer::setAllocCheck(bool abortOnAlloc)
+{
+    allocstats::setAbortOnViolation(abortOnAlloc);
+}
+
+#if !CHAT_SIM //模拟网络的版本由simbench提供main，驱动ChatServer::runOnce
+static void onStopSignal(int)
+{
+    ChatServer::getInstance().stop();
+}
+
+//Ctrl-C/kill时正常退出事件循环，让抓包等后台组件把缓冲数据写完
+static void installStopSignals()
+{
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = onStopSignal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+}
+
+static void usage(const char* prog)
+{
+    std::cout << "Usage: " << prog << " [-U path] [-z bytes] [-r file] [-l defer_ms,reject_ms] [-u cpu[,spin_us[,busy_poll_us]]] [-s lines] [-f dir] [-m dir] [-w bytes] [-W workers[,steer]] [-a]" << std::endl;
+    std::cout << "  -U path   also listen on a unix domain socket (may be repeated)" << std::endl;
+    std::cout << "  -z bytes  use MSG_ZEROCOPY for broadcast payloads of at least this size" << std::endl;
+    std::cout << "  -r file   record inbound traffic to a capture file for ./replay" << std::endl;
+    std::cout << "  -l defer_ms,reject_ms" << std::endl;
+    std::cout << "            event loop lag at which new connections are deferred / rejected (default "
+              << LAG_DEFER_US / 1000 << "," << LAG_REJECT_US / 1000 << ")" << std::endl;
+    std::cout << "  -u cpu[,spin_us[,busy_poll_us]]" << std::endl;
+    std::cout << "            low latency mode: pin the loop to cpu (-1 to skip), spin with zero timeout selects" << std::endl;
+    std::cout << "            for spin_us before blocking, set SO_BUSY_POLL on client sockets (default "
+              << LOWLAT_SPIN_US << "," << LOWLAT_BUSY_POLL_US << ")" << std::endl;
+    std::cout << "  -s lines  keep roughly this many recent broadcast lines searchable with /search, 0 disables"
+              << " (default " << SEARCH_DEFAULT_DOCS << ")" << std::endl;
+    std::cout << "  -f dir    enable /upload and /get, storing shared files in dir (created if missing)" << std::endl;
+    std::cout << "  -m dir    enable /register and offline mailboxes, spilling queued direct messages to dir" << std::endl;
+    std::cout << "  -w bytes  TCP_NOTSENT_LOWAT on client sockets, so replies can overtake queued broadcasts; 0 leaves"
+              << " the kernel default (default " << CLIENT_NOTSENT_LOWAT << ")" << std::endl;
+    std::cout << "  -W workers[,steer]" << std::endl;
+    std::cout << "            fork this many worker processes, each accepting on its own SO_REUSEPORT socket and" << std::endl;
+    std::cout << "            sharing broadcasts over a shared-memory bus; crashed workers are restarted. steer=1 pins" << std::endl;
+    std::cout << "            worker i to cpu i and picks the worker by the cpu that received the connection" << std::endl;
+    std::cout << "            (at most " << WORKER_MAX << "; not combinable with -r, -f, -m)" << std::endl;
+    std::cout << "  -a        abort on any heap allocation on the steady-state receive->fan-out path" << std::endl;
+    std::cout << "            (needs a build with make ALLOC_STATS=1)" << std::endl;
+}
+
+int main(int argc,char * argv[])
+{
+    ChatServer& server = ChatServer::getInstance();
+    int workers = 0;
+    int steer = 0;
+    bool perProcessState = false; //抓包文件、文件目录和信箱由一个进程独占，多进程模式下不能用
+
+    int opt;
+    while((opt = getopt(argc, argv, "U:z:r:l:u:s:f:m:w:W:ah")) != -1)
+    {
+        switch(opt)
+        {
+            case 'U':
+                server.addUnixListener(optarg);
+                break;
+            case 'z':
+                server.setZeroCopyThreshold(strtoul(optarg, nullptr, 10));
+                break;
+            case 'r':
+                perProcessState = true;
+                if(!server.setCapture(optarg))
+                {
+                    std::cout << "open capture file " << optarg << " failure" << std::endl;
+                    return 1;
+                }
+                break;
+            case 'l':
+            {
+                double deferMs = 0, rejectMs = 0;
+                if(sscanf(optarg, "%lf,%lf", &deferMs, &rejectMs) != 2 || deferMs > rejectMs)
+                {
+                    usage(argv[0]);
+                    return 1;
+                }
+                server.setLagThresholds((int64_t)(deferMs * 1000), (int64_t)(rejectMs * 1000));
+                break;
+            }
+            case 'u':
+            {
+                int cpu = -1, spinUs = LOWLAT_SPIN_US, busyPollUs = LOWLAT_BUSY_POLL_US;
+                if(sscanf(optarg, "%d,%d,%d", &cpu, &spinUs, &busyPollUs) < 1)
+                {
+                    usage(argv[0]);
+                    return 1;
+                }
+                server.setLowLatency(cpu, spinUs, busyPollUs);
+                break;
+            }
+            case 's':
+                server.setSearchHistory(strtoull(optarg, nullptr, 10));
+                break;
+            case 'f':
+                perProcessState = true;
+                if(!server.setSpoolDir(optarg))
+                {
+                    std::cout << "open spool directory " << optarg << " failure" << std::endl;
+                    return 1;
+                }
+                break;
+            case 'm':
+                perProcessState = true;
+                if(!server.setMailDir(optarg))
+                {
+                    std::cout << "open mail directory " << optarg << " failure" << std::endl;
+                    return 1;
+                }
+                break;
+            case 'w':
+                server.setNotsentLowat(atoi(optarg));
+                break;
+            case 'W':
+                if(sscanf(optarg, "%d,%d", &workers, &steer) < 1 || workers < 1 || workers > WORKER_MAX)
+                {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'a':
+                if(!allocstats::kEnabled)
+                {
+                    std::cout << "-a needs a build with make ALLOC_STATS=1" << std::endl;
+                    return 1;
+                }
+                server.setAllocCheck(true);
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if constexpr(trace::kEnabled)
+        trace::installDumpSignal(); //kill -USR2 <pid> 导出trace-<pid>.json
+    signal(SIGPIPE, SIG_IGN); //对端已关闭时send返回EPIPE，由freeClient处理
+
+    if(workers > 0)
+    {
+        if(perProcessState)
+        {
+            std::cout << "-W can't be combined with -r, -f or -m" << std::endl;
+            return 1;
+        }
+        //每个worker是fork出来的一份完整的服务端，启动器只看护
+        WorkerPool pool;
+        if(!pool.start(workers, BIND_PORT, steer != 0))
+            return 1;
+        return pool.run([&server](int index, int listenfd, int cpu, WorkerBus* bus) {
+            installStopSignals();
+            server.setWorker(index, listenfd, cpu, bus);
+            server.start();
+            return 0;
+        });
+    }
 
+    installStopSignals();
+    server.start();
+    
+    return 0;
+}
+#endif
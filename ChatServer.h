@@ -3,10 +3,14 @@
 
 #include<sys/socket.h>
 #include<netinet/in.h>
+#include<sys/un.h>
 #include<unistd.h>
 #include<fcntl.h>
 #include<netinet/tcp.h>
 #include<sys/select.h>
+#include<time.h>
+#include<signal.h>
+#include<sched.h>
 #include<stdio.h>
 #include<iostream>
 #include<array>
@@ -14,38 +18,386 @@
 #include<string>
 #include<cstring> 
 #include<vector>
+#include<deque>
 #include<functional>
+#include<algorithm>
+#include<optional>
+#include<string_view>
+#include<unordered_map>
+#include<charconv>
+#include<sys/random.h>
+#include<linux/errqueue.h>
+#include"Trace.h"
+#include"AllocStats.h"
+#include"Capture.h"
+#include"ShmRing.h"
+#include"Task.h"
+#include"BufferPool.h"
+#include"RingQueue.h"
+#include"SearchIndex.h"
+#include"PatternMatcher.h"
+#include"CommandTable.h"
+#include"FileSpool.h"
+#include"MailStore.h"
+#include"WorkerBus.h"
+#include"WorkerPool.h"
+#include"Compress.h"
+#include"Transport.h"
 
-#define MAX_CLIENT 1024
+#ifndef MAX_CLIENT
+#define MAX_CLIENT 1024 //select的fd_set只能放这么多；模拟网络没有这个限制，simbench编译时调大
+#endif
 #define BIND_PORT 7711
 
+#define CLIENT_LINE_MAX  1024 //单行最长字节数，超过的行作为一条流边读边转发
+#define CLIENT_SCRATCH_SIZE 16384 //每个线程一块的读缓冲区，一次读事件最多读这么多，必须不大于BufferPool的最大一级
+
+//待发送数据的内存预算(字节)
+#define CLIENT_OUTBUF_MAX    (512 * 1024)       //单个接收者最多积压的数据，超过就认为读得太慢并断开
+#define SENDER_PENDING_HIGH  (4 * 1024 * 1024)  //单个发送者的消息在各接收者队列里积压超过该值就暂停读它
+#define SENDER_PENDING_LOW   (1 * 1024 * 1024)  //降到该值以下恢复读
+#define GLOBAL_PENDING_HIGH  (64 * 1024 * 1024) //所有队列加起来超过该值就暂停读所有连接
+#define GLOBAL_PENDING_LOW   (32 * 1024 * 1024)
+#define STALL_TIMEOUT_SEC    3 //发送队列这么久一个字节都发不出去，就认为接收者卡死并断开
+#define OUTQUEUE_SPARE       64   //排空后留着给下一个积压的连接用的发送队列个数
+#define OUTQUEUE_KEEP_CHUNKS 1024 //容量超过它的发送队列排空后直接释放
+
+//发送队列按优先级分成几条通道，写事件时先发高优先级的；同一条通道内保持顺序，通道之间只在整行的边界切换
+#define LANE_CONTROL     0 //命令回复和/ping：用户正在等的交互
+#define LANE_DIRECT      1 //只发给这一个连接的通知：名单增量、检索结果
+#define LANE_BROADCAST   2 //聊天广播和/resume补发的历史，两者的序号要连续，必须在同一条通道
+#define LANE_BULK        3 //超长行的流
+#define LANE_COUNT       4
+#define LANE_AGING_BYTES (64 * 1024)  //低优先级通道有数据在等时，高优先级通道插队发出这么多字节后让它发一段
+#define FLUSH_BUDGET_PER_EVENT (256 * 1024) //每次写事件最多从队列发出的字节，积压很多的接收者不会占住整轮事件循环
+#define CLIENT_NOTSENT_LOWAT   (16 * 1024) //TCP_NOTSENT_LOWAT：内核里没发出的数据超过它就不再收，积压留在用户态的通道里才能插队
+
+//过载保护：事件循环延迟(事件就绪到被处理的时间)的平滑值超过阈值时开始削减负载
+#define LAG_DEFER_US         20000  //超过它暂缓accept，新连接留在listen队列里
+#define LAG_REJECT_US        100000 //超过它接受新连接后立刻回复稍后重试并关闭
+#define LAG_IDLE_HALVE_US    50000  //select每空闲阻塞这么久平滑值减半：超过拒绝阈值时不带超时，负载过去后只有新连接会唤醒事件循环
+#define BULK_BYTES_PER_SEC   (64 * 1024) //上一秒读到的数据超过它的连接算大流量连接
+#define BULK_READS_PER_LOOP  4      //过载时每轮最多读几个大流量连接，其余留到后面的轮次
+#define SHED_REPORT_SEC      10     //削减计数有变化时多久打印一次
+
+//低延迟模式(-u)的默认参数
+#define LOWLAT_SPIN_US       200 //阻塞select前用零超时select空转的时间
+#define LOWLAT_BUSY_POLL_US  50  //客户端socket的SO_BUSY_POLL
+
+//可恢复会话：每行广播有一个全局递增的序号，最近的广播保留一段，重连的客户端凭令牌和最后看到的序号补发缺失的部分
+#define RESUME_WINDOW_BYTES  (256 * 1024) //保留的广播字节数，要小于CLIENT_OUTBUF_MAX，补发的数据一次能排进队列
+#define RESUME_TTL_SEC       600  //连接断开后令牌保留多久
+#define RESUME_MAX_SESSIONS  4096 //断开的连接最多留多少个令牌，超过时先清理过期的，再淘汰断开最久的
+
+//关键词订阅：有订阅的连接只收到包含任一关键词的行
+#define SUB_MAX_PER_CLIENT   32
+#define SUB_PATTERN_MAX      64
+
+//在线名单：/who 回复快照 "who <人数>\n" 加每人一行 "who +昵称\n"，之后只推送增量 "who +昵称\n"/"who -昵称\n"，
+//改名是旧名字下线加新名字上线。同一轮事件循环里的变化合并后一次发出，同名的上线和下线互相抵消，
+//重连风暴中每个关注名单的连接每轮只收到一条合并的增量，而不是每次变化都收到完整名单
+
+//超长消息的流式转发：同一时刻只有一条流，转发期间其它连接的消息和回复都等流结束，接收者看到的消息不会被打断
+#define STREAM_IDLE_SEC      10 //流的发送者这么久没有新数据(且不是被流控暂停)，就断开它，避免整个聊天室被卡住
+#define STREAM_PEER_HIGH     (CLIENT_OUTBUF_MAX / 2) //最慢的接收者积压超过该值就停止读流的发送者，流按最慢的接收者的速度前进
+#define STREAM_PEER_LOW      (CLIENT_OUTBUF_MAX / 8) //所有接收者都降到该值以下恢复
+
+//分配统计(make ALLOC_STATS=1)：定期打印每轮事件循环、每条消息的分配次数和字节数；
+//最近一次有连接加入后过了预热时间算稳定状态，此后收消息->广播的路径上每次分配都算违规，-a时直接中止
+#define ALLOC_REPORT_SEC     5
+#define ALLOC_WARMUP_SEC     5
+
+//Poller告诉Client本轮就绪的事件
+#define EV_READ  1
+#define EV_WRITE 2
+#define EV_BELL  4 //共享内存连接的门铃响了，或者环里本来就有数据/空间
+
+//共享内存连接每轮最多从环里取多少字节，一批消息合并成一个payload广播
+#define SHM_BATCH_BYTES      (64 * 1024)
+#define SHM_DRAIN_PER_EVENT  (1024 * 1024)
+
+//压缩的连接(/compress)：每个级别、带不带序号各一个配置，一次广播每个配置只压缩一次
+#define COMPRESS_LEVEL_MAX 9
+#define COMPRESS_GROUPS    (COMPRESS_LEVEL_MAX * 2)
+
+//发送队列里一段数据的形式。压缩的连接只发给它的数据先按明文排队，轮到它发的时候才用私有流压缩，
+//帧的顺序才和线路上的顺序一致；广播的帧在广播时就压缩好了。帧里的明文停在半行上时，和明文一样不能切换通道
+#define FRAMING_PLAIN   0 //明文，压缩的连接发之前要先压缩
+#define FRAMING_LINE    1 //已经是线路上的形式，结尾在行边界上
+#define FRAMING_MIDLINE 2 //压缩帧，里面的明文没有以换行结尾
+
+#define BUS_OWNER_FD (-2) //总线转来的广播在本进程里整体算一个发送者：积压超过SENDER_PENDING_HIGH就不再从总线取
+
 class ChatServer;
 
+int64_t monotonicMs();
+int64_t monotonicUs();
+
+//接收者发送队列中的一段数据，广播时所有接收者共享同一个payload
+struct OutChunk
+{
+    std::shared_ptr<const std::string> data;
+    size_t                             offset; //已经发送的字节数
+    int                                ownerFd; //这段数据记在哪个发送者的账上，-1表示服务端自己，BUS_OWNER_FD表示别的worker经总线转来的
+    uint8_t                            framing; //FRAMING_*
+    uint64_t                           ownerSerial; //fd会被复用，用序号确认还是同一个发送者
+};
+
+//接收者的发送队列，每条优先级通道一个环
+struct OutLanes
+{
+    RingQueue<OutChunk> lanes[LANE_COUNT];
+    size_t              waited[LANE_COUNT] = {}; //通道有数据在等期间，更高优先级的通道发出的字节数
+    size_t              chunks = 0; //所有通道加起来的段数，为0时整个还回去
+};
+
+//压缩的连接在服务端的状态
+struct CompressLink
+{
+    int           level;
+    DeflateStream stream; //私有流，第一次用到时才分配
+    int           group = -1; //已经和哪个配置的共享流同步，-1表示还没有
+    uint64_t      seen = 0; //收到了那个共享流的前多少帧
+};
+
+//一个压缩配置的共享流，同步的成员收到同一个帧
+struct CompressGroup
+{
+    DeflateStream                      stream; //第一次有成员时才分配
+    uint64_t                           frames = 0; //压缩过的帧数
+    uint64_t                           broadcastId = 0; //frame是哪一次广播的
+    bool                               resetNext = false; //有连接要加入，下一帧之前重置
+    bool                               resetFrame = false; //frame之前重置过，收到它的连接都同步了
+    std::shared_ptr<const std::string> frame;
+    std::shared_ptr<const std::string> own; //frame的FRAME_OWN版本，给发送者自己，用到才生成
+};
+
 class Client final
 {
     public:
-        Client(int sockfd);
+        //会话协程等待下一行：缓冲区里已经有完整的行时不挂起
+        struct ReadLineAwaiter
+        {
+            Client* client;
+            bool await_ready();
+            void await_suspend(std::coroutine_handle<> handle) { client->m_reader = handle; }
+            std::optional<std::string_view> await_resume() { return client->takeLine(); }
+        };
+
+        //超长行的后续数据：缓冲区里有多少取多少，到换行为止
+        struct ReadChunkAwaiter
+        {
+            Client* client;
+            bool await_ready() { return client->hasChunk(); }
+            void await_suspend(std::coroutine_handle<> handle) { client->m_reader = handle; client->m_chunkReader = true; }
+            std::optional<std::string_view> await_resume() { client->m_chunkReader = false; return client->takeChunk(); }
+        };
+
+        //上传：连接上后续的数据是文件内容，会话等到收齐(或者连接断开)再回到按行读
+        struct ReceiveFileAwaiter
+        {
+            Client* client;
+            bool await_ready();
+            void await_suspend(std::coroutine_handle<> handle) { client->m_reader = handle; }
+            bool await_resume();
+        };
+
+        //下载：文件从page cache直接发到socket，发完之前会话不读新的行，别人的消息排在文件后面
+        struct SendFileAwaiter
+        {
+            Client* client;
+            int     result; //1发完 0还在发 -1出错
+            bool await_ready();
+            void await_suspend(std::coroutine_handle<> handle) { client->m_writer = handle; }
+            bool await_resume() { return result != -1; }
+        };
+
+        //会话协程等待回复交给内核：能立即发完时不挂起，否则排进控制通道，控制通道清空后恢复(下载前要等整个队列清空)
+        struct WriteAllAwaiter
+        {
+            Client*                            client;
+            std::shared_ptr<const std::string> data;
+            int                                result; //1发完 0排队 -1出错
+            bool await_ready();
+            void await_suspend(std::coroutine_handle<> handle) { client->m_writer = handle; }
+            bool await_resume() { return result != -1; }
+        };
+
+        Client(int sockfd, uint64_t serial, ChatServer* server);
         ~Client();
         Client(const Client&) = delete;
         Client& operator=(const Client&) = delete;
 
         template<typename Func>
         void setReadCallback(Func func); //读事件的回调处理函数
+        template<typename Func>
+        void setWriteCallback(Func func); //写事件的回调处理函数(发送队列中还有数据时才会关注写事件)
+
+        //会话协程的可等待接口，一个连接同一时刻只会等其中一个
+        ReadLineAwaiter readLine(); //下一行(不含换行符)，连接关闭后返回std::nullopt；结果在下一次co_await之前有效
+        WriteAllAwaiter writeAll(std::string data); //出错返回false
+        ReadChunkAwaiter readChunk(); //上一次取到的行被截断后，取这一行剩下的数据；连接关闭后返回std::nullopt
+        ReceiveFileAwaiter receiveFile(); //收齐返回true
+        SendFileAwaiter    sendFile(); //出错返回false
+        void setSession(Task session);
+        bool isSessionDone();
+        void resumeSession(); //等的行到了或者回复发完了就恢复会话协程
 
+        //读缓冲区：数据先recv进scratch，会话协程按行取，剩下的才存进从BufferPool借的缓冲区
+        char* beginInput(char* scratch, size_t* space); //返回scratch中可写入的位置和长度
+        void  commitInput(size_t n);
+        void  endInput(); //会话挂起后调用，没处理完的数据存起来，空了就不占缓冲区
+        void  closeInput(); //对端关闭，剩下不完整的一行也交给会话
+        bool  hasLine();
+        std::optional<std::string_view> takeLine();
+        bool  lineCut(); //上一次取到的只是超长行的一部分，后面还有
+        bool  hasChunk();
+        std::optional<std::string_view> takeChunk();
+        std::string_view takeInput(size_t max); //不按行，直接取缓冲区里最多max字节(上传开始前已经读进来的文件内容)
+        bool  wantsRead(); //没有被流控暂停，也没有在等发送完成
+
+        void setReadyEvents(int events); //由Poller设置本轮就绪的EV_READ/EV_WRITE
+        int  readyEvents();
         void handleEvent(); //处理就绪事件
 
         int fd(); // 返回m_fd
-        std::string nick(); //返回m_nick
-        std::string Buffer(); //返回m_writebuf
+        uint64_t serial(); //连接的唯一序号
+        const std::string& nick(); //返回m_nick
+
+        void changeNick(std::string_view nick); //修改名称
+
+        uint64_t token(); //可恢复会话的令牌
+        void     setToken(uint64_t token);
+        bool     wantsSeq(); //是否接收带序号的广播(/seq或者/resume之后)
+        void     enableSeq();
+        bool     wantsRoster(); //是否接收在线名单的增量(/who之后)
+        void     enableRoster();
+        bool     isRegistered(); //用的是注册过的昵称并且验证过口令(/register或/login之后)，改名就失效
+        void     setRegistered(bool registered);
+
+        bool enableZeroCopy(); //开启SO_ZEROCOPY
+        bool isZeroCopy(); 
+        int  sendZeroCopy(const std::shared_ptr<const std::string>& payload, size_t offset = 0); //MSG_ZEROCOPY发送，payload保留到完成通知到达
+        void reapZeroCopy(); //从错误队列读取完成通知并释放对应payload
+        bool enableBusyPoll(int usec); //设置SO_BUSY_POLL/SO_PREFER_BUSY_POLL
+        bool limitUnsent(int bytes); //设置TCP_NOTSENT_LOWAT
+
+        //文件传输：同一时刻最多一个，为空表示没有
+        FileTransfer* transfer();
+        void          setTransfer(std::unique_ptr<FileTransfer> transfer);
+        std::unique_ptr<FileTransfer> takeTransfer();
+        bool          isReceivingFile(); //会话在等上传的数据，读事件交给splice
+        bool          isSendingFile(); //下载还没发完，别的数据都排在它后面
+        void          advanceTransfer(size_t n); //文件搬了n字节，发送方向也算发送队列有进展
 
-        void changeNick(const char* nick); //修改名称
-        void changeBuffer(const char* buffer); //重写缓冲区中的数据
+        //共享内存传输：之后广播写进它的发送环，它发的消息从接收环里取
+        bool attachShm(const char* reply); //创建共享段并连同reply交给客户端
+        bool isShm();
+        ShmEndpoint* shm();
+        bool armShm(bool wantRead); //select之前调用，返回true表示环里已经有数据或者空间，不能睡
+
+        //压缩：之后发给它的数据都是压缩帧
+        void          enableCompression(int level);
+        bool          isCompressed();
+        CompressLink* compression();
+
+        //发送队列：socket发送缓冲区满时剩下的数据按通道排在这里，等写事件再发
+        bool      hasPendingOutput();
+        bool      hasPendingOutput(int lane);
+        bool      hasSendableOutput(); //停在半行上、而那条通道还没有后续数据时，别的通道也不能发
+        bool      canSendDirect(int lane); //队列为空、没在下载、也没停在别的通道的半行上，可以不排队直接发
+        void      markSent(int lane, bool lineEnd); //直接发出了数据，记下是不是停在半行上
+        size_t    pendingBytes(); //队列中还没发出去的字节数
+        void      queueOutput(OutChunk chunk, int lane);
+        OutChunk& frontOutput(); //选出下一段：先把半行发完，其次是等得够久的低优先级通道，再按优先级
+        void      advanceOutput(size_t n); //frontOutput选中的段发出去了n字节，发完就出队，队列空了就还回去
+        void      reframeOutput(size_t before, size_t after); //frontOutput选中的段压缩了，积压的字节数跟着变
+        int64_t   lastDrainMs(); //队列最近一次有进展(变为非空或者发出数据)的时间
+
+        //读流控：暂停后Poller不再关注它的读事件，TCP背压会传回发送端
+        bool   isReading();
+        void   pauseReading();
+        void   resumeReading();
+        void   charge(size_t n); //该连接发出的消息在别人队列里又积压了n字节
+        void   uncharge(size_t n);
+        size_t chargedBytes();
+
+        void accountRead(size_t n, int64_t nowMs); //统计读到的数据量，用来区分大流量连接
+        bool isBulk();
     
     private:
         int                   m_fd; 
+        uint64_t              m_serial;
+        ChatServer*           m_server;
         std::string           m_nick; //用户名称
-        char                  m_writeBuf[1024]; //暂时接收用户发送数据的缓冲区
+        uint64_t              m_token;
+        bool                  m_seq;
+        bool                  m_roster;
+        bool                  m_registered;
         std::function<void()> m_readCallback;  //注意这里不能是引用
+        std::function<void()> m_writeCallback;
+        int                   m_events; //本轮就绪的事件
+
+        char*                   m_inData; //会话正在读的数据，指向scratch或者m_inStash，空闲时为空
+        char*                   m_inStash; //从BufferPool借来存放剩余数据的缓冲区
+        size_t                  m_inStashCap;
+        size_t                  m_inStart; //还没被会话取走的数据的开始位置
+        size_t                  m_inEnd;
+        bool                    m_inClosed;
+        bool                    m_lineCut;
+        bool                    m_chunkReader; //m_reader等的是readChunk
+        bool                    m_fileActive; //m_file的回复已经发出，会话在receiveFile/sendFile上，之后的数据才是文件内容
+        Task                    m_session; //连接的会话协程，连接释放时一起销毁
+        std::coroutine_handle<> m_reader; //在readLine/readChunk上挂起的会话
+        std::coroutine_handle<> m_writer; //在writeAll上挂起的会话
+
+        std::unique_ptr<OutLanes> m_out; //有数据积压时才从s_spareQueues取一个
+        static inline std::vector<std::unique_ptr<OutLanes>> s_spareQueues; //只在事件循环线程上使用
+        size_t                m_outBytes; //m_out中未发送的字节数
+        int                   m_outLane; //客户端收到的字节流停在哪条通道的半行上(段发了一半或者流还没换行)，-1表示在行边界
+        int                   m_pickLane; //frontOutput选中的通道
+        int64_t               m_lastDrainMs;
+        bool                  m_reading;
+        size_t                m_chargedBytes;
+        int64_t               m_readWindowMs; //当前统计窗口的开始时间
+        size_t                m_readWindowBytes; //当前窗口读到的字节数
+        size_t                m_readRate; //上一个窗口读到的字节数
+
+        bool                  m_zeroCopy; //该连接是否走零拷贝发送
+        uint32_t              m_zcNextId; //内核为每次成功的零拷贝send分配的递增序号
+        std::unique_ptr<std::deque<std::pair<uint32_t, std::shared_ptr<const std::string>>>> m_zcPending; //等待完成通知的payload，有才创建
+
+        std::unique_ptr<ShmEndpoint> m_shm; //为空表示普通socket连接
+        std::unique_ptr<CompressLink> m_compress; //为空表示不压缩
+        std::unique_ptr<FileTransfer> m_file; //进行中的上传或下载
+};
+
+//保留窗口中的一次广播，覆盖序号[firstSeq, firstSeq + lines)
+struct Retained
+{
+    uint64_t                           firstSeq;
+    uint32_t                           lines;
+    uint64_t                           senderToken; //补发时跳过客户端自己发的消息
+    std::shared_ptr<const std::string> plain;
+    std::shared_ptr<const std::string> stamped; //每行带序号的版本，没有客户端需要时不生成，补发时再补上
+};
+
+//令牌对应的会话，连接断开后保留昵称等待重连
+struct ResumeSession
+{
+    std::string nick;
+    int         fd; //-1表示已经断开
+    uint64_t    serial;
+    int64_t     detachedMs;
+    bool        registered; //断开时是不是登录着注册过的昵称，恢复后继续收它的私信
+};
+
+//一个监听socket，TCP或者Unix域，来自不同监听socket的客户端处理方式完全一样
+struct Listener
+{
+    int         fd;
+    std::string unixPath; //为空表示TCP
+    bool        ready; //本轮select报告可读
 };
 
 class Acceptor final
@@ -56,21 +408,32 @@ class Acceptor final
         Acceptor(const Acceptor&) = delete;
         Acceptor& operator=(const Acceptor&) = delete;
 
-        int  fd(); //返回m_listenfd
-        bool isReady(); //返回是否接收值
+        const std::vector<Listener>& listeners(); //所有监听socket，交给Poller关注
+        bool isReady(); //是否有监听socket就绪
 
+        void addUnixListener(const char* path); //listenClient之前调用，额外监听一个Unix域socket
         bool listenClient(); //开始监听客户端连接
-        void setReady(bool ready); //设置开始接收与否
-        bool acceptClient(); 
+        void setReady(int listenfd); //Poller报告该监听socket就绪
+        void clearReady();
+        bool acceptClient(); //每个就绪的监听socket接受一个连接
+        bool rejectClient(); //过载时接受连接，回复稍后重试后立即关闭
         void addClient(int fd); //更新当前接收的文件描述符到Poller中
+        void setPaused(bool paused); //过载时暂缓accept，Poller不再关注listenfd
+        bool isPaused();
         void welcomeClientJoin(int sockfd);
         void reduceClientNum(); 
+        int  clientNum();
         
     private:
-        ChatServer* m_server;
-        int         m_listenfd;
-        int         m_clientNum;
-        bool        m_isReadyAcc;
+        bool listenTcp();
+        bool listenUnix(const std::string& path);
+        int  acceptOne(int listenfd); //返回新连接fd，失败返回-1
+
+    private:
+        ChatServer*           m_server;
+        std::vector<Listener> m_listeners;
+        int                   m_clientNum;
+        bool                  m_isPaused;
 };
 
 class Poller final
@@ -87,18 +450,39 @@ class Poller final
         void addClient(std::shared_ptr<Client>& ptr, int maxClientFd);
         void rmClient(int fd, int maxClientFd);
 
+        void setReadPaused(bool paused); //全局内存超预算时暂停所有连接的读事件
+        bool isReadPaused();
+        void setSpin(int64_t spinUs); //阻塞前空转的时间，0表示直接阻塞
+        void addNotifyFd(int fd); //后台线程有结果时可读的eventfd
+        bool takeNotify(int fd); //本轮这个eventfd是否就绪
+        void setExclusiveReader(int fd); //只关注这个连接的读事件，-1表示恢复正常，MAX_CLIENT表示谁都不读
+        void wakeNow(); //下一次poll不阻塞：总线上已经有别的worker转来的消息
+
     private:
         void fillActiveClients(std::vector<std::shared_ptr<Client>>& activeClients, int num);
+        void pollSimulated(std::vector<std::shared_ptr<Client>>& activeClients, Acceptor* acceptor); //CHAT_SIM：只看模拟网络报告的连接，没有fd_set的大小限制
 
     private:
         int                                             m_maxClientFd;
+        bool                                            m_readPaused;
+        bool                                            m_hasShm; //本轮有共享内存连接
+        int64_t                                         m_spinUs;
+        std::vector<int>                                m_notifyFds;
+        std::vector<int>                                m_notified; //本轮就绪的eventfd
+        int                                             m_exclusiveFd;
+        bool                                            m_wakeNow;
         fd_set                                          m_readfds;
+        fd_set                                          m_writefds;
         std::array<std::shared_ptr<Client>, MAX_CLIENT> m_users;
 };
 
 class ChatServer final
 {//单例模式
     public: 
+        //扩展命令的处理函数，返回要回复给客户端的内容，空串表示不回复
+        using CommandHandler = std::function<std::string(Client* client, const CommandArgs& cmd)>;
+
+
         ChatServer(const ChatServer &rhs) = delete;
         ChatServer& operator=(const ChatServer& ) = delete;
         ~ChatServer() = default;
@@ -107,6 +491,21 @@ class ChatServer final
         
         void start();
         void stop();
+        bool init(); //开始监听、启动后台线程，start会先调用它
+        void runOnce(); //事件循环的一轮：poll一次，处理就绪的事件；simbench用它在虚拟时钟下一轮一轮地驱动服务端
+
+        void setZeroCopyThreshold(size_t bytes); //消息长度达到该值时走MSG_ZEROCOPY，0表示关闭
+        bool setCapture(const char* path); //把收到的流量记录到抓包文件，供回放工具使用
+        void setLagThresholds(int64_t deferUs, int64_t rejectUs); //过载保护的延迟阈值(微秒)
+        void setLowLatency(int cpu, int64_t spinUs, int busyPollUs); //低延迟模式，cpu为-1表示不绑核
+        void addUnixListener(const char* path); //除了TCP端口再监听一个Unix域socket
+        void setSearchHistory(uint64_t lines); //全文检索保留最近多少行广播，0表示关闭/search
+        bool registerCommand(std::string_view name, CommandHandler handler); //注册扩展命令(名字不含'/')，和内置命令重名时返回false
+        void setAllocCheck(bool abortOnAlloc); //稳定状态下热路径一分配就中止，只在CHAT_ALLOC_STATS开启时有效
+        bool setSpoolDir(const char* dir); //开启/upload和/get，文件存在这个目录
+        void setNotsentLowat(int bytes); //客户端socket的TCP_NOTSENT_LOWAT，0表示不设置
+        bool setMailDir(const char* dir); //开启/register和离线信箱，超出内存预算的消息写到这个目录
+        void setWorker(int index, int listenfd, int cpu, WorkerBus* bus); //多进程模式：用启动器建好的监听socket，广播经总线转给其它worker
 
     private:
         ChatServer();
@@ -114,22 +513,174 @@ class ChatServer final
         void initMaxFd(int fd);
         void addClient(int fd);
 
-        //定制事件响应方法(接收并转发信息函数)
-        void forwardMessage(Client* client);
+        //连接的会话协程：按行读消息，命令就地处理，消息合并成批广播
+        Task session(Client* client);
+        void runSession(Client* client); //恢复会话协程，协程结束就释放连接
+
+        //定制事件响应方法
+        void onReadable(Client* client);
         int  readFromSocket(Client* client); 
-        void processCmd(Client* client, char* msg);
-        void readMsg(Client* client, char* msg, int nread);
-        bool sendMsg(Client* client, int targetFd);
+        void readFromShm(Client* client); //取出环里的消息，合并成批广播
+        void broadcast(Client* client, const std::shared_ptr<const std::string>& plain, const std::shared_ptr<const std::string>& stamped, uint32_t lines);
+        void broadcastBatch(Client* client, std::string& batch); //打印并广播攒好的一批消息，然后清空；client为空表示别的worker转来的
+        void relayBus(); //取出其它worker经总线转来的广播，合并成批扇出给本进程的连接
+        void checkBusBacklog(); //发往别的worker的排队超过上限时暂停读所有连接，降下来再恢复
+
+        //在线名单
+        std::string who(Client* client); //返回快照，之后这个连接接收增量
+        void        rosterDelta(std::string_view nick, int change); //+1上线 -1下线，没有连接关注名单时不记
+        void        flushRoster(Client* caller = nullptr); //每轮事件处理完后把合并好的增量发给关注名单的连接，caller是正在执行/who的连接
+
+        //私信和离线信箱
+        std::string directMessage(Client* client, const CommandArgs& cmd); //处理 /msg <昵称> <内容>
+        std::string registerNick(Client* client, const CommandArgs& cmd); //处理 /register <口令>，注册当前的昵称
+        std::string login(Client* client, const CommandArgs& cmd); //处理 /login <昵称> <口令>
+        void        openMailbox(Client* client); //登录后信箱里有消息时开始补发
+        void        deliverMail(); //每轮给补发中的连接发下一批，发送队列降下来才发
+
+        //文件分享
+        std::string startTransfer(Client* client, const CommandArgs& cmd, bool upload); //处理 /upload <名字> <大小> 和 /get <名字> [偏移]
+        std::string listFiles();
+        bool        receiveBuffered(Client* client); //上传开始前已经读进来的部分写进文件，收齐或者出错返回true
+        int         receiveFile(Client* client); //读事件就绪时splice进文件，1有进展 0没有数据 -1出错或对端关闭
+        int         sendFile(Client* client); //1发完 0还没发完 -1出错
+        std::string finishUpload(Client* client); //返回给上传者的回复
+        bool        endTransfer(Client* client); //结束并释放连接上的传输，返回是否完整传完
+
+        //超长消息的流式转发
+        bool inputBlocked(Client* client); //别的连接的流正在转发，这个连接的会话暂时不能取新的行
+        void beginStream(Client* client, const std::string& nick, std::string_view first);
+        void relayChunk(Client* client, std::string_view data);
+        void relayStream(Client* client, const std::shared_ptr<const std::string>& plain, const std::shared_ptr<const std::string>& stamped);
+        void endStream(Client* client);
+        void wakeBlockedSessions(); //流结束后恢复等待的会话和查询结果
+        void checkStream(int64_t nowMs); //每轮检查一次：按最慢的接收者暂停/恢复读发送者，发送者空闲太久就断开
+        std::string attachShm(Client* client); //成功返回空串，失败返回错误提示
+        std::string startCompression(Client* client, const CommandArgs& cmd); //处理 /compress [级别]，成功时回复已经发出
+
+        //压缩
+        int  compressGroup(Client* target); //target所属的配置
+        bool groupFrame(int id, const std::string& payload); //本次广播在这个配置的帧，已经压缩过就直接用
+        bool sendFrame(Client* client, int targetFd, const std::shared_ptr<const std::string>& payload); //给压缩的连接发广播
+        void echoFrame(Client* client); //发送者自己也要收一份，共享流才保持同步
+        std::shared_ptr<const std::string> encodePrivate(Client* target, const std::string& data, size_t offset); //用私有流压缩成帧，失败返回空
+        bool encodeChunk(Client* client, OutChunk& chunk); //排队的明文轮到发送时压缩，账按压缩后的大小改
+        void chargeOutput(const OutChunk& chunk, size_t n); //队列中的数据又多了n字节，记在发送者和全局的账上
+        std::string processCmd(Client* client, std::string_view line); //返回要回复给客户端的内容
+        using BuiltinCommand = std::string (*)(ChatServer* server, Client* client, const CommandArgs& cmd);
+        static BuiltinCommand builtinCommand(std::string_view name); //内置命令的编译期完美哈希表，没有返回nullptr
+        int  writeSome(Client* client, const std::shared_ptr<const std::string>& data, int lane = LANE_CONTROL, size_t offset = 0, int framing = FRAMING_PLAIN); //1发完 0排队 -1出错
+        void renameClient(Client* client, std::string_view nick); //改名并记进抓包，/nick、/login和/resume共用
+
+        //可恢复会话
+        uint64_t    issueSession(Client* client); //生成令牌并登记，返回令牌
+        void        detachSession(Client* client); //连接断开，令牌保留一段时间
+        void        purgeSessions(int64_t nowMs);
+        std::string resumeFrom(Client* client, const CommandArgs& cmd); //处理 /resume <令牌> <最后看到的序号>
+        std::shared_ptr<const std::string> stampBatch(const std::string& batch, uint64_t firstSeq);
+        void        retain(Retained entry);
+
+        //关键词订阅
+        std::string subscribe(Client* client, std::string_view pattern); //pattern为空时列出已有的订阅
+        std::string unsubscribe(Client* client, std::string_view pattern); //pattern为空时退订全部
+        void        matchSubscriptions(const std::string& batch); //扫描一批消息，记下每个订阅者命中的行
+        std::shared_ptr<const std::string> pickLines(const std::string& source, const std::vector<uint32_t>& lines);
+        bool sendMsg(Client* client, int targetFd, const std::shared_ptr<const std::string>& payload, int lane = LANE_BROADCAST, int framing = FRAMING_PLAIN);
+        int  sendChunk(Client* target, const std::shared_ptr<const std::string>& data, size_t offset); //返回发出的字节数，-1表示连接出错
+        void flushClient(Client* client); //写事件就绪，继续发送队列中的数据
+        void releaseOutput(const OutChunk& chunk, size_t n); //队列中的n字节已发出或丢弃，归还发送者和全局的预算
         void freeClient(int fd);
+        void dropStalledReaders(int64_t now);
+        void updateLoopLag(int64_t lagUs); //根据本轮的事件延迟调整过载状态
+        void reportShedding(int64_t nowMs);
+        void reportAllocs(int64_t nowMs, uint64_t iterations); //只在CHAT_ALLOC_STATS开启时调用
+        void dumpTrace(); //导出事件追踪，只在CHAT_TRACE开启时调用
+        void deliverSearchResults(); //把后台线程完成的查询结果发给还在线的发起者
         
     private:
-        bool                                            m_isStop; //是否停止运行
+        volatile bool                                   m_isStop; //是否停止运行(会在信号处理函数中修改)
         int                                             m_maxClientFd; //当前连接用户对应的最大的fd
         std::unique_ptr<Poller>                         m_poller; //IO对象
         std::shared_ptr<Acceptor>                       m_acceptor; 
         std::array<std::shared_ptr<Client>, MAX_CLIENT> m_users;//跟Poller拿的是同一份Client对象(同一个Client对象两个shared_ptr指向)
+        size_t                                          m_zeroCopyThreshold; //零拷贝发送阈值(字节)，0表示关闭
+        uint64_t                                        m_nextSerial; //分配给新连接的序号
+        size_t                                          m_pendingBytes; //所有发送队列中积压的字节数
+        int64_t                                         m_lastStallCheckMs;
+
+        int64_t                                         m_lagDeferUs; //过载阈值
+        int64_t                                         m_lagRejectUs;
+        int64_t                                         m_loopLagUs; //事件循环延迟的平滑值
+        int64_t                                         m_lastBusyUs; //上一轮处理事件花的时间
+        uint64_t                                        m_deferredAccepts; //进入暂缓accept状态的次数
+        uint64_t                                        m_rejectedAccepts; //回复稍后重试的连接数
+        uint64_t                                        m_deferredBulkReads; //过载时被推迟的大流量读
+        uint64_t                                        m_lastShedTotal; //上次打印时三个计数的和
+        int64_t                                         m_lastShedReportMs;
+
+        int                                             m_cpu; //事件循环绑定的核，-1表示不绑
+        int                                             m_busyPollUs; //0表示不开启busy poll
+        int                                             m_notsentLowat; //0表示不限制内核里未发出的数据
+        std::unique_ptr<Capture>                        m_capture; //为空表示不抓包
+        std::unique_ptr<SearchIndex>                    m_search; //为空表示没有开启检索
+        uint64_t                                        m_searchLines;
+
+        uint64_t                                        m_seq; //最后一行广播的序号
+        int                                             m_seqClients; //接收带序号广播的连接数
+        RingQueue<Retained>                             m_retained; //最近的广播，按序号递增
+        size_t                                          m_retainedBytes;
+        std::unordered_map<uint64_t, ResumeSession>     m_sessions; //令牌 -> 会话
+
+        CommandRegistry<CommandHandler>                 m_commands; //运行时注册的扩展命令
+        PatternMatcher                                  m_matcher; //所有连接订阅的关键词
+        std::vector<std::vector<int>>                   m_subscribers; //关键词id -> 订阅的fd
+        std::array<std::vector<int>, MAX_CLIENT>        m_subs; //fd -> 订阅的关键词id
+        int                                             m_subscribedClients;
+        std::vector<uint32_t>                           m_patternMark; //关键词id -> 最后命中的行，同一行里重复出现只算一次
+        uint32_t                                        m_scanStamp;
+        std::array<std::vector<uint32_t>, MAX_CLIENT>   m_matchedLines; //本批里每个订阅者命中的行号
+        std::vector<int>                                m_matchedFds;
+
+        int                                             m_rosterClients; //关注在线名单的连接数
+        std::unordered_map<std::string, int>            m_rosterDelta; //昵称 -> 本轮的净变化
+        std::vector<std::pair<int, uint64_t>>           m_rosterDrops; //跟不上增量的/who调用者(fd, serial)，会话还在运行，本轮事件处理完再断开
+
+        Client*                                         m_streamOwner; //正在转发超长消息的连接，为空表示没有
+        std::vector<std::pair<int, uint64_t>>           m_streamPeers; //流开始时确定的接收者(fd, serial)
+        size_t                                          m_streamBytes;
+        int64_t                                         m_streamLastMs; //最近一次有进展的时间
+        bool                                            m_streamThrottled; //在等最慢的接收者
+        bool                                            m_streamEnded; //本轮有流结束，要唤醒等待的会话
+        std::vector<SearchIndex::Result>                m_searchResults; //流转发期间到达的查询结果先存着
+        std::unique_ptr<FileSpool>                      m_spool; //为空表示没有开启文件分享
+        std::unique_ptr<MailStore>                      m_mail; //为空表示没有开启离线信箱
+        std::vector<std::pair<int, uint64_t>>           m_mailReaders; //正在补发信箱的连接(fd, serial)
+        uint64_t                                        m_mailLost; //已经报告过的丢失条数
+        PayloadPool                                     m_payloads; //广播、带序号的版本、订阅者挑出的行都从这里取
+        int64_t                                         m_lastTrimMs;
+        std::string                                     m_shmBatch; //共享内存连接取出的消息攒成的批，所有连接共用
+        WorkerBus*                                      m_bus; //多进程模式下和其它worker共用的总线(启动器所有)，为空表示单进程
+        int                                             m_workerIndex; //-1表示单进程
+        int                                             m_workerListenFd; //启动器建好的SO_REUSEPORT监听socket
+        std::string                                     m_busBatch;
+        size_t                                          m_busPending; //总线转来的广播在本进程发送队列里积压的字节数
+        bool                                            m_busPaused; //积压超预算，暂时不从总线取
+        bool                                            m_busBlocked; //发往别的worker的排队超预算，暂停了读
+        std::array<CompressGroup, COMPRESS_GROUPS>      m_compressGroups;
+        uint64_t                                        m_broadcastId; //每次广播加一，判断配置的帧是不是这一次的
+
+        int64_t                                         m_lastJoinMs; //最近一次有连接加入，之后预热一段时间才检查热路径
+        allocstats::Counters                            m_allocBase; //上次打印时的计数
+        uint64_t                                        m_allocBaseSeq;
+        uint64_t                                        m_allocBaseViolations;
+        uint64_t                                        m_allocIters; //上次打印以来的循环轮数
+        int64_t                                         m_allocReportMs;
+
+        std::vector<std::shared_ptr<Client>>            m_activeClients; //本轮就绪的连接
+        std::vector<std::shared_ptr<Client>>            m_bulkClients; //过载时推迟到最后处理的大流量连接
         
     friend class Acceptor;
+    friend class Client;
 };
 
 #endif //CHATSERVER_H
\ No newline at end of file
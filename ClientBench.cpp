@@ -0,0 +1,140 @@
+//客户端库压测：一个线程上用ChatClient开N个会话，测建连速度、每个会话的内存，
+//以及一个会话持续发消息、其余会话全部接收时客户端每个CPU秒能处理多少行，换算成每个核能带多少个会话
+#include"ChatClient.h"
+#include"BenchUtil.h"
+
+#include<sys/resource.h>
+#include<time.h>
+#include<stdio.h>
+#include<stdlib.h>
+#include<unistd.h>
+#include<iostream>
+#include<string>
+#include<vector>
+
+static void usage(const char* prog)
+{
+    std::cout << "Usage: " << prog << " [-H host] [-p port] [-U path] [-c sessions] [-n messages] [-s size] [-w window] [-r lines_per_sec_per_session] [-z compress_level]" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+    std::string host = "127.0.0.1";
+    int port = 7711;
+    const char* unixPath = nullptr;
+    int count = 1000;
+    int messages = 2000;
+    int size = 64;
+    int window = 1; //默认每条消息等所有会话收到再发下一条，每行都是一次单独的可读事件，和稀疏的真实流量一样
+    double rate = 1;
+    int level = 0; //接收的会话开启压缩的级别，0表示不压缩
+
+    int opt;
+    while((opt = getopt(argc, argv, "H:p:U:c:n:s:w:r:z:h")) != -1)
+    {
+        switch(opt)
+        {
+            case 'H': host = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            case 'U': unixPath = optarg; break;
+            case 'c': count = atoi(optarg); break;
+            case 'n': messages = atoi(optarg); break;
+            case 's': size = atoi(optarg); break;
+            case 'w': window = atoi(optarg); break;
+            case 'r': rate = atof(optarg); break;
+            case 'z': level = atoi(optarg); break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if(count < 2)
+    {
+        std::cout << "need at least 2 sessions" << std::endl;
+        return 1;
+    }
+
+    ChatClient client;
+    if(!client.init())
+    {
+        std::cout << "create epoll failure" << std::endl;
+        return 1;
+    }
+
+    //每个会话收到的第一行是欢迎语，之后只数发送者的消息
+    const std::string sender = "benchsender";
+    size_t welcomed = 0;
+    uint64_t delivered = 0;
+    uint64_t disconnects = 0;
+    std::shared_ptr<ChatSession::Handler> handler = std::make_shared<ChatSession::Handler>();
+    handler->onLine = [&](ChatSession& session, std::string_view line) {
+        if(!session.context())
+        {
+            session.setContext(&welcomed);
+            welcomed++;
+            return;
+        }
+        if(line.size() > sender.size() && line.compare(0, sender.size(), sender) == 0 && line[sender.size()] == '>')
+            delivered++;
+    };
+    handler->onDisconnect = [&](ChatSession&, int) {
+        disconnects++;
+    };
+
+    long rssStart = rssBytes();
+    int64_t start = nowNs();
+    std::vector<ChatSession*> sessions;
+    for(int i = 0; i < count; i++)
+    {
+        sessions.push_back(client.open(unixPath ? unixPath : host, unixPath ? 0 : port, handler));
+        if(level > 0 && i > 0)
+            sessions.back()->enableCompression(level);
+    }
+    while(welcomed < (size_t)count && nowNs() - start < 10000000000ll)
+        client.runOnce(100);
+    int64_t connected = nowNs();
+    if(welcomed < (size_t)count)
+    {
+        std::cout << "only " << welcomed << " of " << count << " sessions welcomed in 10 s" << std::endl;
+        return 1;
+    }
+    long rssConnected = rssBytes();
+
+    //空闲的会话不应该占CPU
+    double idleCpu = selfCpuSeconds();
+    int64_t idleStart = nowNs();
+    while(nowNs() - idleStart < 1000000000ll)
+        client.runOnce(100);
+    idleCpu = selfCpuSeconds() - idleCpu;
+
+    //第一个会话改名后发消息，最多领先接收者window条
+    ChatSession* source = sessions[0];
+    source->send("/nick " + sender);
+    std::string payload(size, 'x');
+    uint64_t receivers = count - 1;
+    uint64_t sent = 0;
+    double cpuStart = selfCpuSeconds();
+    int64_t sendStart = nowNs();
+    while(delivered < (uint64_t)messages * receivers && nowNs() - sendStart < 60000000000ll)
+    {
+        while(sent < (uint64_t)messages && sent * receivers - delivered < (uint64_t)window * receivers)
+        {
+            if(!source->send(payload))
+                break;
+            sent++;
+        }
+        client.runOnce(100);
+    }
+    double cpu = selfCpuSeconds() - cpuStart;
+    double elapsed = (nowNs() - sendStart) / 1e9;
+    double perCpu = delivered / cpu;
+
+    printf("sessions:      %d connected in %.1f ms, %.0f bytes per session\n", count, (connected - start) / 1e6,
+           (double)(rssConnected - rssStart) / count);
+    printf("idle:          %.3f cpu s per second with all sessions open\n", idleCpu);
+    printf("delivered:     %llu of %llu lines in %.2f s (%.0f lines/s), %llu disconnects\n", (unsigned long long)delivered,
+           (unsigned long long)messages * receivers, elapsed, delivered / elapsed, (unsigned long long)disconnects);
+    printf("client cpu:    %.3f s, %.0f lines per cpu second (%.0f ns/line)\n", cpu, perCpu, cpu * 1e9 / delivered);
+    printf("capacity:      %.0f sessions per core at %g inbound lines/s each\n", perCpu / rate, rate);
+    return 0;
+}
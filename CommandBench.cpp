@@ -0,0 +1,139 @@
+//命令分发压测：注册50个命令，比较逐个strcasecmp、编译期完美哈希表和运行时注册的哈希表的单次分发开销
+#include"CommandTable.h"
+#include"BenchUtil.h"
+
+#include<time.h>
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<strings.h>
+#include<unistd.h>
+#include<iostream>
+#include<string>
+#include<vector>
+#include<random>
+#include<functional>
+
+using Handler = int (*)(const CommandArgs& cmd);
+
+static int countArgs(const CommandArgs& cmd)
+{
+    return cmd.argc;
+}
+
+#define CMD(name) {#name, countArgs}
+static constexpr CommandDef<Handler> defs[] = {
+    CMD(nick), CMD(shm), CMD(seq), CMD(resume), CMD(sub), CMD(unsub), CMD(search), CMD(who),
+    CMD(upload), CMD(get), CMD(join), CMD(part), CMD(topic), CMD(kick), CMD(ban), CMD(unban),
+    CMD(mute), CMD(unmute), CMD(op), CMD(deop), CMD(msg), CMD(me), CMD(away), CMD(back),
+    CMD(ignore), CMD(unignore), CMD(list), CMD(names), CMD(whois), CMD(invite), CMD(mode), CMD(quit),
+    CMD(ping), CMD(pong), CMD(time), CMD(version), CMD(help), CMD(stats), CMD(motd), CMD(rules),
+    CMD(history), CMD(mark), CMD(pin), CMD(unpin), CMD(react), CMD(edit), CMD(delete), CMD(typing),
+    CMD(status), CMD(bye),
+};
+#undef CMD
+static constexpr CommandTable<Handler, std::size(defs)> table(defs);
+
+//原来的写法：逐个比较命令名，越靠后的命令越慢，不存在的命令要比较完所有的
+static int chainDispatch(std::string_view line)
+{
+    CommandArgs cmd = CommandArgs::parse(line);
+    for(const CommandDef<Handler>& def : defs)
+    {
+        if(def.name.size() == cmd.name.size() && !strncasecmp(def.name.data(), cmd.name.data(), cmd.name.size()))
+            return def.handler(cmd);
+    }
+    return -1;
+}
+
+static int parseOnly(std::string_view line)
+{
+    return CommandArgs::parse(line).argc;
+}
+
+static int tableDispatch(std::string_view line)
+{
+    CommandArgs cmd = CommandArgs::parse(line);
+    const Handler* handler = table.find(cmd.name);
+    return handler ? (*handler)(cmd) : -1;
+}
+
+static CommandRegistry<std::function<int(const CommandArgs&)>> registry;
+
+static int registryDispatch(std::string_view line)
+{
+    CommandArgs cmd = CommandArgs::parse(line);
+    const std::function<int(const CommandArgs&)>* handler = registry.find(cmd.name);
+    return handler ? (*handler)(cmd) : -1;
+}
+
+template<typename Func>
+static void run(const char* name, const std::vector<std::string>& lines, int rounds, Func dispatch)
+{
+    long sum = 0;
+    int64_t start = nowNs();
+    for(int r = 0; r < rounds; r++)
+    {
+        for(const std::string& line : lines)
+            sum += dispatch(line);
+    }
+    int64_t elapsed = nowNs() - start;
+    printf("%-18s %6.1f ns/command (checksum %ld)\n", name, (double)elapsed / ((double)rounds * lines.size()), sum);
+}
+
+static void usage(const char* prog)
+{
+    std::cout << "Usage: " << prog << " [-n lines] [-r rounds] [-m miss_percent]" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+    int count = 4096;
+    int rounds = 2000;
+    int missPercent = 10;
+
+    int opt;
+    while((opt = getopt(argc, argv, "n:r:m:h")) != -1)
+    {
+        switch(opt)
+        {
+            case 'n': count = atoi(optarg); break;
+            case 'r': rounds = atoi(optarg); break;
+            case 'm': missPercent = atoi(optarg); break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    for(const CommandDef<Handler>& def : defs)
+        registry.add(def.name, def.handler);
+
+    //命令均匀分布，大小写随机，带0到3个参数；一部分是不存在的命令
+    std::mt19937 rng(1);
+    std::vector<std::string> lines;
+    for(int i = 0; i < count; i++)
+    {
+        std::string line = "/";
+        if((int)(rng() % 100) < missPercent)
+            line += "nosuch" + std::to_string(rng() % 100);
+        else
+            line += std::string(defs[rng() % std::size(defs)].name);
+        for(size_t c = 1; c < line.size(); c++)
+        {
+            if(rng() % 4 == 0)
+                line[c] = toupper(line[c]);
+        }
+        for(int a = rng() % 4; a > 0; a--)
+            line += " arg" + std::to_string(rng() % 1000);
+        line += "\n";
+        lines.push_back(line);
+    }
+
+    printf("commands:          %zu registered, %d lines, %d%% unknown\n", std::size(defs), count, missPercent);
+    run("parse only", lines, rounds, parseOnly);
+    run("strcasecmp chain", lines, rounds, chainDispatch);
+    run("constexpr table", lines, rounds, tableDispatch);
+    run("runtime registry", lines, rounds, registryDispatch);
+    return 0;
+}
@@ -0,0 +1,223 @@
+#ifndef COMMANDTABLE_H
+#define COMMANDTABLE_H
+
+#include<stdint.h>
+#include<stddef.h>
+#include<bit>
+#include<array>
+#include<string>
+#include<string_view>
+#include<stdexcept>
+#include<unordered_map>
+
+//命令分发：内置命令在编译期建成完美哈希表，命令名(不区分ASCII大小写)算一次哈希、比较一次就找到处理函数，
+//不再逐个strcasecmp；运行时注册的扩展命令放在另一张哈希表里，内置命令找不到时才查。
+//命令行在分发前就切好参数，处理函数拿到的都是指向原始行的视图，分发过程不分配内存。
+#define CMD_NAME_MAX 32 //命令名的最大长度，更长的一定找不到
+#define CMD_ARGS_MAX 8  //预先切好的参数个数，多出来的只在rest里
+
+//切好的命令行，视图都指向原始的行，只在处理函数返回前有效
+struct CommandArgs
+{
+    std::string_view name; //不含'/'，保持原来的大小写
+    std::string_view rest; //命令名之后的全部内容，去掉首尾空白
+    std::string_view argv[CMD_ARGS_MAX] = {}; //按空白切开的参数
+    int              argc = 0;
+
+    //行尾的换行以及第一个\r或\n之后的内容都不算命令的一部分；只扫描一遍，不用find_first_of逐字符查集合
+    static constexpr CommandArgs parse(std::string_view line)
+    {
+        CommandArgs cmd;
+        size_t end = 0;
+        while(end < line.size() && line[end] != '\r' && line[end] != '\n')
+            end++;
+        size_t pos = (end > 0 && line[0] == '/') ? 1 : 0;
+
+        size_t begin = pos;
+        while(pos < end && !blank(line[pos]))
+            pos++;
+        cmd.name = line.substr(begin, pos - begin);
+
+        while(pos < end && blank(line[pos]))
+            pos++;
+        size_t last = end;
+        while(last > pos && blank(line[last - 1]))
+            last--;
+        cmd.rest = line.substr(pos, last - pos);
+
+        while(pos < last && cmd.argc < CMD_ARGS_MAX)
+        {
+            begin = pos;
+            while(pos < last && !blank(line[pos]))
+                pos++;
+            cmd.argv[cmd.argc++] = line.substr(begin, pos - begin);
+            while(pos < last && blank(line[pos]))
+                pos++;
+        }
+        return cmd;
+    }
+
+    static constexpr bool blank(char c)
+    {
+        return c == ' ' || c == '\t';
+    }
+};
+
+constexpr unsigned char cmdLower(unsigned char c)
+{
+    return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+//FNV-1a，边算边转小写；seed由编译期建表时挑选
+constexpr uint32_t cmdHash(std::string_view name, uint32_t seed)
+{
+    uint32_t h = 2166136261u ^ (seed * 0x9e3779b9u);
+    for(unsigned char c : name)
+    {
+        h ^= cmdLower(c);
+        h *= 16777619u;
+    }
+    return h ^ (h >> 15);
+}
+
+//lower必须已经是小写
+constexpr bool cmdNameEquals(std::string_view lower, std::string_view name)
+{
+    if(lower.size() != name.size())
+        return false;
+    for(size_t i = 0; i < name.size(); i++)
+    {
+        if((unsigned char)lower[i] != cmdLower(name[i]))
+            return false;
+    }
+    return true;
+}
+
+template<typename Handler>
+struct CommandDef
+{
+    std::string_view name; //小写，不含'/'
+    Handler          handler;
+};
+
+//编译期的完美哈希表：槽数取命令数4倍以上的2的幂，逐个试种子，直到所有命令名落在不同的槽里。
+//命令名重复、含大写或者过长时建表失败，声明成constexpr的表会直接编译不过。
+template<typename Handler, size_t N>
+class CommandTable final
+{
+    static_assert(N > 0 && N < 255, "command table size");
+
+    public:
+        constexpr explicit CommandTable(const CommandDef<Handler> (&defs)[N])
+            : m_defs{}, m_slots{}, m_seed(0)
+        {
+            for(size_t i = 0; i < N; i++)
+            {
+                if(defs[i].name.empty() || defs[i].name.size() > CMD_NAME_MAX)
+                    throw std::invalid_argument("bad command name length");
+                for(unsigned char c : defs[i].name)
+                {
+                    if(c != cmdLower(c) || c == ' ' || c == '\t')
+                        throw std::invalid_argument("command name must be lowercase without blanks");
+                }
+                m_defs[i] = defs[i];
+            }
+
+            for(m_seed = 1; ; m_seed++)
+            {
+                if(m_seed > 1000000)
+                    throw std::invalid_argument("duplicate command name");
+                bool ok = true;
+                m_slots.fill(0);
+                for(size_t i = 0; i < N && ok; i++)
+                {
+                    uint8_t& slot = m_slots[cmdHash(m_defs[i].name, m_seed) & (SLOTS - 1)];
+                    ok = (slot == 0);
+                    slot = i + 1;
+                }
+                if(ok)
+                    break;
+            }
+        }
+
+        constexpr const Handler* find(std::string_view name) const
+        {
+            if(name.empty() || name.size() > CMD_NAME_MAX)
+                return nullptr;
+            uint8_t slot = m_slots[cmdHash(name, m_seed) & (SLOTS - 1)];
+            if(!slot || !cmdNameEquals(m_defs[slot - 1].name, name))
+                return nullptr;
+            return &m_defs[slot - 1].handler;
+        }
+
+    private:
+        static constexpr size_t SLOTS = std::bit_ceil(N * 4);
+
+        std::array<CommandDef<Handler>, N> m_defs;
+        std::array<uint8_t, SLOTS>         m_slots; //槽 -> 命令下标+1，0表示空
+        uint32_t                           m_seed;
+};
+
+//运行时注册的命令，名字统一存小写；查找时在栈上转小写，不构造string
+template<typename Handler>
+class CommandRegistry final
+{
+    public:
+        CommandRegistry() = default;
+        ~CommandRegistry() = default;
+        CommandRegistry(const CommandRegistry&) = delete;
+        CommandRegistry& operator=(const CommandRegistry&) = delete;
+
+        bool add(std::string_view name, Handler handler) //名字不合法或者已经注册过返回false
+        {
+            if(name.empty() || name.size() > CMD_NAME_MAX || name.find_first_of(" \t") != std::string_view::npos)
+                return false;
+            std::string key(name);
+            for(char& c : key)
+                c = cmdLower(c);
+            return m_handlers.emplace(std::move(key), std::move(handler)).second;
+        }
+
+        bool remove(std::string_view name)
+        {
+            char key[CMD_NAME_MAX];
+            if(!fold(name, key))
+                return false;
+            auto it = m_handlers.find(std::string_view(key, name.size()));
+            if(it == m_handlers.end())
+                return false;
+            m_handlers.erase(it);
+            return true;
+        }
+
+        const Handler* find(std::string_view name) const
+        {
+            char key[CMD_NAME_MAX];
+            if(m_handlers.empty() || !fold(name, key))
+                return nullptr;
+            auto it = m_handlers.find(std::string_view(key, name.size()));
+            return it == m_handlers.end() ? nullptr : &it->second;
+        }
+
+        size_t size() const { return m_handlers.size(); }
+
+    private:
+        static bool fold(std::string_view name, char* key)
+        {
+            if(name.empty() || name.size() > CMD_NAME_MAX)
+                return false;
+            for(size_t i = 0; i < name.size(); i++)
+                key[i] = cmdLower(name[i]);
+            return true;
+        }
+
+        struct NameHash
+        {
+            using is_transparent = void;
+            size_t operator()(std::string_view s) const { return std::hash<std::string_view>()(s); }
+        };
+
+        std::unordered_map<std::string, Handler, NameHash, std::equal_to<>> m_handlers;
+};
+
+#endif //COMMANDTABLE_H
@@ -0,0 +1,151 @@
+#include"Compress.h"
+
+#include<string.h>
+#include<algorithm>
+
+DeflateStream::DeflateStream()
+    : m_ready(false)
+{
+    memset(&m_z, 0, sizeof(m_z));
+}
+
+DeflateStream::~DeflateStream()
+{
+    if(m_ready)
+        deflateEnd(&m_z);
+}
+
+bool DeflateStream::init(int level, int windowBits, int memLevel)
+{
+    //负的windowBits表示raw deflate，没有zlib头和校验，帧里只有压缩数据
+    m_ready = deflateInit2(&m_z, level, Z_DEFLATED, -windowBits, memLevel, Z_DEFAULT_STRATEGY) == Z_OK;
+    return m_ready;
+}
+
+bool DeflateStream::isReady()
+{
+    return m_ready;
+}
+
+void DeflateStream::frame(int kind, const char* data, size_t len, std::string& out)
+{
+    //输出一般比输入小得多；不可压缩的数据每个块多几个字节，加上同步标记，空间不够时再扩
+    size_t used = 0;
+    m_z.next_in = (Bytef*)data;
+    m_z.avail_in = len;
+    do
+    {
+        if(m_body.size() - used < 64)
+            m_body.resize(std::max(m_body.size() * 2, len + len / 16 + 64));
+        m_z.next_out = (Bytef*)m_body.data() + used;
+        m_z.avail_out = m_body.size() - used;
+        deflate(&m_z, Z_SYNC_FLUSH); //只可能返回Z_OK或者没有进展的Z_BUF_ERROR
+        used = m_body.size() - m_z.avail_out;
+    } while(m_z.avail_out == 0);
+
+    out.push_back((char)kind);
+    uint64_t n = used;
+    do
+    {
+        out.push_back((char)((n & 0x7f) | (n >= 0x80 ? 0x80 : 0)));
+        n >>= 7;
+    } while(n);
+    out.append(m_body.data(), used);
+}
+
+void DeflateStream::reset()
+{
+    if(m_ready)
+        deflateReset(&m_z);
+}
+
+FrameDecoder::FrameDecoder()
+    : m_kind(0),
+      m_left(0),
+      m_shift(-1),
+      m_frames(0)
+{
+    //两个流都按最大的窗口解，服务端用多大的窗口都能解
+    memset(&m_own, 0, sizeof(m_own));
+    memset(&m_group, 0, sizeof(m_group));
+    inflateInit2(&m_own, -15);
+    inflateInit2(&m_group, -15);
+}
+
+FrameDecoder::~FrameDecoder()
+{
+    inflateEnd(&m_own);
+    inflateEnd(&m_group);
+}
+
+bool FrameDecoder::feed(const char* data, size_t len, std::string& out)
+{
+    size_t pos = 0;
+    while(pos < len)
+    {
+        if(m_shift == -1) //类型
+        {
+            m_kind = (unsigned char)data[pos++];
+            if(m_kind & ~(FRAME_GROUP | FRAME_RESET | FRAME_OWN))
+                return false;
+            m_left = 0;
+            m_shift = 0;
+            continue;
+        }
+        if(m_shift >= 0) //长度
+        {
+            unsigned char c = data[pos++];
+            if(m_shift > 35)
+                return false;
+            m_left |= (uint64_t)(c & 0x7f) << m_shift;
+            m_shift += 7;
+            if(c & 0x80)
+                continue;
+            m_shift = -2;
+            if((m_kind & FRAME_RESET) && inflateReset(&m_group) != Z_OK)
+                return false;
+            if(m_left > 0)
+                continue;
+        }
+
+        //数据：不用等整帧到齐，收到多少解多少
+        size_t take = std::min<uint64_t>(m_left, len - pos);
+        z_stream& z = (m_kind & FRAME_GROUP) ? m_group : m_own;
+        if(take > 0 && !inflateSome(z, data + pos, take, (m_kind & FRAME_OWN) ? m_discard : out))
+            return false;
+        m_discard.clear();
+        pos += take;
+        m_left -= take;
+        if(m_left == 0)
+        {
+            m_shift = -1;
+            m_frames++;
+        }
+    }
+    return true;
+}
+
+uint64_t FrameDecoder::frames()
+{
+    return m_frames;
+}
+
+bool FrameDecoder::inflateSome(z_stream& z, const char* data, size_t len, std::string& out)
+{
+    z.next_in = (Bytef*)data;
+    z.avail_in = len;
+    do
+    {
+        size_t used = out.size();
+        out.resize(used + std::max<size_t>(4 * len, 4096)); //聊天文本的压缩比一般在4倍以内，不够时再来一轮
+        z.next_out = (Bytef*)out.data() + used;
+        z.avail_out = out.size() - used;
+        int ret = inflate(&z, Z_NO_FLUSH);
+        out.resize(out.size() - z.avail_out);
+        if(ret == Z_BUF_ERROR) //没有可以推进的了
+            break;
+        if(ret != Z_OK) //raw deflate流不会结束，Z_STREAM_END也是错的
+            return false;
+    } while(z.avail_in > 0 || z.avail_out == 0); //输出空间正好用完时zlib里可能还压着数据
+    return true;
+}
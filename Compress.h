@@ -0,0 +1,76 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include<stdint.h>
+#include<stddef.h>
+#include<string>
+#include<string_view>
+#include<zlib.h>
+
+//连接级压缩：客户端发送 /compress [级别]，服务端回复明文的 "compress on <级别>\n"，之后发给它的所有数据都是压缩帧
+//(客户端发来的仍然是明文，聊天的上行流量很小)。每帧：1字节类型 | 长度(LEB128变长整数) | raw deflate数据，
+//每帧以Z_SYNC_FLUSH结束，收到一帧就能解出这一帧的明文，解压的上下文在帧之间延续。
+//客户端有两个解压上下文：私有流给只发给它的数据(回复、私信、订阅命中的行、流式转发)，共享流给聊天室广播。
+//同一个级别、同样带不带序号的连接属于同一个配置，共享流在服务端每个配置只有一份，一次广播每个配置只压缩一次，
+//所有连接收到的是同一个帧；自己发的消息也要收一份(FRAME_OWN，解压后丢掉)，解压状态才和别人一致。
+//有连接要加入共享流时服务端在下一帧之前重置它(FRAME_RESET)，所有成员一起从头开始。
+#define FRAME_PRIVATE        0x00 //私有流
+#define FRAME_GROUP          0x01 //共享流
+#define FRAME_RESET          0x02 //先重置共享流再解这一帧
+#define FRAME_OWN            0x04 //自己发的广播，解出来丢掉
+#define FRAME_HEADER_MAX     6    //类型加最长5字节的长度
+
+#define COMPRESS_LEVEL_DEFAULT 6
+#define COMPRESS_WINDOW_BITS   15 //共享流的窗口，所有成员共用一份，用最大的
+#define COMPRESS_MEM_LEVEL     8
+#define PRIVATE_WINDOW_BITS    13 //私有流每个连接一份，数据量小，窗口小一些省内存(大约64KB一个连接)
+#define PRIVATE_MEM_LEVEL      6
+
+//一条raw deflate压缩流。zlib的状态在init时分配(窗口15、memLevel 8时大约256KB)，用的时候才init
+class DeflateStream final
+{
+    public:
+        DeflateStream();
+        ~DeflateStream();
+        DeflateStream(const DeflateStream&) = delete;
+        DeflateStream& operator=(const DeflateStream&) = delete;
+
+        bool init(int level, int windowBits, int memLevel); //分配失败返回false
+        bool isReady();
+        //压缩一段数据并Z_SYNC_FLUSH，帧头和压缩数据追加到out
+        void frame(int kind, const char* data, size_t len, std::string& out);
+        void reset(); //之后的输出不再引用之前的数据
+
+    private:
+        z_stream    m_z;
+        bool        m_ready;
+        std::string m_body; //压缩数据先写在这里，知道长度后再接在帧头后面
+};
+
+//客户端：把收到的字节流还原成明文
+class FrameDecoder final
+{
+    public:
+        FrameDecoder();
+        ~FrameDecoder();
+        FrameDecoder(const FrameDecoder&) = delete;
+        FrameDecoder& operator=(const FrameDecoder&) = delete;
+
+        //收到的数据可以在任意位置切开；解出的明文追加到out，格式或者压缩数据错误返回false
+        bool feed(const char* data, size_t len, std::string& out);
+        uint64_t frames(); //解完的帧数
+
+    private:
+        bool inflateSome(z_stream& z, const char* data, size_t len, std::string& out);
+
+    private:
+        z_stream    m_own; //私有流
+        z_stream    m_group; //共享流
+        int         m_kind;
+        uint64_t    m_left; //当前帧还没收到的字节
+        int         m_shift; //正在读长度时已经读到的位数，-1表示在读类型，-2表示在读数据
+        uint64_t    m_frames;
+        std::string m_discard; //FRAME_OWN解出来的明文
+};
+
+#endif //COMPRESS_H
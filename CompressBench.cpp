@@ -0,0 +1,388 @@
+//压缩压测：先离线比较每条消息单独压缩和整条流共用一个窗口压缩的压缩比和耗时，
+//再启动 ./server，同样的消息分别发给一批不压缩和一批压缩的接收者，比较每个接收者收到的线路字节数和服务端每条消息的CPU时间。
+//语料是模拟的聊天：词由音节拼成，词频服从Zipf分布，夹着@昵称、链接和常见的短回复
+#include"Compress.h"
+#include"BenchUtil.h"
+
+#include<sys/socket.h>
+#include<sys/wait.h>
+#include<fcntl.h>
+#include<signal.h>
+#include<poll.h>
+#include<time.h>
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<unistd.h>
+#include<errno.h>
+#include<iostream>
+#include<string>
+#include<vector>
+#include<random>
+#include<memory>
+#include<algorithm>
+
+extern "C" {
+#include"smallchat/chatlib.h"
+}
+
+//词频服从Zipf分布，和真实聊天记录一样少数词极常见、大部分词很少出现
+class ZipfWords final
+{
+    public:
+        ZipfWords(size_t vocab, uint32_t seed) : m_rng(seed), m_uniform(0.0, 1.0)
+        {
+            double sum = 0;
+            for(size_t i = 1; i <= vocab; i++)
+            {
+                sum += 1.0 / i;
+                m_cdf.push_back(sum);
+            }
+            for(double& c : m_cdf)
+                c /= sum;
+        }
+
+        size_t next()
+        {
+            return std::lower_bound(m_cdf.begin(), m_cdf.end(), m_uniform(m_rng)) - m_cdf.begin();
+        }
+
+        std::mt19937& rng() { return m_rng; }
+
+    private:
+        std::mt19937                           m_rng;
+        std::uniform_real_distribution<double> m_uniform;
+        std::vector<double>                    m_cdf;
+};
+
+//按编号拼出一个像样的词：常见的词短，编号越大音节越多
+static std::string word(size_t rank)
+{
+    static const char* syllables[] = {"ka", "to", "ri", "an", "me", "so", "lu", "ne", "di", "ba", "po", "the", "in", "er", "ve", "lo",
+                                      "st", "ra", "mi", "go", "ne", "ti", "or", "wa", "fe", "chu", "ly", "ng", "pe", "za", "ho", "ck"};
+    const size_t count = sizeof(syllables) / sizeof(syllables[0]);
+    std::string w;
+    do
+    {
+        w += syllables[rank % count];
+        rank /= count;
+    } while(rank);
+    return w;
+}
+
+//生成n条消息(不带换行)
+static std::vector<std::string> corpus(size_t n, uint32_t seed)
+{
+    static const char* replies[] = {"lol", "ok", "+1", "thanks!", "same here", "brb", "nice", "yes", "no idea", "haha", "agreed", "gm"};
+    ZipfWords zipf(20000, seed);
+    std::mt19937& rng = zipf.rng();
+    std::vector<std::string> nicks;
+    for(int i = 0; i < 200; i++)
+        nicks.push_back(word(rng() % 5000) + std::to_string(rng() % 100));
+
+    std::vector<std::string> lines;
+    for(size_t i = 0; i < n; i++)
+    {
+        std::string line;
+        uint32_t kind = rng() % 100;
+        if(kind < 15)
+        {
+            line = replies[rng() % (sizeof(replies) / sizeof(replies[0]))];
+        }
+        else
+        {
+            if(kind < 30)
+                line = "@" + nicks[rng() % nicks.size()] + " ";
+            size_t words = 3 + rng() % 18;
+            for(size_t k = 0; k < words; k++)
+                line += word(zipf.next()) + (k + 1 < words ? " " : "");
+            if(kind >= 90)
+                line += " https://example.com/" + word(zipf.next()) + "/" + std::to_string(rng() % 100000);
+        }
+        lines.push_back(line);
+    }
+    return lines;
+}
+
+struct Offline
+{
+    size_t  bytesIn;
+    size_t  bytesOut; //包括帧头
+    int64_t compressNs;
+    int64_t decompressNs;
+};
+
+//每条消息一帧；shared为false时每帧之前都重置，相当于每条消息单独压缩
+static Offline offline(const std::vector<std::string>& lines, int level, bool shared)
+{
+    Offline result = {0, 0, 0, 0};
+    DeflateStream stream;
+    stream.init(level, COMPRESS_WINDOW_BITS, COMPRESS_MEM_LEVEL);
+    std::vector<std::string> frames(lines.size());
+    std::string plain;
+    int64_t start = nowNs();
+    for(size_t i = 0; i < lines.size(); i++)
+    {
+        plain.assign(lines[i]);
+        plain.push_back('\n');
+        if(!shared)
+            stream.reset();
+        stream.frame(FRAME_GROUP | (shared ? 0 : FRAME_RESET), plain.data(), plain.size(), frames[i]);
+        result.bytesIn += plain.size();
+    }
+    result.compressNs = nowNs() - start;
+
+    FrameDecoder decoder;
+    std::string out;
+    start = nowNs();
+    for(const std::string& frame : frames)
+    {
+        out.clear();
+        decoder.feed(frame.data(), frame.size(), out);
+        result.bytesOut += frame.size();
+    }
+    result.decompressNs = nowNs() - start;
+    return result;
+}
+
+struct Receiver
+{
+    int                           fd;
+    std::unique_ptr<FrameDecoder> decoder; //不压缩的接收者为空
+    uint64_t                      wire; //测量期间收到的字节
+    uint64_t                      lines;
+};
+
+//连上并读掉两行欢迎语；level大于0时开启压缩，回复之后的数据都是压缩帧
+static bool openReceiver(Receiver& r, int port, int level)
+{
+    r.fd = TCPConnect((char*)"127.0.0.1", port, 0);
+    r.wire = 0;
+    r.lines = 0;
+    std::string line;
+    if(r.fd == -1 || !readLine(r.fd, line) || !readLine(r.fd, line))
+        return false;
+    if(level <= 0)
+        return true;
+
+    std::string cmd = "/compress " + std::to_string(level) + "\n";
+    write(r.fd, cmd.data(), cmd.size());
+    if(!readLine(r.fd, line) || line != "compress on " + std::to_string(level))
+        return false;
+    r.decoder = std::make_unique<FrameDecoder>();
+    return true;
+}
+
+struct Online
+{
+    double   wirePerReceiver; //每个接收者每条消息的线路字节
+    double   cpuPerMsg; //服务端每条消息的CPU时间，纳秒
+    uint64_t minLines; //收到最少的接收者解出的行数
+    bool     ok;
+};
+
+//senders个发送者按rate发完lines，所有接收者用同一个配置(level为0表示不压缩)
+static Online online(const char* server, int port, const std::vector<std::string>& lines, int receivers, int senders, int level, int rate)
+{
+    Online result = {0, 0, 0, false};
+    pid_t pid = startServer(server, port, {"-s", "0"}); //关掉检索，只测扇出
+    if(pid == -1)
+    {
+        std::cout << "start " << server << " failure" << std::endl;
+        return result;
+    }
+
+    std::vector<Receiver> rx(receivers);
+    bool ok = true;
+    for(Receiver& r : rx)
+        ok = ok && openReceiver(r, port, level);
+    std::vector<int> tx;
+    for(int i = 0; i < senders && ok; i++)
+    {
+        Receiver r;
+        ok = openReceiver(r, port, 0);
+        std::string nick = "/nick " + word(1000 + i) + std::to_string(i) + "\n";
+        write(r.fd, nick.data(), nick.size());
+        fcntl(r.fd, F_SETFL, fcntl(r.fd, F_GETFL) | O_NONBLOCK);
+        tx.push_back(r.fd);
+    }
+    if(!ok)
+    {
+        std::cout << "connect failure" << std::endl;
+        stopServer(pid);
+        return result;
+    }
+    for(Receiver& r : rx)
+        fcntl(r.fd, F_SETFL, fcntl(r.fd, F_GETFL) | O_NONBLOCK);
+    usleep(200000);
+
+    //发送和读在同一个线程里轮流做：单核机器上压测端多开线程只会和服务端抢CPU
+    std::vector<pollfd> pfds;
+    for(Receiver& r : rx)
+        pfds.push_back({r.fd, POLLIN, 0});
+    for(int fd : tx)
+        pfds.push_back({fd, POLLIN, 0});
+    std::vector<char> buf(65536);
+    std::string plain;
+    auto drain = [&](int timeoutMs) {
+        if(poll(pfds.data(), pfds.size(), timeoutMs) <= 0)
+            return;
+        for(size_t i = 0; i < pfds.size(); i++)
+        {
+            if(!(pfds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+            ssize_t n;
+            while((n = read(pfds[i].fd, buf.data(), buf.size())) > 0)
+            {
+                if(i >= rx.size()) //发送者收到的别人的消息只读掉
+                    continue;
+                Receiver& r = rx[i];
+                r.wire += n;
+                if(r.decoder)
+                {
+                    plain.clear();
+                    if(!r.decoder->feed(buf.data(), n, plain))
+                        pfds[i].fd = -1;
+                    r.lines += std::count(plain.begin(), plain.end(), '\n');
+                }
+                else
+                {
+                    r.lines += std::count(buf.data(), buf.data() + n, '\n');
+                }
+            }
+            if(n == 0)
+                pfds[i].fd = -1;
+        }
+    };
+
+    int64_t cpu0 = processCpuNs(pid);
+    int64_t begin = nowNs();
+    for(size_t i = 0; i < lines.size(); i++)
+    {
+        while(rate > 0 && (double)i * 1e9 / rate > nowNs() - begin)
+            drain(1);
+        std::string line = lines[i] + "\n";
+        int fd = tx[i % tx.size()];
+        size_t off = 0;
+        while(off < line.size())
+        {
+            ssize_t n = write(fd, line.data() + off, line.size() - off);
+            if(n > 0)
+                off += n;
+            else
+                drain(10);
+        }
+        drain(0);
+    }
+    //等所有接收者都收齐，最多等5秒
+    uint64_t want = lines.size();
+    int64_t deadline = nowNs() + 5000000000ll;
+    auto least = [&]() {
+        uint64_t m = UINT64_MAX;
+        for(Receiver& r : rx)
+            m = std::min(m, r.lines);
+        return m;
+    };
+    while(least() < want && nowNs() < deadline)
+        drain(10);
+    int64_t cpu1 = processCpuNs(pid);
+
+    for(Receiver& r : rx)
+        close(r.fd);
+    for(int fd : tx)
+        close(fd);
+    stopServer(pid);
+
+    uint64_t wire = 0;
+    for(Receiver& r : rx)
+        wire += r.wire;
+    result.wirePerReceiver = (double)wire / rx.size() / lines.size();
+    result.cpuPerMsg = (double)(cpu1 - cpu0) / lines.size();
+    result.minLines = least();
+    result.ok = result.minLines == want;
+    return result;
+}
+
+static void usage(const char* prog)
+{
+    std::cout << "Usage: " << prog << " [-l levels,...] [-m messages] [-c receivers] [-n senders] [-r msgs/s] [-S server] [-p port] [-o (offline only)]" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+    std::vector<int> levels = {1, 6, 9};
+    int messages = 20000;
+    int receivers = 50;
+    int senders = 4;
+    int rate = 2000;
+    const char* server = "./server";
+    int port = 7711;
+    bool offlineOnly = false;
+
+    int opt;
+    while((opt = getopt(argc, argv, "l:m:c:n:r:S:p:oh")) != -1)
+    {
+        switch(opt)
+        {
+            case 'l':
+            {
+                levels.clear();
+                char* p = optarg;
+                while(*p)
+                {
+                    levels.push_back(strtol(p, &p, 10));
+                    if(*p == ',')
+                        p++;
+                    else if(*p)
+                        break;
+                }
+                break;
+            }
+            case 'm': messages = atoi(optarg); break;
+            case 'c': receivers = atoi(optarg); break;
+            case 'n': senders = atoi(optarg); break;
+            case 'r': rate = atoi(optarg); break;
+            case 'S': server = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            case 'o': offlineOnly = true; break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if(levels.empty() || std::any_of(levels.begin(), levels.end(), [](int l) { return l < 1 || l > 9; }) || messages < 1 || receivers < 1
+       || senders < 1 || rate < 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    std::vector<std::string> lines = corpus(messages, 1);
+    std::cout << messages << " messages, offline: per-message vs shared window" << std::endl;
+    printf("%6s %10s %12s %12s %8s %12s %12s\n", "level", "mode", "bytes in", "bytes out", "ratio", "comp ns/msg", "decomp ns/msg");
+    for(int level : levels)
+    {
+        for(bool shared : {false, true})
+        {
+            Offline r = offline(lines, level, shared);
+            printf("%6d %10s %12zu %12zu %7.2fx %12.0f %12.0f\n", level, shared ? "stream" : "per-msg", r.bytesIn, r.bytesOut,
+                   (double)r.bytesIn / r.bytesOut, (double)r.compressNs / messages, (double)r.decompressNs / messages);
+        }
+    }
+    if(offlineOnly)
+        return 0;
+
+    std::cout << std::endl << receivers << " receivers, " << senders << " senders, " << rate << " msgs/s, " << server << std::endl;
+    printf("%6s %14s %14s %12s %s\n", "level", "wire B/msg/rx", "cpu ns/msg", "min lines", "");
+    std::vector<int> runs = {0};
+    runs.insert(runs.end(), levels.begin(), levels.end());
+    for(int level : runs)
+    {
+        Online r = online(server, port, lines, receivers, senders, level, rate);
+        printf("%6s %14.1f %14.0f %12llu %s\n", level ? std::to_string(level).c_str() : "plain", r.wirePerReceiver, r.cpuPerMsg,
+               (unsigned long long)r.minLines, r.ok ? "ok" : "MISSING");
+        fflush(stdout);
+    }
+    return 0;
+}
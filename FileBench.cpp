@@ -0,0 +1,366 @@
+//文件分享压测：先把一个大文件分两次/upload上去(第一次传一半就断开，第二次从服务端回复的偏移续传)，
+//再开N个连接同时/get，统计上传和下载的吞吐、服务端的CPU；下载期间另外两个连接互发ping，
+//看文件传输占满带宽时聊天消息的延迟。第一个下载者逐字节校验内容。服务端要用 -f 目录 启动。
+#include"BenchUtil.h"
+
+#include<sys/epoll.h>
+#include<sys/sendfile.h>
+#include<sys/socket.h>
+#include<sys/resource.h>
+#include<fcntl.h>
+#include<time.h>
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<unistd.h>
+#include<errno.h>
+#include<iostream>
+#include<string>
+#include<vector>
+#include<algorithm>
+
+extern "C" {
+#include"smallchat/chatlib.h"
+}
+
+#define BENCH_FILE_NAME "filebench.bin"
+#define BENCH_BUF_SIZE  (64 * 1024)
+
+//文件内容：第i个8字节是i乘一个奇数，错位、丢失、重复都能发现
+static uint64_t patternWord(uint64_t index)
+{
+    return index * 0x9e3779b97f4a7c15ull;
+}
+
+static std::string g_host = "127.0.0.1";
+static int         g_port = 7711;
+static const char* g_unixPath = nullptr;
+
+static int connectServer(bool nonblock)
+{
+    return g_unixPath ? UnixConnect((char*)g_unixPath, nonblock) : TCPConnect((char*)g_host.c_str(), g_port, nonblock);
+}
+
+//连上并读掉两行欢迎语
+static int openSession(bool nonblock)
+{
+    int fd = connectServer(false);
+    if(fd == -1)
+        return -1;
+    if(!skipWelcome(fd))
+        return -1;
+    if(nonblock)
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+static bool command(int fd, const std::string& cmd, std::string& reply)
+{
+    std::string line = cmd + "\n";
+    if(write(fd, line.data(), line.size()) != (ssize_t)line.size())
+        return false;
+    return readLine(fd, reply, -1);
+}
+
+//把本地文件的[from, to)用sendfile发到连接上
+static bool sendRange(int sock, int file, uint64_t from, uint64_t to)
+{
+    off_t offset = from;
+    while((uint64_t)offset < to)
+    {
+        ssize_t n = sendfile(sock, file, &offset, std::min<uint64_t>(to - offset, 1 << 30));
+        if(n <= 0)
+            return false;
+    }
+    return true;
+}
+
+//上传：第一个连接传一半就断开，第二个连接按服务端回复的偏移续传
+static bool upload(int file, uint64_t size, uint64_t* resumedAt)
+{
+    std::string reply;
+    int fd = openSession(false);
+    if(fd == -1 || !command(fd, "/upload " BENCH_FILE_NAME " " + std::to_string(size), reply))
+        return false;
+    uint64_t offset = 0;
+    if(sscanf(reply.c_str(), "upload ok %lu", &offset) != 1)
+    {
+        std::cout << "upload refused: " << reply << std::endl;
+        return false;
+    }
+    uint64_t half = std::max(offset, size / 2);
+    bool ok = sendRange(fd, file, offset, half);
+    close(fd);
+    if(!ok)
+        return false;
+
+    //服务端按连接关闭处理完前一半之后才会释放这个名字
+    for(int attempt = 0; ; attempt++)
+    {
+        fd = openSession(false);
+        if(fd == -1 || !command(fd, "/upload " BENCH_FILE_NAME " " + std::to_string(size), reply))
+            return false;
+        if(sscanf(reply.c_str(), "upload ok %lu", resumedAt) == 1)
+            break;
+        close(fd);
+        if(attempt == 100)
+        {
+            std::cout << "resume refused: " << reply << std::endl;
+            return false;
+        }
+        usleep(10000);
+    }
+    ok = sendRange(fd, file, *resumedAt, size) && readLine(fd, reply, -1) && reply.compare(0, 11, "upload done") == 0;
+    if(!ok)
+        std::cout << "upload failure: " << reply << std::endl;
+    close(fd);
+    return ok;
+}
+
+struct Downloader
+{
+    int      fd;
+    uint64_t received;
+    uint64_t size;
+    bool     header; //已经读到 get ok 回复
+    bool     done;
+    std::string line; //回复行的前半部分
+    uint64_t verifiedWord; //第一个下载者：下一个要校验的8字节
+    uint8_t  partial[8]; //跨读边界的不完整的8字节
+    size_t   partialLen;
+    bool     corrupt;
+};
+
+static void verify(Downloader& d, const char* data, size_t len)
+{
+    for(size_t i = 0; i < len && !d.corrupt; i++)
+    {
+        d.partial[d.partialLen++] = data[i];
+        if(d.partialLen == 8)
+        {
+            uint64_t word;
+            memcpy(&word, d.partial, 8);
+            d.corrupt = word != patternWord(d.verifiedWord++);
+            d.partialLen = 0;
+        }
+    }
+}
+
+static void usage(const char* prog)
+{
+    std::cout << "Usage: " << prog << " [-H host] [-p port] [-U path] [-s megabytes] [-c downloaders] [-P server_pid]" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+    uint64_t megabytes = 1024;
+    int count = 50;
+    int pid = 0;
+
+    int opt;
+    while((opt = getopt(argc, argv, "H:p:U:s:c:P:h")) != -1)
+    {
+        switch(opt)
+        {
+            case 'H': g_host = optarg; break;
+            case 'p': g_port = atoi(optarg); break;
+            case 'U': g_unixPath = optarg; break;
+            case 's': megabytes = strtoull(optarg, nullptr, 10); break;
+            case 'c': count = atoi(optarg); break;
+            case 'P': pid = atoi(optarg); break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    uint64_t size = megabytes << 20;
+    if(size == 0 || count < 1)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    //本地的源文件，写完就unlink，只靠fd引用
+    char tmpl[] = "/tmp/filebench-XXXXXX";
+    int file = mkstemp(tmpl);
+    if(file == -1)
+    {
+        std::cout << "create temp file failure" << std::endl;
+        return 1;
+    }
+    unlink(tmpl);
+    std::vector<uint64_t> block(1 << 17);
+    for(uint64_t word = 0; word < size / 8; word += block.size())
+    {
+        size_t n = std::min<uint64_t>(block.size(), size / 8 - word);
+        for(size_t i = 0; i < n; i++)
+            block[i] = patternWord(word + i);
+        if(write(file, block.data(), n * 8) != (ssize_t)(n * 8))
+        {
+            std::cout << "write temp file failure" << std::endl;
+            return 1;
+        }
+    }
+
+    double cpu0 = pid ? processCpuNs(pid) / 1e9 : -1;
+    int64_t start = nowNs();
+    uint64_t resumedAt = 0;
+    if(!upload(file, size, &resumedAt))
+        return 1;
+    double uploadSec = (nowNs() - start) / 1e9;
+    double cpu1 = pid ? processCpuNs(pid) / 1e9 : -1;
+
+    //两个聊天连接：一个每10ms发一条带时间戳的ping，另一个统计延迟
+    int pinger = openSession(true);
+    int ponger = openSession(true);
+    if(pinger == -1 || ponger == -1)
+    {
+        std::cout << "connect failure" << std::endl;
+        return 1;
+    }
+
+    int ep = epoll_create1(0);
+    std::vector<Downloader> downloaders(count);
+    for(int i = 0; i < count; i++)
+    {
+        Downloader& d = downloaders[i];
+        d = Downloader{};
+        d.fd = openSession(true);
+        if(d.fd == -1)
+        {
+            std::cout << "connect failure" << std::endl;
+            return 1;
+        }
+        epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.u32 = i;
+        epoll_ctl(ep, EPOLL_CTL_ADD, d.fd, &ev);
+    }
+    epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.u32 = count;
+    epoll_ctl(ep, EPOLL_CTL_ADD, ponger, &ev);
+
+    double selfCpu0 = selfCpuSeconds();
+    double cpu2 = pid ? processCpuNs(pid) / 1e9 : -1;
+    int64_t downloadStart = nowNs();
+    for(Downloader& d : downloaders)
+    {
+        const char* get = "/get " BENCH_FILE_NAME "\n";
+        if(write(d.fd, get, strlen(get)) != (ssize_t)strlen(get))
+            return 1;
+    }
+
+    std::vector<char> buf(BENCH_BUF_SIZE);
+    std::string pongs;
+    std::vector<int64_t> latencies;
+    int finished = 0;
+    int64_t nextPing = nowNs();
+    int64_t lastDone = 0;
+    while(finished < count && nowNs() - downloadStart < 600000000000ll)
+    {
+        int64_t now = nowNs();
+        if(now >= nextPing)
+        {
+            std::string ping = "ping " + std::to_string(now) + "\n";
+            if(write(pinger, ping.data(), ping.size()) < 0 && errno != EAGAIN)
+                return 1;
+            nextPing = now + 10000000;
+        }
+
+        epoll_event events[64];
+        int n = epoll_wait(ep, events, 64, 5);
+        for(int e = 0; e < n; e++)
+        {
+            uint32_t id = events[e].data.u32;
+            if(id == (uint32_t)count)
+            {
+                //ping的格式是 昵称>ping <发送时间>
+                ssize_t r = read(ponger, buf.data(), buf.size());
+                if(r <= 0)
+                    continue;
+                pongs.append(buf.data(), r);
+                size_t pos;
+                while((pos = pongs.find('\n')) != std::string::npos)
+                {
+                    size_t at = pongs.find(">ping ");
+                    if(at != std::string::npos && at < pos)
+                        latencies.push_back(nowNs() - strtoll(pongs.c_str() + at + 6, nullptr, 10));
+                    pongs.erase(0, pos + 1);
+                }
+                continue;
+            }
+
+            //每个事件只读一次，水平触发下次还会报告，不让一个下载者占住循环耽误ping
+            Downloader& d = downloaders[id];
+            if(!d.done)
+            {
+                ssize_t r = read(d.fd, buf.data(), buf.size());
+                if(r == 0 || (r < 0 && errno != EAGAIN && errno != EINTR))
+                {
+                    std::cout << "downloader " << id << " disconnected after " << d.received << " bytes" << std::endl;
+                    return 1;
+                }
+                if(r < 0)
+                    continue;
+                size_t used = 0;
+                if(!d.header)
+                {
+                    //回复行之后紧跟着文件内容，ping可能排在回复之前
+                    while(used < (size_t)r && !d.header)
+                    {
+                        char c = buf[used++];
+                        if(c != '\n')
+                        {
+                            d.line.push_back(c);
+                            continue;
+                        }
+                        if(d.line.compare(0, 7, "get ok ") == 0)
+                        {
+                            d.size = strtoull(d.line.c_str() + 7, nullptr, 10);
+                            d.header = true;
+                        }
+                        else if(d.line.find(">ping ") == std::string::npos)
+                        {
+                            std::cout << "downloader " << id << ": " << d.line << std::endl;
+                            return 1;
+                        }
+                        d.line.clear();
+                    }
+                }
+                size_t len = std::min<uint64_t>(r - used, d.size - d.received);
+                if(id == 0)
+                    verify(d, buf.data() + used, len);
+                d.received += len;
+                if(d.header && d.received == d.size)
+                {
+                    d.done = true;
+                    finished++;
+                    lastDone = nowNs();
+                    close(d.fd); //文件后面排着下载期间的聊天消息，不关心
+                }
+            }
+        }
+    }
+    double downloadSec = ((lastDone ? lastDone : nowNs()) - downloadStart) / 1e9;
+    double selfCpu = selfCpuSeconds() - selfCpu0;
+    double cpu3 = pid ? processCpuNs(pid) / 1e9 : -1;
+
+    uint64_t total = 0;
+    for(const Downloader& d : downloaders)
+        total += d.received;
+    std::sort(latencies.begin(), latencies.end());
+    printf("upload:        %.0f MB in %.2f s (%.0f MB/s), resumed at %llu\n", size / 1048576.0, uploadSec, size / 1048576.0 / uploadSec,
+           (unsigned long long)resumedAt);
+    printf("download:      %d of %d x %.0f MB in %.2f s, %.0f MB/s aggregate\n", finished, count, size / 1048576.0, downloadSec,
+           total / 1048576.0 / downloadSec);
+    printf("verify:        first downloader %s\n", downloaders[0].corrupt ? "CORRUPT" : (downloaders[0].done ? "ok" : "incomplete"));
+    if(!latencies.empty())
+        printf("chat latency:  %zu pings during downloads, p50 %.2f ms, p99 %.2f ms, max %.2f ms\n", latencies.size(),
+               latencies[latencies.size() / 2] / 1e6, latencies[latencies.size() * 99 / 100] / 1e6, latencies.back() / 1e6);
+    printf("client cpu:    %.3f s while downloading\n", selfCpu);
+    if(cpu0 >= 0 && cpu3 >= 0)
+        printf("server cpu:    upload %.3f s (%.3f s/GB), download %.3f s (%.3f s/GB)\n", cpu1 - cpu0, (cpu1 - cpu0) / (size / 1e9),
+               cpu3 - cpu2, (cpu3 - cpu2) / (total / 1e9));
+    return finished == count && !downloaders[0].corrupt ? 0 : 1;
+}
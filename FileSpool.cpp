@@ -0,0 +1,315 @@
+#include"FileSpool.h"
+
+#include<sys/stat.h>
+#include<sys/sendfile.h>
+#include<fcntl.h>
+#include<unistd.h>
+#include<dirent.h>
+#include<errno.h>
+#include<string.h>
+#include<algorithm>
+
+//////////////////////FileTransfer类
+FileTransfer::FileTransfer(int fd, bool upload, std::string_view name, uint64_t offset, uint64_t end)
+    : m_fd(fd),
+      m_upload(upload),
+      m_name(name),
+      m_offset(offset),
+      m_end(end)
+{
+}
+
+FileTransfer::~FileTransfer()
+{
+    close(m_fd);
+}
+
+int FileTransfer::fd()
+{
+    return m_fd;
+}
+
+bool FileTransfer::isUpload()
+{
+    return m_upload;
+}
+
+const std::string& FileTransfer::name()
+{
+    return m_name;
+}
+
+uint64_t FileTransfer::offset()
+{
+    return m_offset;
+}
+
+uint64_t FileTransfer::end()
+{
+    return m_end;
+}
+
+uint64_t FileTransfer::remaining()
+{
+    return m_end - m_offset;
+}
+
+bool FileTransfer::done()
+{
+    return m_offset == m_end;
+}
+
+void FileTransfer::advance(size_t n)
+{
+    m_offset += n;
+}
+
+//////////////////////FileSpool类
+FileSpool::FileSpool()
+    : m_pipeSize(0),
+      m_active(0)
+{
+    m_pipe[0] = m_pipe[1] = -1;
+}
+
+FileSpool::~FileSpool()
+{
+    if(m_pipe[0] != -1)
+        close(m_pipe[0]);
+    if(m_pipe[1] != -1)
+        close(m_pipe[1]);
+}
+
+bool FileSpool::open(const std::string& dir)
+{
+    if(mkdir(dir.c_str(), 0755) == -1 && errno != EEXIST)
+        return false;
+    struct stat st;
+    if(stat(dir.c_str(), &st) == -1 || !S_ISDIR(st.st_mode))
+        return false;
+
+    //管道的读端也要非阻塞，出错时倒空它不会卡住
+    if(pipe2(m_pipe, O_NONBLOCK | O_CLOEXEC) == -1)
+        return false;
+    fcntl(m_pipe[1], F_SETPIPE_SZ, FILE_PIPE_SIZE);
+    int size = fcntl(m_pipe[1], F_GETPIPE_SZ);
+    m_pipeSize = size > 0 ? size : 65536;
+    m_dir = dir;
+    return true;
+}
+
+bool FileSpool::validName(std::string_view name)
+{
+    if(name.empty() || name.size() > FILE_NAME_MAX || name.front() == '.')
+        return false;
+    //没传完的文件和正式文件放在同一个目录，不允许直接取.part
+    size_t suffix = strlen(FILE_PART_SUFFIX);
+    if(name.size() > suffix && name.compare(name.size() - suffix, suffix, FILE_PART_SUFFIX) == 0)
+        return false;
+    for(char c : name)
+    {
+        if(!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '.' || c == '_' || c == '-'))
+            return false;
+    }
+    return true;
+}
+
+std::string FileSpool::path(std::string_view name, bool part)
+{
+    std::string path = m_dir;
+    path += '/';
+    path.append(name);
+    if(part)
+        path += FILE_PART_SUFFIX;
+    return path;
+}
+
+std::unique_ptr<FileTransfer> FileSpool::startUpload(std::string_view name, uint64_t size, const char** err)
+{
+    if(!validName(name))
+    {
+        *err = "upload bad name\n";
+        return nullptr;
+    }
+    if(size > FILE_SIZE_MAX)
+    {
+        *err = "upload too large\n";
+        return nullptr;
+    }
+    if(m_active >= FILE_TRANSFERS_MAX)
+    {
+        *err = "upload busy, retry later\n";
+        return nullptr;
+    }
+    if(m_uploading.count(std::string(name)))
+    {
+        *err = "upload in progress by another client\n";
+        return nullptr;
+    }
+
+    //已经有的.part就是上次传到的位置；比这次声明的大小还长说明不是同一个文件，从头来
+    int fd = ::open(path(name, true).c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    struct stat st;
+    if(fd == -1 || fstat(fd, &st) == -1)
+    {
+        if(fd != -1)
+            close(fd);
+        *err = "upload open failure\n";
+        return nullptr;
+    }
+    uint64_t offset = st.st_size;
+    if(offset > size)
+    {
+        if(ftruncate(fd, 0) == -1)
+        {
+            close(fd);
+            *err = "upload open failure\n";
+            return nullptr;
+        }
+        offset = 0;
+    }
+
+    m_uploading.emplace(name);
+    m_active++;
+    return std::make_unique<FileTransfer>(fd, true, name, offset, size);
+}
+
+std::unique_ptr<FileTransfer> FileSpool::startDownload(std::string_view name, uint64_t offset, const char** err)
+{
+    if(!validName(name))
+    {
+        *err = "get bad name\n";
+        return nullptr;
+    }
+    if(m_active >= FILE_TRANSFERS_MAX)
+    {
+        *err = "get busy, retry later\n";
+        return nullptr;
+    }
+
+    //正在上传的同名文件写在.part里，这里打开的是上一个完整的版本；上传完改名也不影响已经打开的下载
+    int fd = ::open(path(name, false).c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if(fd == -1 || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))
+    {
+        if(fd != -1)
+            close(fd);
+        *err = "get no such file\n";
+        return nullptr;
+    }
+    if(offset > (uint64_t)st.st_size)
+    {
+        close(fd);
+        *err = "get bad offset\n";
+        return nullptr;
+    }
+
+    //整个文件都会被顺序读一遍，让内核预读得更积极
+    posix_fadvise(fd, offset, 0, POSIX_FADV_SEQUENTIAL);
+    m_active++;
+    return std::make_unique<FileTransfer>(fd, false, name, offset, st.st_size);
+}
+
+bool FileSpool::finish(FileTransfer* transfer)
+{
+    m_active--;
+    if(!transfer->isUpload())
+        return transfer->done();
+
+    m_uploading.erase(transfer->name());
+    if(!transfer->done())
+        return false;
+    return rename(path(transfer->name(), true).c_str(), path(transfer->name(), false).c_str()) == 0;
+}
+
+size_t FileSpool::active()
+{
+    return m_active;
+}
+
+std::vector<std::pair<std::string, uint64_t>> FileSpool::list()
+{
+    std::vector<std::pair<std::string, uint64_t>> files;
+    DIR* dir = opendir(m_dir.c_str());
+    if(!dir)
+        return files;
+    while(dirent* entry = readdir(dir))
+    {
+        struct stat st;
+        if(!validName(entry->d_name) || fstatat(dirfd(dir), entry->d_name, &st, 0) == -1 || !S_ISREG(st.st_mode))
+            continue;
+        files.emplace_back(entry->d_name, st.st_size);
+    }
+    closedir(dir);
+    std::sort(files.begin(), files.end());
+    return files;
+}
+
+ssize_t FileSpool::writeBuffered(FileTransfer* transfer, const char* data, size_t len)
+{
+    size_t done = 0;
+    while(done < len)
+    {
+        ssize_t n = pwrite(transfer->fd(), data + done, len - done, transfer->offset() + done);
+        if(n == -1 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return -1;
+        done += n;
+    }
+    return done;
+}
+
+ssize_t FileSpool::receive(FileTransfer* transfer, int sockfd, size_t max)
+{
+    //socket -> 管道：只是把skb里的页挂到管道上；每次都把管道倒空，所有上传共用一个管道
+    size_t want = std::min<uint64_t>({max, m_pipeSize, transfer->remaining()});
+    ssize_t in = splice(sockfd, nullptr, m_pipe[1], nullptr, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if(in == 0)
+    {
+        errno = 0;
+        return -1;
+    }
+    if(in == -1)
+        return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+
+    //管道 -> 文件：写进page cache，由内核择机落盘
+    loff_t offset = transfer->offset();
+    size_t left = in;
+    while(left > 0)
+    {
+        ssize_t out = splice(m_pipe[0], nullptr, transfer->fd(), &offset, left, SPLICE_F_MOVE);
+        if(out == -1 && errno == EINTR)
+            continue;
+        if(out <= 0)
+        {
+            int saved = errno;
+            discardPipe();
+            errno = saved;
+            return -1;
+        }
+        left -= out;
+    }
+    return in;
+}
+
+ssize_t FileSpool::send(FileTransfer* transfer, int sockfd, size_t max)
+{
+    off_t offset = transfer->offset();
+    ssize_t n = sendfile(sockfd, transfer->fd(), &offset, std::min<uint64_t>(max, transfer->remaining()));
+    if(n == -1)
+        return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+    if(n == 0) //文件在传输过程中被截短了
+    {
+        errno = EIO;
+        return -1;
+    }
+    return n;
+}
+
+void FileSpool::discardPipe()
+{
+    char buf[4096];
+    while(read(m_pipe[0], buf, sizeof(buf)) > 0)
+        ;
+}
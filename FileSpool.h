@@ -0,0 +1,86 @@
+#ifndef FILESPOOL_H
+#define FILESPOOL_H
+
+#include<stdint.h>
+#include<stddef.h>
+#include<sys/types.h>
+#include<memory>
+#include<string>
+#include<string_view>
+#include<unordered_set>
+#include<vector>
+#include<utility>
+
+//文件分享：/upload 把文件存进本地的spool目录，/get 从spool目录取回。文件数据不经过用户态：
+//上传用splice把socket里的数据挪进管道再挪进文件，下载用sendfile直接从page cache发到socket。
+//传输都是非阻塞的，每次就绪事件最多搬FILE_CHUNK_PER_EVENT字节，和聊天消息在同一个事件循环里轮流处理。
+#define FILE_NAME_MAX        128             //文件名只能由字母、数字和 . _ - 组成，不能以 . 开头
+#define FILE_SIZE_MAX        (64ull << 30)   //单个文件的上限
+#define FILE_CHUNK_PER_EVENT (256 * 1024)    //每次就绪事件最多搬的字节数，大文件不会占住整轮事件循环
+#define FILE_PIPE_SIZE       (1024 * 1024)   //上传共用的管道容量，超过pipe-max-size时用系统给的大小
+#define FILE_TRANSFERS_MAX   128             //同时进行的传输数，每个占一个文件fd
+#define FILE_PART_SUFFIX     ".part"         //没传完的上传，重新上传同名文件时从它的长度续传
+
+//一次传输：上传写到 名字.part，传完改名；下载从offset发到end。位置由调用者在搬完数据后推进
+class FileTransfer final
+{
+    public:
+        FileTransfer(int fd, bool upload, std::string_view name, uint64_t offset, uint64_t end);
+        ~FileTransfer();
+        FileTransfer(const FileTransfer&) = delete;
+        FileTransfer& operator=(const FileTransfer&) = delete;
+
+        int                fd();
+        bool               isUpload();
+        const std::string& name();
+        uint64_t           offset(); //下一个要写进文件/发给对方的位置
+        uint64_t           end();
+        uint64_t           remaining();
+        bool               done();
+        void               advance(size_t n);
+
+    private:
+        int         m_fd;
+        bool        m_upload;
+        std::string m_name;
+        uint64_t    m_offset;
+        uint64_t    m_end;
+};
+
+class FileSpool final
+{
+    public:
+        FileSpool();
+        ~FileSpool();
+        FileSpool(const FileSpool&) = delete;
+        FileSpool& operator=(const FileSpool&) = delete;
+
+        bool open(const std::string& dir); //目录不存在时创建，同时创建上传共用的管道
+        static bool validName(std::string_view name);
+
+        //开始上传：已经有 名字.part 时从它的长度续传；同名文件正在上传、名字不合法等返回nullptr，*err是回复给客户端的原因
+        std::unique_ptr<FileTransfer> startUpload(std::string_view name, uint64_t size, const char** err);
+        std::unique_ptr<FileTransfer> startDownload(std::string_view name, uint64_t offset, const char** err);
+        //结束传输，调用者随后释放它：上传传完时把 名字.part 改成正式的名字，返回是否成功；没传完的保留.part等续传
+        bool   finish(FileTransfer* transfer);
+        size_t active(); //进行中的传输数
+        std::vector<std::pair<std::string, uint64_t>> list(); //已经传完的文件和大小，按名字排序
+
+        //搬数据，返回搬了多少字节，0表示暂时没有数据/发不出去，-1表示出错或者对端关闭(errno为0)
+        ssize_t writeBuffered(FileTransfer* transfer, const char* data, size_t len); //上传开始前已经读进用户态的部分
+        ssize_t receive(FileTransfer* transfer, int sockfd, size_t max); //socket -> 管道 -> 文件
+        ssize_t send(FileTransfer* transfer, int sockfd, size_t max); //文件 -> socket
+
+    private:
+        std::string path(std::string_view name, bool part);
+        void        discardPipe(); //写文件失败时把管道里剩下的数据扔掉，下一个上传拿到的是空管道
+
+    private:
+        std::string                     m_dir;
+        int                             m_pipe[2];
+        size_t                          m_pipeSize;
+        std::unordered_set<std::string> m_uploading; //同一个名字同时只能有一个上传
+        size_t                          m_active;
+};
+
+#endif //FILESPOOL_H
@@ -0,0 +1,242 @@
+//优先级通道压测：一个连接按固定速率成批灌聊天消息，另一个连接按限定的速率读(模拟慢速的手机网络)，
+//同时每隔几毫秒发一次/ping。统计pong的往返延迟：回复和广播在同一个队列里时pong排在积压的广播后面，
+//分了通道以后只排在已经交给内核的数据后面。先在没有洪水的情况下测一秒作为基线。
+#include"BenchUtil.h"
+
+#include<sys/socket.h>
+#include<netinet/in.h>
+#include<netinet/tcp.h>
+#include<arpa/inet.h>
+#include<netdb.h>
+#include<poll.h>
+#include<fcntl.h>
+#include<time.h>
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<unistd.h>
+#include<errno.h>
+#include<iostream>
+#include<string>
+#include<vector>
+#include<algorithm>
+
+extern "C" {
+#include"smallchat/chatlib.h"
+}
+
+static std::string g_host = "127.0.0.1";
+static int         g_port = 7711;
+static const char* g_unixPath = nullptr;
+
+//慢读者要在connect之前设置：接收缓冲区小，MSS和真实网络一样。回环接口的MSS有64KB，
+//接收窗口要腾出一整个MSS才会通告，小缓冲区的连接会一卡一卡地收，测不出服务端的排队
+static int connectSlow(int rcvbuf, int mss)
+{
+    addrinfo hints, *res = nullptr;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if(getaddrinfo(g_host.c_str(), std::to_string(g_port).c_str(), &hints, &res) != 0)
+        return -1;
+    int fd = socket(res->ai_family, SOCK_STREAM, 0);
+    if(fd != -1)
+    {
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+        setsockopt(fd, IPPROTO_TCP, TCP_MAXSEG, &mss, sizeof(mss));
+        if(connect(fd, res->ai_addr, res->ai_addrlen) == -1)
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+//连上并读掉两行欢迎语，之后切成非阻塞；rcvbuf为0时是普通连接
+static int openSession(int rcvbuf = 0, int mss = 0)
+{
+    int fd = -1;
+    if(g_unixPath)
+        fd = UnixConnect((char*)g_unixPath, 0);
+    else
+        fd = rcvbuf > 0 ? connectSlow(rcvbuf, mss) : TCPConnect((char*)g_host.c_str(), g_port, 0);
+    if(fd == -1)
+        return -1;
+    if(!skipWelcome(fd))
+        return -1;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+//尽量把out写出去，写掉的部分从头上删掉；连接出错返回false
+static bool flushOut(int fd, std::string& out)
+{
+    while(!out.empty())
+    {
+        ssize_t n = write(fd, out.data(), out.size());
+        if(n == -1)
+            return errno == EAGAIN || errno == EINTR;
+        out.erase(0, n);
+    }
+    return true;
+}
+
+static void usage(const char* prog)
+{
+    std::cout << "Usage: " << prog << " [-H host] [-p port] [-U path] [-r read_kb_per_sec] [-f flood_kb_per_sec] [-b burst_ms] [-s line_size] [-i ping_ms] [-t seconds] [-R rcvbuf] [-M mss]" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+    int readKBps = 512;
+    int floodKBps = 450;
+    int burstMs = 1000;
+    int lineSize = 200;
+    int pingMs = 10;
+    int seconds = 10;
+    int rcvbuf = 16384;
+    int mss = 1448;
+
+    int opt;
+    while((opt = getopt(argc, argv, "H:p:U:r:f:b:s:i:t:R:M:h")) != -1)
+    {
+        switch(opt)
+        {
+            case 'H': g_host = optarg; break;
+            case 'p': g_port = atoi(optarg); break;
+            case 'U': g_unixPath = optarg; break;
+            case 'r': readKBps = atoi(optarg); break;
+            case 'f': floodKBps = atoi(optarg); break;
+            case 'b': burstMs = atoi(optarg); break;
+            case 's': lineSize = atoi(optarg); break;
+            case 'i': pingMs = atoi(optarg); break;
+            case 't': seconds = atoi(optarg); break;
+            case 'R': rcvbuf = atoi(optarg); break;
+            case 'M': mss = atoi(optarg); break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if(readKBps < 1 || burstMs < 1 || pingMs < 1 || lineSize < 2 || rcvbuf < 1)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    //慢读者的接收缓冲区设小，积压留在服务端
+    int probe = openSession(rcvbuf, mss);
+    int flooder = openSession();
+    if(probe == -1 || flooder == -1)
+    {
+        std::cout << "connect failure" << std::endl;
+        return 1;
+    }
+
+    std::string line(lineSize - 1, 'x');
+    line.push_back('\n');
+    std::string probeIn, probeOut, floodOut;
+    std::vector<int64_t> baseline, flooded;
+    uint64_t pings = 0, pongs = 0, floodSent = 0, floodRecv = 0;
+    double tokens = 0;
+    const double maxTokens = 64 * 1024;
+    char buf[64 * 1024];
+
+    int64_t start = nowNs();
+    int64_t floodStart = start + 1000000000ll;
+    int64_t end = floodStart + (int64_t)seconds * 1000000000ll;
+    int64_t nextPing = start, nextBurst = floodStart, last = start;
+    bool dropped = false;
+    while(true)
+    {
+        int64_t now = nowNs();
+        //洪水结束后再等最后几个pong回来
+        if(now >= end + 1000000000ll || (now >= end && pongs == pings))
+            break;
+
+        if(now < end && now >= nextPing)
+        {
+            probeOut += "/ping " + std::to_string(now) + "\n";
+            pings++;
+            nextPing += (int64_t)pingMs * 1000000;
+        }
+        if(now < end && now >= nextBurst)
+        {
+            size_t bytes = (size_t)floodKBps * 1024 * burstMs / 1000;
+            for(size_t n = 0; n < bytes; n += line.size())
+            {
+                floodOut += line;
+                floodSent++;
+            }
+            nextBurst += (int64_t)burstMs * 1000000;
+        }
+        if(!flushOut(probe, probeOut) || !flushOut(flooder, floodOut))
+        {
+            dropped = true;
+            break;
+        }
+
+        tokens = std::min(maxTokens, tokens + (now - last) / 1e9 * readKBps * 1024);
+        last = now;
+
+        pollfd fds[2] = {{probe, POLLIN, 0}, {flooder, POLLIN, 0}};
+        poll(fds, 2, 1);
+
+        //洪水发送者不会收到自己的消息，收到的别的数据直接丢掉
+        if(fds[1].revents & (POLLIN | POLLHUP | POLLERR))
+        {
+            ssize_t n = read(flooder, buf, sizeof(buf));
+            if(n == 0 || (n == -1 && errno != EAGAIN))
+            {
+                dropped = true;
+                break;
+            }
+        }
+
+        if((fds[0].revents & (POLLIN | POLLHUP | POLLERR)) && tokens >= 1)
+        {
+            ssize_t n = read(probe, buf, std::min<size_t>(sizeof(buf), (size_t)tokens));
+            if(n == 0 || (n == -1 && errno != EAGAIN))
+            {
+                std::cout << "probe disconnected, the server dropped it as a slow reader; lower -f or raise -r" << std::endl;
+                dropped = true;
+                break;
+            }
+            if(n > 0)
+            {
+                tokens -= n;
+                probeIn.append(buf, n);
+                size_t pos = 0, eol;
+                int64_t recvNs = nowNs();
+                while((eol = probeIn.find('\n', pos)) != std::string::npos)
+                {
+                    if(probeIn.compare(pos, 5, "pong ") == 0)
+                    {
+                        int64_t sentNs = strtoll(probeIn.c_str() + pos + 5, nullptr, 10);
+                        (sentNs < floodStart ? baseline : flooded).push_back(recvNs - sentNs);
+                        pongs++;
+                    }
+                    else
+                    {
+                        floodRecv++;
+                    }
+                    pos = eol + 1;
+                }
+                probeIn.erase(0, pos);
+            }
+        }
+    }
+
+    printf("flood:         %d KB/s in %d ms bursts of %d byte lines, slow reader at %d KB/s, rcvbuf %d, mss %d\n", floodKBps,
+           burstMs, lineSize, readKBps, rcvbuf, mss);
+    printf("delivered:     %llu of %llu flood lines to the slow reader, %llu of %llu pongs\n", (unsigned long long)floodRecv,
+           (unsigned long long)floodSent, (unsigned long long)pongs, (unsigned long long)pings);
+    printf("idle ping:     p50 %.2f ms, p99 %.2f ms (%zu samples)\n", percentile(baseline, 0.5) / 1e6, percentile(baseline, 0.99) / 1e6, baseline.size());
+    printf("flooded ping:  p50 %.2f ms, p99 %.2f ms, max %.2f ms (%zu samples)\n", percentile(flooded, 0.5) / 1e6, percentile(flooded, 0.99) / 1e6,
+           percentile(flooded, 1.0) / 1e6, flooded.size());
+    close(probe);
+    close(flooder);
+    return dropped ? 1 : 0;
+}
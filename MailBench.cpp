@@ -0,0 +1,168 @@
+//离线信箱压测：注册大量昵称，每个信箱存几条消息，统计注册表和排队消息占的内存、落盘后的文件大小，
+//以及事件循环线程存一条消息的耗时(不碰磁盘)；最后把所有信箱取空，检查条数和顺序，统计从磁盘读回的吞吐
+#include"MailStore.h"
+#include"BenchUtil.h"
+
+#include<poll.h>
+#include<time.h>
+#include<stdio.h>
+#include<stdlib.h>
+#include<unistd.h>
+#include<iostream>
+#include<string>
+#include<vector>
+
+static std::string nickOf(size_t i)
+{
+    return "user" + std::to_string(i);
+}
+
+//和服务端存进信箱的格式一样：mail <时间> <发送者>><内容>，内容里带上第几条，取回时检查顺序
+static std::string mailLine(size_t box, size_t index, size_t size)
+{
+    std::string line = "mail 1760000000 sender" + std::to_string(box % 977) + ">#" + std::to_string(index) + " ";
+    if(line.size() + 1 < size)
+        line.append(size - 1 - line.size(), 'x');
+    line.push_back('\n');
+    return line;
+}
+
+static void usage(const char* prog)
+{
+    std::cout << "Usage: " << prog << " [-n mailboxes] [-m messages_per_box] [-s message_size] [-b budget_mb] [-d dir]" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+    size_t boxes = 100000;
+    size_t perBox = 5;
+    size_t size = 120;
+    size_t budgetMb = MAIL_MEMORY_BUDGET >> 20;
+    std::string dir = "/tmp/mailbench";
+
+    int opt;
+    while((opt = getopt(argc, argv, "n:m:s:b:d:h")) != -1)
+    {
+        switch(opt)
+        {
+            case 'n': boxes = strtoull(optarg, nullptr, 10); break;
+            case 'm': perBox = strtoull(optarg, nullptr, 10); break;
+            case 's': size = strtoull(optarg, nullptr, 10); break;
+            case 'b': budgetMb = strtoull(optarg, nullptr, 10); break;
+            case 'd': dir = optarg; break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if(boxes == 0 || perBox == 0 || perBox > MAIL_BOX_MAX || size < 40 || budgetMb == 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    MailStore store;
+    if(!store.start(dir, budgetMb << 20))
+    {
+        std::cout << "open mail store in " << dir << " failure" << std::endl;
+        return 1;
+    }
+
+    double rss0 = rssMb();
+    int64_t start = nowNs();
+    for(size_t i = 0; i < boxes; i++)
+        store.enroll(nickOf(i), "secret" + std::to_string(i));
+    int64_t enrollNs = nowNs() - start;
+    double rss1 = rssMb();
+
+    //一轮给每个信箱存一条，模拟很多人都离线时的私信
+    std::vector<std::string> nicks;
+    nicks.reserve(boxes);
+    for(size_t i = 0; i < boxes; i++)
+        nicks.push_back(nickOf(i));
+    size_t refused = 0;
+    uint64_t bytes = 0;
+    int64_t depositNs = 0;
+    for(size_t j = 0; j < perBox; j++)
+    {
+        for(size_t i = 0; i < boxes; i++)
+        {
+            std::string line = mailLine(i, j, size);
+            int64_t t = nowNs();
+            int rc = store.deposit(nicks[i], line);
+            depositNs += nowNs() - t;
+            if(rc == 1)
+            {
+                bytes += line.size();
+                continue;
+            }
+            //后台线程跟不上时等它写一会儿再重试，和服务端回复稍后重试一样
+            refused++;
+            usleep(1000);
+            i--;
+        }
+    }
+    int64_t filled = nowNs();
+    while(store.queuedBytes() > 0)
+        usleep(1000);
+    int64_t flushed = nowNs();
+    double rss2 = rssMb();
+
+    size_t messages = boxes * perBox;
+    printf("mailboxes:     %zu registered in %.1f ms, registry %.1f MB RSS (%.0f bytes/box)\n", boxes, enrollNs / 1e6, rss1 - rss0,
+           (rss1 - rss0) * 1e6 / boxes);
+    printf("messages:      %zu x %zu bytes = %.1f MB, deposit %.0f ns/msg on the loop thread, %zu deferred by a full writer\n",
+           messages, size, bytes / 1e6, (double)depositNs / messages, refused);
+    printf("memory:        %.1f MB queued in memory (budget %zu MB), %.1f MB RSS growth for messages\n", store.memoryBytes() / 1e6,
+           budgetMb, rss2 - rss1);
+    printf("disk:          %.1f MB spilled, log %.1f MB (%.1f bytes/message with block headers), writer drained %.1f ms after the last deposit\n",
+           store.spilledBytes() / 1e6, store.diskBytes() / 1e6,
+           store.spilledBytes() ? (double)store.diskBytes() / (store.spilledBytes() / size) : 0, (flushed - filled) / 1e6);
+
+    //把所有信箱取空：在磁盘上的先请后台线程读回，等通知再取
+    start = nowNs();
+    std::vector<size_t> next(boxes, 0);
+    std::vector<size_t> waiting;
+    size_t delivered = 0, misordered = 0, loads = 0;
+    std::string out;
+    for(size_t i = 0; i < boxes; i++)
+        waiting.push_back(i);
+    while(!waiting.empty())
+    {
+        std::vector<size_t> again;
+        for(size_t i : waiting)
+        {
+            int rc;
+            while((rc = store.collect(nicks[i], MAIL_BATCH_BYTES, out)) == 1)
+            {
+                size_t pos = 0;
+                while(pos < out.size())
+                {
+                    size_t hash = out.find('#', pos);
+                    if(strtoull(out.c_str() + hash + 1, nullptr, 10) != next[i]++)
+                        misordered++;
+                    pos = out.find('\n', pos) + 1;
+                    delivered++;
+                }
+                out.clear();
+            }
+            if(rc == 0)
+                again.push_back(i);
+        }
+        if(loads == 0)
+            loads = again.size(); //第一遍取不到的就是有块在磁盘上的信箱
+        waiting.swap(again);
+        if(!waiting.empty())
+        {
+            pollfd pfd = {store.notifyFd(), POLLIN, 0};
+            poll(&pfd, 1, 1000);
+            store.takeLoaded();
+        }
+    }
+    int64_t drainNs = nowNs() - start;
+
+    printf("drain:         %zu of %zu messages in %.1f ms (%.0f msg/s), %zu boxes read back from disk, %zu out of order, %llu lost\n", delivered, messages,
+           drainNs / 1e6, delivered / (drainNs / 1e9), loads, misordered, (unsigned long long)store.lost());
+    printf("after drain:   %.1f MB in memory, log %.1f MB\n", store.memoryBytes() / 1e6, store.diskBytes() / 1e6);
+    return delivered == messages && misordered == 0 ? 0 : 1;
+}
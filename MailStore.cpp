@@ -0,0 +1,522 @@
+#include"MailStore.h"
+
+#include<sys/stat.h>
+#include<sys/eventfd.h>
+#include<sys/random.h>
+#include<fcntl.h>
+#include<unistd.h>
+#include<errno.h>
+#include<stdio.h>
+#include<string.h>
+#include<time.h>
+#include<algorithm>
+
+#define MAIL_NO_BLOCK  UINT64_MAX
+#define MAIL_WRITE_MAX (1024 * 1024) //整理时攒够这么多就写一次
+
+MailStore::MailStore()
+    : m_salt(0),
+      m_budget(MAIL_MEMORY_BUDGET),
+      m_memBytes(0),
+      m_lost(0),
+      m_notifyFd(-1),
+      m_queuedBytes(0),
+      m_diskBytes(0),
+      m_spilledBytes(0),
+      m_stop(false),
+      m_logFd(-1),
+      m_logEnd(0),
+      m_liveBytes(0)
+{
+}
+
+MailStore::~MailStore()
+{
+    if(m_worker.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_cond.notify_one();
+        m_worker.join();
+    }
+    if(m_notifyFd != -1)
+        close(m_notifyFd);
+    if(m_logFd != -1)
+        close(m_logFd);
+}
+
+bool MailStore::start(const std::string& dir, size_t memoryBudget)
+{
+    if(mkdir(dir.c_str(), 0755) == -1 && errno != EEXIST)
+        return false;
+    m_dir = dir;
+    m_logFd = open((dir + "/" MAIL_LOG_NAME).c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if(m_logFd == -1)
+        return false;
+    m_notifyFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(m_notifyFd == -1)
+        return false;
+
+    if(getrandom(&m_salt, sizeof(m_salt), 0) != sizeof(m_salt))
+        m_salt = ((uint64_t)rand() << 32) ^ rand() ^ time(nullptr);
+    m_budget = memoryBudget;
+    m_worker = std::thread(&MailStore::workerLoop, this);
+    return true;
+}
+
+MailStore::Box* MailStore::find(std::string_view nick)
+{
+    auto it = m_ids.find(nick);
+    return it == m_ids.end() ? nullptr : &m_boxes[it->second];
+}
+
+uint64_t MailStore::hashSecret(std::string_view password)
+{
+    //加盐的FNV-1a，只是不在内存里留明文，不是安全的口令存储
+    uint64_t h = 14695981039346656037ull ^ m_salt;
+    for(unsigned char c : password)
+    {
+        h ^= c;
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+int MailStore::enroll(std::string_view nick, std::string_view password)
+{
+    if(m_ids.find(nick) != m_ids.end())
+        return 0;
+    if(m_boxes.size() >= MAIL_BOXES_MAX)
+        return -1;
+    m_ids.emplace(nick, (uint32_t)m_boxes.size());
+    m_boxes.push_back(Box{hashSecret(password), 0, 0, false, false, std::string()});
+    return 1;
+}
+
+bool MailStore::isRegistered(std::string_view nick)
+{
+    return find(nick) != nullptr;
+}
+
+bool MailStore::verify(std::string_view nick, std::string_view password)
+{
+    Box* box = find(nick);
+    return box && box->secret == hashSecret(password);
+}
+
+int MailStore::deposit(std::string_view nick, std::string_view line)
+{
+    Box* box = find(nick);
+    if(!box || box->memCount + box->diskCount >= MAIL_BOX_MAX)
+        return 0;
+
+    //后台线程写不过来时内存里最多攒到预算的两倍，再多就拒收
+    size_t queued;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        queued = m_queuedBytes;
+    }
+    if(m_memBytes + queued >= 2 * m_budget)
+        return -1;
+
+    queueSpill(box - m_boxes.data());
+    box->pending.append(line);
+    box->memCount++;
+    m_memBytes += line.size();
+    if(m_memBytes > m_budget)
+        spill();
+    return 1;
+}
+
+uint32_t MailStore::count(std::string_view nick)
+{
+    Box* box = find(nick);
+    return box ? box->memCount + box->diskCount : 0;
+}
+
+bool MailStore::hasMail(std::string_view nick)
+{
+    Box* box = find(nick);
+    return box && (box->memCount + box->diskCount > 0 || box->loading);
+}
+
+int MailStore::collect(std::string_view nick, size_t max, std::string& out)
+{
+    Box* box = find(nick);
+    if(!box)
+        return -1;
+    if(box->loading)
+        return 0;
+    if(box->diskCount > 0) //磁盘上的比内存里的旧，先读回来放到前面
+    {
+        box->loading = true;
+        submit(Job{(uint32_t)(box - m_boxes.data()), 0, std::string()});
+        return 0;
+    }
+    if(box->pending.empty())
+        return -1;
+
+    size_t end = 0;
+    uint32_t lines = 0;
+    while(end < box->pending.size())
+    {
+        size_t next = box->pending.find('\n', end) + 1;
+        if(end > 0 && next > max)
+            break;
+        end = next;
+        lines++;
+    }
+    out.append(box->pending, 0, end);
+    box->memCount -= lines;
+    m_memBytes -= end;
+    if(end == box->pending.size())
+        std::string().swap(box->pending); //取空了就把容量也还回去
+    else
+        box->pending.erase(0, end);
+    return 1;
+}
+
+int MailStore::notifyFd()
+{
+    return m_notifyFd;
+}
+
+void MailStore::takeLoaded()
+{
+    uint64_t count;
+    while(read(m_notifyFd, &count, sizeof(count)) == -1 && errno == EINTR)
+        ;
+
+    std::vector<Loaded> loaded;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        loaded.swap(m_loaded);
+    }
+    for(Loaded& item : loaded)
+    {
+        //读回期间这个信箱没有再落盘，磁盘上的就是全部；少了的是写坏或者读坏的块
+        Box& box = m_boxes[item.box];
+        if(item.count < box.diskCount)
+            m_lost += box.diskCount - item.count;
+        box.diskCount = 0;
+        box.loading = false;
+        if(item.lines.empty())
+            continue;
+        queueSpill(item.box);
+        box.pending.insert(0, item.lines);
+        box.memCount += item.count;
+        m_memBytes += item.lines.size();
+    }
+    if(m_memBytes > m_budget)
+        spill();
+}
+
+void MailStore::queueSpill(uint32_t id)
+{
+    //取空又收到新消息的信箱还在原来的位置上，不再排一次：没有落盘的服务端里队列不会随着收发越来越长
+    if(m_boxes[id].queued)
+        return;
+    m_boxes[id].queued = true;
+    m_spillOrder.push_back(id);
+}
+
+void MailStore::spill()
+{
+    //降到预算的3/4再停，每次交出去的块大一些，后台线程合并成一次写
+    std::vector<Job> jobs;
+    while(m_memBytes > m_budget / 4 * 3 && !m_spillOrder.empty())
+    {
+        uint32_t id = m_spillOrder.front();
+        m_spillOrder.pop_front();
+        Box& box = m_boxes[id];
+        box.queued = false;
+        if(box.loading || box.pending.empty())
+            continue;
+        m_memBytes -= box.pending.size();
+        box.diskCount += box.memCount;
+        jobs.push_back(Job{id, box.memCount, std::move(box.pending)});
+        box.memCount = 0;
+        box.pending = std::string();
+    }
+    if(jobs.empty())
+        return;
+
+    bool wake;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        wake = m_jobs.empty(); //队列不空说明后台线程还没取走上一批，不用再唤醒
+        for(Job& job : jobs)
+        {
+            m_queuedBytes += job.lines.size();
+            m_jobs.push_back(std::move(job));
+        }
+    }
+    if(wake)
+        m_cond.notify_one();
+}
+
+void MailStore::submit(Job job)
+{
+    bool wake;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        wake = m_jobs.empty();
+        m_jobs.push_back(std::move(job));
+    }
+    if(wake)
+        m_cond.notify_one();
+}
+
+size_t MailStore::boxes()
+{
+    return m_boxes.size();
+}
+
+size_t MailStore::memoryBytes()
+{
+    return m_memBytes;
+}
+
+uint64_t MailStore::diskBytes()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_diskBytes;
+}
+
+size_t MailStore::queuedBytes()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_queuedBytes;
+}
+
+uint64_t MailStore::spilledBytes()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_spilledBytes;
+}
+
+uint64_t MailStore::lost()
+{
+    return m_lost;
+}
+
+void MailStore::workerLoop()
+{
+    std::vector<Job> jobs;
+    std::vector<Loaded> loaded;
+    std::string out; //这一批要追加的块
+    while(true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cond.wait(lock, [this] { return m_stop || !m_jobs.empty(); });
+            if(m_jobs.empty()) //退出前把队列处理完
+                break;
+            jobs.swap(m_jobs);
+        }
+
+        size_t written = 0;
+        for(Job& job : jobs)
+        {
+            if(job.count > 0)
+            {
+                queueBlock(out, job.box, job.count, job.lines);
+                written += job.lines.size();
+                continue;
+            }
+
+            //读回之前先把攒着的块写出去，链上才有它们
+            appendBlocks(out);
+            Loaded result{job.box, 0, std::string()};
+            if(job.box < m_heads.size() && m_heads[job.box] != MAIL_NO_BLOCK)
+            {
+                readChain(m_heads[job.box], result.lines, &result.count);
+                m_heads[job.box] = MAIL_NO_BLOCK;
+            }
+            loaded.push_back(std::move(result));
+        }
+        appendBlocks(out);
+        jobs.clear();
+
+        //全都取走了就直接截断，否则垃圾多于有效数据时整理一次
+        if(m_liveBytes == 0 && m_logEnd > 0)
+        {
+            if(ftruncate(m_logFd, 0) == 0)
+                m_logEnd = 0;
+        }
+        else if(m_logEnd > MAIL_COMPACT_MIN && m_logEnd - m_liveBytes > m_liveBytes)
+        {
+            compact();
+        }
+
+        bool notify;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_queuedBytes -= written;
+            m_spilledBytes += written;
+            m_diskBytes = m_logEnd;
+            notify = !loaded.empty() && m_loaded.empty(); //事件循环还没取走上次的结果时不用再通知
+            for(Loaded& item : loaded)
+                m_loaded.push_back(std::move(item));
+        }
+        loaded.clear();
+
+        uint64_t one = 1;
+        if(notify)
+        {
+            while(write(m_notifyFd, &one, sizeof(one)) == -1 && errno == EINTR)
+                ;
+        }
+    }
+}
+
+void MailStore::queueBlock(std::string& out, uint32_t box, uint32_t count, const std::string& lines)
+{
+    if(box >= m_heads.size())
+        m_heads.resize(box + 1, MAIL_NO_BLOCK);
+    BlockHeader header{box, count, (uint32_t)lines.size(), 0, m_heads[box]};
+    m_heads[box] = m_logEnd + out.size();
+    out.append((const char*)&header, sizeof(header));
+    out.append(lines);
+}
+
+bool MailStore::appendBlocks(std::string& out)
+{
+    if(out.empty())
+        return true;
+
+    size_t done = 0;
+    while(done < out.size())
+    {
+        ssize_t n = pwrite(m_logFd, out.data() + done, out.size() - done, m_logEnd + done);
+        if(n == -1 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            break;
+        done += n;
+    }
+
+    if(done < out.size())
+    {
+        //写失败的块不算数：指向它们的链头退回到上一个块，截掉写了一半的尾巴
+        size_t pos = 0;
+        while(pos < out.size())
+        {
+            BlockHeader header;
+            memcpy(&header, out.data() + pos, sizeof(header));
+            m_heads[header.box] = header.prev;
+            pos += sizeof(header) + header.bytes;
+        }
+        if(ftruncate(m_logFd, m_logEnd) == -1)
+            perror("mail log truncate");
+        out.clear();
+        return false;
+    }
+
+    m_logEnd += out.size();
+    m_liveBytes += out.size();
+    out.clear();
+    return true;
+}
+
+bool MailStore::readChain(uint64_t head, std::string& lines, uint32_t* count)
+{
+    //链是从新到旧的，先把块头都读出来，再按从旧到新的顺序读消息
+    std::vector<std::pair<uint64_t, BlockHeader>> blocks;
+    bool ok = true;
+    for(uint64_t offset = head; offset != MAIL_NO_BLOCK;)
+    {
+        BlockHeader header;
+        if(offset + sizeof(header) > m_logEnd || pread(m_logFd, &header, sizeof(header), offset) != (ssize_t)sizeof(header) ||
+           offset + sizeof(header) + header.bytes > m_logEnd || header.prev == offset)
+        {
+            ok = false;
+            break;
+        }
+        blocks.emplace_back(offset, header);
+        offset = header.prev;
+    }
+
+    *count = 0;
+    for(auto it = blocks.rbegin(); it != blocks.rend(); ++it)
+    {
+        size_t size = lines.size();
+        lines.resize(size + it->second.bytes);
+        if(pread(m_logFd, lines.data() + size, it->second.bytes, it->first + sizeof(BlockHeader)) != (ssize_t)it->second.bytes)
+        {
+            lines.resize(size);
+            ok = false;
+            continue;
+        }
+        *count += it->second.count;
+        m_liveBytes -= std::min<uint64_t>(m_liveBytes, sizeof(BlockHeader) + it->second.bytes);
+    }
+    return ok;
+}
+
+void MailStore::compact()
+{
+    std::string path = m_dir + "/" MAIL_LOG_NAME;
+    std::string tmpPath = path + ".tmp";
+    int fd = open(tmpPath.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if(fd == -1)
+        return;
+
+    //每个信箱的所有块合并成一个，按信箱号顺序写进新文件
+    std::vector<uint64_t> heads(m_heads.size(), MAIL_NO_BLOCK);
+    std::string out, lines;
+    uint64_t end = 0;
+    bool ok = true;
+    for(uint32_t box = 0; box < m_heads.size() && ok; box++)
+    {
+        if(m_heads[box] == MAIL_NO_BLOCK)
+            continue;
+        uint32_t count = 0;
+        lines.clear();
+        readChain(m_heads[box], lines, &count);
+        if(count == 0)
+            continue;
+        heads[box] = end + out.size();
+        BlockHeader header{box, count, (uint32_t)lines.size(), 0, MAIL_NO_BLOCK};
+        out.append((const char*)&header, sizeof(header));
+        out.append(lines);
+        if(out.size() >= MAIL_WRITE_MAX)
+        {
+            ok = pwrite(fd, out.data(), out.size(), end) == (ssize_t)out.size();
+            end += out.size();
+            out.clear();
+        }
+    }
+    if(ok && !out.empty())
+    {
+        ok = pwrite(fd, out.data(), out.size(), end) == (ssize_t)out.size();
+        end += out.size();
+    }
+
+    //readChain已经把旧块记成取走了，失败时旧文件原样保留，重新按旧文件算有效数据
+    if(!ok || rename(tmpPath.c_str(), path.c_str()) == -1)
+    {
+        close(fd);
+        unlink(tmpPath.c_str());
+        m_liveBytes = 0;
+        for(uint64_t head : m_heads)
+        {
+            for(uint64_t offset = head; offset != MAIL_NO_BLOCK;)
+            {
+                BlockHeader header;
+                if(pread(m_logFd, &header, sizeof(header), offset) != (ssize_t)sizeof(header))
+                    break;
+                m_liveBytes += sizeof(header) + header.bytes;
+                offset = header.prev;
+            }
+        }
+        return;
+    }
+    close(m_logFd);
+    m_logFd = fd;
+    m_logEnd = end;
+    m_liveBytes = end;
+    m_heads.swap(heads);
+}
@@ -0,0 +1,139 @@
+#ifndef MAILSTORE_H
+#define MAILSTORE_H
+
+#include<stdint.h>
+#include<stddef.h>
+#include<string>
+#include<string_view>
+#include<vector>
+#include<unordered_map>
+#include<thread>
+#include<mutex>
+#include<condition_variable>
+#include"RingQueue.h"
+
+//离线信箱：注册过的昵称不在线时，发给它的私信存进信箱，登录后分批补发。
+//信箱里的消息先排在内存里，所有信箱加起来超过内存预算时，按变成非空的先后把整个信箱交给后台线程追加到磁盘上的日志文件。
+//日志里每次落盘是一个块，块头记着同一个信箱上一个块的位置，取信时由后台线程顺着链读回来，再交给事件循环发出去。
+//事件循环线程只在内存里排队、交接，不碰文件。
+#define MAIL_MEMORY_BUDGET  (8 * 1024 * 1024) //内存里排队的消息超过它就开始落盘
+#define MAIL_BOX_MAX        1000     //每个信箱最多存多少条，满了拒收
+#define MAIL_BOXES_MAX      (1 << 20) //最多注册多少个昵称
+#define MAIL_NICK_MAX       32       //能注册的昵称长度，不能有空白
+#define MAIL_BATCH_BYTES    (16 * 1024) //补发时每批的大小，接收者的发送队列低于它才发下一批
+#define MAIL_COMPACT_MIN    (64 * 1024 * 1024) //日志超过这个大小、并且已经取走的部分多于还在的部分时整理一次
+#define MAIL_LOG_NAME       "mail.log"
+
+class MailStore final
+{
+    public:
+        MailStore();
+        ~MailStore(); //写完队列里剩下的块后退出后台线程
+        MailStore(const MailStore&) = delete;
+        MailStore& operator=(const MailStore&) = delete;
+
+        //目录不存在时创建；日志每次启动清空(注册表只在内存里，重启后信箱都不存在了)，然后启动后台线程
+        bool start(const std::string& dir, size_t memoryBudget = MAIL_MEMORY_BUDGET);
+
+        //以下在事件循环线程调用
+        int  enroll(std::string_view nick, std::string_view password); //1成功 0已经被注册 -1注册数已满
+        bool isRegistered(std::string_view nick);
+        bool verify(std::string_view nick, std::string_view password);
+        int  deposit(std::string_view nick, std::string_view line); //line以换行结尾；1存下 0信箱满了 -1内存和落盘都跟不上
+        uint32_t count(std::string_view nick); //信箱里还有多少条(内存加磁盘)
+        bool hasMail(std::string_view nick); //还有没取走的消息，或者正在从磁盘读回
+        //取出信箱最前面不超过max字节的整行(至少一行)追加到out：1取到 0要先从磁盘读回，读完后notifyFd可读 -1空了
+        int  collect(std::string_view nick, size_t max, std::string& out);
+        int  notifyFd(); //有信箱从磁盘读回时可读
+        void takeLoaded(); //把读回的消息放回信箱最前面，之后collect能取到
+
+        size_t   boxes(); //注册的信箱数
+        size_t   memoryBytes(); //内存里排队的消息字节数
+        uint64_t diskBytes(); //日志文件的大小
+        size_t   queuedBytes(); //交给后台线程还没写完的字节数
+        uint64_t spilledBytes(); //累计落盘的消息字节数
+        uint64_t lost(); //写日志或者读回失败丢掉的消息数
+
+    private:
+        struct Box
+        {
+            uint64_t    secret; //口令的哈希
+            uint32_t    memCount; //pending里的行数
+            uint32_t    diskCount; //落盘还没读回的行数
+            bool        loading; //已经请后台线程读回，结果到达前不再落盘，保证顺序
+            bool        queued; //在m_spillOrder里，每个信箱最多排一次
+            std::string pending; //内存里排队的消息，一行一条
+        };
+
+        //日志里的块：块头之后是bytes字节的消息
+        struct BlockHeader
+        {
+            uint32_t box;
+            uint32_t count;
+            uint32_t bytes;
+            uint32_t reserved;
+            uint64_t prev; //同一个信箱的上一个块，MAIL_NO_BLOCK表示没有
+        };
+
+        struct Job
+        {
+            uint32_t    box;
+            uint32_t    count; //为0表示读回
+            std::string lines;
+        };
+
+        struct Loaded
+        {
+            uint32_t    box;
+            uint32_t    count;
+            std::string lines;
+        };
+
+        //注册表支持用string_view查找
+        struct NickHash
+        {
+            using is_transparent = void;
+            size_t operator()(std::string_view s) const { return std::hash<std::string_view>()(s); }
+        };
+
+        Box*     find(std::string_view nick);
+        uint64_t hashSecret(std::string_view password);
+        void     queueSpill(uint32_t id); //信箱有了消息，排进落盘顺序
+        void     spill(); //超过内存预算时把最早变成非空的信箱交给后台线程
+        void     submit(Job job);
+
+        //以下只在后台线程调用
+        void workerLoop();
+        bool appendBlocks(std::string& out); //攒好的块一次写到日志末尾
+        void queueBlock(std::string& out, uint32_t box, uint32_t count, const std::string& lines);
+        bool readChain(uint64_t head, std::string& lines, uint32_t* count); //顺着链读回一个信箱的全部块，按时间顺序拼好
+        void compact(); //把还在的块按信箱合并写进新文件，替换旧的日志
+
+    private:
+        std::string                                                      m_dir;
+        uint64_t                                                         m_salt;
+        size_t                                                           m_budget;
+        std::unordered_map<std::string, uint32_t, NickHash, std::equal_to<>> m_ids; //昵称 -> 信箱号
+        std::vector<Box>                                                 m_boxes;
+        size_t                                                           m_memBytes;
+        uint64_t                                                         m_lost;
+        RingQueue<uint32_t>                                              m_spillOrder; //信箱按变成非空的先后排队，可能已经空了；每个信箱最多一项
+
+        int                                                              m_notifyFd;
+        std::thread                                                      m_worker;
+        std::mutex                                                       m_mutex; //保护下面的队列和计数
+        std::condition_variable                                          m_cond;
+        std::vector<Job>                                                 m_jobs;
+        std::vector<Loaded>                                              m_loaded;
+        size_t                                                           m_queuedBytes; //交给后台线程还没写完的字节数
+        uint64_t                                                         m_diskBytes;
+        uint64_t                                                         m_spilledBytes;
+        bool                                                             m_stop;
+
+        int                                                              m_logFd; //以下只在后台线程访问
+        uint64_t                                                         m_logEnd;
+        uint64_t                                                         m_liveBytes; //还没读回的块(含块头)的字节数
+        std::vector<uint64_t>                                            m_heads; //信箱号 -> 最新的块
+};
+
+#endif //MAILSTORE_H
@@ -0,0 +1,145 @@
+#include"PatternMatcher.h"
+
+#include<string.h>
+#include<deque>
+
+PatternMatcher::PatternMatcher()
+    : m_dirty(false)
+{
+    build(); //空的自动机：只有根，所有字节都回到根
+}
+
+int PatternMatcher::add(std::string_view pattern)
+{
+    std::string key(pattern);
+    for(char& c : key)
+        c = lower(c);
+
+    auto it = m_ids.find(key);
+    if(it != m_ids.end())
+    {
+        m_refs[it->second]++;
+        return it->second;
+    }
+
+    int id;
+    if(!m_freeIds.empty())
+    {
+        id = m_freeIds.back();
+        m_freeIds.pop_back();
+        m_patterns[id] = key;
+        m_refs[id] = 1;
+    }
+    else
+    {
+        id = m_patterns.size();
+        m_patterns.push_back(key);
+        m_refs.push_back(1);
+    }
+    m_ids.emplace(std::move(key), id);
+    m_dirty = true;
+    return id;
+}
+
+void PatternMatcher::remove(int id)
+{
+    if(--m_refs[id] > 0)
+        return;
+
+    m_ids.erase(m_patterns[id]);
+    m_patterns[id].clear();
+    m_freeIds.push_back(id);
+    m_dirty = true;
+}
+
+int PatternMatcher::find(std::string_view pattern)
+{
+    std::string key(pattern);
+    for(char& c : key)
+        c = lower(c);
+
+    auto it = m_ids.find(key);
+    return it == m_ids.end() ? -1 : it->second;
+}
+
+const std::string& PatternMatcher::pattern(int id)
+{
+    return m_patterns[id];
+}
+
+size_t PatternMatcher::capacity()
+{
+    return m_patterns.size();
+}
+
+void PatternMatcher::build()
+{
+    //关键词里出现过的每种字节一列，列0给其余所有字节
+    memset(m_class, 0, sizeof(m_class));
+    m_classes = 1;
+    for(const std::string& pattern : m_patterns)
+    {
+        for(unsigned char c : pattern)
+        {
+            if(!m_class[c])
+                m_class[c] = m_classes++;
+        }
+    }
+    for(int c = 'A'; c <= 'Z'; c++)
+        m_class[c] = m_class[c + ('a' - 'A')];
+
+    //字典树直接建在转移表上，-1表示没有这条边
+    m_delta.assign(m_classes, -1);
+    m_pattern.assign(1, -1);
+    for(size_t id = 0; id < m_patterns.size(); id++)
+    {
+        int state = 0;
+        for(unsigned char c : m_patterns[id])
+        {
+            int32_t& next = m_delta[state * m_classes + m_class[c]];
+            if(next < 0)
+            {
+                next = m_pattern.size();
+                m_pattern.push_back(-1);
+                m_delta.resize(m_delta.size() + m_classes, -1); //会使next失效，放在赋值之后
+            }
+            state = m_delta[state * m_classes + m_class[c]];
+        }
+        if(!m_patterns[id].empty())
+            m_pattern[state] = id;
+    }
+
+    //按层遍历：没有的边指向失配状态的同一条边，有的边的目标状态的失配指针就是失配状态的同一条边
+    int states = m_pattern.size();
+    std::vector<int> fail(states, 0);
+    m_output.assign(states, -1);
+    std::deque<int> queue;
+    for(int c = 0; c < m_classes; c++)
+    {
+        int32_t& next = m_delta[c];
+        if(next < 0)
+            next = 0;
+        else
+            queue.push_back(next);
+    }
+    while(!queue.empty())
+    {
+        int state = queue.front();
+        queue.pop_front();
+        int32_t* row = &m_delta[state * m_classes];
+        const int32_t* failRow = &m_delta[fail[state] * m_classes];
+        for(int c = 0; c < m_classes; c++)
+        {
+            if(row[c] < 0)
+            {
+                row[c] = failRow[c];
+                continue;
+            }
+            int next = row[c];
+            fail[next] = failRow[c];
+            m_output[next] = m_pattern[fail[next]] >= 0 ? fail[next] : m_output[fail[next]];
+            queue.push_back(next);
+        }
+    }
+    m_dirty = false;
+}
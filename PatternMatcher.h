@@ -0,0 +1,74 @@
+#ifndef PATTERNMATCHER_H
+#define PATTERNMATCHER_H
+
+#include<stdint.h>
+#include<stddef.h>
+#include<string>
+#include<string_view>
+#include<vector>
+#include<unordered_map>
+
+//多模式匹配(Aho-Corasick)：所有订阅的关键词编进一个自动机，消息只扫描一遍。
+//失配链在建的时候就展开成完整的状态转移表，扫描时每个字节只查一次表，开销和关键词个数无关，
+//命中多少个关键词就回调多少次。表的列是关键词里出现过的字节种类，其余字节共用一列，表的大小和关键词总长成正比。
+//关键词按引用计数共享，已有的关键词再被订阅或者退订后还有人订阅时不用重建；
+//关键词集合变化时只标记一下，下次扫描前重建一次，连续的订阅变化只付一次重建的开销。
+//匹配不区分ASCII大小写。只在事件循环线程上使用。
+class PatternMatcher final
+{
+    public:
+        PatternMatcher();
+        ~PatternMatcher() = default;
+        PatternMatcher(const PatternMatcher&) = delete;
+        PatternMatcher& operator=(const PatternMatcher&) = delete;
+
+        int  add(std::string_view pattern); //返回关键词的id，相同的关键词(忽略大小写)id相同
+        void remove(int id); //引用计数减到0时关键词才真正删除，id以后会被复用
+        int  find(std::string_view pattern); //没有返回-1
+        const std::string& pattern(int id);
+        size_t capacity(); //id都小于这个值
+
+        //依次回调文本中命中的关键词id，同一个关键词出现几次回调几次
+        template<typename Func>
+        void scan(std::string_view text, Func f)
+        {
+            if(m_dirty)
+                build();
+
+            const int32_t* delta = m_delta.data();
+            int state = 0;
+            for(unsigned char c : text)
+            {
+                state = delta[state * m_classes + m_class[c]];
+                //报告以当前位置结尾的所有关键词：自己的，再沿着输出链找更短的
+                if(m_pattern[state] >= 0)
+                    f(m_pattern[state]);
+                for(int n = m_output[state]; n >= 0; n = m_output[n])
+                    f(m_pattern[n]);
+            }
+        }
+
+    private:
+        static unsigned char lower(unsigned char c)
+        {
+            return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+        }
+
+        void build(); //建字典树，按层计算失配指针并展开成状态转移表
+
+    private:
+        std::vector<std::string>             m_patterns; //id -> 小写的关键词，空串表示空闲
+        std::vector<int>                     m_refs;
+        std::vector<int>                     m_freeIds;
+        std::unordered_map<std::string, int> m_ids;
+        bool                                 m_dirty;
+
+        //自动机：状态0是根
+        uint8_t                              m_class[256]; //字节 -> 列，大小写映射到同一列
+        int                                  m_classes;
+        std::vector<int32_t>                 m_delta; //状态 * m_classes + 列 -> 下一个状态
+        std::vector<int>                     m_pattern; //状态 -> 以它结尾的关键词id，-1表示没有
+        std::vector<int>                     m_output; //状态 -> 失配链上(不含自己)第一个有关键词的状态，-1表示没有
+};
+
+#endif //PATTERNMATCHER_H
@@ -0,0 +1,461 @@
+//抓包回放工具：按抓包文件中的时间间隔(1x、Nx或者尽快)把流量重新打到服务端
+//每个抓到的连接对应一个模拟客户端，另外开一个观察者连接统计广播的到达延迟
+#include"Capture.h"
+#include"BenchUtil.h"
+
+#include<sys/socket.h>
+#include<netdb.h>
+#include<fcntl.h>
+#include<poll.h>
+#include<errno.h>
+#include<signal.h>
+#include<unistd.h>
+#include<time.h>
+#include<string.h>
+#include<stdlib.h>
+#include<iostream>
+#include<vector>
+#include<deque>
+#include<unordered_map>
+#include<algorithm>
+
+struct Record
+{
+    CaptureType type;
+    uint64_t    ts; //距抓包开始的纳秒数
+    int         fd;
+    std::string data;
+};
+
+static bool loadCapture(const char* path, std::vector<Record>& records)
+{
+    FILE* fp = fopen(path, "rb");
+    if(!fp)
+        return false;
+
+    std::string buf;
+    char chunk[65536];
+    size_t n;
+    while((n = fread(chunk, 1, sizeof(chunk), fp)) > 0)
+        buf.append(chunk, n);
+    fclose(fp);
+
+    if(buf.size() < CAPTURE_MAGIC_LEN || memcmp(buf.data(), CAPTURE_MAGIC, CAPTURE_MAGIC_LEN) != 0)
+        return false;
+
+    const uint8_t* p = (const uint8_t*)buf.data();
+    size_t pos = CAPTURE_MAGIC_LEN;
+    uint64_t ts = 0;
+    while(pos < buf.size())
+    {
+        Record rec;
+        uint64_t delta, fd, len;
+        size_t used;
+        rec.type = (CaptureType)p[pos++];
+        if(!(used = getVarint(p + pos, buf.size() - pos, &delta))) break;
+        pos += used;
+        if(!(used = getVarint(p + pos, buf.size() - pos, &fd))) break;
+        pos += used;
+        if(!(used = getVarint(p + pos, buf.size() - pos, &len))) break;
+        pos += used;
+        if(pos + len > buf.size()) //服务端被强杀时最后一条记录可能不完整
+            break;
+
+        ts += delta;
+        rec.ts = ts;
+        rec.fd = (int)fd;
+        rec.data.assign(buf.data() + pos, len);
+        pos += len;
+        if(rec.type == CAP_LINE) //补上换行就和socket上收到的字节一样
+        {
+            rec.type = CAP_DATA;
+            rec.data.push_back('\n');
+        }
+        records.push_back(std::move(rec));
+    }
+    return true;
+}
+
+static int connectServer(const char* host, int port)
+{
+    addrinfo hints, *servinfo;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    std::string portstr = std::to_string(port);
+    if(getaddrinfo(host, portstr.c_str(), &hints, &servinfo) != 0)
+        return -1;
+
+    int s = -1;
+    for(addrinfo* p = servinfo; p; p = p->ai_next)
+    {
+        if((s = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1)
+            continue;
+        if(connect(s, p->ai_addr, p->ai_addrlen) == 0)
+            break;
+        close(s);
+        s = -1;
+    }
+    freeaddrinfo(servinfo);
+    if(s != -1) //连上以后不再阻塞，服务端暂停读取时数据留在连接自己的发送缓冲区里
+        fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+    return s;
+}
+
+//一个模拟客户端
+struct Conn
+{
+    int         sock = -1;
+    std::string out; //服务端还没收下的数据
+    size_t      outPos = 0;
+    bool        lineStart = true; //下一个字节是一行的开头
+    bool        command = false;  //当前这一行是命令，不会被广播
+    std::string line;             //当前命令行已经收到的部分
+    std::string nick;             //回放出去的命令会把昵称改成什么
+    bool        broken = false;   //写出错，等pump关掉
+};
+
+class Replayer final
+{
+    public:
+        Replayer(const char* host, int port) : m_host(host), m_port(port), m_observer(-1), m_expectLines(0), m_seenLines(0) {}
+
+        bool run(const std::vector<Record>& records, double speed);
+        void report(const std::vector<Record>& records);
+
+    private:
+        void pump(int timeoutMs); //读走所有连接上的数据，写出积压的数据，观察者顺便统计延迟
+        bool flush(Conn& conn);   //尽量写出积压的数据，连接出错返回false
+        uint64_t chatLines(Conn& conn, const std::string& data); //数据里完整的聊天行数，命令行不算，顺便记下改名命令
+        bool pending() const;
+
+    private:
+        const char*                            m_host;
+        int                                    m_port;
+        int                                    m_observer;
+        std::unordered_map<int, Conn>          m_conns;   //抓包中的fd -> 模拟客户端
+        std::vector<Conn>                      m_closing; //抓包里已经关闭，积压的数据写完再关
+        std::deque<std::pair<uint64_t, int64_t>> m_inflight; //(广播完成时观察者应看到的行数, 发送时间)
+        uint64_t                               m_expectLines;
+        uint64_t                               m_seenLines;
+        std::vector<int64_t>                   m_latency;
+        uint64_t                               m_sentMsgs = 0;
+        uint64_t                               m_sentBytes = 0;
+        uint64_t                               m_failed = 0;
+        double                                 m_elapsed = 0;
+};
+
+bool Replayer::flush(Conn& conn)
+{
+    while(conn.outPos < conn.out.size())
+    {
+        ssize_t n = send(conn.sock, conn.out.data() + conn.outPos, conn.out.size() - conn.outPos, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+            return true;
+        if(n <= 0)
+            return false;
+        conn.outPos += n;
+        m_sentBytes += n;
+    }
+    conn.out.clear();
+    conn.outPos = 0;
+    return true;
+}
+
+uint64_t Replayer::chatLines(Conn& conn, const std::string& data)
+{
+    //抓到的一条记录可能是半行，也可能是好几行，按行首是不是'/'分别判断
+    uint64_t lines = 0;
+    size_t pos = 0;
+    while(pos < data.size())
+    {
+        if(conn.lineStart)
+        {
+            conn.command = data[pos] == '/';
+            conn.lineStart = false;
+        }
+        size_t end = data.find('\n', pos);
+        if(conn.command)
+            conn.line.append(data, pos, (end == std::string::npos ? data.size() : end) - pos);
+        if(end == std::string::npos)
+            break;
+        if(!conn.command)
+            lines++;
+        else if(conn.line.compare(0, 6, "/nick ") == 0)
+            conn.nick = conn.line.substr(6);
+        else if(conn.line.compare(0, 7, "/login ") == 0)
+            conn.nick = conn.line.substr(7, conn.line.find(' ', 7) - 7);
+        conn.line.clear();
+        conn.lineStart = true;
+        pos = end + 1;
+    }
+    return lines;
+}
+
+bool Replayer::pending() const
+{
+    if(!m_closing.empty())
+        return true;
+    for(const auto& conn : m_conns)
+        if(conn.second.outPos < conn.second.out.size())
+            return true;
+    return false;
+}
+
+void Replayer::pump(int timeoutMs)
+{
+    std::vector<pollfd> fds;
+    std::vector<Conn*> conns; //和fds[1..]一一对应
+    fds.push_back({m_observer, POLLIN, 0});
+    for(auto& conn : m_conns)
+    {
+        fds.push_back({conn.second.sock, (short)(conn.second.out.empty() ? POLLIN : POLLIN | POLLOUT), 0});
+        conns.push_back(&conn.second);
+    }
+    for(Conn& conn : m_closing)
+    {
+        fds.push_back({conn.sock, POLLIN | POLLOUT, 0});
+        conns.push_back(&conn);
+    }
+
+    if(poll(fds.data(), fds.size(), timeoutMs) <= 0)
+        return;
+
+    char buf[65536];
+    bool broken = false;
+    for(size_t i = 0; i < fds.size(); i++)
+    {
+        pollfd& pfd = fds[i];
+        if(i > 0 && (pfd.revents & (POLLOUT | POLLHUP | POLLERR)) && !flush(*conns[i - 1]))
+        {
+            conns[i - 1]->broken = true;
+            broken = true;
+            m_failed++;
+        }
+        if(!(pfd.revents & (POLLIN | POLLHUP | POLLERR)))
+            continue;
+        ssize_t n = recv(pfd.fd, buf, sizeof(buf), MSG_DONTWAIT);
+        if(n <= 0 || pfd.fd != m_observer)
+            continue;
+
+        int64_t now = nowNs();
+        m_seenLines += std::count(buf, buf + n, '\n');
+        while(!m_inflight.empty() && m_inflight.front().first <= m_seenLines)
+        {
+            m_latency.push_back(now - m_inflight.front().second);
+            m_inflight.pop_front();
+        }
+    }
+
+    //抓包里已经关闭的连接写完就关掉，出错的连接也关掉，之后发给它的记录算失败
+    for(size_t i = 0; i < m_closing.size();)
+    {
+        if(!m_closing[i].out.empty() && !m_closing[i].broken)
+        {
+            i++;
+            continue;
+        }
+        close(m_closing[i].sock);
+        m_closing[i] = std::move(m_closing.back());
+        m_closing.pop_back();
+    }
+    if(!broken)
+        return;
+    for(auto it = m_conns.begin(); it != m_conns.end();)
+    {
+        if(it->second.broken)
+        {
+            close(it->second.sock);
+            it = m_conns.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
+
+bool Replayer::run(const std::vector<Record>& records, double speed)
+{
+    m_observer = connectServer(m_host, m_port);
+    if(m_observer == -1)
+    {
+        std::cout << "connect observer failure" << std::endl;
+        return false;
+    }
+    pump(200); //丢掉欢迎语
+    m_seenLines = 0;
+
+    int64_t start = nowNs();
+    for(const Record& rec : records)
+    {
+        if(speed > 0) //按原始间隔的1/speed等待，等待期间继续收数据
+        {
+            int64_t due = start + (int64_t)(rec.ts / speed);
+            int64_t now;
+            while((now = nowNs()) < due)
+                pump((int)std::max<int64_t>((due - now) / 1000000, 0));
+        }
+        else
+        {
+            pump(0); //尽快回放，只顺手读一下防止服务端发送缓冲区被写满
+        }
+
+        auto it = m_conns.find(rec.fd);
+        switch(rec.type)
+        {
+            case CAP_OPEN:
+            {
+                if(it != m_conns.end()) //关闭记录被丢了，旧连接写完再关
+                {
+                    m_closing.push_back(std::move(it->second));
+                    m_conns.erase(it);
+                }
+                int s = connectServer(m_host, m_port);
+                if(s == -1)
+                    m_failed++;
+                else
+                    m_conns[rec.fd].sock = s;
+                break;
+            }
+            case CAP_CLOSE:
+                if(it != m_conns.end())
+                {
+                    m_closing.push_back(std::move(it->second));
+                    m_conns.erase(it);
+                }
+                break;
+            case CAP_DATA:
+            {
+                if(it == m_conns.end())
+                {
+                    m_failed++;
+                    break;
+                }
+                //先排进连接自己的缓冲区，服务端暂停读取时不会卡住整个回放
+                Conn& conn = it->second;
+                conn.out.append(rec.data);
+                if(!flush(conn))
+                {
+                    close(conn.sock);
+                    m_conns.erase(it);
+                    m_failed++;
+                    break;
+                }
+                uint64_t lines = chatLines(conn, rec.data);
+                if(lines > 0)
+                {
+                    m_sentMsgs += lines;
+                    m_expectLines += lines;
+                    m_inflight.emplace_back(m_expectLines, nowNs());
+                }
+                break;
+            }
+            case CAP_NICK:
+            {
+                //改名命令本身在CAP_DATA里，已经重发过；/resume 这类命令在回放的服务端上找不到原来的会话，
+                //昵称要补一条 /nick 改过去。连接正停在半行中间时插不进去，只能跳过
+                if(it == m_conns.end() || it->second.nick == rec.data || !it->second.lineStart)
+                    break;
+                Conn& conn = it->second;
+                conn.nick = rec.data;
+                conn.out += "/nick " + rec.data + "\n";
+                if(!flush(conn))
+                {
+                    close(conn.sock);
+                    m_conns.erase(it);
+                    m_failed++;
+                }
+                break;
+            }
+            case CAP_LINE: //加载时已经换成CAP_DATA
+                break;
+        }
+    }
+
+    //等积压的数据写完、剩下的广播到达观察者；还在往外写说明服务端只是读得慢，继续等
+    int64_t deadline = nowNs() + 2000000000ll;
+    while((!m_inflight.empty() || pending()) && nowNs() < deadline)
+    {
+        uint64_t sent = m_sentBytes;
+        pump(10);
+        if(m_sentBytes != sent)
+            deadline = nowNs() + 2000000000ll;
+    }
+
+    m_elapsed = (nowNs() - start) / 1e9;
+    return true;
+}
+
+void Replayer::report(const std::vector<Record>& records)
+{
+    uint64_t count[5] = {0};
+    for(const Record& rec : records)
+        if(rec.type >= CAP_OPEN && rec.type <= CAP_DATA)
+            count[rec.type]++;
+
+    printf("records:     %zu (open %llu, close %llu, nick %llu, data %llu)\n", records.size(),
+           (unsigned long long)count[CAP_OPEN], (unsigned long long)count[CAP_CLOSE],
+           (unsigned long long)count[CAP_NICK], (unsigned long long)count[CAP_DATA]);
+    printf("captured:    %.3f s\n", records.empty() ? 0.0 : records.back().ts / 1e9);
+    printf("replayed:    %.3f s\n", m_elapsed);
+    printf("sent:        %llu msgs, %llu bytes, %llu failed\n",
+           (unsigned long long)m_sentMsgs, (unsigned long long)m_sentBytes, (unsigned long long)m_failed);
+    printf("throughput:  %.0f msg/s, %.2f MB/s\n", m_sentMsgs / m_elapsed, m_sentBytes / m_elapsed / 1e6);
+
+    if(!m_latency.empty())
+    {
+        std::sort(m_latency.begin(), m_latency.end());
+        size_t n = m_latency.size();
+        printf("latency:     p50 %.1f us, p99 %.1f us, max %.1f us (%zu samples, %zu lost)\n",
+               m_latency[n / 2] / 1e3, m_latency[n * 99 / 100] / 1e3, m_latency[n - 1] / 1e3,
+               n, m_inflight.size());
+    }
+}
+
+static void usage(const char* prog)
+{
+    std::cout << "Usage: " << prog << " [-H host] [-p port] [-s speed] capture-file" << std::endl;
+    std::cout << "  -s speed  1 = original timing (default), N = N times faster, 0 = as fast as possible" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+    const char* host = "127.0.0.1";
+    int port = 7711;
+    double speed = 1;
+
+    int opt;
+    while((opt = getopt(argc, argv, "H:p:s:h")) != -1)
+    {
+        switch(opt)
+        {
+            case 'H': host = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            case 's': speed = atof(optarg); break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if(optind != argc - 1)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN); //服务端踢掉连接时write返回错误而不是直接退出
+
+    std::vector<Record> records;
+    if(!loadCapture(argv[optind], records))
+    {
+        std::cout << "read capture file " << argv[optind] << " failure" << std::endl;
+        return 1;
+    }
+
+    Replayer replayer(host, port);
+    if(!replayer.run(records, speed))
+        return 1;
+    replayer.report(records);
+    return 0;
+}
@@ -0,0 +1,70 @@
+#ifndef RINGQUEUE_H
+#define RINGQUEUE_H
+
+#include<stddef.h>
+#include<utility>
+#include<vector>
+#include"AllocStats.h"
+
+#define RING_QUEUE_MIN 8 //第一次push时的容量，之后满了就翻倍，必须是2的幂
+
+//先进先出的环形队列：std::deque每过几十个元素就要申请/释放一个节点，
+//这里容量只在满时翻倍、出队不释放，稳定状态下push/pop不经过堆。
+//出队的元素马上被重置为T()，它持有的shared_ptr等资源立刻释放。
+template<typename T>
+class RingQueue final
+{
+    public:
+        RingQueue() : m_head(0), m_size(0) {}
+        ~RingQueue() = default;
+        RingQueue(const RingQueue&) = delete;
+        RingQueue& operator=(const RingQueue&) = delete;
+
+        bool   empty() const { return m_size == 0; }
+        size_t size() const { return m_size; }
+        size_t capacity() const { return m_items.size(); }
+
+        T&       front() { return m_items[m_head]; }
+        T&       back() { return (*this)[m_size - 1]; }
+        T&       operator[](size_t i) { return m_items[(m_head + i) & (m_items.size() - 1)]; } //i从队首开始数
+
+        void push_back(T item)
+        {
+            if(m_size == m_items.size())
+                grow();
+            (*this)[m_size] = std::move(item);
+            m_size++;
+        }
+
+        void pop_front()
+        {
+            m_items[m_head] = T();
+            m_head = (m_head + 1) & (m_items.size() - 1);
+            m_size--;
+        }
+
+        void clear()
+        {
+            while(m_size > 0)
+                pop_front();
+            m_head = 0;
+        }
+
+    private:
+        void grow()
+        {
+            allocstats::AllowScope allow; //容量只在积压创新高时翻倍
+            std::vector<T> items(m_items.empty() ? RING_QUEUE_MIN : m_items.size() * 2);
+            for(size_t i = 0; i < m_size; i++)
+                items[i] = std::move((*this)[i]);
+            m_items.swap(items);
+            m_head = 0;
+        }
+
+    private:
+        std::vector<T> m_items; //大小总是0或者2的幂
+        size_t         m_head;
+        size_t         m_size;
+};
+
+#endif //RINGQUEUE_H
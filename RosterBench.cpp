@@ -0,0 +1,303 @@
+//在线名单压测：W个会话发/who后维护名单，另外C个并发会话反复"连上、收到欢迎语就断开"，一共建连N次(重连风暴)。
+//统计关注者收到的名单流量，和"每次有人上下线就给每个关注者推一遍完整名单"的做法估算出的流量对比，
+//结束后再开一个新连接取快照，检查每个关注者按增量维护的名单和快照一致。
+//-x <服务端pid> 改做回归检查：一轮里的名单增量超过CLIENT_OUTBUF_MAX时，正在发/who的关注者被断开，服务端不能出错。
+#include"ChatClient.h"
+#include"BenchUtil.h"
+
+#include<sys/socket.h>
+#include<signal.h>
+#include<time.h>
+#include<stdio.h>
+#include<stdlib.h>
+#include<unistd.h>
+#include<iostream>
+#include<string>
+#include<vector>
+#include<unordered_map>
+
+//关注者按 who <n> 快照加 who +昵称/who -昵称 增量维护的名单，同名的人可以有多个
+struct Roster
+{
+    bool                                 welcomed = false;
+    bool                                 snapshot = false; //收到 who <n> 之后才算开始
+    std::unordered_map<std::string, int> nicks;
+    size_t                               size = 0;
+    size_t                               nickBytes = 0; //名单里所有昵称的字节数，用来估算推完整名单的开销
+    uint64_t                             deltaLines = 0;
+    uint64_t                             deltaBytes = 0;
+    uint64_t                             naiveBytes = 0; //每条增量换成推一遍完整名单的字节数
+    uint64_t                             errors = 0; //减成负数的次数
+
+    void apply(std::string_view line)
+    {
+        if(line.size() < 5 || line.compare(0, 4, "who ") != 0)
+            return;
+        char sign = line[4];
+        if(sign != '+' && sign != '-')
+        {
+            snapshot = true;
+            return;
+        }
+        std::string nick(line.substr(5));
+        if(sign == '+')
+        {
+            nicks[nick]++;
+            size++;
+            nickBytes += nick.size();
+        }
+        else
+        {
+            auto it = nicks.find(nick);
+            if(it == nicks.end())
+            {
+                errors++;
+                return;
+            }
+            if(--it->second == 0)
+                nicks.erase(it);
+            size--;
+            nickBytes -= nick.size();
+        }
+    }
+
+    //完整名单的大小：一行 who <n> 加每人一行
+    size_t fullListBytes() const
+    {
+        return 4 + std::to_string(size).size() + 1 + size * 6 + nickBytes;
+    }
+};
+
+static void usage(const char* prog)
+{
+    std::cout << "Usage: " << prog << " [-H host] [-p port] [-U path] [-w watchers] [-n connects] [-c concurrency] [-x server_pid]" << std::endl;
+}
+
+static bool sendLine(int fd, const std::string& line)
+{
+    std::string data = line + "\n";
+    return send(fd, data.data(), data.size(), MSG_NOSIGNAL) == (ssize_t)data.size();
+}
+
+//服务端暂停时让一批会话改成很长的昵称，同时关注者再发一次/who；恢复后这些改名和/who在同一轮里处理，
+///who先把攒下的增量推给关注者，超过CLIENT_OUTBUF_MAX，断开的正是还在执行命令的这个连接
+static int overflowCheck(int port, pid_t server)
+{
+    const int renamers = 600; //每个增量一千多字节，600个超过512KB
+    std::vector<int> fds;
+    for(int i = 0; i < renamers; i++)
+    {
+        int fd = openSession(port);
+        if(fd == -1)
+        {
+            std::cout << "connect renamer " << i << " failure" << std::endl;
+            return 1;
+        }
+        fds.push_back(fd);
+    }
+
+    //关注者最后连上，fd最大，同一轮里排在改名之后处理
+    int watcher = openSession(port);
+    std::string line;
+    uint64_t count = 0;
+    if(watcher == -1 || !sendLine(watcher, "/who") || !readLine(watcher, line) || sscanf(line.c_str(), "who %llu", (unsigned long long*)&count) != 1)
+    {
+        std::cout << "watcher got no snapshot" << std::endl;
+        return 1;
+    }
+    for(uint64_t i = 0; i < count; i++)
+        readLine(watcher, line);
+
+    kill(server, SIGSTOP);
+    for(int i = 0; i < renamers; i++)
+        sendLine(fds[i], "/nick " + std::to_string(i) + std::string(1000, 'x'));
+    sendLine(watcher, "/who");
+    usleep(200000);
+    kill(server, SIGCONT);
+
+    //关注者应该被断开；之后服务端照常工作
+    bool closed = false;
+    char buf[65536];
+    int64_t start = nowNs();
+    while(!closed && nowNs() - start < 5000000000ll)
+    {
+        pollfd pfd = {watcher, POLLIN, 0};
+        if(poll(&pfd, 1, 100) > 0)
+            closed = recv(watcher, buf, sizeof(buf), 0) <= 0;
+    }
+    for(int fd : fds)
+        close(fd);
+    close(watcher);
+
+    int probe = openSession(port);
+    bool alive = probe != -1 && kill(server, 0) == 0;
+    if(probe != -1)
+        close(probe);
+    printf("overflow:      watcher %s, server %s\n", closed ? "disconnected" : "still connected", alive ? "alive" : "gone");
+    return closed && alive ? 0 : 1;
+}
+
+int main(int argc, char* argv[])
+{
+    std::string host = "127.0.0.1";
+    int port = 7711;
+    const char* unixPath = nullptr;
+    int watchers = 100;
+    int connects = 10000;
+    int concurrency = 500;
+    pid_t server = 0;
+
+    int opt;
+    while((opt = getopt(argc, argv, "H:p:U:w:n:c:x:h")) != -1)
+    {
+        switch(opt)
+        {
+            case 'H': host = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            case 'U': unixPath = optarg; break;
+            case 'w': watchers = atoi(optarg); break;
+            case 'n': connects = atoi(optarg); break;
+            case 'c': concurrency = atoi(optarg); break;
+            case 'x': server = atoi(optarg); break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if(server > 0)
+        return overflowCheck(port, server);
+    if(watchers < 1 || concurrency < 1)
+    {
+        std::cout << "need at least 1 watcher and 1 churning session" << std::endl;
+        return 1;
+    }
+
+    ChatClient client;
+    if(!client.init())
+    {
+        std::cout << "create epoll failure" << std::endl;
+        return 1;
+    }
+    std::string target = unixPath ? unixPath : host;
+    int targetPort = unixPath ? 0 : port;
+
+    //关注者：第一行欢迎语之后发/who，之后的who行都记进名单
+    std::vector<Roster> rosters(watchers);
+    size_t ready = 0;
+    int64_t lastRosterNs = 0;
+    std::shared_ptr<ChatSession::Handler> watcher = std::make_shared<ChatSession::Handler>();
+    watcher->onLine = [&](ChatSession& session, std::string_view line) {
+        Roster* roster = (Roster*)session.context();
+        if(!roster->welcomed)
+        {
+            roster->welcomed = true;
+            session.send("/who");
+            return;
+        }
+        bool delta = roster->snapshot && line.size() > 5 && line.compare(0, 4, "who ") == 0;
+        if(delta)
+        {
+            roster->deltaLines++;
+            roster->deltaBytes += line.size() + 1;
+        }
+        bool wasSnapshot = roster->snapshot;
+        roster->apply(line);
+        if(delta)
+        {
+            roster->naiveBytes += roster->fullListBytes();
+            lastRosterNs = nowNs();
+        }
+        else if(!wasSnapshot && roster->snapshot)
+        {
+            ready++;
+        }
+    };
+
+    std::vector<ChatSession*> watching;
+    for(int i = 0; i < watchers; i++)
+    {
+        watching.push_back(client.open(target, targetPort, watcher));
+        watching.back()->setContext(&rosters[i]);
+    }
+    int64_t start = nowNs();
+    while(ready < (size_t)watchers && nowNs() - start < 10000000000ll)
+        client.runOnce(100);
+    if(ready < (size_t)watchers)
+    {
+        std::cout << "only " << ready << " of " << watchers << " watchers got a snapshot in 10 s" << std::endl;
+        return 1;
+    }
+    size_t baseline = rosters[0].size;
+
+    //重连风暴：收到欢迎语就断开，再开一个新的，直到建连N次
+    int opened = 0;
+    int finished = 0;
+    std::shared_ptr<ChatSession::Handler> churn = std::make_shared<ChatSession::Handler>();
+    churn->onLine = [&](ChatSession& session, std::string_view) {
+        session.close();
+        finished++;
+        if(opened < connects)
+        {
+            client.open(target, targetPort, churn);
+            opened++;
+        }
+    };
+    for(; opened < concurrency && opened < connects; opened++)
+        client.open(target, targetPort, churn);
+
+    int64_t stormStart = nowNs();
+    while(finished < connects && nowNs() - stormStart < 60000000000ll)
+        client.runOnce(100);
+    int64_t stormEnd = nowNs();
+
+    //等名单安静下来：最后一批离开的增量到齐
+    lastRosterNs = nowNs();
+    while(nowNs() - lastRosterNs < 500000000ll)
+        client.runOnce(100);
+
+    //新连接的快照就是服务端当前的名单；它自己的+增量也会推给关注者，所以两边都包含它
+    Roster check;
+    std::shared_ptr<ChatSession::Handler> verifier = std::make_shared<ChatSession::Handler>();
+    verifier->onLine = [&](ChatSession& session, std::string_view line) {
+        if(!check.welcomed)
+        {
+            check.welcomed = true;
+            session.send("/who");
+            return;
+        }
+        check.apply(line);
+    };
+    client.open(target, targetPort, verifier);
+    int64_t verifyStart = nowNs();
+    while((!check.snapshot || check.size < baseline) && nowNs() - verifyStart < 5000000000ll)
+        client.runOnce(100);
+    int64_t settle = nowNs();
+    while(nowNs() - settle < 300000000ll)
+        client.runOnce(100);
+
+    int mismatched = 0;
+    uint64_t errors = 0;
+    uint64_t deltaLines = 0, deltaBytes = 0, naiveBytes = 0;
+    for(const Roster& roster : rosters)
+    {
+        if(roster.nicks != check.nicks)
+            mismatched++;
+        errors += roster.errors;
+        deltaLines += roster.deltaLines;
+        deltaBytes += roster.deltaBytes;
+        naiveBytes += roster.naiveBytes;
+    }
+
+    double elapsed = (stormEnd - stormStart) / 1e9;
+    uint64_t events = (uint64_t)finished * 2; //每次建连一上一下
+    printf("storm:         %d connects in %.2f s (%.0f/s), %d concurrent, %d watchers, %zu online before\n", finished, elapsed,
+           finished / elapsed, concurrency, watchers, baseline);
+    printf("deltas:        %.0f lines per watcher for %llu join/leave events (%.1f%% after coalescing)\n", (double)deltaLines / watchers,
+           (unsigned long long)events, events ? 100.0 * deltaLines / watchers / events : 0.0);
+    printf("roster bytes:  %.0f per watcher, %llu total\n", (double)deltaBytes / watchers, (unsigned long long)deltaBytes);
+    printf("full list:     %.0f per watcher, %llu total if every change resent the whole roster (%.0fx)\n", (double)naiveBytes / watchers,
+           (unsigned long long)naiveBytes, deltaBytes ? (double)naiveBytes / deltaBytes : 0.0);
+    printf("verify:        %d of %d watchers differ from a fresh snapshot of %zu, %llu bad leaves\n", mismatched, watchers, check.size,
+           (unsigned long long)errors);
+    return mismatched || errors ? 1 : 0;
+}
@@ -0,0 +1,177 @@
+//全文检索压测：生成大量模拟聊天消息喂给SearchIndex，测索引速度、内存和查询延迟(包括和后台线程之间的往返)
+#include"SearchIndex.h"
+#include"BenchUtil.h"
+
+#include<poll.h>
+#include<time.h>
+#include<stdio.h>
+#include<stdlib.h>
+#include<unistd.h>
+#include<iostream>
+#include<string>
+#include<vector>
+#include<random>
+#include<algorithm>
+
+//词频服从Zipf分布，和真实聊天记录一样少数词极常见、大部分词很少出现
+class ZipfWords final
+{
+    public:
+        ZipfWords(size_t vocab, uint32_t seed) : m_rng(seed), m_uniform(0.0, 1.0)
+        {
+            double sum = 0;
+            for(size_t i = 1; i <= vocab; i++)
+            {
+                sum += 1.0 / i;
+                m_cdf.push_back(sum);
+            }
+            for(double& c : m_cdf)
+                c /= sum;
+        }
+
+        size_t next()
+        {
+            return std::lower_bound(m_cdf.begin(), m_cdf.end(), m_uniform(m_rng)) - m_cdf.begin();
+        }
+
+        std::mt19937& rng() { return m_rng; }
+
+    private:
+        std::mt19937                           m_rng;
+        std::uniform_real_distribution<double> m_uniform;
+        std::vector<double>                    m_cdf;
+};
+
+static std::string word(size_t rank)
+{
+    return "w" + std::to_string(rank);
+}
+
+//发一个查询并等结果，返回耗时(纳秒)和命中数
+static int64_t timedQuery(SearchIndex& index, const std::string& terms, int* hits)
+{
+    int64_t start = nowNs();
+    index.query(0, 0, terms);
+
+    std::vector<SearchIndex::Result> results;
+    while(results.empty())
+    {
+        pollfd pfd = {index.notifyFd(), POLLIN, 0};
+        poll(&pfd, 1, 1000);
+        index.takeResults(results);
+    }
+    int64_t elapsed = nowNs() - start;
+    if(hits)
+        *hits = atoi(results[0].reply.c_str() + 7); //"search N\n"
+    return elapsed;
+}
+
+static void report(const char* name, std::vector<int64_t>& lat, double hits)
+{
+    std::sort(lat.begin(), lat.end());
+    size_t n = lat.size();
+    printf("%-22s p50 %8.1f us, p99 %8.1f us, max %8.1f us (avg %.1f hits)\n", name, lat[n / 2] / 1e3,
+           lat[n * 99 / 100] / 1e3, lat[n - 1] / 1e3, hits);
+}
+
+static void usage(const char* prog)
+{
+    std::cout << "Usage: " << prog << " [-n messages] [-v vocabulary] [-w words_per_message] [-b lines_per_batch] [-q queries]" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+    uint64_t count = 10000000;
+    size_t vocab = 50000;
+    int words = 8;
+    int batchLines = 16;
+    int queries = 1000;
+
+    int opt;
+    while((opt = getopt(argc, argv, "n:v:w:b:q:h")) != -1)
+    {
+        switch(opt)
+        {
+            case 'n': count = strtoull(optarg, nullptr, 10); break;
+            case 'v': vocab = strtoul(optarg, nullptr, 10); break;
+            case 'w': words = atoi(optarg); break;
+            case 'b': batchLines = atoi(optarg); break;
+            case 'q': queries = atoi(optarg); break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    SearchIndex index;
+    if(!index.start(count))
+    {
+        std::cout << "start search index failure" << std::endl;
+        return 1;
+    }
+
+    ZipfWords zipf(vocab, 1);
+    double rssStart = rssMb();
+    int64_t start = nowNs();
+    uint64_t seq = 1;
+    std::string batch;
+    for(uint64_t i = 0; i < count; i++)
+    {
+        batch += "user" + std::to_string(zipf.rng()() % 1000) + ">";
+        for(int w = 0; w < words; w++)
+        {
+            batch += word(zipf.next());
+            batch.push_back(w + 1 < words ? ' ' : '\n');
+        }
+        if((i + 1) % batchLines == 0 || i + 1 == count)
+        {
+            size_t lines = std::count(batch.begin(), batch.end(), '\n');
+            std::shared_ptr<const std::string> payload = std::make_shared<const std::string>(std::move(batch));
+            index.add(seq, payload);
+            seq += lines;
+            batch.clear();
+        }
+        //服务端的事件循环不等后台线程，积压超过SEARCH_MAX_PENDING就丢弃；压测要测的是索引速度，定期等它追上来
+        if((i + 1) % 100000 == 0)
+            timedQuery(index, "w0", nullptr);
+    }
+    int64_t produced = nowNs();
+    timedQuery(index, "w0", nullptr); //查询排在所有消息之后，返回时已经全部索引完
+    int64_t indexed = nowNs();
+
+    printf("indexed:               %llu messages in %.2f s (%.0f msg/s, producer %.2f s), %llu batches dropped\n",
+           (unsigned long long)count, (indexed - start) / 1e9, count / ((indexed - start) / 1e9),
+           (produced - start) / 1e9, (unsigned long long)index.dropped());
+    printf("memory:                %.0f MB resident for the index and stored text\n", rssMb() - rssStart);
+
+    //四类查询：常见词、罕见词、两个中等频率词的交集、一个常见词和一个罕见词的交集
+    std::mt19937 rng(2);
+    struct Kind
+    {
+        const char* name;
+        size_t      lo, hi; //词的排名范围
+        size_t      lo2, hi2; //第二个词，hi2为0表示单词查询
+    };
+    Kind kinds[] = {
+        {"common term", 0, 10, 0, 0},
+        {"rare term", vocab / 2, vocab, 0, 0},
+        {"two mid terms", 100, 1000, 100, 1000},
+        {"common + rare", 0, 10, vocab / 2, vocab},
+    };
+    for(const Kind& kind : kinds)
+    {
+        std::vector<int64_t> lat;
+        double totalHits = 0;
+        for(int q = 0; q < queries; q++)
+        {
+            std::string terms = word(kind.lo + rng() % (kind.hi - kind.lo));
+            if(kind.hi2)
+                terms += " " + word(kind.lo2 + rng() % (kind.hi2 - kind.lo2));
+            int hits = 0;
+            lat.push_back(timedQuery(index, terms, &hits));
+            totalHits += hits;
+        }
+        report(kind.name, lat, totalHits / queries);
+    }
+    return 0;
+}
@@ -0,0 +1,319 @@
+#include"SearchIndex.h"
+
+#include<sys/eventfd.h>
+#include<unistd.h>
+#include<errno.h>
+#include<algorithm>
+
+void SearchIndex::Posting::append(uint32_t id)
+{
+    //每块第一个id放在块头，其余存和前一个的差值
+    if(count % SEARCH_BLOCK_DOCS == 0)
+    {
+        blocks.push_back(Block{id, (uint32_t)bytes.size()});
+    }
+    else
+    {
+        uint32_t delta = id - last;
+        while(delta >= 0x80)
+        {
+            bytes.push_back((uint8_t)(delta | 0x80));
+            delta >>= 7;
+        }
+        bytes.push_back((uint8_t)delta);
+    }
+    last = id;
+    count++;
+}
+
+size_t SearchIndex::Posting::decodeBlock(size_t block, uint32_t* ids) const
+{
+    size_t n = (block + 1 == blocks.size()) ? count - block * SEARCH_BLOCK_DOCS : SEARCH_BLOCK_DOCS;
+    const uint8_t* p = bytes.data() + blocks[block].offset;
+    ids[0] = blocks[block].first;
+    for(size_t i = 1; i < n; i++)
+    {
+        uint32_t delta = 0;
+        int shift = 0;
+        uint8_t c;
+        do
+        {
+            c = *p++;
+            delta |= (uint32_t)(c & 0x7f) << shift;
+            shift += 7;
+        } while(c & 0x80);
+        ids[i] = ids[i - 1] + delta;
+    }
+    return n;
+}
+
+bool SearchIndex::Cursor::contains(uint32_t id)
+{
+    if(block < 0 || id < ids[0])
+    {
+        //二分找到最后一个起始id不大于id的块
+        size_t lo = 0, hi = posting->blocks.size();
+        while(lo < hi)
+        {
+            size_t mid = (lo + hi) / 2;
+            if(posting->blocks[mid].first <= id)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        if(lo == 0)
+            return false;
+        block = lo - 1;
+        pos = posting->decodeBlock(block, ids) - 1;
+    }
+    while(pos > 0 && ids[pos] > id)
+        pos--;
+    return ids[pos] == id;
+}
+
+SearchIndex::SearchIndex()
+    : m_notifyFd(-1),
+      m_pendingBytes(0),
+      m_dropped(0),
+      m_stop(false),
+      m_maxSegments(1)
+{
+}
+
+SearchIndex::~SearchIndex()
+{
+    if(m_worker.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_cond.notify_one();
+        m_worker.join();
+    }
+    if(m_notifyFd != -1)
+        close(m_notifyFd);
+}
+
+bool SearchIndex::start(uint64_t maxDocs)
+{
+    m_notifyFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(m_notifyFd == -1)
+        return false;
+
+    //保留的行数按段取整，至少一段
+    m_maxSegments = std::max<uint64_t>(1, (maxDocs + SEARCH_SEGMENT_DOCS - 1) / SEARCH_SEGMENT_DOCS);
+    m_jobs.reserve(SEARCH_JOBS_RESERVE);
+    m_worker = std::thread(&SearchIndex::workerLoop, this);
+    return true;
+}
+
+void SearchIndex::add(uint64_t firstSeq, const std::shared_ptr<const std::string>& batch)
+{
+    bool wake;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if(m_pendingBytes + batch->size() > SEARCH_MAX_PENDING)
+        {
+            m_dropped++;
+            return;
+        }
+        wake = m_jobs.empty(); //队列不空说明后台线程还没取走上一批，不用再唤醒
+        m_jobs.push_back(Job{firstSeq, batch, -1, 0, std::string()});
+        m_pendingBytes += batch->size();
+    }
+    if(wake)
+        m_cond.notify_one();
+}
+
+void SearchIndex::query(int fd, uint64_t serial, std::string_view terms)
+{
+    bool wake;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        wake = m_jobs.empty();
+        m_jobs.push_back(Job{0, nullptr, fd, serial, std::string(terms)});
+    }
+    if(wake)
+        m_cond.notify_one();
+}
+
+int SearchIndex::notifyFd()
+{
+    return m_notifyFd;
+}
+
+void SearchIndex::takeResults(std::vector<Result>& results)
+{
+    uint64_t count;
+    while(read(m_notifyFd, &count, sizeof(count)) == -1 && errno == EINTR)
+        ;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    results.swap(m_results);
+}
+
+uint64_t SearchIndex::dropped()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_dropped;
+}
+
+void SearchIndex::workerLoop()
+{
+    std::vector<Job> jobs;
+    jobs.reserve(SEARCH_JOBS_RESERVE); //和m_jobs交换，两边的容量都要预留
+    std::vector<Result> results;
+    while(true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cond.wait(lock, [this] { return m_stop || !m_jobs.empty(); });
+            if(m_jobs.empty()) //退出前把队列处理完
+                break;
+            jobs.swap(m_jobs);
+        }
+
+        size_t done = 0;
+        for(Job& job : jobs)
+        {
+            if(job.batch)
+            {
+                ingest(job.seq, *job.batch);
+                done += job.batch->size();
+            }
+            else
+            {
+                results.push_back(Result{job.fd, job.serial, search(job.terms)});
+            }
+        }
+        jobs.clear(); //payload的最后一个引用可能在这里释放
+
+        bool notify;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_pendingBytes -= done;
+            notify = !results.empty() && m_results.empty(); //事件循环还没取走上次的结果时不用再通知
+            for(Result& result : results)
+                m_results.push_back(std::move(result));
+        }
+        results.clear();
+
+        uint64_t one = 1;
+        if(notify)
+        {
+            while(write(m_notifyFd, &one, sizeof(one)) == -1 && errno == EINTR)
+                ;
+        }
+    }
+}
+
+void SearchIndex::ingest(uint64_t seq, const std::string& batch)
+{
+    size_t pos = 0;
+    while(pos < batch.size())
+    {
+        size_t nl = batch.find('\n', pos);
+        if(nl == std::string::npos)
+            break;
+
+        //当前段写满了就开新段，超过保留段数时整段丢弃最旧的
+        if(m_segments.empty() || seq - m_segments.back()->baseSeq >= SEARCH_SEGMENT_DOCS)
+        {
+            while(m_segments.size() >= m_maxSegments)
+                m_segments.pop_front();
+            m_segments.push_back(std::make_unique<Segment>());
+            m_segments.back()->baseSeq = seq;
+            m_segments.back()->offsets.reserve(SEARCH_SEGMENT_DOCS);
+        }
+
+        Segment& seg = *m_segments.back();
+        uint32_t id = seq - seg.baseSeq;
+        while(seg.offsets.size() < id) //积压丢弃造成的空缺
+            seg.offsets.push_back(seg.text.size());
+        seg.offsets.push_back(seg.text.size());
+        seg.text.append(batch, pos, nl + 1 - pos);
+        indexLine(seg, id, std::string_view(batch).substr(pos, nl - pos));
+
+        pos = nl + 1;
+        seq++;
+    }
+}
+
+void SearchIndex::indexLine(Segment& seg, uint32_t id, std::string_view line)
+{
+    tokenize(line, [&](std::string_view term) {
+        auto it = seg.terms.find(term);
+        if(it == seg.terms.end())
+            it = seg.terms.emplace(std::string(term), Posting()).first;
+        if(it->second.count && it->second.last == id) //同一行里重复的词只记一次
+            return;
+        it->second.append(id);
+    });
+}
+
+std::string SearchIndex::search(const std::string& query)
+{
+    std::vector<std::string> terms;
+    tokenize(query, [&](std::string_view term) {
+        if(terms.size() < SEARCH_TERMS_MAX && std::find(terms.begin(), terms.end(), term) == terms.end())
+            terms.emplace_back(term);
+    });
+    if(terms.empty())
+        return "usage: /search <terms>\n";
+
+    std::string hits;
+    size_t found = 0;
+    for(auto it = m_segments.rbegin(); it != m_segments.rend() && found < SEARCH_RESULTS_MAX; ++it)
+        searchSegment(**it, terms, hits, found);
+
+    return "search " + std::to_string(found) + "\n" + hits;
+}
+
+void SearchIndex::searchSegment(const Segment& seg, const std::vector<std::string>& terms, std::string& hits, size_t& found)
+{
+    //所有词都出现的行，从最短的倒排表开始倒序遍历，其余的词逐个确认
+    std::vector<const Posting*> postings;
+    for(const std::string& term : terms)
+    {
+        auto it = seg.terms.find(term);
+        if(it == seg.terms.end())
+            return;
+        postings.push_back(&it->second);
+    }
+    std::sort(postings.begin(), postings.end(), [](const Posting* a, const Posting* b) { return a->count < b->count; });
+
+    std::vector<Cursor> others;
+    for(size_t i = 1; i < postings.size(); i++)
+        others.emplace_back(postings[i]);
+
+    uint32_t ids[SEARCH_BLOCK_DOCS];
+    const Posting& rarest = *postings[0];
+    for(size_t b = rarest.blocks.size(); b-- > 0 && found < SEARCH_RESULTS_MAX;)
+    {
+        size_t n = rarest.decodeBlock(b, ids);
+        for(size_t i = n; i-- > 0 && found < SEARCH_RESULTS_MAX;)
+        {
+            uint32_t id = ids[i];
+            bool all = true;
+            for(Cursor& cursor : others)
+            {
+                if(!cursor.contains(id))
+                {
+                    all = false;
+                    break;
+                }
+            }
+            if(!all)
+                continue;
+
+            size_t begin = seg.offsets[id];
+            size_t end = (id + 1 < seg.offsets.size()) ? seg.offsets[id + 1] : seg.text.size();
+            hits.push_back('#');
+            hits.append(std::to_string(seg.baseSeq + id));
+            hits.push_back(' ');
+            hits.append(seg.text, begin, end - begin);
+            found++;
+        }
+    }
+}
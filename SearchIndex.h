@@ -0,0 +1,150 @@
+#ifndef SEARCHINDEX_H
+#define SEARCHINDEX_H
+
+#include<stdint.h>
+#include<stddef.h>
+#include<string>
+#include<string_view>
+#include<vector>
+#include<deque>
+#include<memory>
+#include<unordered_map>
+#include<thread>
+#include<mutex>
+#include<condition_variable>
+
+//聊天记录的全文检索：广播的每一行(序号即文档id)由后台线程切词，写进倒排索引。
+//索引按 SEARCH_SEGMENT_DOCS 行分段，超过保留行数时整段丢弃最旧的，查询从最新的段往回找，凑够结果就停。
+//事件循环线程只负责把payload的引用放进队列、取回查询结果，不碰索引本身。
+#define SEARCH_SEGMENT_DOCS (1 << 17)  //每段的行数
+#define SEARCH_DEFAULT_DOCS (1 << 20)  //默认保留最近多少行
+#define SEARCH_BLOCK_DOCS   128        //倒排表分块：块内是varint编码的差值，块头记录第一个id，倒序遍历和跳跃查找都按块解码
+#define SEARCH_RESULTS_MAX  20         //每次查询最多返回的行数，最新的在前
+#define SEARCH_TERMS_MAX    8          //查询最多的词数，多出来的忽略
+#define SEARCH_TERM_MAX     32         //词的最大长度，超过的截断
+#define SEARCH_MAX_PENDING  (64 * 1024 * 1024) //后台线程跟不上时最多积压的字节数，超过就不索引并计数
+#define SEARCH_JOBS_RESERVE 1024       //任务队列预留的容量，两个线程交换队列，积压不超过它时add不分配内存
+
+class SearchIndex final
+{
+    public:
+        //查询结果，fd和serial原样带回，由事件循环检查连接是否还是发起查询的那个
+        struct Result
+        {
+            int         fd;
+            uint64_t    serial;
+            std::string reply;
+        };
+
+        SearchIndex();
+        ~SearchIndex(); //处理完队列里剩下的任务后退出后台线程
+        SearchIndex(const SearchIndex&) = delete;
+        SearchIndex& operator=(const SearchIndex&) = delete;
+
+        bool start(uint64_t maxDocs); //创建通知用的eventfd并启动后台线程
+
+        //以下在事件循环线程调用
+        void add(uint64_t firstSeq, const std::shared_ptr<const std::string>& batch); //batch的每一行依次是firstSeq, firstSeq+1...
+        void query(int fd, uint64_t serial, std::string_view terms); //排在已提交的消息之后执行，能搜到查询之前发的消息
+        int  notifyFd(); //有查询完成时可读
+        void takeResults(std::vector<Result>& results);
+        uint64_t dropped(); //因积压过多没有索引的payload数
+
+        //按索引时的规则切词：ASCII字母数字转小写，非ASCII字节(UTF-8多字节字符)算作词的一部分，其余都是分隔符
+        template<typename Func>
+        static void tokenize(std::string_view text, Func f)
+        {
+            char term[SEARCH_TERM_MAX];
+            size_t len = 0;
+            for(size_t i = 0; i <= text.size(); i++)
+            {
+                unsigned char c = i < text.size() ? (unsigned char)text[i] : ' ';
+                bool word = (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c >= 0x80;
+                if(word)
+                {
+                    if(len < SEARCH_TERM_MAX)
+                        term[len++] = (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+                    continue;
+                }
+                if(len)
+                    f(std::string_view(term, len));
+                len = 0;
+            }
+        }
+
+    private:
+        struct Block
+        {
+            uint32_t first; //块内第一个id
+            uint32_t offset; //块内其余id的差值在bytes中的起始位置
+        };
+
+        struct Posting
+        {
+            uint32_t             last = 0;
+            uint32_t             count = 0;
+            std::vector<uint8_t> bytes;
+            std::vector<Block>   blocks;
+
+            void append(uint32_t id);
+            size_t decodeBlock(size_t block, uint32_t* ids) const; //返回块内id数
+        };
+
+        //在一个词的倒排表上按id从大到小确认，只解码用到的块
+        struct Cursor
+        {
+            const Posting* posting;
+            long           block = -1;
+            size_t         pos = 0;
+            uint32_t       ids[SEARCH_BLOCK_DOCS];
+
+            explicit Cursor(const Posting* p) : posting(p) {}
+            bool contains(uint32_t id); //id必须单调不增
+        };
+
+        //词表支持用string_view查找，切词时不用为每个词构造string
+        struct TermHash
+        {
+            using is_transparent = void;
+            size_t operator()(std::string_view s) const { return std::hash<std::string_view>()(s); }
+        };
+
+        //一段：文档id是序号减去baseSeq，原文连续存放
+        struct Segment
+        {
+            uint64_t                                 baseSeq;
+            std::string                              text;
+            std::vector<uint32_t>                    offsets; //第i行在text中的起始位置，结束位置是下一个
+            std::unordered_map<std::string, Posting, TermHash, std::equal_to<>> terms;
+        };
+
+        struct Job
+        {
+            uint64_t                           seq; //查询时不用
+            std::shared_ptr<const std::string> batch; //为空表示查询
+            int                                fd;
+            uint64_t                           serial;
+            std::string                        terms;
+        };
+
+        void workerLoop();
+        void ingest(uint64_t seq, const std::string& batch);
+        void indexLine(Segment& seg, uint32_t id, std::string_view line);
+        std::string search(const std::string& terms);
+        void searchSegment(const Segment& seg, const std::vector<std::string>& terms, std::string& hits, size_t& found);
+
+    private:
+        int                                  m_notifyFd;
+        std::thread                          m_worker;
+        std::mutex                           m_mutex; //保护下面的队列和结果
+        std::condition_variable              m_cond;
+        std::vector<Job>                     m_jobs;
+        std::vector<Result>                  m_results;
+        size_t                               m_pendingBytes;
+        uint64_t                             m_dropped;
+        bool                                 m_stop;
+        std::deque<std::unique_ptr<Segment>> m_segments; //只在后台线程访问
+        size_t                               m_maxSegments;
+};
+
+#endif //SEARCHINDEX_H
@@ -0,0 +1,206 @@
+//共享内存传输压测：一个生产者通过共享内存环尽快发消息，若干接收者(同样走共享内存)统计收到的行数和延迟
+#include"ShmRing.h"
+#include"BenchUtil.h"
+
+#include<sys/socket.h>
+#include<sys/un.h>
+#include<sys/resource.h>
+#include<unistd.h>
+#include<time.h>
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<iostream>
+#include<string>
+#include<vector>
+#include<thread>
+#include<atomic>
+#include<memory>
+#include<algorithm>
+
+static int connectUnix(const char* path)
+{
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(addr.sun_path))
+        return -1;
+    strcpy(addr.sun_path, path);
+
+    int s = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(s == -1)
+        return -1;
+    if(connect(s, (sockaddr*)&addr, sizeof(addr)) == -1)
+    {
+        close(s);
+        return -1;
+    }
+    return s;
+}
+
+struct Session
+{
+    int                          sock = -1;
+    std::unique_ptr<ShmEndpoint> shm;
+
+    ~Session() { if(sock != -1) close(sock); }
+};
+
+static bool openSession(const char* path, Session& session)
+{
+    session.sock = connectUnix(path);
+    if(session.sock == -1)
+        return false;
+    session.shm = std::make_unique<ShmEndpoint>();
+    return session.shm->connect(session.sock);
+}
+
+//接收者：统计行数，每条消息开头是发送时间，算出延迟
+static void receiver(Session* session, uint64_t expect, std::vector<int64_t>* latency, int64_t* doneNs,
+                     std::atomic<uint64_t>* progress)
+{
+    uint64_t lines = 0;
+    int64_t deadline = nowNs() + 30 * 1000000000ll;
+    while(lines < expect && nowNs() < deadline)
+    {
+        int64_t now = 0;
+        size_t n = session->shm->receive([&](const char* data, size_t len) {
+            const char* end = data + len;
+            while(data < end)
+            {
+                const char* nl = (const char*)memchr(data, '\n', end - data);
+                if(!nl)
+                    break;
+                const char* gt = (const char*)memchr(data, '>', nl - data);
+                if(gt && latency)
+                {
+                    if(!now)
+                        now = nowNs();
+                    latency->push_back(now - strtoll(gt + 1, nullptr, 10));
+                }
+                lines++;
+                data = nl + 1;
+            }
+        }, 1 << 20);
+        progress->store(lines, std::memory_order_relaxed);
+
+        if(n == 0 && !session->shm->arm(true, 0))
+            session->shm->wait(100);
+    }
+    *doneNs = nowNs();
+}
+
+static void usage(const char* prog)
+{
+    std::cout << "Usage: " << prog << " [-U path] [-c receivers] [-s size] [-n messages] [-w window] [-P server_pid]" << std::endl;
+    std::cout << "  -w window  max messages the slowest receiver may lag behind the producer (default 8192)," << std::endl;
+    std::cout << "             keeps the backlog under the server's slow reader limit" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+    const char* path = "/tmp/smallchat.sock";
+    int receivers = 1;
+    size_t size = 64;
+    uint64_t count = 1000000;
+    uint64_t window = 8192;
+    int serverPid = 0;
+
+    int opt;
+    while((opt = getopt(argc, argv, "U:c:s:n:w:P:h")) != -1)
+    {
+        switch(opt)
+        {
+            case 'U': path = optarg; break;
+            case 'c': receivers = atoi(optarg); break;
+            case 's': size = strtoul(optarg, nullptr, 10); break;
+            case 'n': count = strtoull(optarg, nullptr, 10); break;
+            case 'w': window = strtoull(optarg, nullptr, 10); break;
+            case 'P': serverPid = atoi(optarg); break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    size = std::min<size_t>(std::max<size_t>(size, 24), SHM_MSG_MAX); //至少放得下时间戳
+
+    std::vector<std::unique_ptr<Session>> sessions;
+    for(int i = 0; i <= receivers; i++) //第0个是生产者
+    {
+        sessions.push_back(std::make_unique<Session>());
+        if(!openSession(path, *sessions.back()))
+        {
+            std::cout << "open shared memory session on " << path << " failure" << std::endl;
+            return 1;
+        }
+    }
+    usleep(100000); //等服务端处理完所有连接的欢迎语和切换
+
+    std::vector<std::vector<int64_t>> latency(receivers);
+    std::vector<int64_t> doneNs(receivers);
+    std::unique_ptr<std::atomic<uint64_t>[]> progress(new std::atomic<uint64_t>[receivers]());
+    std::vector<std::thread> threads;
+    for(int i = 0; i < receivers; i++)
+    {
+        latency[i].reserve(count);
+        threads.emplace_back(receiver, sessions[i + 1].get(), count, i == 0 ? &latency[0] : nullptr, &doneNs[i], &progress[i]);
+    }
+
+    double cpuStart = serverPid ? processCpuNs(serverPid) / 1e9 : 0;
+    ShmEndpoint* shm = sessions[0]->shm.get();
+    std::string msg(size, 'x');
+    msg[size - 1] = '\n';
+
+    int64_t start = nowNs();
+    uint64_t fullWaits = 0, windowWaits = 0;
+    uint64_t slowest = 0;
+    for(uint64_t i = 0; i < count; i++)
+    {
+        while(window && i - slowest >= window) //最慢的接收者落后太多，等它追上来
+        {
+            slowest = count;
+            for(int r = 0; r < receivers; r++)
+                slowest = std::min<uint64_t>(slowest, progress[r].load(std::memory_order_relaxed));
+            if(i - slowest >= window)
+            {
+                windowWaits++;
+                sched_yield();
+            }
+        }
+
+        int len = snprintf(&msg[0], size, "%lld ", (long long)nowNs());
+        msg[len] = 'x'; //snprintf写入的结束符
+        while(!shm->send(msg.data(), msg.size()))
+        {
+            fullWaits++;
+            if(!shm->arm(false, msg.size()))
+                shm->wait(100);
+        }
+    }
+    int64_t sent = nowNs();
+
+    for(std::thread& t : threads)
+        t.join();
+    int64_t done = *std::max_element(doneNs.begin(), doneNs.end());
+
+    double sendSec = (sent - start) / 1e9;
+    double totalSec = (done - start) / 1e9;
+    printf("producer:      %.0f msg/s, %.1f MB/s (%llu ring-full waits, %llu window waits)\n", count / sendSec,
+           count * size / sendSec / 1e6, (unsigned long long)fullWaits, (unsigned long long)windowWaits);
+    printf("delivered:     %.0f msg/s to each of %d receivers\n", count / totalSec, receivers);
+
+    std::vector<int64_t>& lat = latency[0];
+    if(!lat.empty())
+    {
+        std::sort(lat.begin(), lat.end());
+        size_t n = lat.size();
+        printf("latency:       p50 %.1f us, p99 %.1f us, max %.1f us (%zu of %llu received)\n", lat[n / 2] / 1e3,
+               lat[n * 99 / 100] / 1e3, lat[n - 1] / 1e3, n, (unsigned long long)count);
+    }
+    if(serverPid)
+    {
+        double cpu = processCpuNs(serverPid) / 1e9 - cpuStart;
+        printf("server cpu:    %.3f s, %.0f ns/msg\n", cpu, cpu * 1e9 / count);
+    }
+    return 0;
+}
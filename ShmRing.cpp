@@ -0,0 +1,186 @@
+#include"ShmRing.h"
+
+#include<sys/socket.h>
+#include<sys/mman.h>
+#include<sys/eventfd.h>
+#include<poll.h>
+#include<unistd.h>
+#include<errno.h>
+#include<new>
+
+ShmEndpoint::ShmEndpoint()
+    : m_base(nullptr),
+      m_memfd(-1),
+      m_bell(-1),
+      m_peerBell(-1),
+      m_rxMax(SHM_RING_BYTES)
+{
+}
+
+ShmEndpoint::~ShmEndpoint()
+{
+    if(m_base)
+        munmap(m_base, SHM_SEGMENT_BYTES);
+    if(m_memfd != -1)
+        close(m_memfd);
+    if(m_bell != -1)
+        close(m_bell);
+    if(m_peerBell != -1)
+        close(m_peerBell);
+}
+
+bool ShmEndpoint::create()
+{
+    m_rxMax = SHM_MSG_MAX;
+    m_memfd = memfd_create("smallchat-shm", MFD_CLOEXEC);
+    if(m_memfd == -1)
+        return false;
+
+    if(ftruncate(m_memfd, SHM_SEGMENT_BYTES) == -1 ||
+       (m_base = mmap(nullptr, SHM_SEGMENT_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, m_memfd, 0)) == MAP_FAILED)
+    {
+        m_base = nullptr;
+        return false;
+    }
+
+    //两端都在select/poll上等门铃，eventfd必须是非阻塞的(O_NONBLOCK属于文件描述，传过去后两端共享)
+    m_bell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    m_peerBell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(m_bell == -1 || m_peerBell == -1)
+        return false;
+
+    char* base = (char*)m_base;
+    new(base) ShmRingHeader{}; //ftruncate出来的内存已经是0，这里只是按C++的规矩构造原子变量
+    new(base + SHM_RING_STRIDE) ShmRingHeader{};
+    m_rx.attach(base);
+    m_tx.attach(base + SHM_RING_STRIDE);
+    return true;
+}
+
+bool ShmEndpoint::handOver(int sockfd, const char* msg)
+{
+    //共享段、客户端等待的门铃、服务端等待的门铃
+    int fds[3] = {m_memfd, m_peerBell, m_bell};
+    char control[CMSG_SPACE(sizeof(fds))];
+    memset(control, 0, sizeof(control));
+
+    iovec iov = {(void*)msg, strlen(msg)};
+    msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control;
+    mh.msg_controllen = sizeof(control);
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&mh);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    ssize_t n = sendmsg(sockfd, &mh, MSG_DONTWAIT);
+    close(m_memfd); //映射已经建立，客户端收到的是自己的一份fd
+    m_memfd = -1;
+    return n == (ssize_t)iov.iov_len;
+}
+
+bool ShmEndpoint::connect(int sockfd)
+{
+    const char* cmd = "/shm\n";
+    if(::send(sockfd, cmd, strlen(cmd), 0) != (ssize_t)strlen(cmd))
+        return false;
+
+    //回复之前socket上可能还有欢迎语或者广播，一直读到带着fd的那条消息
+    int fds[3] = {-1, -1, -1};
+    while(fds[0] == -1)
+    {
+        char buf[1024];
+        char control[CMSG_SPACE(sizeof(fds))];
+        iovec iov = {buf, sizeof(buf)};
+        msghdr mh;
+        memset(&mh, 0, sizeof(mh));
+        mh.msg_iov = &iov;
+        mh.msg_iovlen = 1;
+        mh.msg_control = control;
+        mh.msg_controllen = sizeof(control);
+
+        ssize_t n = recvmsg(sockfd, &mh, MSG_CMSG_CLOEXEC);
+        if(n == -1 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return false;
+
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&mh);
+        if(cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+           cmsg->cmsg_len == CMSG_LEN(sizeof(fds)))
+            memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+        else if((n >= 11 && !memcmp(buf, "unsupported", 11)) || (n >= 4 && !memcmp(buf, "shm ", 4))) //服务端不支持或者拒绝
+            return false;
+    }
+
+    m_base = mmap(nullptr, SHM_SEGMENT_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    close(fds[0]);
+    m_bell = fds[1];
+    m_peerBell = fds[2];
+    if(m_base == MAP_FAILED)
+    {
+        m_base = nullptr;
+        return false;
+    }
+
+    char* base = (char*)m_base;
+    m_tx.attach(base);
+    m_rx.attach(base + SHM_RING_STRIDE);
+    return true;
+}
+
+bool ShmEndpoint::corrupt()
+{
+    return m_rx.corrupt();
+}
+
+bool ShmEndpoint::send(const char* data, size_t len)
+{
+    if(!m_tx.tryWrite(data, len))
+        return false;
+    if(m_tx.wakeReader())
+        ring();
+    return true;
+}
+
+bool ShmEndpoint::arm(bool wantRead, size_t pendingLen)
+{
+    bool ready = false;
+    if(wantRead && m_rx.armReader())
+        ready = true;
+    if(pendingLen && m_tx.armWriter(pendingLen))
+        ready = true;
+    return ready;
+}
+
+bool ShmEndpoint::wait(int timeoutMs)
+{
+    pollfd pfd = {m_bell, POLLIN, 0};
+    if(poll(&pfd, 1, timeoutMs) <= 0)
+        return false;
+    clearBell();
+    return true;
+}
+
+void ShmEndpoint::clearBell()
+{
+    uint64_t count;
+    while(read(m_bell, &count, sizeof(count)) == -1 && errno == EINTR)
+        ;
+}
+
+int ShmEndpoint::bellFd()
+{
+    return m_bell;
+}
+
+void ShmEndpoint::ring()
+{
+    uint64_t one = 1;
+    while(write(m_peerBell, &one, sizeof(one)) == -1 && errno == EINTR)
+        ;
+}
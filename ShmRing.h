@@ -0,0 +1,244 @@
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include<stdint.h>
+#include<stddef.h>
+#include<string.h>
+#include<atomic>
+
+//共享内存传输：同机客户端在Unix域socket上发送 /shm，服务端创建一段memfd，里面是一对单生产者单消费者环形缓冲区
+//(客户端->服务端、服务端->客户端)，连同两个eventfd门铃用SCM_RIGHTS交给客户端。之后消息直接写进环里，
+//只有对方已经声明自己空闲(置了等待标志)时才敲门铃，双方都忙的时候每条消息没有系统调用也没有内核拷贝。
+//socket本身仍然保留：命令的回复走socket，socket断开即连接结束。
+#define SHM_RING_BYTES   (1 << 20) //每个方向的环大小，必须是2的幂
+#define SHM_MSG_MAX      1024      //客户端单条消息的最大长度，和socket路径的读缓冲区一致
+#define SHM_RECORD_ALIGN 8         //记录按8字节对齐，长度字段不会跨越环尾
+
+//环中的记录：4字节长度 | 数据 | 填充到8字节对齐。长度为SHM_RECORD_WRAP表示环尾剩余空间不够，跳到环头
+#define SHM_RECORD_WRAP  0xffffffffu
+
+//两个进程共用的头部，生产者和消费者各自的位置放在不同的cache line上
+struct ShmRingHeader
+{
+    alignas(64) std::atomic<uint64_t> head; //生产者写到的位置(累计字节数)
+    alignas(64) std::atomic<uint64_t> tail; //消费者读到的位置
+    alignas(64) std::atomic<uint32_t> readerWaiting; //消费者读空后准备睡眠，生产者写入后要敲门铃
+    std::atomic<uint32_t>             writerWaiting; //生产者遇到环满准备睡眠，消费者腾出空间后要敲门铃
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "ring positions must be lock free to live in shared memory");
+
+//段布局：[客户端->服务端的头部][数据][服务端->客户端的头部][数据]
+#define SHM_RING_STRIDE   (sizeof(ShmRingHeader) + SHM_RING_BYTES)
+#define SHM_SEGMENT_BYTES (2 * SHM_RING_STRIDE)
+
+//进程内对一个环的视图，缓存对方的位置，只有看起来满/空时才去读对方的cache line
+class ShmRing final
+{
+    public:
+        ShmRing() : m_hdr(nullptr), m_data(nullptr), m_cachedHead(0), m_cachedTail(0), m_corrupt(false) {}
+
+        void attach(void* base)
+        {
+            m_hdr = (ShmRingHeader*)base;
+            m_data = (char*)base + sizeof(ShmRingHeader);
+            m_cachedHead = m_hdr->head.load(std::memory_order_acquire);
+            m_cachedTail = m_hdr->tail.load(std::memory_order_acquire);
+        }
+
+        static size_t recordSize(size_t len)
+        {
+            return (4 + len + SHM_RECORD_ALIGN - 1) & ~(size_t)(SHM_RECORD_ALIGN - 1);
+        }
+
+        //生产者：写入一条完整的记录，空间不够返回false，不会写入一半
+        bool tryWrite(const char* data, size_t len)
+        {
+            uint64_t head = m_hdr->head.load(std::memory_order_relaxed);
+            size_t need = recordSize(len);
+            size_t wrap = wrapBytes(head, need);
+            if(!hasSpace(head, wrap + need))
+                return false;
+
+            if(wrap)
+            {
+                uint32_t mark = SHM_RECORD_WRAP;
+                memcpy(m_data + (head & (SHM_RING_BYTES - 1)), &mark, 4);
+                head += wrap;
+            }
+            size_t pos = head & (SHM_RING_BYTES - 1);
+            uint32_t len32 = (uint32_t)len;
+            memcpy(m_data + pos, &len32, 4);
+            memcpy(m_data + pos + 4, data, len);
+            m_hdr->head.store(head + need, std::memory_order_release);
+            return true;
+        }
+
+        //生产者：长度为len的记录现在写得进去吗
+        bool canWrite(size_t len)
+        {
+            uint64_t head = m_hdr->head.load(std::memory_order_relaxed);
+            size_t need = recordSize(len);
+            return hasSpace(head, wrapBytes(head, need) + need);
+        }
+
+        //消费者：依次把记录交给f(const char*, size_t)，最多消费maxBytes字节，返回消费的字节数
+        //数据直接在共享内存里读取，f返回前有效。头位置和长度都是对方写的，不可信：长度超过maxLen、
+        //记录越过头位置或者环尾、位置不对的跳转标记都算损坏，停在这条记录之前并置corrupt()，之后不再读
+        template<typename Func>
+        size_t read(Func f, size_t maxBytes, size_t maxLen = SHM_RING_BYTES)
+        {
+            uint64_t tail = m_hdr->tail.load(std::memory_order_relaxed);
+            uint64_t start = tail;
+            while(tail - start < maxBytes && !m_corrupt)
+            {
+                if(tail == m_cachedHead)
+                {
+                    m_cachedHead = m_hdr->head.load(std::memory_order_acquire);
+                    if(tail == m_cachedHead)
+                        break;
+                }
+
+                uint64_t avail = m_cachedHead - tail;
+                size_t pos = tail & (SHM_RING_BYTES - 1);
+                uint32_t len;
+                memcpy(&len, m_data + pos, 4);
+                if(len == SHM_RECORD_WRAP)
+                {
+                    //生产者只在环尾放不下下一条记录时才跳，跳过的部分和下一条记录都在头位置之前
+                    if(pos == 0 || SHM_RING_BYTES - pos >= avail || avail > SHM_RING_BYTES)
+                    {
+                        m_corrupt = true;
+                        break;
+                    }
+                    tail += SHM_RING_BYTES - pos;
+                    continue;
+                }
+                if(len > maxLen || recordSize(len) > avail || avail > SHM_RING_BYTES || pos + recordSize(len) > SHM_RING_BYTES)
+                {
+                    m_corrupt = true;
+                    break;
+                }
+                f(m_data + pos + 4, (size_t)len);
+                tail += recordSize(len);
+            }
+            if(tail != start) //一批读完才发布一次，减少和生产者之间的cache line来回
+                m_hdr->tail.store(tail, std::memory_order_release);
+            return tail - start;
+        }
+
+        //消费者：丢掉环里已有的所有记录。头位置只在整条记录写完后才发布，跳到那里总是落在记录的边界上
+        void skip()
+        {
+            m_cachedHead = m_hdr->head.load(std::memory_order_acquire);
+            m_hdr->tail.store(m_cachedHead, std::memory_order_release);
+        }
+
+        bool corrupt()
+        {
+            return m_corrupt;
+        }
+
+        bool empty()
+        {
+            return m_hdr->tail.load(std::memory_order_relaxed) == m_hdr->head.load(std::memory_order_acquire);
+        }
+
+        //准备睡眠：先置等待标志再检查一次，防止对方在检查之后、置标志之前写入而漏掉门铃
+        //返回true表示不用睡了，已经有数据/空间
+        bool armReader()
+        {
+            m_hdr->readerWaiting.store(1, std::memory_order_seq_cst);
+            return !empty();
+        }
+
+        bool armWriter(size_t len)
+        {
+            m_hdr->writerWaiting.store(1, std::memory_order_seq_cst);
+            return canWrite(len);
+        }
+
+        //发布数据/空间之后调用：对方在等待时清掉标志并返回true，调用者负责敲门铃
+        bool wakeReader()
+        {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            return m_hdr->readerWaiting.load(std::memory_order_relaxed) && m_hdr->readerWaiting.exchange(0);
+        }
+
+        bool wakeWriter()
+        {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            return m_hdr->writerWaiting.load(std::memory_order_relaxed) && m_hdr->writerWaiting.exchange(0);
+        }
+
+    private:
+        static size_t wrapBytes(uint64_t head, size_t need) //环尾剩余空间放不下时要跳过的字节数
+        {
+            size_t pos = head & (SHM_RING_BYTES - 1);
+            return (pos + need > SHM_RING_BYTES) ? SHM_RING_BYTES - pos : 0;
+        }
+
+        bool hasSpace(uint64_t head, size_t need)
+        {
+            if(head + need - m_cachedTail <= SHM_RING_BYTES)
+                return true;
+            m_cachedTail = m_hdr->tail.load(std::memory_order_acquire);
+            return head + need - m_cachedTail <= SHM_RING_BYTES;
+        }
+
+    private:
+        ShmRingHeader* m_hdr;
+        char*          m_data;
+        uint64_t       m_cachedHead; //消费者缓存的生产者位置
+        uint64_t       m_cachedTail; //生产者缓存的消费者位置
+        bool           m_corrupt; //读到过损坏的记录
+};
+
+//连接的一端：一个发送环、一个接收环、自己等待的门铃和对方的门铃
+class ShmEndpoint final
+{
+    public:
+        ShmEndpoint();
+        ~ShmEndpoint(); //解除映射并关闭门铃
+        ShmEndpoint(const ShmEndpoint&) = delete;
+        ShmEndpoint& operator=(const ShmEndpoint&) = delete;
+
+        //服务端：创建共享段和门铃，再把它们连同回复msg一起通过Unix域socket交给客户端
+        bool create();
+        bool handOver(int sockfd, const char* msg);
+        //客户端：在已经连上的Unix域socket上发送 /shm 并接收共享段，期间socket上收到的其它数据被丢弃
+        bool connect(int sockfd);
+
+        //发送一条消息，环满返回false；对方在等待时顺便敲门铃
+        bool send(const char* data, size_t len);
+        //接收消息，接收端腾出空间且对方在等待时顺便敲门铃；环里的记录损坏时停下，corrupt()返回true
+        template<typename Func>
+        size_t receive(Func f, size_t maxBytes)
+        {
+            size_t n = m_rx.read(f, maxBytes, m_rxMax);
+            if(n && m_rx.wakeWriter())
+                ring();
+            return n;
+        }
+
+        //准备睡眠前调用，返回true表示已经有数据可读或者有空间写入pendingLen字节，不用睡
+        bool arm(bool wantRead, size_t pendingLen);
+        bool wait(int timeoutMs); //阻塞等待自己的门铃(客户端用)，返回是否被敲响
+        void clearBell(); //读走门铃计数(eventfd是非阻塞的)
+        int  bellFd();
+        bool corrupt(); //对方写了损坏的记录，连接不能再用
+
+    private:
+        void ring();
+
+    private:
+        void*   m_base;
+        int     m_memfd; //服务端交出去之前持有
+        int     m_bell; //自己等待的eventfd
+        int     m_peerBell; //对方等待的eventfd
+        ShmRing m_tx;
+        ShmRing m_rx;
+        size_t  m_rxMax; //收到的单条记录的上限：服务端收客户端的消息不超过SHM_MSG_MAX
+};
+
+#endif //SHMRING_H
@@ -0,0 +1,297 @@
+//模拟网络压测：服务端和模拟网络编译进同一个进程(-DCHAT_SIM=1)，用虚拟时钟驱动大量模拟客户端。
+//客户端按设定的延迟、带宽连上来改名，之后随机挑人按固定速率发消息，一部分客户端读得慢，一部分中途被重置或者卡住不读。
+//统计服务端自己每条消息、每次扇出花的线程CPU时间(不经过内核，也没有别的进程抢CPU)，
+//以及几个探针客户端看到的虚拟延迟。虚拟时间只由事件推进，同样的参数和种子每次跑出来的计数完全一样。
+#include"ChatServer.h"
+#include"BenchUtil.h"
+
+#include<time.h>
+#include<stdio.h>
+#include<stdlib.h>
+#include<fcntl.h>
+#include<unistd.h>
+#include<iostream>
+#include<random>
+#include<string>
+#include<vector>
+#include<algorithm>
+
+//事件循环线程自己用掉的CPU时间
+static int64_t cpuNs()
+{
+    timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return (int64_t)now.tv_sec * 1000000000ll + now.tv_nsec;
+}
+
+//压测程序在虚拟时间上安排的动作
+enum ActionType { ACT_MESSAGE, ACT_RESET, ACT_STALL };
+struct Action
+{
+    int64_t    at;
+    ActionType type;
+    int        conn;
+};
+
+struct Bench
+{
+    ChatServer&          server = ChatServer::getInstance();
+    SimNet&              net = SimNet::instance();
+    std::vector<int>     probes; //保存收到的内容、测延迟的连接
+    std::vector<std::string> probeIn;
+    std::vector<int64_t> latencies; //探针收到的每条消息从发出到读到的虚拟时间(微秒)
+    uint64_t             iterations = 0;
+    int64_t              cpu = 0;
+
+    //跑到虚拟时间until，服务端没事做时时钟直接跳过去
+    void runUntil(int64_t until)
+    {
+        while(net.now() < until)
+            step(until);
+    }
+
+    void step(int64_t deadline)
+    {
+        net.setDeadline(deadline);
+        int64_t start = cpuNs();
+        server.runOnce();
+        cpu += cpuNs() - start;
+        iterations++;
+        for(size_t i = 0; i < probes.size(); i++)
+            readProbe(i);
+    }
+
+    //消息是 昵称>发出时间 xxx...，读到整行时记下延迟
+    void readProbe(size_t i)
+    {
+        std::string& in = probeIn[i];
+        net.clientRead(probes[i], [&](std::string_view data, int64_t arriveUs) {
+            in.append(data);
+            size_t pos = 0, eol;
+            while((eol = in.find('\n', pos)) != std::string::npos)
+            {
+                size_t gt = in.find('>', pos);
+                if(gt < eol)
+                {
+                    int64_t sentUs = strtoll(in.c_str() + gt + 1, nullptr, 10);
+                    if(sentUs > 0)
+                        latencies.push_back(arriveUs - sentUs);
+                }
+                pos = eol + 1;
+            }
+            in.erase(0, pos);
+        });
+    }
+};
+
+static void usage(const char* prog)
+{
+    std::cout << "Usage: " << prog << " [-n clients] [-t seconds] [-r messages_per_sec] [-s message_size] [-L latency_ms] [-B bandwidth_kb_per_sec]"
+              << " [-S slow_percent] [-R slow_read_kb_per_sec] [-d reset_percent] [-x stall_percent] [-p probes] [-e seed] [-v]" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+    size_t clients = 100000;
+    double seconds = 5;
+    double rate = 100;
+    size_t size = 64;
+    double latencyMs = 20;
+    double bandwidthKBps = 0;
+    double slowPercent = 1;
+    double slowKBps = 2;
+    double resetPercent = 0.5;
+    double stallPercent = 0.1;
+    size_t probeCount = 4;
+    uint64_t seed = 1;
+    bool verbose = false;
+
+    int opt;
+    while((opt = getopt(argc, argv, "n:t:r:s:L:B:S:R:d:x:p:e:vh")) != -1)
+    {
+        switch(opt)
+        {
+            case 'n': clients = strtoull(optarg, nullptr, 10); break;
+            case 't': seconds = atof(optarg); break;
+            case 'r': rate = atof(optarg); break;
+            case 's': size = strtoull(optarg, nullptr, 10); break;
+            case 'L': latencyMs = atof(optarg); break;
+            case 'B': bandwidthKBps = atof(optarg); break;
+            case 'S': slowPercent = atof(optarg); break;
+            case 'R': slowKBps = atof(optarg); break;
+            case 'd': resetPercent = atof(optarg); break;
+            case 'x': stallPercent = atof(optarg); break;
+            case 'p': probeCount = strtoull(optarg, nullptr, 10); break;
+            case 'e': seed = strtoull(optarg, nullptr, 10); break;
+            case 'v': verbose = true; break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if(clients < 2 || clients + SIM_FIRST_FD + 1 > MAX_CLIENT || probeCount > clients || seconds <= 0 || rate <= 0 || size < 24 ||
+       latencyMs < 0 || slowKBps <= 0)
+    {
+        usage(argv[0]);
+        std::cout << "at most " << MAX_CLIENT - SIM_FIRST_FD - 1 << " clients, messages of at least 24 bytes" << std::endl;
+        return 1;
+    }
+
+    //服务端每个连接都要打印日志，默认丢掉，只留压测结果
+    fflush(stdout);
+    int savedStdout = dup(1);
+    if(!verbose)
+    {
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, 1);
+        close(devnull);
+    }
+
+    Bench bench;
+    SimNet& net = bench.net;
+    std::mt19937_64 rng(seed);
+    if(!bench.server.init())
+        return 1;
+
+    //连接：延迟在设定值的一半到一倍半之间，慢读者随机挑(探针除外)
+    int64_t latencyUs = (int64_t)(latencyMs * 1000);
+    int64_t maxLatencyUs = latencyUs * 3 / 2;
+    size_t slow = 0;
+    std::vector<bool> isSlow(clients, false);
+    double rss0 = rssMb();
+    int64_t wallStart = nowNs();
+    for(size_t i = 0; i < clients; i++)
+    {
+        SimLink link;
+        link.latencyUs = latencyUs / 2 + (latencyUs > 0 ? (int64_t)(rng() % (uint64_t)(latencyUs + 1)) : 0);
+        link.bandwidth = (uint64_t)(bandwidthKBps * 1024);
+        if(i < probeCount)
+        {
+            link.keepData = true;
+        }
+        else if(rng() % 10000 < slowPercent * 100)
+        {
+            link.readRate = (uint64_t)(slowKBps * 1024);
+            isSlow[i] = true;
+            slow++;
+        }
+        net.connect(link);
+    }
+    for(size_t i = 0; i < probeCount; i++)
+    {
+        bench.probes.push_back((int)i);
+        bench.probeIn.emplace_back();
+    }
+    bench.runUntil(net.now() + 2 * maxLatencyUs + 1000);
+
+    //都改成一样长的昵称，扇出的每一行长度相同，发出的字节数就能换算成行数
+    char nick[32];
+    for(size_t i = 0; i < clients; i++)
+    {
+        int n = snprintf(nick, sizeof(nick), "/nick u%06zu\n", i);
+        net.clientSend((int)i, std::string_view(nick, n));
+    }
+    bench.runUntil(net.now() + 2 * maxLatencyUs + 1000);
+    int64_t connectCpu = bench.cpu;
+    uint64_t connectIters = bench.iterations;
+    double rss1 = rssMb();
+    int64_t wallConnected = nowNs();
+
+    //流量：固定间隔从还在线的客户端里随机挑一个发消息；重置和卡住的客户端在流量期间随机的时间发生
+    int64_t trafficStart = net.now();
+    int64_t trafficEnd = trafficStart + (int64_t)(seconds * 1000000);
+    std::vector<Action> actions;
+    int64_t interval = std::max<int64_t>(1, (int64_t)(1000000 / rate));
+    for(int64_t at = trafficStart; at < trafficEnd; at += interval)
+        actions.push_back(Action{at, ACT_MESSAGE, -1});
+    size_t resets = 0, stalls = 0;
+    std::vector<bool> gone(clients, false);
+    for(size_t i = probeCount; i < clients; i++)
+    {
+        uint64_t roll = rng() % 100000;
+        if(roll < resetPercent * 1000)
+            resets++;
+        else if(roll < (resetPercent + stallPercent) * 1000)
+            stalls++;
+        else
+            continue;
+        int64_t at = trafficStart + (int64_t)(rng() % (uint64_t)(trafficEnd - trafficStart));
+        actions.push_back(Action{at, roll < resetPercent * 1000 ? ACT_RESET : ACT_STALL, (int)i});
+    }
+    std::stable_sort(actions.begin(), actions.end(), [](const Action& a, const Action& b) { return a.at < b.at; });
+
+    uint64_t downStart = net.bytesToClients();
+    bench.cpu = 0;
+    bench.iterations = 0;
+    bench.latencies.clear();
+    size_t messages = 0;
+    std::string line;
+    size_t next = 0;
+    while(next < actions.size())
+    {
+        while(next < actions.size() && actions[next].at <= net.now())
+        {
+            Action& act = actions[next++];
+            if(act.type == ACT_MESSAGE)
+            {
+                int conn;
+                do
+                {
+                    conn = (int)(rng() % clients);
+                } while(gone[conn] || net.isClosed(conn));
+                line = std::to_string(net.now()) + " ";
+                line.append(size - 1 - std::min(size - 1, line.size()), 'x');
+                line.push_back('\n');
+                net.clientSend(conn, line);
+                messages++;
+            }
+            else
+            {
+                gone[act.conn] = true;
+                if(act.type == ACT_RESET)
+                    net.clientReset(act.conn);
+                else
+                    net.clientStall(act.conn);
+            }
+        }
+        bench.step(next < actions.size() ? actions[next].at : trafficEnd);
+    }
+    //最后一条消息送到所有人，慢读者和卡住的客户端的积压由服务端按自己的规则处理
+    bench.runUntil(trafficEnd + (STALL_TIMEOUT_SEC + 2) * 1000000ll);
+    int64_t wallEnd = nowNs();
+
+    size_t closed = 0;
+    for(size_t i = 0; i < clients; i++)
+        closed += net.isClosed((int)i);
+    uint64_t sentBytes = net.bytesToClients() - downStart;
+    size_t lineSize = 8 + size; //u000000>加上消息
+    double deliveries = (double)sentBytes / lineSize;
+
+    fflush(stdout);
+    std::cout.flush();
+    dup2(savedStdout, 1);
+    close(savedStdout);
+
+    printf("clients:       %zu connected and renamed, %zu slow readers at %.1f KB/s, latency %.1f-%.1f ms, bandwidth %s\n", clients, slow, slowKBps,
+           latencyUs / 2 / 1e3, maxLatencyUs / 1e3, bandwidthKBps > 0 ? (std::to_string((int)bandwidthKBps) + " KB/s").c_str() : "unlimited");
+    printf("setup:         %.1f us server CPU per client (accept, welcome, /nick), %.0f bytes RSS per client, %.1f s wall, %llu iterations\n",
+           connectCpu / 1e3 / clients, (rss1 - rss0) * 1e6 / clients, (wallConnected - wallStart) / 1e9, (unsigned long long)connectIters);
+    printf("traffic:       %zu messages x %zu bytes over %.1f virtual s, %zu resets, %zu stalls, %zu connections closed by the server\n", messages, size,
+           seconds, resets, stalls, closed);
+    printf("server CPU:    %.1f ms total, %.1f us per message, %.1f ns per fan-out line (%.0f lines, %.1f MB)\n", bench.cpu / 1e6,
+           messages ? bench.cpu / 1e3 / messages : 0, deliveries > 0 ? bench.cpu / deliveries : 0, deliveries, sentBytes / 1e6);
+    printf("net:           %llu sends (%llu short), %llu recvs, %llu clock advances, %llu loop iterations\n", (unsigned long long)net.sends(),
+           (unsigned long long)net.shortSends(), (unsigned long long)net.recvs(), (unsigned long long)net.wakeups(),
+           (unsigned long long)bench.iterations);
+    size_t samples = bench.latencies.size();
+    printf("probe latency: p50 %.2f ms, p99 %.2f ms, max %.2f ms virtual (%zu samples)\n", percentile(bench.latencies, 0.5) / 1e3,
+           percentile(bench.latencies, 0.99) / 1e3, percentile(bench.latencies, 1.0) / 1e3, samples);
+
+    //计数的指纹：同样的参数和种子每次都一样，服务端改动以后可以拿来确认行为没变
+    uint64_t print = 1469598103934665603ull;
+    for(uint64_t v : {(uint64_t)net.sends(), net.shortSends(), net.recvs(), net.wakeups(), net.bytesToClients(), net.bytesToServer(),
+                      (uint64_t)bench.iterations, (uint64_t)closed, (uint64_t)samples})
+        print = (print ^ v) * 1099511628211ull;
+    printf("fingerprint:   %016llx, %.1f s wall for the traffic\n", (unsigned long long)print, (wallEnd - wallConnected) / 1e9);
+    return 0;
+}
@@ -0,0 +1,429 @@
+#include"SimNet.h"
+
+#include<errno.h>
+#include<string.h>
+#include<algorithm>
+
+SimNet& SimNet::instance()
+{
+    static SimNet* net = new SimNet(); //不析构：ChatServer单例析构时还要关闭连接，两个静态对象的析构顺序没法保证
+    return *net;
+}
+
+SimNet::SimNet()
+    : m_now(SIM_START_US),
+      m_deadline(INT64_MAX),
+      m_order(0),
+      m_nextFd(SIM_FIRST_FD),
+      m_listenFd(-1),
+      m_sends(0),
+      m_recvs(0),
+      m_shortSends(0),
+      m_bytesDown(0),
+      m_bytesUp(0),
+      m_wakeups(0)
+{
+}
+
+int64_t SimNet::now()
+{
+    return m_now;
+}
+
+void SimNet::setDeadline(int64_t us)
+{
+    m_deadline = us;
+}
+
+void SimNet::schedule(int64_t at, int conn, EventType type)
+{
+    m_events.push(Event{at, m_order++, conn, type});
+}
+
+SimNet::Conn* SimNet::connOf(int fd)
+{
+    if(fd < 0 || fd >= (int)m_fdConn.size() || m_fdConn[fd] < 0)
+        return nullptr;
+    return &m_conns[m_fdConn[fd]];
+}
+
+int SimNet::allocFd()
+{
+    int fd;
+    if(!m_freeFds.empty())
+    {
+        fd = m_freeFds.top();
+        m_freeFds.pop();
+    }
+    else
+    {
+        fd = m_nextFd++;
+        m_fdConn.resize(m_nextFd, -1);
+        m_fdFlags.resize(m_nextFd, 0);
+    }
+    return fd;
+}
+
+int64_t SimNet::transmit(int64_t& freeUs, const SimLink& link, size_t bytes)
+{
+    int64_t depart = m_now;
+    if(link.bandwidth > 0) //前面的数据还没发完时排在后面
+    {
+        depart = std::max(m_now, freeUs) + (int64_t)(bytes * 1000000 / link.bandwidth);
+        freeUs = depart;
+    }
+    return depart + link.latencyUs;
+}
+
+void SimNet::markReadable(int fd)
+{
+    if(m_fdFlags[fd] & FD_IN_READABLE)
+        return;
+    m_fdFlags[fd] |= FD_IN_READABLE;
+    m_readable.push_back(fd);
+}
+
+//////////////////////客户端一侧
+int SimNet::connect(const SimLink& link)
+{
+    int conn = (int)m_conns.size();
+    Conn& c = m_conns.emplace_back();
+    c.link = link;
+    c.fd = -1;
+    c.upFreeUs = m_now;
+    c.downFreeUs = m_now;
+    c.upStart = 0;
+    c.upArrived = 0;
+    c.finUs = INT64_MAX;
+    c.downBytes = 0;
+    c.downStart = 0;
+    c.received = 0;
+    c.readUs = m_now;
+    c.stalled = false;
+    c.reset = false;
+    c.serverClosed = false;
+    c.wakeScheduled = false;
+    schedule(m_now + link.latencyUs, conn, SIM_CONNECT);
+    return conn;
+}
+
+void SimNet::clientSend(int conn, std::string_view data)
+{
+    Conn& c = m_conns[conn];
+    if(data.empty() || c.reset || c.serverClosed || c.finUs != INT64_MAX)
+        return;
+    int64_t arrive = transmit(c.upFreeUs, c.link, data.size());
+    c.up.push_back(Segment{arrive, (uint32_t)data.size()});
+    c.upData.append(data);
+    m_bytesUp += data.size();
+    schedule(arrive, conn, SIM_ARRIVE);
+}
+
+void SimNet::clientClose(int conn)
+{
+    Conn& c = m_conns[conn];
+    if(c.finUs != INT64_MAX || c.reset)
+        return;
+    c.finUs = std::max(m_now + c.link.latencyUs, c.up.empty() ? 0 : c.up.back().arriveUs); //FIN跟在已经发出的数据后面
+    c.stalled = true;
+    schedule(c.finUs, conn, SIM_ARRIVE);
+}
+
+void SimNet::clientReset(int conn)
+{
+    Conn& c = m_conns[conn];
+    c.stalled = true;
+    schedule(m_now + c.link.latencyUs, conn, SIM_RESET);
+}
+
+void SimNet::clientStall(int conn)
+{
+    m_conns[conn].stalled = true;
+}
+
+bool SimNet::isClosed(int conn)
+{
+    return m_conns[conn].serverClosed;
+}
+
+uint64_t SimNet::received(int conn)
+{
+    Conn& c = m_conns[conn];
+    consume(c);
+    return c.received;
+}
+
+void SimNet::consume(Conn& c)
+{
+    if(c.stalled)
+        return;
+
+    uint64_t rate = c.link.readRate;
+    while(!c.down.empty())
+    {
+        Segment& seg = c.down.front();
+        if(seg.arriveUs > m_now)
+            break;
+
+        //慢读者从数据到达(或者读完上一段)开始按速度读，到现在为止能读多少
+        uint32_t n = seg.bytes;
+        if(rate > 0)
+        {
+            int64_t start = std::max(c.readUs, seg.arriveUs);
+            n = (uint32_t)std::min<uint64_t>(seg.bytes, (uint64_t)(m_now - start) * rate / 1000000);
+            if(n == 0) //不到一个字节的时间留到下次
+                break;
+            c.readUs = start + (int64_t)(((uint64_t)n * 1000000 + rate - 1) / rate);
+        }
+
+        if(c.link.keepData)
+        {
+            if(!c.taken.empty() && c.taken.back().arriveUs == seg.arriveUs)
+                c.taken.back().bytes += n;
+            else
+                c.taken.push_back(Segment{seg.arriveUs, n});
+        }
+        seg.bytes -= n;
+        c.downBytes -= n;
+        c.received += n;
+        if(seg.bytes > 0)
+            break;
+        c.down.pop_front();
+    }
+}
+
+int64_t SimNet::nextWritableUs(Conn& c)
+{
+    if(c.stalled)
+        return INT64_MAX;
+
+    //和consume的算法一样往后推，直到窗口里只剩四分之三
+    size_t need = c.downBytes - c.link.window * 3 / 4;
+    uint64_t rate = c.link.readRate;
+    int64_t t = c.readUs;
+    for(size_t i = 0; i < c.down.size() && need > 0; i++)
+    {
+        Segment& seg = c.down[i];
+        size_t n = std::min<size_t>(seg.bytes, need);
+        if(rate > 0)
+            t = std::max(t, seg.arriveUs) + (int64_t)((n * 1000000 + rate - 1) / rate);
+        else
+            t = seg.arriveUs;
+        need -= n;
+    }
+    return std::max(t, m_now + 1);
+}
+
+//////////////////////服务端一侧
+int SimNet::listen()
+{
+    m_listenFd = allocFd();
+    m_fdConn[m_listenFd] = -2; //不是连接，connOf返回空
+    return m_listenFd;
+}
+
+int SimNet::accept(int listenfd)
+{
+    if(listenfd != m_listenFd || m_acceptQueue.empty())
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+    int conn = m_acceptQueue.front();
+    m_acceptQueue.pop_front();
+
+    int fd = allocFd();
+    m_fdConn[fd] = conn;
+    Conn& c = m_conns[conn];
+    c.fd = fd;
+    if(c.upArrived > 0 || c.reset || c.finUs <= m_now) //accept之前已经到了的数据
+        markReadable(fd);
+    return fd;
+}
+
+ssize_t SimNet::recv(int fd, void* buf, size_t len)
+{
+    Conn* c = connOf(fd);
+    if(!c)
+    {
+        errno = EBADF;
+        return -1;
+    }
+    m_recvs++;
+    if(c->reset)
+    {
+        errno = ECONNRESET;
+        return -1;
+    }
+
+    size_t n = std::min(len, c->upArrived);
+    if(n == 0)
+    {
+        if(c->finUs <= m_now && c->up.empty())
+            return 0;
+        errno = EAGAIN;
+        return -1;
+    }
+    memcpy(buf, c->upData.data() + c->upStart, n);
+    c->upStart += n;
+    c->upArrived -= n;
+    if(c->upStart == c->upData.size())
+    {
+        c->upData.clear();
+        c->upStart = 0;
+    }
+    else if(c->upStart >= 65536 && c->upStart * 2 >= c->upData.size())
+    {
+        c->upData.erase(0, c->upStart);
+        c->upStart = 0;
+    }
+    return n;
+}
+
+ssize_t SimNet::send(int fd, const void* buf, size_t len)
+{
+    Conn* c = connOf(fd);
+    if(!c)
+    {
+        errno = EBADF;
+        return -1;
+    }
+    m_sends++;
+    if(c->reset)
+    {
+        errno = EPIPE;
+        return -1;
+    }
+
+    consume(*c);
+    size_t space = c->link.window - c->downBytes;
+    if(space == 0)
+    {
+        m_shortSends++;
+        errno = EAGAIN;
+        return -1;
+    }
+    size_t n = std::min(len, space);
+    if(n < len)
+        m_shortSends++;
+
+    int64_t arrive = transmit(c->downFreeUs, c->link, n);
+    if(!c->down.empty() && c->down.back().arriveUs == arrive) //同一时刻到达的合成一段，队列不随发送次数变长
+        c->down.back().bytes += n;
+    else
+        c->down.push_back(Segment{arrive, (uint32_t)n});
+    c->downBytes += n;
+    if(c->link.keepData)
+        c->downData.append((const char*)buf, n);
+    m_bytesDown += n;
+    return n;
+}
+
+int SimNet::close(int fd)
+{
+    if(fd < 0 || fd >= (int)m_fdConn.size() || m_fdConn[fd] == -1)
+    {
+        errno = EBADF;
+        return -1;
+    }
+    if(Conn* c = connOf(fd))
+    {
+        c->fd = -1;
+        c->serverClosed = true;
+    }
+    if(fd == m_listenFd)
+        m_listenFd = -1;
+    m_fdConn[fd] = -1;
+    m_freeFds.push(fd); //可读、关注写的列表里留下的旧项下次遍历时去掉
+    return 0;
+}
+
+void SimNet::watchWrite(int fd)
+{
+    if(!isOpen(fd) || (m_fdFlags[fd] & FD_WATCHED))
+        return;
+    m_fdFlags[fd] |= FD_WATCHED;
+    m_watched.push_back(fd);
+}
+
+//////////////////////Poller调用
+bool SimNet::isOpen(int fd)
+{
+    return connOf(fd) != nullptr;
+}
+
+bool SimNet::acceptReady()
+{
+    return m_listenFd >= 0 && !m_acceptQueue.empty();
+}
+
+bool SimNet::readable(int fd)
+{
+    Conn* c = connOf(fd);
+    return c && (c->reset || c->upArrived > 0 || (c->finUs <= m_now && c->up.empty()));
+}
+
+bool SimNet::writable(int fd)
+{
+    Conn* c = connOf(fd);
+    if(!c)
+        return false;
+    if(c->reset)
+        return true;
+
+    consume(*c);
+    if(c->link.window - c->downBytes >= c->link.window / 4)
+        return true;
+    if(!c->wakeScheduled && !c->stalled) //客户端读走足够的数据时唤醒一次poll
+    {
+        c->wakeScheduled = true;
+        schedule(nextWritableUs(*c), m_fdConn[fd], SIM_WAKE);
+    }
+    return false;
+}
+
+void SimNet::fire(const Event& ev)
+{
+    Conn& c = m_conns[ev.conn];
+    switch(ev.type)
+    {
+        case SIM_CONNECT:
+            m_acceptQueue.push_back(ev.conn);
+            return;
+        case SIM_ARRIVE:
+            while(!c.up.empty() && c.up.front().arriveUs <= m_now)
+            {
+                c.upArrived += c.up.front().bytes;
+                c.up.pop_front();
+            }
+            break;
+        case SIM_RESET:
+            c.reset = true;
+            break;
+        case SIM_WAKE:
+            c.wakeScheduled = false;
+            return;
+    }
+    if(c.fd >= 0)
+        markReadable(c.fd);
+}
+
+bool SimNet::advance(int64_t limitUs)
+{
+    int64_t target = std::min(m_deadline, limitUs);
+    bool event = !m_events.empty() && m_events.top().at <= target;
+    if(event)
+        target = m_events.top().at;
+    if(target == INT64_MAX) //没有任何事件也没有上限，真实的select会永远阻塞
+        return false;
+
+    m_now = std::max(m_now, target);
+    m_wakeups++;
+    while(!m_events.empty() && m_events.top().at <= m_now)
+    {
+        Event ev = m_events.top();
+        m_events.pop();
+        fire(ev);
+    }
+    return event;
+}
@@ -0,0 +1,210 @@
+#ifndef SIMNET_H
+#define SIMNET_H
+
+#include<stdint.h>
+#include<stddef.h>
+#include<sys/types.h>
+#include<string>
+#include<string_view>
+#include<vector>
+#include<deque>
+#include<queue>
+#include"RingQueue.h"
+
+//进程内的模拟网络：服务端看到的fd是虚拟连接，读写不进内核，时间是虚拟时钟。
+//每个连接有单向延迟、每个方向的带宽、客户端读数据的速度和发送窗口，客户端可以关闭、重置或者卡住不读。
+//时钟只在服务端poll没有就绪事件时往前推，直接跳到下一个事件(数据到达、窗口腾出空间、压测程序的下一批动作)，
+//服务端处理事件不花虚拟时间，同样的输入每次跑出来的事件顺序和计数完全一样。
+//只在事件循环线程使用，不加锁。
+#define SIM_FIRST_FD     3            //虚拟fd从这里开始分配，和内核一样总是分最小的空闲编号
+#define SIM_WINDOW       (64 * 1024)  //默认的发送窗口：服务端发出、客户端还没读走的数据上限(发送缓冲区加接收窗口)
+#define SIM_START_US     1000000000ll //虚拟时钟的起点，和真实的单调时钟一样远离0
+
+//一个连接的网络条件
+struct SimLink
+{
+    int64_t  latencyUs = 0; //单向延迟
+    uint64_t bandwidth = 0; //每个方向的带宽(字节/秒)，0表示不限
+    uint64_t readRate = 0;  //客户端读数据的速度(字节/秒)，0表示数据到了就读走
+    size_t   window = SIM_WINDOW;
+    bool     keepData = false; //保存服务端发来的内容，压测程序用clientRead取走；否则只计数
+};
+
+class SimNet final
+{
+    public:
+        static SimNet& instance();
+        SimNet(const SimNet&) = delete;
+        SimNet& operator=(const SimNet&) = delete;
+
+        int64_t now(); //虚拟时钟(微秒)
+        void    setDeadline(int64_t us); //服务端poll最多把时钟推进到这里，压测程序在这个时间安排下一批动作
+
+        //客户端一侧，由压测程序调用；conn是连接号，和服务端看到的fd无关
+        int      connect(const SimLink& link); //一个延迟之后服务端能accept
+        void     clientSend(int conn, std::string_view data);
+        void     clientClose(int conn); //发FIN并且不再读，服务端读完已到的数据后读到0
+        void     clientReset(int conn); //一个延迟之后服务端的读写出错
+        void     clientStall(int conn); //不再读，服务端的发送窗口满了以后就一直发不出去
+        bool     isClosed(int conn); //服务端已经关闭了这个连接
+        uint64_t received(int conn); //客户端已经读走的字节数
+
+        //取出keepData的连接已经读走的数据，func(数据, 到达的虚拟时间)按顺序调用
+        template<typename Func>
+        void clientRead(int conn, Func func)
+        {
+            Conn& c = m_conns[conn];
+            consume(c);
+            while(!c.taken.empty())
+            {
+                Segment& seg = c.taken.front();
+                func(std::string_view(c.downData.data() + c.downStart, seg.bytes), seg.arriveUs);
+                c.downStart += seg.bytes;
+                c.taken.pop_front();
+            }
+            if(c.downStart > 0 && c.downStart * 2 >= c.downData.size())
+            {
+                c.downData.erase(0, c.downStart);
+                c.downStart = 0;
+            }
+        }
+
+        //服务端一侧，语义和对应的非阻塞系统调用一样，出错时设置errno
+        int     listen();
+        int     accept(int listenfd);
+        ssize_t recv(int fd, void* buf, size_t len);
+        ssize_t send(int fd, const void* buf, size_t len);
+        int     close(int fd);
+        void    watchWrite(int fd); //发送队列开始积压，Poller之后检查这个fd什么时候能写
+
+        //Poller调用
+        bool isOpen(int fd);
+        bool acceptReady();
+        bool readable(int fd); //有数据、读到FIN或者连接被重置
+        bool writable(int fd); //窗口腾出了四分之一以上，或者连接被重置；不能写时安排一次唤醒
+        bool advance(int64_t limitUs); //把时钟推进到下一个事件(最多到limitUs和deadline)并处理，到了上限返回false
+
+        //遍历可读的fd，顺便去掉已经不可读的
+        template<typename Func>
+        void forEachReadable(Func func)
+        {
+            size_t kept = 0;
+            for(size_t i = 0; i < m_readable.size(); i++)
+            {
+                int fd = m_readable[i];
+                if(!readable(fd))
+                {
+                    m_fdFlags[fd] &= ~FD_IN_READABLE;
+                    continue;
+                }
+                m_readable[kept++] = fd;
+                func(fd);
+            }
+            m_readable.resize(kept);
+        }
+
+        //遍历关注写的fd，func返回false表示不再关注
+        template<typename Func>
+        void forEachWatched(Func func)
+        {
+            size_t kept = 0;
+            for(size_t i = 0; i < m_watched.size(); i++)
+            {
+                int fd = m_watched[i];
+                if(!isOpen(fd) || !func(fd))
+                {
+                    m_fdFlags[fd] &= ~FD_WATCHED;
+                    continue;
+                }
+                m_watched[kept++] = fd;
+            }
+            m_watched.resize(kept);
+        }
+
+        //累计计数，同样的输入每次都一样
+        uint64_t sends() { return m_sends; }
+        uint64_t recvs() { return m_recvs; }
+        uint64_t shortSends() { return m_shortSends; } //窗口不够，只发出一部分或者EAGAIN
+        uint64_t bytesToClients() { return m_bytesDown; }
+        uint64_t bytesToServer() { return m_bytesUp; }
+        uint64_t wakeups() { return m_wakeups; } //advance推进时钟的次数
+
+    private:
+        SimNet();
+
+        struct Segment
+        {
+            int64_t  arriveUs;
+            uint32_t bytes;
+        };
+
+        struct Conn
+        {
+            SimLink             link;
+            int                 fd; //还没accept或者已经关闭时是-1
+            int64_t             upFreeUs; //上行链路在这个时间之前都在发前面的数据(带宽限制)
+            int64_t             downFreeUs;
+            RingQueue<Segment>  up; //客户端发出、还没到达服务端的数据
+            std::string         upData; //upStart之前的部分已经被服务端读走
+            size_t              upStart;
+            size_t              upArrived; //已经到达、还没被读走的字节数
+            int64_t             finUs; //客户端关闭时FIN到达的时间，没有关闭是INT64_MAX
+            RingQueue<Segment>  down; //服务端发出、客户端还没读走的数据
+            size_t              downBytes;
+            RingQueue<Segment>  taken; //keepData时客户端已经读走、压测程序还没取的数据
+            std::string         downData; //keepData时保存的内容，downStart之前已经被取走
+            size_t              downStart;
+            uint64_t            received;
+            int64_t             readUs; //慢读者按读的速度读到了这个时间，没有数据可读的时间不攒额度
+            bool                stalled;
+            bool                reset;
+            bool                serverClosed;
+            bool                wakeScheduled;
+        };
+
+        //事件按时间排序，时间相同时按加入的先后，保证每次处理的顺序一样
+        enum EventType { SIM_CONNECT, SIM_ARRIVE, SIM_RESET, SIM_WAKE };
+        struct Event
+        {
+            int64_t   at;
+            uint64_t  order;
+            int       conn;
+            EventType type;
+            bool operator>(const Event& rhs) const { return at != rhs.at ? at > rhs.at : order > rhs.order; }
+        };
+
+        enum { FD_IN_READABLE = 1, FD_WATCHED = 2 };
+
+        void    schedule(int64_t at, int conn, EventType type);
+        void    fire(const Event& ev);
+        void    markReadable(int fd);
+        Conn*   connOf(int fd);
+        int     allocFd();
+        int64_t transmit(int64_t& freeUs, const SimLink& link, size_t bytes); //返回到达时间
+        void    consume(Conn& c); //客户端读走到现在为止能读的数据
+        int64_t nextWritableUs(Conn& c); //窗口腾出四分之一的时间
+
+    private:
+        int64_t                                                       m_now;
+        int64_t                                                       m_deadline;
+        uint64_t                                                      m_order;
+        std::priority_queue<Event, std::vector<Event>, std::greater<>> m_events;
+        std::deque<Conn>                                              m_conns; //连接号 -> 连接，只增不减
+        std::vector<int>                                              m_fdConn; //fd -> 连接号，-1表示空闲
+        std::vector<uint8_t>                                          m_fdFlags;
+        std::priority_queue<int, std::vector<int>, std::greater<>>     m_freeFds;
+        int                                                           m_nextFd;
+        int                                                           m_listenFd;
+        RingQueue<int>                                                m_acceptQueue; //已经到达、等着accept的连接
+        std::vector<int>                                              m_readable;
+        std::vector<int>                                              m_watched;
+
+        uint64_t                                                      m_sends;
+        uint64_t                                                      m_recvs;
+        uint64_t                                                      m_shortSends;
+        uint64_t                                                      m_bytesDown;
+        uint64_t                                                      m_bytesUp;
+        uint64_t                                                      m_wakeups;
+};
+
+#endif //SIMNET_H
@@ -0,0 +1,100 @@
+#ifndef TASK_H
+#define TASK_H
+
+#include<stddef.h>
+#include<coroutine>
+#include<exception>
+#include<new>
+
+#define FRAME_POOL_ALIGN   64   //按64字节分级，同一个协程函数的帧大小固定，总是落在同一级
+#define FRAME_POOL_CLASSES 64   //最大能缓存 64 * 64 = 4K 的帧，更大的直接走operator new
+
+//协程帧池：每个连接一个会话协程，连接断开时帧放回空闲链表，下一个连接直接复用，不经过malloc。
+//只在事件循环线程上使用，不加锁。
+class FramePool final
+{
+    public:
+        static void* allocate(size_t size)
+        {
+            size_t cls = (size + FRAME_POOL_ALIGN - 1) / FRAME_POOL_ALIGN;
+            if(cls >= FRAME_POOL_CLASSES)
+                return ::operator new(size);
+
+            FreeFrame*& head = s_free[cls];
+            if(head)
+            {
+                FreeFrame* frame = head;
+                head = frame->next;
+                return frame;
+            }
+            return ::operator new(cls * FRAME_POOL_ALIGN);
+        }
+
+        static void deallocate(void* p, size_t size)
+        {
+            size_t cls = (size + FRAME_POOL_ALIGN - 1) / FRAME_POOL_ALIGN;
+            if(cls >= FRAME_POOL_CLASSES)
+            {
+                ::operator delete(p);
+                return;
+            }
+
+            FreeFrame* frame = (FreeFrame*)p;
+            frame->next = s_free[cls];
+            s_free[cls] = frame;
+        }
+
+    private:
+        struct FreeFrame
+        {
+            FreeFrame* next;
+        };
+        static inline FreeFrame* s_free[FRAME_POOL_CLASSES] = {};
+};
+
+//连接会话协程：创建后立即运行到第一个co_await，结束后停在final_suspend，
+//由持有者(Client)检查done()并负责销毁帧，协程自己不能释放它所在的连接
+class Task final
+{
+    public:
+        struct promise_type
+        {
+            Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+            std::suspend_never initial_suspend() noexcept { return {}; }
+            std::suspend_always final_suspend() noexcept { return {}; }
+            void return_void() {}
+            void unhandled_exception() { std::terminate(); }
+
+            static void* operator new(size_t size) { return FramePool::allocate(size); }
+            static void operator delete(void* p, size_t size) { FramePool::deallocate(p, size); }
+        };
+
+        Task() = default;
+        explicit Task(std::coroutine_handle<promise_type> handle) : m_handle(handle) {}
+        Task(Task&& rhs) noexcept : m_handle(rhs.m_handle) { rhs.m_handle = nullptr; }
+        Task& operator=(Task&& rhs) noexcept
+        {
+            if(this != &rhs)
+            {
+                if(m_handle)
+                    m_handle.destroy();
+                m_handle = rhs.m_handle;
+                rhs.m_handle = nullptr;
+            }
+            return *this;
+        }
+        ~Task()
+        {
+            if(m_handle) //挂起中的协程也可以直接销毁，帧里的局部变量会被析构
+                m_handle.destroy();
+        }
+        Task(const Task&) = delete;
+        Task& operator=(const Task&) = delete;
+
+        bool done() const { return m_handle && m_handle.done(); }
+
+    private:
+        std::coroutine_handle<promise_type> m_handle;
+};
+
+#endif //TASK_H
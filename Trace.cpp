@@ -0,0 +1,87 @@
+#include"Trace.h"
+
+#include<signal.h>
+#include<unistd.h>
+#include<sys/syscall.h>
+#include<stdio.h>
+#include<cstring>
+#include<mutex>
+#include<vector>
+
+namespace trace
+{
+    thread_local ThreadBuffer* t_buffer = nullptr;
+
+    static std::mutex                 s_mutex; //只保护登记表，写事件不加锁
+    static std::vector<ThreadBuffer*> s_buffers;
+    static volatile sig_atomic_t      s_dumpFlag = 0;
+
+    ThreadBuffer::ThreadBuffer(int tid) : m_tid(tid), m_head(0)
+    {
+    }
+
+    ThreadBuffer* registerThread()
+    {
+        //线程退出后缓冲区仍然保留，导出时还能看到它的事件
+        ThreadBuffer* buf = new ThreadBuffer((int)syscall(SYS_gettid));
+        std::lock_guard<std::mutex> lock(s_mutex);
+        s_buffers.push_back(buf);
+        return buf;
+    }
+
+    bool dump(const std::string& path)
+    {
+        FILE* fp = fopen(path.c_str(), "w");
+        if(!fp)
+            return false;
+
+        int pid = getpid();
+        bool first = true;
+        fprintf(fp, "{\"traceEvents\":[\n");
+
+        std::lock_guard<std::mutex> lock(s_mutex);
+        for(ThreadBuffer* buf : s_buffers)
+        {
+            uint64_t head = buf->head();
+            //环形缓冲区已经回绕时，最旧的一段可能正在被写线程覆盖，留出余量不读
+            uint64_t begin = 0;
+            if(head > TRACE_BUFFER_EVENTS)
+                begin = head - TRACE_BUFFER_EVENTS + 1024;
+
+            for(uint64_t i = begin; i < head; i++)
+            {
+                const Event& ev = buf->at(i);
+                fprintf(fp, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%llu.%03llu,\"pid\":%d,\"tid\":%d}",
+                        first ? "" : ",\n", ev.name, ev.phase,
+                        (unsigned long long)(ev.ts / 1000), (unsigned long long)(ev.ts % 1000),
+                        pid, buf->tid());
+                first = false;
+            }
+        }
+
+        fprintf(fp, "\n]}\n");
+        return fclose(fp) == 0;
+    }
+
+    static void onDumpSignal(int)
+    {
+        s_dumpFlag = 1;
+    }
+
+    void installDumpSignal()
+    {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = onDumpSignal;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGUSR2, &sa, nullptr); //不设SA_RESTART，让select返回EINTR后及时导出
+    }
+
+    bool dumpRequested()
+    {
+        if(!s_dumpFlag)
+            return false;
+        s_dumpFlag = 0;
+        return true;
+    }
+}
@@ -0,0 +1,88 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include<sys/socket.h>
+#include<sys/types.h>
+#include<unistd.h>
+#include<errno.h>
+#include<time.h>
+#include<stdint.h>
+#include"SimNet.h"
+
+//编译时开关：-DCHAT_SIM=1 时服务端的socket读写、accept、close和时钟都换成进程内的模拟网络(SimNet)，
+//由压测程序simbench驱动；否则每个接口都是内联的系统调用，和直接调用没有区别
+#ifndef CHAT_SIM
+#define CHAT_SIM 0
+#endif
+
+namespace transport
+{
+    constexpr bool kSimulated = CHAT_SIM;
+
+    inline int64_t nowUs() //单调时钟(微秒)
+    {
+        if constexpr(kSimulated)
+            return SimNet::instance().now();
+        timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+    }
+
+    inline ssize_t recv(int fd, void* buf, size_t len)
+    {
+        if constexpr(kSimulated)
+            return SimNet::instance().recv(fd, buf, len);
+        return ::recv(fd, buf, len, 0);
+    }
+
+    inline ssize_t send(int fd, const void* buf, size_t len, int flags = 0)
+    {
+        if constexpr(kSimulated)
+            return SimNet::instance().send(fd, buf, len); //模拟的连接总是非阻塞，没有零拷贝
+        return ::send(fd, buf, len, flags);
+    }
+
+    inline int accept(int listenfd, sockaddr* addr = nullptr, socklen_t* len = nullptr)
+    {
+        if constexpr(kSimulated)
+            return SimNet::instance().accept(listenfd);
+        return ::accept(listenfd, addr, len);
+    }
+
+    inline int close(int fd)
+    {
+        if constexpr(kSimulated)
+            return SimNet::instance().close(fd);
+        return ::close(fd);
+    }
+
+    //模拟的连接没有socket选项，一律返回不支持，走和选项设置失败一样的路径
+    inline int setsockopt(int fd, int level, int name, const void* value, socklen_t len)
+    {
+        if constexpr(kSimulated)
+        {
+            errno = ENOPROTOOPT;
+            return -1;
+        }
+        return ::setsockopt(fd, level, name, value, len);
+    }
+
+    inline int getsockname(int fd, sockaddr* addr, socklen_t* len)
+    {
+        if constexpr(kSimulated)
+        {
+            errno = ENOTSOCK;
+            return -1;
+        }
+        return ::getsockname(fd, addr, len);
+    }
+
+    //发送队列开始积压：select每轮都扫所有连接，不用登记；模拟网络只检查登记过的连接
+    inline void watchWrite(int fd)
+    {
+        if constexpr(kSimulated)
+            SimNet::instance().watchWrite(fd);
+    }
+}
+
+#endif //TRANSPORT_H
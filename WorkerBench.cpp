@@ -0,0 +1,268 @@
+//多进程模式的扩展性压测：对每个worker个数启动一次 ./server -W n，连上一批接收者和几个发送者。
+//发送者在各自的线程里阻塞地尽快发消息，服务端的读流控会把它们压到扇出跟得上的速度；接收者分给几个线程用epoll读、数行数。
+//输出每个worker个数下每秒进来的消息、扇出的行数和相对第一个配置的加速比。
+//dropped不为0说明压测端读得比服务端发得慢，积压超过CLIENT_OUTBUF_MAX的接收者被断开了，这时的数字没有意义：
+//把压测放到另一台机器上、加读线程(-T)，或者用-r限制总的发送速率，找扇出能持续跟上的最高速率。
+//测量之前每个发送者先发一条探针，检查每个接收者都收到了所有探针：连到不同worker上的用户确实在同一个聊天室
+#include"BenchUtil.h"
+
+#include<sys/socket.h>
+#include<sys/epoll.h>
+#include<sys/wait.h>
+#include<fcntl.h>
+#include<signal.h>
+#include<poll.h>
+#include<time.h>
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<unistd.h>
+#include<errno.h>
+#include<atomic>
+#include<thread>
+#include<iostream>
+#include<string>
+#include<vector>
+#include<algorithm>
+
+extern "C" {
+#include"smallchat/chatlib.h"
+}
+
+//读到包含want的行为止，超时返回false
+static bool waitFor(int fd, const std::string& want, std::string& buf, int timeoutMs)
+{
+    int64_t deadline = nowNs() + timeoutMs * 1000000ll;
+    while(buf.find(want) == std::string::npos)
+    {
+        int left = (int)((deadline - nowNs()) / 1000000);
+        pollfd pfd = {fd, POLLIN, 0};
+        if(left <= 0 || poll(&pfd, 1, left) <= 0)
+            return false;
+        char tmp[4096];
+        ssize_t n = read(fd, tmp, sizeof(tmp));
+        if(n <= 0)
+            return false;
+        buf.append(tmp, n);
+    }
+    return true;
+}
+
+struct Result
+{
+    double msgsPerSec;
+    double linesPerSec;
+    int    dropped; //测量期间被服务端断开的接收者(读得比服务端发得慢)
+    bool   shared; //所有接收者都收到了所有发送者的探针
+};
+
+static Result runOnce(const char* server, int workers, int port, int receivers, int senders, int size, int seconds, int threads, int rate)
+{
+    Result result = {0, 0, 0, false};
+    pid_t pid = startServer(server, port, {"-W", std::to_string(workers), "-s", "0"}); //关掉检索，只测扇出
+    if(pid == -1)
+    {
+        std::cout << "start " << server << " -W " << workers << " failure" << std::endl;
+        return result;
+    }
+
+    std::vector<int> rx, tx;
+    for(int i = 0; i < receivers; i++)
+        rx.push_back(openSession(port));
+    for(int i = 0; i < senders; i++)
+        tx.push_back(openSession(port));
+    if(std::count(rx.begin(), rx.end(), -1) || std::count(tx.begin(), tx.end(), -1))
+    {
+        std::cout << "connect failure" << std::endl;
+        stopServer(pid);
+        return result;
+    }
+
+    //探针：内核把连接分给了不同的worker，每个接收者都要看到每个发送者的消息
+    for(int i = 0; i < senders; i++)
+    {
+        std::string line = "/nick s" + std::to_string(i) + "\nprobe " + std::to_string(i) + "\n";
+        write(tx[i], line.data(), line.size());
+    }
+    result.shared = true;
+    for(int fd : rx)
+    {
+        std::string buf;
+        for(int i = 0; i < senders && result.shared; i++)
+            result.shared = waitFor(fd, "s" + std::to_string(i) + ">probe " + std::to_string(i) + "\n", buf, 3000);
+    }
+    std::atomic<bool> stop(false);
+    std::atomic<uint64_t> lines(0), sent(0);
+    std::atomic<int> dropped(0);
+
+    //接收者按线程分组，每个线程一个epoll，只数换行；发送者也收得到别的发送者的消息，一起读掉但不算，否则会因为读得太慢被断开
+    std::vector<int> readers = rx;
+    readers.insert(readers.end(), tx.begin(), tx.end());
+    std::vector<bool> isSender(*std::max_element(readers.begin(), readers.end()) + 1, false);
+    for(int fd : tx)
+        isSender[fd] = true;
+    std::vector<std::thread> pool;
+    for(int t = 0; t < threads; t++)
+    {
+        pool.emplace_back([&, t]() {
+            int ep = epoll_create1(0);
+            for(size_t i = t; i < readers.size(); i += threads)
+            {
+                fcntl(readers[i], F_SETFL, fcntl(readers[i], F_GETFL) | O_NONBLOCK);
+                epoll_event ev = {EPOLLIN, {.fd = readers[i]}};
+                epoll_ctl(ep, EPOLL_CTL_ADD, readers[i], &ev);
+            }
+            std::vector<char> buf(65536);
+            epoll_event events[64];
+            while(!stop.load(std::memory_order_relaxed))
+            {
+                int n = epoll_wait(ep, events, 64, 100);
+                uint64_t count = 0;
+                for(int i = 0; i < n; i++)
+                {
+                    int fd = events[i].data.fd;
+                    ssize_t got = read(fd, buf.data(), buf.size());
+                    if(got == 0 || (got == -1 && errno != EAGAIN && errno != EINTR))
+                    {
+                        epoll_ctl(ep, EPOLL_CTL_DEL, fd, nullptr);
+                        if(!isSender[fd])
+                            dropped++;
+                        continue;
+                    }
+                    if(got > 0 && !isSender[fd])
+                        count += std::count(buf.data(), buf.data() + got, '\n');
+                }
+                lines.fetch_add(count, std::memory_order_relaxed);
+            }
+            close(ep);
+        });
+    }
+
+    //发送者：一次写一批整行，阻塞写，服务端暂停读它时就停在这里；限速时每个发送者分到总速率的一份，超前了就睡一会
+    const int linesPerChunk = 32;
+    std::string chunk;
+    for(int i = 0; i < linesPerChunk; i++)
+        chunk += std::string(size - 1, 'x') + "\n";
+    for(int fd : tx)
+    {
+        pool.emplace_back([&, fd]() {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+            timeval timeout = {0, 100000}; //阻塞写也要定期检查stop
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+            size_t off = 0;
+            uint64_t mine = 0; //这个发送者写出的字节数
+            int64_t begin = nowNs();
+            while(!stop.load(std::memory_order_relaxed))
+            {
+                if(rate > 0 && off == 0 && (double)(mine / size + linesPerChunk) * senders * 1e9 / rate > nowNs() - begin)
+                {
+                    usleep(1000);
+                    continue;
+                }
+                ssize_t n = send(fd, chunk.data() + off, chunk.size() - off, MSG_NOSIGNAL);
+                if(n == -1 && errno != EAGAIN && errno != EINTR)
+                    break;
+                if(n <= 0)
+                    continue;
+                size_t before = off;
+                off = (off + n) % chunk.size();
+                mine += n;
+                sent.fetch_add((before + n) / size - before / size, std::memory_order_relaxed); //完整写出的行
+            }
+        });
+    }
+
+    sleep(1); //预热：队列和拥塞窗口进入稳定状态
+    uint64_t lines0 = lines.load(), sent0 = sent.load();
+    int64_t start = nowNs();
+    sleep(seconds);
+    uint64_t lines1 = lines.load(), sent1 = sent.load();
+    double elapsed = (nowNs() - start) / 1e9;
+    result.dropped = dropped.load();
+
+    stop = true;
+    for(std::thread& t : pool)
+        t.join();
+    for(int fd : readers)
+        close(fd);
+    stopServer(pid);
+
+    result.msgsPerSec = (sent1 - sent0) / elapsed;
+    result.linesPerSec = (lines1 - lines0) / elapsed;
+    return result;
+}
+
+static void usage(const char* prog)
+{
+    std::cout << "Usage: " << prog << " [-w workers,...] [-c receivers] [-n senders] [-s size] [-t seconds] [-T threads] [-r msgs/s] [-S server] [-p port]" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+    std::vector<int> counts = {1, 2, 4};
+    int receivers = 200;
+    int senders = 4;
+    int size = 64;
+    int seconds = 5;
+    int threads = std::max(1, (int)sysconf(_SC_NPROCESSORS_ONLN));
+    const char* server = "./server";
+    int port = 7711;
+    int rate = 0; //所有发送者加起来每秒发的消息数，0表示不限速
+
+    int opt;
+    while((opt = getopt(argc, argv, "w:c:n:s:t:T:r:S:p:h")) != -1)
+    {
+        switch(opt)
+        {
+            case 'w':
+            {
+                counts.clear();
+                char* p = optarg;
+                while(*p)
+                {
+                    counts.push_back(strtol(p, &p, 10));
+                    if(*p == ',')
+                        p++;
+                    else if(*p)
+                        break;
+                }
+                break;
+            }
+            case 'c': receivers = atoi(optarg); break;
+            case 'n': senders = atoi(optarg); break;
+            case 's': size = atoi(optarg); break;
+            case 't': seconds = atoi(optarg); break;
+            case 'T': threads = atoi(optarg); break;
+            case 'r': rate = atoi(optarg); break;
+            case 'S': server = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if(counts.empty() || receivers < 1 || senders < 1 || size < 2 || seconds < 1 || threads < 1 || rate < 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    std::cout << receivers << " receivers, " << senders << " senders, " << size << "-byte messages, " << seconds << "s per run, "
+              << threads << " reader threads, " << sysconf(_SC_NPROCESSORS_ONLN) << " cpus";
+    if(rate > 0)
+        std::cout << ", " << rate << " msgs/s offered";
+    std::cout << std::endl;
+    printf("%8s %14s %16s %9s %9s %s\n", "workers", "msgs in/s", "lines out/s", "speedup", "dropped", "room");
+    double base = 0;
+    for(int workers : counts)
+    {
+        Result r = runOnce(server, workers, port, receivers, senders, size, seconds, threads, rate);
+        if(base == 0)
+            base = r.linesPerSec;
+        printf("%8d %14.0f %16.0f %8.2fx %9d %s\n", workers, r.msgsPerSec, r.linesPerSec, base > 0 ? r.linesPerSec / base : 0, r.dropped,
+               r.shared ? "shared" : "SPLIT");
+        fflush(stdout);
+    }
+    return 0;
+}
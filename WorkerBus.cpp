@@ -0,0 +1,186 @@
+#include"WorkerBus.h"
+
+#include<sys/mman.h>
+#include<sys/eventfd.h>
+#include<unistd.h>
+#include<errno.h>
+#include<new>
+
+WorkerBus::WorkerBus()
+    : m_base(nullptr),
+      m_bytes(0),
+      m_workers(0),
+      m_index(-1),
+      m_nextPeer(0),
+      m_backlogTotal(0),
+      m_dropped(0)
+{
+}
+
+WorkerBus::~WorkerBus()
+{
+    if(m_base)
+        munmap(m_base, m_bytes);
+    for(int bell : m_bells)
+        close(bell);
+}
+
+bool WorkerBus::create(int workers)
+{
+    if(workers < 1 || workers > WORKER_MAX)
+        return false;
+
+    //匿名共享映射在fork之后仍然是同一段内存；页面用到才分配，没有流量的环不占内存
+    m_workers = workers;
+    m_bytes = (size_t)workers * workers * SHM_RING_STRIDE;
+    m_base = mmap(nullptr, m_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(m_base == MAP_FAILED)
+    {
+        m_base = nullptr;
+        return false;
+    }
+    for(int from = 0; from < workers; from++)
+    {
+        for(int to = 0; to < workers; to++)
+            new(ringAt(from, to)) ShmRingHeader{};
+    }
+
+    for(int i = 0; i < workers; i++)
+    {
+        int bell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC); //worker只fork不exec，CLOEXEC不影响继承
+        if(bell == -1)
+            return false;
+        m_bells.push_back(bell);
+    }
+    m_peers = std::make_unique<Peer[]>(workers);
+    return true;
+}
+
+void WorkerBus::join(int index)
+{
+    m_index = index;
+    m_nextPeer = 0;
+    for(int i = 0; i < m_workers; i++)
+    {
+        if(i == index)
+            continue;
+        Peer& peer = m_peers[i];
+        peer.tx.attach(ringAt(index, i));
+        peer.rx.attach(ringAt(i, index));
+        peer.rx.skip(); //上一个实例的连接都已经断开，发给它的消息没有人要了
+        if(peer.rx.wakeWriter()) //对方可能正因为环满在等
+            knock(i);
+    }
+    clearBell();
+}
+
+int WorkerBus::workers()
+{
+    return m_workers;
+}
+
+int WorkerBus::index()
+{
+    return m_index;
+}
+
+int WorkerBus::bellFd()
+{
+    return m_bells[m_index];
+}
+
+void WorkerBus::publish(const std::shared_ptr<const std::string>& batch)
+{
+    if(batch->size() > BUS_RECORD_MAX)
+    {
+        m_dropped++;
+        return;
+    }
+
+    for(int to = 0; to < m_workers; to++)
+    {
+        if(to == m_index)
+            continue;
+        Peer& peer = m_peers[to];
+        if(peer.backlog.empty() && peer.tx.tryWrite(batch->data(), batch->size()))
+        {
+            if(peer.tx.wakeReader())
+                knock(to);
+            continue;
+        }
+
+        //前面还有排队的记录时也要排在后面，保证对方看到的顺序和本进程的广播顺序一样
+        if(peer.backlogBytes + batch->size() > BUS_BACKLOG_MAX)
+        {
+            m_dropped++;
+            continue;
+        }
+        peer.backlog.push_back(batch);
+        peer.backlogBytes += batch->size();
+        m_backlogTotal += batch->size();
+    }
+}
+
+bool WorkerBus::flush(int to)
+{
+    Peer& peer = m_peers[to];
+    bool wrote = false;
+    while(!peer.backlog.empty())
+    {
+        const std::string& batch = *peer.backlog.front();
+        if(!peer.tx.tryWrite(batch.data(), batch.size()))
+            break;
+        peer.backlogBytes -= batch.size();
+        m_backlogTotal -= batch.size();
+        peer.backlog.pop_front();
+        wrote = true;
+    }
+    if(wrote && peer.tx.wakeReader())
+        knock(to);
+    return peer.backlog.empty();
+}
+
+bool WorkerBus::arm(bool wantRead)
+{
+    bool ready = false;
+    for(int i = 0; i < m_workers; i++)
+    {
+        if(i == m_index)
+            continue;
+        Peer& peer = m_peers[i];
+        if(!peer.backlog.empty() && !flush(i) && peer.tx.armWriter(peer.backlog.front()->size()))
+            ready = true;
+        if(wantRead && peer.rx.armReader())
+            ready = true;
+    }
+    return ready;
+}
+
+void WorkerBus::clearBell()
+{
+    uint64_t count;
+    while(read(m_bells[m_index], &count, sizeof(count)) == -1 && errno == EINTR)
+        ;
+}
+
+uint64_t WorkerBus::dropped()
+{
+    return m_dropped;
+}
+
+size_t WorkerBus::backlogBytes()
+{
+    return m_backlogTotal;
+}
+
+void* WorkerBus::ringAt(int from, int to)
+{
+    return (char*)m_base + ((size_t)from * m_workers + to) * SHM_RING_STRIDE;
+}
+
+void WorkerBus::knock(int to)
+{
+    uint64_t one = 1;
+    while(write(m_bells[to], &one, sizeof(one)) == -1 && errno == EINTR)
+        ;
+}
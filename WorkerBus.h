@@ -0,0 +1,95 @@
+#ifndef WORKERBUS_H
+#define WORKERBUS_H
+
+#include<stdint.h>
+#include<stddef.h>
+#include<memory>
+#include<string>
+#include<vector>
+#include"ShmRing.h"
+#include"RingQueue.h"
+
+//多进程模式下worker之间转发广播的总线：启动器在fork之前映射一段匿名共享内存，每对worker之间一个单生产者
+//单消费者的ShmRing(和/shm连接用的是同一种环)，每个worker一个eventfd门铃，只有对方读空后置了等待标志才敲。
+//worker广播一批消息时把它写进发往其它每个worker的环，对方取出来再扇出给自己的连接。
+//环的头位置只在整条记录写完后才发布，worker崩溃不会在环里留下半条记录；重启的实例接着往外写，发给它的旧消息直接丢掉
+#define WORKER_MAX       16 //每对worker一个SHM_RING_BYTES的环，共享段随worker个数平方增长
+//对方读得慢时环会满，记录先在本地排队。排队超过HIGH时服务端暂停读本进程的所有连接，降到LOW以下恢复，
+//背压和单进程里发送队列超预算时一样传回发消息的客户端；单个对方的排队超过MAX就丢弃并计数(对方卡死或者正在重启)
+#define BUS_BACKLOG_HIGH (4 * 1024 * 1024)
+#define BUS_BACKLOG_LOW  (1 * 1024 * 1024)
+#define BUS_BACKLOG_MAX  (16 * 1024 * 1024)
+#define BUS_RECORD_MAX   (SHM_RING_BYTES / 4) //单条记录的上限，更大的批次不转发
+
+class WorkerBus final
+{
+    public:
+        WorkerBus();
+        ~WorkerBus(); //启动器和每个worker各自解除映射、关闭门铃
+        WorkerBus(const WorkerBus&) = delete;
+        WorkerBus& operator=(const WorkerBus&) = delete;
+
+        bool create(int workers); //启动器在fork之前调用，共享段和门铃由所有worker继承
+        void join(int index); //worker启动(包括崩溃后重启)时调用：接上自己的环，丢掉发给上一个实例、还没读的消息
+        int  workers();
+        int  index();
+        int  bellFd(); //自己的门铃，交给Poller关注
+
+        //把一批广播发给其它所有worker；环满时在本地排队，之后按顺序补发
+        void publish(const std::shared_ptr<const std::string>& batch);
+
+        //依次把其它worker发来的记录交给f(const char*, size_t)，最多消费maxBytes字节，返回消费的字节数；
+        //数据直接在共享内存里读取，f返回前有效。腾出空间后对方在等就敲它的门铃
+        template<typename Func>
+        size_t receive(Func f, size_t maxBytes)
+        {
+            size_t total = 0;
+            for(int k = 0; k < m_workers && total < maxBytes; k++)
+            {
+                int from = (m_nextPeer + k) % m_workers;
+                if(from == m_index)
+                    continue;
+                Peer& peer = m_peers[from];
+                size_t n = peer.rx.read(f, maxBytes - total);
+                if(n && peer.rx.wakeWriter())
+                    knock(from);
+                total += n;
+            }
+            m_nextPeer = (m_nextPeer + 1) % m_workers; //轮流从不同的worker开始，发得多的不会让别的饿着
+            return total;
+        }
+
+        //事件循环睡眠前调用：补发排队的记录，给要等的环置等待标志。
+        //返回true表示已经有数据可读(wantRead时)或者有空间补发，不能睡
+        bool arm(bool wantRead);
+        void clearBell(); //读走门铃计数
+
+        uint64_t dropped(); //因为排队超过上限或者太大而没有转发的批次
+        size_t   backlogBytes(); //所有排队记录的字节数
+
+    private:
+        struct Peer
+        {
+            ShmRing tx; //自己发往对方的环
+            ShmRing rx; //对方发来的环
+            RingQueue<std::shared_ptr<const std::string>> backlog; //环满时排队的批次，共享广播的payload
+            size_t  backlogBytes = 0;
+        };
+
+        void* ringAt(int from, int to);
+        bool  flush(int to); //补发排队的记录，排空返回true
+        void  knock(int to); //敲对方的门铃
+
+    private:
+        void*                   m_base;
+        size_t                  m_bytes;
+        int                     m_workers;
+        int                     m_index;
+        std::vector<int>        m_bells; //每个worker的门铃
+        std::unique_ptr<Peer[]> m_peers; //按worker编号，自己那一项不用
+        int                     m_nextPeer;
+        size_t                  m_backlogTotal;
+        uint64_t                m_dropped;
+};
+
+#endif //WORKERBUS_H
@@ -0,0 +1,229 @@
+#include"WorkerPool.h"
+
+#include<sys/socket.h>
+#include<sys/wait.h>
+#include<sys/prctl.h>
+#include<netinet/in.h>
+#include<linux/filter.h>
+#include<signal.h>
+#include<unistd.h>
+#include<errno.h>
+#include<string.h>
+#include<time.h>
+#include<stdlib.h>
+#include<algorithm>
+#include<iostream>
+
+static int64_t nowMs()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+WorkerPool::WorkerPool()
+    : m_workers(0),
+      m_steer(false)
+{
+}
+
+WorkerPool::~WorkerPool()
+{
+    for(int fd : m_listenFds)
+        close(fd);
+}
+
+bool WorkerPool::start(int workers, int port, bool steer)
+{
+    m_workers = workers;
+    m_steer = steer;
+    if(!m_bus.create(workers))
+    {
+        std::cout << "create worker bus failure" << std::endl;
+        return false;
+    }
+
+    //按编号依次bind，socket在SO_REUSEPORT组里的顺序就是worker编号，BPF程序返回的下标才对得上
+    for(int i = 0; i < workers; i++)
+    {
+        int fd = listenReusePort(port);
+        if(fd == -1)
+            return false;
+        m_listenFds.push_back(fd);
+    }
+    if(steer && !attachSteering())
+    {
+        std::cout << "attach reuseport steering program failure: " << strerror(errno) << ", falling back to hashing" << std::endl;
+        m_steer = false;
+    }
+
+    m_pids.assign(workers, -1);
+    m_startMs.assign(workers, 0);
+    m_restartMs.assign(workers, 0);
+    return true;
+}
+
+int WorkerPool::listenReusePort(int port)
+{
+    int listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    if(listenfd == -1)
+    {
+        std::cout << "socket failure" << std::endl;
+        return -1;
+    }
+
+    int yes = 1;
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    if(setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)) == -1)
+    {
+        std::cout << "SO_REUSEPORT failure: " << strerror(errno) << std::endl;
+        close(listenfd);
+        return -1;
+    }
+
+    sockaddr_in saddr;
+    memset(&saddr, 0, sizeof(saddr));
+    saddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    saddr.sin_port = htons(port);
+    saddr.sin_family = AF_INET;
+    if(bind(listenfd, (struct sockaddr*)&saddr, sizeof(saddr)) == -1 || listen(listenfd, 511) == -1)
+    {
+        std::cout << "bind failure" << std::endl;
+        close(listenfd);
+        return -1;
+    }
+    return listenfd;
+}
+
+bool WorkerPool::attachSteering()
+{
+    //经典BPF：A = 处理这个包的CPU % worker个数，返回组里的第A个socket
+    sock_filter code[] = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (uint32_t)(SKF_AD_OFF + SKF_AD_CPU)),
+        BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, (uint32_t)m_workers),
+        BPF_STMT(BPF_RET | BPF_A, 0),
+    };
+    sock_fprog prog;
+    prog.len = sizeof(code) / sizeof(code[0]);
+    prog.filter = code;
+    return setsockopt(m_listenFds[0], SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == 0; //挂在组上，对组里所有socket生效
+}
+
+pid_t WorkerPool::spawn(int index, WorkerMain& main)
+{
+    pid_t parent = getpid();
+    pid_t pid = fork();
+    if(pid == -1)
+    {
+        std::cout << "fork worker " << index << " failure: " << strerror(errno) << std::endl;
+        m_restartMs[index] = nowMs() + WORKER_RESTART_MIN_MS;
+        return -1;
+    }
+
+    if(pid == 0)
+    {
+        sigprocmask(SIG_SETMASK, &m_oldMask, nullptr);
+        prctl(PR_SET_PDEATHSIG, SIGTERM); //启动器被强行杀掉时worker跟着退出，不留下占着端口的孤儿
+        if(getppid() != parent) //设置之前启动器就已经退出了
+            _exit(0);
+
+        for(int i = 0; i < m_workers; i++) //别的worker的监听socket由启动器留着
+        {
+            if(i != index)
+                close(m_listenFds[i]);
+        }
+        m_bus.join(index);
+
+        int cpu = -1;
+        if(m_steer)
+            cpu = index % std::max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+        exit(main(index, m_listenFds[index], cpu, &m_bus)); //exit而不是_exit：让ChatServer等静态对象正常析构
+    }
+
+    m_startMs[index] = nowMs();
+    std::cout << "worker " << index << " started, pid " << pid << std::endl;
+    return pid;
+}
+
+int WorkerPool::run(WorkerMain main)
+{
+    //启动器只在sigtimedwait里等信号：worker退出(SIGCHLD)、停止(SIGINT/SIGTERM)或者到了推迟重启的时间，
+    //没有检查标志和阻塞之间的竞争。worker在fork之后恢复原来的信号掩码
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &set, &m_oldMask);
+
+    for(int i = 0; i < m_workers; i++)
+        m_pids[i] = spawn(i, main);
+
+    bool stopping = false;
+    while(!stopping)
+    {
+        //最早一个推迟重启的时间，没有就一直等
+        int64_t now = nowMs();
+        int64_t next = -1;
+        for(int i = 0; i < m_workers; i++)
+        {
+            if(m_pids[i] == -1 && (next < 0 || m_restartMs[i] < next))
+                next = m_restartMs[i];
+        }
+        if(next >= 0 && next <= now)
+        {
+            for(int i = 0; i < m_workers; i++)
+            {
+                if(m_pids[i] == -1 && m_restartMs[i] <= now)
+                    m_pids[i] = spawn(i, main);
+            }
+            continue;
+        }
+
+        timespec timeout = {(next - now) / 1000, (next - now) % 1000 * 1000000};
+        int sig = sigtimedwait(&set, nullptr, next >= 0 ? &timeout : nullptr);
+        if(sig == SIGINT || sig == SIGTERM)
+        {
+            stopping = true;
+        }
+        else if(sig == SIGCHLD)
+        {
+            int status;
+            pid_t pid;
+            while((pid = waitpid(-1, &status, WNOHANG)) > 0)
+                reap(pid, status);
+        }
+    }
+
+    for(pid_t pid : m_pids)
+    {
+        if(pid > 0)
+            kill(pid, SIGTERM);
+    }
+    for(pid_t pid : m_pids)
+    {
+        if(pid > 0)
+            waitpid(pid, nullptr, 0);
+    }
+    std::cout << "all workers stopped" << std::endl;
+    return 0;
+}
+
+void WorkerPool::reap(pid_t pid, int status)
+{
+    int index = -1;
+    for(int i = 0; i < m_workers; i++)
+    {
+        if(m_pids[i] == pid)
+            index = i;
+    }
+    if(index < 0)
+        return;
+
+    if(WIFSIGNALED(status))
+        std::cout << "worker " << index << " (pid " << pid << ") killed by signal " << WTERMSIG(status) << ", restarting" << std::endl;
+    else
+        std::cout << "worker " << index << " (pid " << pid << ") exited with status " << WEXITSTATUS(status) << ", restarting" << std::endl;
+    m_pids[index] = -1;
+    m_restartMs[index] = std::max(nowMs(), m_startMs[index] + WORKER_RESTART_MIN_MS);
+}
@@ -0,0 +1,50 @@
+#ifndef WORKERPOOL_H
+#define WORKERPOOL_H
+
+#include<sys/types.h>
+#include<signal.h>
+#include<stdint.h>
+#include<functional>
+#include<vector>
+#include"WorkerBus.h"
+
+//多进程模式的启动器：在同一个端口上为每个worker建一个SO_REUSEPORT的监听socket，由内核在它们之间分配新连接；
+//建好总线后fork出worker，每个worker是一个完整的单线程ChatServer，进程之间不共享锁，只通过总线交换广播。
+//启动器自己不处理连接，只看护：worker异常退出就用同一个编号、同一个监听socket重启，监听队列里等着的连接不会丢；
+//收到SIGINT/SIGTERM时转发给所有worker，等它们退出
+#define WORKER_RESTART_MIN_MS 1000 //worker启动后这么短时间内就退出，等这么久再重启，避免崩溃循环占满CPU
+
+class WorkerPool final
+{
+    public:
+        //worker的入口：编号、属于它的监听socket、要绑的核(-1表示不绑)、总线，返回进程的退出码
+        using WorkerMain = std::function<int(int index, int listenfd, int cpu, WorkerBus* bus)>;
+
+        WorkerPool();
+        ~WorkerPool();
+        WorkerPool(const WorkerPool&) = delete;
+        WorkerPool& operator=(const WorkerPool&) = delete;
+
+        //steer为true时worker i绑在第i个核上，并在监听socket组上挂一段按收包的CPU选socket的BPF程序，
+        //连接在哪个核上收包就交给那个核上的worker
+        bool start(int workers, int port, bool steer);
+        int  run(WorkerMain main); //fork出所有worker并看护，直到收到停止信号
+
+    private:
+        int   listenReusePort(int port); //返回监听socket，失败返回-1
+        bool  attachSteering();
+        pid_t spawn(int index, WorkerMain& main);
+        void  reap(pid_t pid, int status); //worker退出，安排重启
+
+    private:
+        int                  m_workers;
+        bool                 m_steer;
+        std::vector<int>     m_listenFds; //按worker编号，也是它们在SO_REUSEPORT组里的顺序
+        std::vector<pid_t>   m_pids; //-1表示没有在运行
+        std::vector<int64_t> m_startMs;
+        std::vector<int64_t> m_restartMs; //退出的worker在这个时间重启
+        sigset_t             m_oldMask; //worker恢复成这个信号掩码
+        WorkerBus            m_bus;
+};
+
+#endif //WORKERPOOL_H
@@ -1,6 +1,7 @@
 #define _POSIX_C_SOURCE 200112L
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
@@ -96,8 +97,11 @@ int TCPConnect(char *addr, int port, int nonblock) {
         if (connect(s,p->ai_addr,p->ai_addrlen) == -1) {
             /* If the socket is non-blocking, it is ok for connect() to
              * return an EINPROGRESS error here. */
-            //这里有问题就是他不一定连接成功还有就是，内存servinfo并没有得到释放
-            if (errno == EINPROGRESS && nonblock) return s;
+            //非阻塞时连接还在进行，由调用者等可写后确认；servinfo也要释放，否则每次重连都会泄漏
+            if (errno == EINPROGRESS && nonblock) {
+                retval = s;
+                break;
+            }
 
             /* Otherwise it's an error. */
             //如果一个servinfo连接失败了那么就会直接跳出for循环，代表不行
@@ -115,6 +119,31 @@ int TCPConnect(char *addr, int port, int nonblock) {
     return retval; /* Will be -1 if no connection succeded. */
 }
 
+/* Connect to a Unix domain stream socket at 'path'. Same return value
+ * and 'nonblock' semantics as TCPConnect(). */
+int UnixConnect(char *path, int nonblock) {
+    int s;
+    struct sockaddr_un sa;
+
+    if (strlen(path) >= sizeof(sa.sun_path)) return -1;
+    memset(&sa,0,sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strcpy(sa.sun_path,path);
+
+    if ((s = socket(AF_UNIX,SOCK_STREAM,0)) == -1) return -1;
+    if (nonblock && socketSetNonBlockNoDelay(s) == -1) {
+        close(s);
+        return -1;
+    }
+    /* Unlike TCP there is no EINPROGRESS here: a non blocking connect()
+     * either succeeds or fails with EAGAIN if the backlog is full. */
+    if (connect(s,(struct sockaddr*)&sa,sizeof(sa)) == -1) {
+        close(s);
+        return -1;
+    }
+    return s;
+}
+
 /* If the listening socket signaled there is a new connection ready to
  * be accepted, we accept(2) it and return -1 on error or the new client
  * socket on success. */
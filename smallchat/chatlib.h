@@ -6,6 +6,7 @@ int createTCPServer(int port);
 int socketSetNonBlockNoDelay(int fd);
 int acceptClient(int server_socket);
 int TCPConnect(char *addr, int port, int nonblock);
+int UnixConnect(char *path, int nonblock);
 
 /* Allocation. */
 void *chatMalloc(size_t size);
@@ -0,0 +1,291 @@
+/* smallchat-bench.c -- Fan-out load generator for the chat server.
+ *
+ * One sender connection writes timestamped lines, every other connection
+ * just drains what the server broadcasts. At the end we print delivered
+ * throughput, the fan-out latency seen by the first receiver and, when the
+ * server pid is given, how much CPU the server burned per GB delivered. */
+
+#define _POSIX_C_SOURCE 200112L
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+
+#include "chatlib.h"
+
+/* ============================================================================
+ * Helpers.
+ * ========================================================================== */
+
+long long nowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (long long)ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+/* Return user+system CPU seconds used so far by 'pid', or -1. */
+double processCpuSeconds(int pid) {
+    char path[64], buf[1024];
+    snprintf(path,sizeof(path),"/proc/%d/stat",pid);
+    FILE *fp = fopen(path,"r");
+    if (fp == NULL) return -1;
+    size_t n = fread(buf,1,sizeof(buf)-1,fp);
+    fclose(fp);
+    buf[n] = '\0';
+
+    /* Skip "pid (comm)" since comm may contain spaces, then fields
+     * 3..13, so that utime and stime are the next two. */
+    char *p = strrchr(buf,')');
+    if (p == NULL) return -1;
+    unsigned long utime, stime;
+    if (sscanf(p+2,"%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+               &utime,&stime) != 2) return -1;
+    return (double)(utime+stime) / sysconf(_SC_CLK_TCK);
+}
+
+/* Return the value in kB of a "Name:   123 kB" line of /proc/<pid>/status,
+ * or -1. */
+long processStatusKb(int pid, const char *name) {
+    char path[64], line[256];
+    snprintf(path,sizeof(path),"/proc/%d/status",pid);
+    FILE *fp = fopen(path,"r");
+    if (fp == NULL) return -1;
+    long kb = -1;
+    size_t namelen = strlen(name);
+    while (fgets(line,sizeof(line),fp)) {
+        if (strncmp(line,name,namelen) == 0 && line[namelen] == ':') {
+            kb = atol(line+namelen+1);
+            break;
+        }
+    }
+    fclose(fp);
+    return kb;
+}
+
+/* Connect over the Unix socket 'unixpath' when set, TCP otherwise. */
+char *unixpath = NULL;
+
+int benchConnect(char *host, int port, int nonblock) {
+    if (unixpath) return UnixConnect(unixpath,nonblock);
+    return TCPConnect(host,port,nonblock);
+}
+
+int cmpLongLong(const void *a, const void *b) {
+    long long x = *(const long long*)a, y = *(const long long*)b;
+    return (x > y) - (x < y);
+}
+
+/* ============================================================================
+ * Benchmark.
+ * ========================================================================== */
+
+struct Receiver {
+    int fd;
+    long long lines;        /* Lines (messages) received so far. */
+    long long bytes;
+    char line[4096];        /* Partial line, only used by receiver 0. */
+    int linelen;
+};
+
+void usage(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s [-H host] [-p port] [-U unix-socket] [-c receivers] [-s msgsize]\n"
+        "          [-n messages] [-w window] [-x stalled] [-a churn]\n"
+        "          [-P server-pid]\n"
+        "\n"
+        "  -a N  open N short lived connections per message sent, to\n"
+        "        overload the accept path while measuring latency\n"
+        "  -x N  also open N connections that never read, to check that\n"
+        "        the server memory stays bounded under a flood (use a big -w)\n",prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    char *host = "127.0.0.1";
+    int port = 7711, nrecv = 100, msgsize = 512, window = 1, pid = 0, nstalled = 0, churn = 0;
+    long long count = 10000;
+
+    int opt;
+    while ((opt = getopt(argc,argv,"H:p:U:c:s:n:w:x:a:P:")) != -1) {
+        switch(opt) {
+        case 'H': host = optarg; break;
+        case 'p': port = atoi(optarg); break;
+        case 'U': unixpath = optarg; break;
+        case 'c': nrecv = atoi(optarg); break;
+        case 's': msgsize = atoi(optarg); break;
+        case 'n': count = atoll(optarg); break;
+        case 'w': window = atoi(optarg); break;
+        case 'x': nstalled = atoi(optarg); break;
+        case 'a': churn = atoi(optarg); break;
+        case 'P': pid = atoi(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (nrecv < 1 || msgsize < 32 || window < 1) usage(argv[0]);
+
+    struct Receiver *r = chatMalloc(sizeof(*r)*nrecv);
+    struct pollfd *pfd = chatMalloc(sizeof(*pfd)*(nrecv+1));
+    long long *lat = chatMalloc(sizeof(long long)*count);
+    long long nlat = 0;
+    char *msg = chatMalloc(msgsize);
+    char drain[65536];
+
+    for (int j = 0; j < nrecv; j++) {
+        memset(&r[j],0,sizeof(r[j]));
+        if ((r[j].fd = benchConnect(host,port,0)) == -1) {
+            perror("Connecting to server");
+            exit(1);
+        }
+        socketSetNonBlockNoDelay(r[j].fd);
+    }
+    for (int j = 0; j < nstalled; j++) {
+        if (benchConnect(host,port,0) == -1) {
+            perror("Connecting to server");
+            exit(1);
+        }
+    }
+    int sender = benchConnect(host,port,0);
+    if (sender == -1) {
+        perror("Connecting to server");
+        exit(1);
+    }
+
+    /* Let the welcome banners arrive and throw them away, so that
+     * we only count broadcast lines from now on. */
+    poll(NULL,0,200);
+    for (int j = 0; j < nrecv; j++)
+        while (read(r[j].fd,drain,sizeof(drain)) > 0);
+    read(sender,drain,sizeof(drain));
+
+    /* When the server applies backpressure the sender must not block,
+     * otherwise we would stop draining the receivers as well. */
+    socketSetNonBlockNoDelay(sender);
+    int msgoff = msgsize; /* Bytes of 'msg' already written. */
+
+    /* Short lived connections: we keep the last CHURN_KEEP open and close
+     * the oldest one every time a new one is created. */
+    #define CHURN_KEEP 64
+    int churnfds[CHURN_KEEP], churnidx = 0;
+    long long churned = 0;
+    for (int j = 0; j < CHURN_KEEP; j++) churnfds[j] = -1;
+
+    double cpu0 = pid ? processCpuSeconds(pid) : -1;
+    long long start = nowNs(), sent = 0, lastProgress = start;
+
+    while (r[0].lines < count) {
+        /* Keep at most 'window' messages in flight, as seen by the first
+         * receiver, so that we measure the server, not our own queues.
+         * The server assumes one line per read, so only raise it above 1
+         * when the server buffers input. */
+        while (sent < count && sent - r[0].lines < window) {
+            if (msgoff == msgsize) {
+                int hdr = snprintf(msg,msgsize,"%lld:",nowNs());
+                memset(msg+hdr,'x',msgsize-hdr-1);
+                msg[msgsize-1] = '\n';
+                msgoff = 0;
+            }
+            ssize_t n = write(sender,msg+msgoff,msgsize-msgoff);
+            if (n == -1 && errno == EAGAIN) break;
+            if (n <= 0) {
+                perror("Writing to server");
+                exit(1);
+            }
+            msgoff += n;
+            if (msgoff < msgsize) break;
+            sent++;
+
+            for (int j = 0; j < churn; j++) {
+                if (churnfds[churnidx] != -1) close(churnfds[churnidx]);
+                churnfds[churnidx] = benchConnect(host,port,1);
+                churnidx = (churnidx+1) % CHURN_KEEP;
+                churned++;
+            }
+        }
+
+        for (int j = 0; j < nrecv; j++) {
+            pfd[j].fd = r[j].fd;
+            pfd[j].events = POLLIN;
+        }
+        if (poll(pfd,nrecv,1000) == -1 && errno != EINTR) {
+            perror("poll() error");
+            exit(1);
+        }
+
+        for (int j = 0; j < nrecv; j++) {
+            if (!(pfd[j].revents & (POLLIN|POLLHUP|POLLERR))) continue;
+            ssize_t n = read(r[j].fd,drain,sizeof(drain));
+            if (n == 0) {
+                fprintf(stderr,"Receiver %d disconnected\n",j);
+                exit(1);
+            }
+            if (n < 0) continue;
+            r[j].bytes += n;
+            for (ssize_t k = 0; k < n; k++) {
+                if (j == 0 && r[j].linelen < (int)sizeof(r[j].line)-1)
+                    r[j].line[r[j].linelen++] = drain[k];
+                if (drain[k] != '\n') continue;
+                r[j].lines++;
+                if (j == 0) {
+                    /* Lines look like "nick>timestamp:xxxx". */
+                    r[j].line[r[j].linelen] = '\0';
+                    char *ts = strchr(r[j].line,'>');
+                    long long t = ts ? atoll(ts+1) : 0;
+                    if (t > 0 && nlat < count)
+                        lat[nlat++] = nowNs() - t;
+                    r[j].linelen = 0;
+                }
+            }
+            lastProgress = nowNs();
+        }
+
+        if (nowNs() - lastProgress > 10000000000LL) {
+            fprintf(stderr,"No progress for 10 seconds, giving up\n");
+            break;
+        }
+    }
+
+    /* The other receivers may still be behind the first one. */
+    for (int j = 1; j < nrecv; j++) {
+        while (r[j].lines < r[0].lines && nowNs() - lastProgress < 5000000000LL) {
+            ssize_t n = read(r[j].fd,drain,sizeof(drain));
+            if (n <= 0) { poll(NULL,0,1); continue; }
+            r[j].bytes += n;
+            for (ssize_t k = 0; k < n; k++)
+                if (drain[k] == '\n') r[j].lines++;
+            lastProgress = nowNs();
+        }
+    }
+
+    double elapsed = (nowNs() - start) / 1e9;
+    double cpu1 = pid ? processCpuSeconds(pid) : -1;
+    long long lines = 0, bytes = 0;
+    for (int j = 0; j < nrecv; j++) {
+        lines += r[j].lines;
+        bytes += r[j].bytes;
+    }
+
+    printf("receivers:     %d\n", nrecv);
+    if (churn) printf("churned:       %lld connections\n", churned);
+    printf("messages:      %lld sent, %lld delivered\n", sent, lines);
+    printf("elapsed:       %.3f s\n", elapsed);
+    printf("throughput:    %.0f msg/s, %.1f MB/s\n",
+        lines/elapsed, bytes/elapsed/1e6);
+    if (nlat) {
+        qsort(lat,nlat,sizeof(long long),cmpLongLong);
+        printf("latency:       p50 %.1f us, p99 %.1f us, max %.1f us\n",
+            lat[nlat/2]/1e3, lat[nlat*99/100]/1e3, lat[nlat-1]/1e3);
+    }
+    if (pid) {
+        printf("server rss:    %.1f MB now, %.1f MB peak\n",
+            processStatusKb(pid,"VmRSS")/1024.0,
+            processStatusKb(pid,"VmHWM")/1024.0);
+    }
+    if (cpu0 >= 0 && cpu1 >= 0 && bytes) {
+        printf("server cpu:    %.3f s, %.3f s/GB\n",
+            cpu1-cpu0, (cpu1-cpu0) / (bytes/1e9));
+    }
+    return 0;
+}
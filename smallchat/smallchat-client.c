@@ -28,6 +28,7 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#define _POSIX_C_SOURCE 200112L
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -36,6 +37,7 @@
 #include <unistd.h>
 #include <termios.h>
 #include <errno.h>
+#include <time.h>
 
 #include "chatlib.h"
 
@@ -193,23 +195,226 @@ void inputBufferClear(struct InputBuffer *ib) {
     inputBufferHide(ib);
 }
 
+/* ============================================================================
+ * Headless mode.
+ * 无终端模式：stdin或stdout不是终端时(或者-b)使用，给管道和压测脚本用。
+ * stdin按大块读，凑齐的整行合并成一次write发给服务端；服务端发来的数据
+ * 读到没有为止再一次性写到stdout，不重画提示行。
+ * ========================================================================== */
+
+#define HL_IOBUF (64*1024)          /* Bytes per read() from stdin/socket. */
+#define HL_PENDING_MAX (1024*1024)  /* Stop reading stdin above this. */
+
+struct Buffer {
+    char *buf;
+    size_t len;
+    size_t cap;
+};
+
+/* Make room for 'len' more bytes, returning where they should go. */
+char *bufferReserve(struct Buffer *b, size_t len) {
+    if (b->len + len > b->cap) {
+        b->cap = (b->len + len) * 2;
+        b->buf = chatRealloc(b->buf,b->cap);
+    }
+    return b->buf+b->len;
+}
+
+void bufferAppend(struct Buffer *b, const char *data, size_t len) {
+    memcpy(bufferReserve(b,len),data,len);
+    b->len += len;
+}
+
+/* Drop the first 'len' bytes. */
+void bufferConsume(struct Buffer *b, size_t len) {
+    memmove(b->buf,b->buf+len,b->len-len);
+    b->len -= len;
+}
+
+long long nowMs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (long long)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+/* Write everything to a blocking fd (stdout). */
+void writeAll(int fd, const char *data, size_t len) {
+    while (len) {
+        ssize_t n = write(fd,data,len);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            exit(1); /* Reader went away, e.g. "| head". */
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+/* Send lines from stdin to the server, copy what the server sends to stdout.
+ * 'rate' limits the lines per second sent (0 = unlimited), 'count' the total
+ * lines (-1 = all of stdin). After stdin ends and everything was sent, keep
+ * printing incoming messages for 'linger' milliseconds and exit. */
+void headlessLoop(int s, double rate, long count, long linger) {
+    struct Buffer in = {0}, out = {0}, term = {0};
+    int stdin_fd = fileno(stdin), stdout_fd = fileno(stdout);
+    int stdin_open = 1;
+    long sent = 0;
+    double tokens = 1;  /* Token bucket, refilled at 'rate' up to 1s worth. */
+    long long last = nowMs(), deadline = -1;
+
+    socketSetNonBlockNoDelay(s);
+    while(1) {
+        /* Move as many complete lines as allowed from 'in' to 'out'. At the
+         * end of stdin a last line without newline gets one. */
+        if (rate > 0) {
+            long long now = nowMs();
+            tokens += (now-last)*rate/1000;
+            if (tokens > (rate > 1 ? rate : 1)) tokens = rate > 1 ? rate : 1;
+            last = now;
+        }
+        size_t taken = 0;
+        while (taken < in.len && (count < 0 || sent < count) &&
+               (rate <= 0 || tokens >= 1))
+        {
+            char *nl = memchr(in.buf+taken,'\n',in.len-taken);
+            if (nl == NULL && stdin_open) break;
+            size_t linelen = nl ? (size_t)(nl-(in.buf+taken))+1 : in.len-taken;
+            bufferAppend(&out,in.buf+taken,linelen);
+            if (nl == NULL) bufferAppend(&out,"\n",1);
+            taken += linelen;
+            sent++;
+            if (rate > 0) tokens -= 1;
+        }
+        bufferConsume(&in,taken);
+        if (count >= 0 && sent >= count) {
+            stdin_open = 0;
+            in.len = 0;
+        }
+
+        /* Everything sent: linger for incoming messages, then exit. */
+        if (!stdin_open && in.len == 0 && out.len == 0) {
+            if (deadline == -1) deadline = nowMs()+linger;
+            if (nowMs() >= deadline) break;
+        }
+
+        fd_set readfds, writefds;
+        FD_ZERO(&readfds);
+        FD_ZERO(&writefds);
+        FD_SET(s,&readfds);
+        if (out.len) FD_SET(s,&writefds);
+        int read_stdin = stdin_open && in.len < HL_PENDING_MAX &&
+                         out.len < HL_PENDING_MAX;
+        if (read_stdin) FD_SET(stdin_fd,&readfds);
+        int maxfd = s > stdin_fd ? s : stdin_fd;
+
+        /* Wake up for the next token or the end of the linger time. */
+        struct timeval tv, *timeout = NULL;
+        long long wait = -1;
+        if (rate > 0 && in.len) wait = (long long)((1-tokens)*1000/rate)+1;
+        if (deadline != -1) {
+            long long left = deadline-nowMs();
+            if (wait == -1 || left < wait) wait = left > 0 ? left : 0;
+        }
+        if (wait >= 0) {
+            tv.tv_sec = wait/1000;
+            tv.tv_usec = (wait%1000)*1000;
+            timeout = &tv;
+        }
+
+        if (select(maxfd+1,&readfds,&writefds,NULL,timeout) == -1) {
+            if (errno == EINTR) continue;
+            perror("select() error");
+            exit(1);
+        }
+
+        if (FD_ISSET(s,&readfds)) {
+            /* Drain the socket, then a single write to stdout. */
+            while(1) {
+                ssize_t n = read(s,bufferReserve(&term,HL_IOBUF),HL_IOBUF);
+                if (n > 0) {
+                    term.len += n;
+                    if (term.len >= HL_PENDING_MAX) break;
+                    continue;
+                }
+                if (n == 0) {
+                    writeAll(stdout_fd,term.buf,term.len);
+                    fprintf(stderr,"Connection lost\n");
+                    exit(stdin_open || out.len ? 1 : 0);
+                }
+                if (errno == EAGAIN || errno == EINTR) break;
+                perror("Reading from server");
+                exit(1);
+            }
+            writeAll(stdout_fd,term.buf,term.len);
+            term.len = 0;
+        }
+
+        if (FD_ISSET(s,&writefds) && out.len) {
+            ssize_t n = write(s,out.buf,out.len);
+            if (n > 0) {
+                bufferConsume(&out,n);
+            } else if (n == -1 && errno != EAGAIN && errno != EINTR) {
+                perror("Writing to server");
+                exit(1);
+            }
+        }
+
+        if (read_stdin && FD_ISSET(stdin_fd,&readfds)) {
+            ssize_t n = read(stdin_fd,bufferReserve(&in,HL_IOBUF),HL_IOBUF);
+            if (n > 0) in.len += n;
+            else if (n == 0 || errno != EINTR) stdin_open = 0;
+        }
+    }
+    free(in.buf);
+    free(out.buf);
+    free(term.buf);
+}
+
 /* =============================================================================
  * Main program logic, finally :)
  * ========================================================================== */
 
+void usage(char *prog) {
+    printf("Usage: %s [-b] [-r lines_per_sec] [-n lines] [-w linger_ms] <host> <port>\n", prog);
+    printf("  -b  headless mode even on a terminal (default when stdin or\n"
+           "      stdout is not a terminal)\n");
+    printf("  -r  headless: send at most this many lines per second\n");
+    printf("  -n  headless: send at most this many lines, then stop\n");
+    printf("  -w  headless: after sending everything keep printing incoming\n"
+           "      messages for this many milliseconds (default 0)\n");
+    exit(1);
+}
+
 int main(int argc, char **argv) {
-    if (argc != 3) {
-        printf("Usage: %s <host> <port>\n", argv[0]);
-        exit(1);
+    int headless = 0;
+    double rate = 0;
+    long count = -1, linger = 0;
+    int opt;
+
+    while ((opt = getopt(argc,argv,"br:n:w:")) != -1) {
+        switch(opt) {
+        case 'b': headless = 1; break;
+        case 'r': rate = atof(optarg); break;
+        case 'n': count = atol(optarg); break;
+        case 'w': linger = atol(optarg); break;
+        default: usage(argv[0]);
+        }
     }
- 
+    if (argc-optind != 2) usage(argv[0]);
+
     /* Create a TCP connection with the server. */
-    int s = TCPConnect(argv[1],atoi(argv[2]),0);
+    int s = TCPConnect(argv[optind],atoi(argv[optind+1]),0);
     if (s == -1) {
         perror("Connecting to server");
         exit(1);
     }
 
+    if (headless || !isatty(fileno(stdin)) || !isatty(fileno(stdout))) {
+        headlessLoop(s,rate,count,linger);
+        close(s);
+        return 0;
+    }
+
     /* Put the terminal in raw mode: this way we will receive every
      * single key stroke as soon as the user types it. No buffering
      * nor translation of escape sequences of any kind. */
@@ -242,14 +447,16 @@ int main(int argc, char **argv) {
             char buf[128]; /* Generic buffer for both code paths. */
 
             if (FD_ISSET(s, &readfds)) {
-                /* Data from the server? */
-                ssize_t count = read(s,buf,sizeof(buf));
+                /* Data from the server? Read a big chunk so that a busy
+                 * room costs one redraw per read, not one per 128 bytes. */
+                static char netbuf[HL_IOBUF];
+                ssize_t count = read(s,netbuf,sizeof(netbuf));
                 if (count <= 0) {
                     printf("Connection lost\n");
                     exit(1);
                 }
                 inputBufferHide(&ib);
-                write(fileno(stdout),buf,count);//往标准输出写数据，把服务端文件描述符中数据读到终端
+                write(fileno(stdout),netbuf,count);//往标准输出写数据，把服务端文件描述符中数据读到终端
                 inputBufferShow(&ib);//其作用是将存储在输入缓冲区结构体 InputBuffer 中的内容显示到标准输出（stdout）
             } else if (FD_ISSET(stdin_fd, &readfds)) {
                 /* Data from the user typing on the terminal? */